@@ -0,0 +1,66 @@
+#pragma once
+
+/* requests, options and counters shared by the benchmarks, without the
+ * storage interface of bench_storage.h */
+
+#include <time/time.h>
+
+#define KEY_LEN 24
+#define MAX_KEY_LEN 256
+#define MAX_VAL_LEN 8 * 1024 * 1024
+#define VERIFY_DATA
+#undef VERIFY_DATA
+
+typedef enum {
+    op_get = 0,
+    op_gets,
+    op_set,
+    op_add,
+    op_cas,
+    op_replace,
+    op_append,
+    op_prepend,
+    op_delete,
+    op_incr,
+    op_decr,
+    op_failed,
+
+    op_invalid
+} op_e;
+
+static const char *op_names[op_invalid + 1] = {"get", "gets", "set", "add",
+        "cas", "replace", "append", "prepend", "delete", "incr", "decr",
+        "cache_miss", "invalid"};
+
+
+struct benchmark_entry {
+    char key[MAX_KEY_LEN];
+    char *val;
+    uint32_t key_len : 8;
+    uint32_t val_len : 24;
+    uint64_t delta;
+    proc_time_i expire_at;
+    delta_time_i ttl;
+    op_e op;
+    uint8_t ns;
+};
+
+struct benchmark {
+    struct benchmark_entry *entries;
+    void *options;
+
+    int64_t     op_cnt[op_invalid];
+
+    struct operation_latency {
+        struct duration *samples;
+        op_e *ops; /* can change to uint8_t* to reduce memory footprint */
+        size_t count;
+    } latency;
+};
+
+
+#define BENCH_OPTS(b) ((struct benchmark_options *)((b)->options))
+#define O(b, opt) option_uint(&(BENCH_OPTS(b)->benchmark.opt))
+#define O_UINT(b, opt) option_uint(&(BENCH_OPTS(b)->benchmark.opt))
+#define O_BOOL(b, opt) option_bool(&(BENCH_OPTS(b)->benchmark.opt))
+#define O_STR(b, opt) option_str(&(BENCH_OPTS(b)->benchmark.opt))
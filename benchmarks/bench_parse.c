@@ -0,0 +1,352 @@
+/*
+ * memcache request parser microbenchmark
+ *
+ * A request mix, taken from a trace in the format of trace_replay or made up
+ * when no trace is given, is rendered into memcache ASCII requests once, and
+ * then fed to parse_req read_size bytes at a time, the way the server fills
+ * rbuf, so requests are also cut at read boundaries like they are in
+ * production. Only parsing is timed.
+ */
+
+#include <protocol/data/memcache_include.h>
+/* benchmark entries are sized by the MAX_KEY_LEN of bench_entry.h */
+#undef MAX_KEY_LEN
+#include <bench_entry.h>
+#include <trace_replay/reader.h>
+
+#include <buffer/cc_buf.h>
+#include <cc_debug.h>
+#include <cc_define.h>
+#include <cc_log.h>
+#include <cc_mm.h>
+#include <cc_option.h>
+#include <time/cc_timer.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/* one in MGET_RATIO synthetic gets asks for MGET_NKEY keys */
+#define MGET_RATIO  10
+#define MGET_NKEY   10
+
+#define BENCHMARK_OPTION(ACTION)                                                                    \
+    ACTION(trace_path,      OPTION_TYPE_STR,  NULL,     "trace to take the mix from, NULL: made up")\
+    ACTION(nreq,            OPTION_TYPE_UINT, 1000000,  "number of requests rendered")              \
+    ACTION(nround,          OPTION_TYPE_UINT, 10,       "times the requests are parsed")            \
+    ACTION(read_size,       OPTION_TYPE_UINT, 16384,    "max bytes added to rbuf per read")         \
+    ACTION(max_vlen,        OPTION_TYPE_UINT, 4096,     "longer values are cut to this size")       \
+    ACTION(debug_logging,   OPTION_TYPE_BOOL, false,    "turn on debug logging")
+
+struct benchmark_specific {
+    BENCHMARK_OPTION(OPTION_DECLARE)
+};
+
+struct benchmark_options {
+    struct benchmark_specific benchmark;
+    debug_options_st debug;
+};
+typedef struct benchmark_options bench_options_st;
+
+static char     val_array[MAX_VAL_LEN];
+static char     *text;      /* the rendered requests */
+static size_t   text_len;
+static size_t   text_cap;
+static uint64_t n_req;
+static uint32_t max_vlen;
+
+static __thread __uint128_t g_lehmer64_state;
+
+static inline uint64_t prand(void) {
+    g_lehmer64_state *= 0xda942042e4dd58b5;
+    return g_lehmer64_state >> 64u;
+}
+
+
+static rstatus_i
+benchmark_create(struct benchmark *b, const char *config)
+{
+    for (int i = 0; i < MAX_VAL_LEN; i++) {
+        val_array[i] = (char)('A' + i % 26);
+    }
+
+    unsigned n_opts_all, n_opts_bench, n_opts_dbg;
+    struct benchmark_specific bench_opts = {BENCHMARK_OPTION(OPTION_INIT)};
+    debug_options_st debug_opts = {DEBUG_OPTION(OPTION_INIT)};
+
+    n_opts_bench    = OPTION_CARDINALITY(struct benchmark_specific);
+    n_opts_dbg      = OPTION_CARDINALITY(debug_options_st);
+    n_opts_all      = n_opts_bench + n_opts_dbg;
+
+    b->options = cc_alloc(sizeof(struct option) * n_opts_all);
+    ASSERT(b->options != NULL);
+
+    option_load_default((struct option *)&bench_opts, n_opts_bench);
+    option_load_default((struct option *)&debug_opts, n_opts_dbg);
+
+    BENCH_OPTS(b)->benchmark = bench_opts;
+    BENCH_OPTS(b)->debug = debug_opts;
+
+    if (config != NULL) {
+        FILE *fp = fopen(config, "r");
+        if (fp == NULL) {
+            log_stderr("cannot open config %s", config);
+            exit(EX_CONFIG);
+        }
+        option_load_file(fp, (struct option *)b->options, n_opts_all);
+        fclose(fp);
+    }
+
+    if (O_BOOL(b, debug_logging)) {
+        if (debug_setup(&(BENCH_OPTS(b)->debug)) != CC_OK) {
+            log_stderr("debug log setup failed");
+            exit(EX_CONFIG);
+        }
+    }
+
+    max_vlen = O_UINT(b, max_vlen);
+    if (max_vlen > MAX_VAL_LEN) {
+        max_vlen = MAX_VAL_LEN;
+    }
+    memset(b->op_cnt, 0, sizeof(b->op_cnt));
+
+    return CC_OK;
+}
+
+static void
+benchmark_destroy(struct benchmark *b)
+{
+    cc_free(b->options);
+    cc_free(text);
+}
+
+
+static char *
+_render_key(char *p, uint64_t id, uint32_t klen)
+{
+    return p + sprintf(p, "%0*" PRIu64, (int)klen, id);
+}
+
+/* append the request of entry e, asking for nkey keys if it is a get */
+static void
+_render(struct benchmark_entry *e, uint64_t id, uint32_t nkey)
+{
+    uint32_t vlen = e->val_len < max_vlen ? e->val_len : max_vlen;
+    size_t need = (size_t)nkey * (e->key_len + 21) + vlen + 128;
+    bool val = false;
+    char *p;
+
+    while (text_cap - text_len < need) {
+        text_cap = text_cap == 0 ? 1024 * 1024 : text_cap * 2;
+        text = cc_realloc(text, text_cap);
+        if (text == NULL) {
+            log_stderr("cannot allocate %zu bytes for requests", text_cap);
+            exit(EX_UNAVAILABLE);
+        }
+    }
+
+    p = text + text_len;
+    p += sprintf(p, "%s ", op_names[e->op]);
+    p = _render_key(p, id, e->key_len);
+
+    switch (e->op) {
+    case op_get:
+    case op_gets:
+        for (uint32_t i = 1; i < nkey; i++) {
+            *p++ = ' ';
+            p = _render_key(p, id + i, e->key_len);
+        }
+        break;
+
+    case op_set:
+    case op_add:
+    case op_replace:
+    case op_append:
+    case op_prepend:
+        p += sprintf(p, " 0 %" PRId32 " %" PRIu32, e->ttl, vlen);
+        val = true;
+        break;
+
+    case op_cas:
+        p += sprintf(p, " 0 %" PRId32 " %" PRIu32 " %" PRIu64, e->ttl, vlen,
+                id);
+        val = true;
+        break;
+
+    case op_incr:
+    case op_decr:
+        p += sprintf(p, " %" PRIu64, e->delta);
+        break;
+
+    default:
+        break;
+    }
+    *p++ = CR;
+    *p++ = LF;
+
+    if (val) {
+        cc_memcpy(p, e->val, vlen);
+        p += vlen;
+        *p++ = CR;
+        *p++ = LF;
+    }
+
+    text_len = p - text;
+    n_req++;
+}
+
+/* a made-up mix: mostly small gets, some of them multi-key, and some writes */
+static void
+_render_synthetic(struct benchmark *b, uint64_t nreq)
+{
+    struct benchmark_entry e;
+    uint64_t r;
+    uint32_t nkey;
+
+    memset(&e, 0, sizeof(e));
+    e.key_len = KEY_LEN;
+    e.val = val_array;
+    e.ttl = 3600;
+    e.delta = 1;
+
+    g_lehmer64_state = 1;
+    for (uint64_t i = 0; i < nreq; i++) {
+        r = prand() % 100;
+        nkey = 1;
+        if (r < 80) {
+            e.op = op_get;
+            nkey = (prand() % MGET_RATIO == 0) ? MGET_NKEY : 1;
+        } else if (r < 82) {
+            e.op = op_gets;
+        } else if (r < 95) {
+            e.op = op_set;
+            e.val_len = 16 + prand() % 1009;
+        } else if (r < 98) {
+            e.op = op_delete;
+        } else {
+            e.op = op_incr;
+        }
+        b->op_cnt[e.op]++;
+        _render(&e, prand() % 10000000, nkey);
+    }
+}
+
+static void
+_render_trace(struct benchmark *b, const char *trace_path, uint64_t nreq)
+{
+    static delta_time_i default_ttls[100];
+    struct reader *reader;
+    struct benchmark_entry *e;
+
+    for (int i = 0; i < 100; i++) {
+        default_ttls[i] = 86400;
+    }
+
+    reader = open_trace(trace_path, default_ttls, false);
+    e = reader->e;
+    e->delta = 1;
+    while (n_req < nreq && read_trace(reader) == 0) {
+        b->op_cnt[e->op]++;
+        _render(e, *(uint64_t *)e->key, 1);
+    }
+
+    close_trace(reader);
+}
+
+
+static struct duration
+benchmark_run(struct benchmark *b, uint64_t *nparsed)
+{
+    struct request *req = request_create();
+    struct buf *rbuf = buf_create();
+    uint32_t read_size = O_UINT(b, read_size);
+    uint32_t nround = O_UINT(b, nround);
+    parse_rstatus_e status;
+    struct duration d;
+    size_t pos, n;
+
+    ASSERT(req != NULL && rbuf != NULL);
+
+    *nparsed = 0;
+    duration_start(&d);
+    for (uint32_t i = 0; i < nround; i++) {
+        buf_reset(rbuf);
+        for (pos = 0; pos < text_len; pos += n) {
+            n = text_len - pos < read_size ? text_len - pos : read_size;
+            n = buf_write(rbuf, text + pos, n);
+
+            while (buf_rsize(rbuf) > 0) {
+                status = parse_req(req, rbuf);
+                if (status == PARSE_EUNFIN) {
+                    break;
+                }
+                if (status != PARSE_OK) {
+                    log_stderr("request %" PRIu64 " failed to parse: %d",
+                            *nparsed, status);
+                    exit(EX_DATAERR);
+                }
+                if (req->partial) { /* the value goes on in the next read */
+                    break;
+                }
+                (*nparsed)++;
+                request_reset(req);
+            }
+            buf_lshift(rbuf);
+        }
+    }
+    duration_stop(&d);
+
+    buf_destroy(&rbuf);
+    request_destroy(&req);
+
+    return d;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct benchmark b;
+    struct duration d;
+    uint64_t nparsed;
+    char *trace_path;
+
+    if (benchmark_create(&b, argv[1]) != 0) {
+        printf("failed to create benchmark instance\n");
+        return -1;
+    }
+
+    parse_setup(NULL, NULL);
+
+    trace_path = O_STR(&b, trace_path);
+    if (trace_path == NULL) {
+        _render_synthetic(&b, O_UINT(&b, nreq));
+    } else {
+        _render_trace(&b, trace_path, O_UINT(&b, nreq));
+    }
+
+    d = benchmark_run(&b, &nparsed);
+
+    printf("%s: %" PRIu64 " requests (%zu bytes) parsed %u times\n",
+            trace_path == NULL ? "synthetic mix" : trace_path, n_req, text_len,
+            (unsigned)O_UINT(&b, nround));
+    printf("total parse time: %.4f s, throughput %.2f M req/s, %.2f GB/s, "
+            "average %.1f ns per request\n", duration_sec(&d),
+            nparsed / duration_sec(&d) / 1000000,
+            (double)text_len * O_UINT(&b, nround) / duration_sec(&d) / 1e9,
+            duration_ns(&d) / nparsed);
+    for (op_e op = op_get; op < op_invalid; op++) {
+        if (b.op_cnt[op] == 0) {
+            continue;
+        }
+        printf("%16s %16" PRId64 "\t (%8.2lf%%)\n", op_names[op], b.op_cnt[op],
+                (double)b.op_cnt[op] / n_req * 100);
+    }
+
+    parse_teardown();
+    benchmark_destroy(&b);
+
+    return 0;
+}
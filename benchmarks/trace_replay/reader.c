@@ -4,7 +4,7 @@
  */
 
 #include "reader.h"
-#include "bench_storage.h"
+#include "bench_entry.h"
 
 #include <cc_array.h>
 #include <cc_debug.h>
@@ -0,0 +1,586 @@
+/*
+ * ccommon - a cache common library.
+ * Copyright (C) 2013 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * io_uring backend of the event module, used in place of epoll when built
+ * with USE_IO_URING.
+ *
+ * Each registered fd has a poll request in the ring. Adding and deleting
+ * events only queue submission entries, which are submitted together by the
+ * io_uring_enter that waits for completions in event_wait, so that the
+ * event_del/event_add pairs of the workers do not cost a syscall each.
+ *
+ * Poll requests are one-shot and re-armed after their event is handled, a
+ * re-armed poll completes right away if the fd is still ready, so events are
+ * level-triggered like those of the epoll backend: a reader that leaves data
+ * in the socket is called again on the next wait.
+ *
+ * An fd deleted and added again gets a new generation, completions of polls
+ * of an older generation (e.g. canceled ones) are ignored.
+ */
+
+#include <cc_event.h>
+
+#include <cc_debug.h>
+#include <cc_define.h>
+#include <cc_mm.h>
+
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cc_shared.h"
+
+#define UD_IGNORE       UINT64_MAX  /* user_data of poll removals */
+#define UD(_fd, _gen)   ((uint64_t)(_gen) << 32 | (uint32_t)(_fd))
+#define UD_FD(_ud)      ((int)(uint32_t)(_ud))
+#define UD_GEN(_ud)     ((uint32_t)((_ud) >> 32))
+
+#define NFD_MIN         64
+
+struct event_fd {
+    void               *data;
+    uint32_t           events;  /* POLLIN or POLLOUT, 0 if not registered */
+    uint32_t           gen;
+    bool               armed;   /* a poll of this gen is in the ring */
+};
+
+struct event_base {
+    int                 ring;   /* io_uring descriptor */
+
+    /* submission queue */
+    void                *sq_ptr;
+    size_t              sq_size;
+    uint32_t            *sq_head;
+    uint32_t            *sq_tail;
+    uint32_t            *sq_array;
+    uint32_t            sq_mask;
+    uint32_t            sq_nentry;
+    struct io_uring_sqe *sqe;
+    size_t              sqe_size;
+    uint32_t            npending; /* queued, not submitted yet */
+
+    /* completion queue */
+    void                *cq_ptr;
+    size_t              cq_size;
+    uint32_t            *cq_head;
+    uint32_t            *cq_tail;
+    uint32_t            cq_mask;
+    struct io_uring_cqe *cqe;
+
+    struct event_fd     *fds;   /* indexed by fd */
+    uint32_t            nfd;
+
+    int                 nevent; /* max # events returned by a wait */
+    event_cb_fn         cb;     /* event callback */
+};
+
+static inline int
+_io_uring_setup(uint32_t nentry, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, nentry, p);
+}
+
+static inline int
+_io_uring_enter(int ring, uint32_t to_submit, uint32_t min_complete,
+        uint32_t flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ring, to_submit, min_complete,
+            flags, arg, argsz);
+}
+
+static void
+_ring_unmap(struct event_base *evb)
+{
+    if (evb->sqe != NULL && evb->sqe != MAP_FAILED) {
+        munmap(evb->sqe, evb->sqe_size);
+    }
+    if (evb->cq_ptr != NULL && evb->cq_ptr != MAP_FAILED) {
+        munmap(evb->cq_ptr, evb->cq_size);
+    }
+    if (evb->sq_ptr != NULL && evb->sq_ptr != MAP_FAILED) {
+        munmap(evb->sq_ptr, evb->sq_size);
+    }
+}
+
+static bool
+_ring_map(struct event_base *evb, struct io_uring_params *p)
+{
+    evb->sq_size = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    evb->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    evb->sqe_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    evb->sq_ptr = mmap(NULL, evb->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, evb->ring, IORING_OFF_SQ_RING);
+    if (evb->sq_ptr == MAP_FAILED) {
+        return false;
+    }
+    evb->cq_ptr = mmap(NULL, evb->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, evb->ring, IORING_OFF_CQ_RING);
+    if (evb->cq_ptr == MAP_FAILED) {
+        return false;
+    }
+    evb->sqe = mmap(NULL, evb->sqe_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, evb->ring, IORING_OFF_SQES);
+    if (evb->sqe == MAP_FAILED) {
+        return false;
+    }
+
+    evb->sq_head = (uint32_t *)((char *)evb->sq_ptr + p->sq_off.head);
+    evb->sq_tail = (uint32_t *)((char *)evb->sq_ptr + p->sq_off.tail);
+    evb->sq_array = (uint32_t *)((char *)evb->sq_ptr + p->sq_off.array);
+    evb->sq_mask = *(uint32_t *)((char *)evb->sq_ptr + p->sq_off.ring_mask);
+    evb->sq_nentry = p->sq_entries;
+
+    evb->cq_head = (uint32_t *)((char *)evb->cq_ptr + p->cq_off.head);
+    evb->cq_tail = (uint32_t *)((char *)evb->cq_ptr + p->cq_off.tail);
+    evb->cq_mask = *(uint32_t *)((char *)evb->cq_ptr + p->cq_off.ring_mask);
+    evb->cqe = (struct io_uring_cqe *)((char *)evb->cq_ptr + p->cq_off.cqes);
+
+    return true;
+}
+
+struct event_base *
+event_base_create(int nevent, event_cb_fn cb)
+{
+    struct event_base *evb;
+    struct io_uring_params p;
+    int ring;
+
+    ASSERT(nevent > 0);
+
+    /* room for a re-arm and a removal per event, completions of removals and
+     * canceled polls come on top of the events */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = 4 * (uint32_t)nevent;
+    ring = _io_uring_setup(2 * (uint32_t)nevent, &p);
+    if (ring < 0 && errno == EINVAL) {
+        /* COOP_TASKRUN is new in 5.19 */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = 4 * (uint32_t)nevent;
+        ring = _io_uring_setup(2 * (uint32_t)nevent, &p);
+    }
+    if (ring < 0) {
+        log_error("io_uring setup failed: %s", strerror(errno));
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        log_error("io_uring of the kernel cannot wait with a timeout");
+        close(ring);
+        return NULL;
+    }
+
+    evb = (struct event_base *)cc_zalloc(sizeof(*evb));
+    if (evb == NULL) {
+        close(ring);
+        return NULL;
+    }
+    evb->ring = ring;
+
+    if (!_ring_map(evb, &p)) {
+        log_error("io_uring mmap failed: %s", strerror(errno));
+        _ring_unmap(evb);
+        close(ring);
+        cc_free(evb);
+        return NULL;
+    }
+
+    evb->nevent = nevent;
+    evb->cb = cb;
+
+    log_info("io_uring fd %d with %"PRIu32" sq and %"PRIu32" cq entries, "
+            "nevent %d", evb->ring, p.sq_entries, p.cq_entries, nevent);
+
+    return evb;
+}
+
+void
+event_base_destroy(struct event_base **evb)
+{
+    int status;
+    struct event_base *e = *evb;
+
+    if (e == NULL) {
+        return;
+    }
+
+    ASSERT(e->ring > 0);
+
+    _ring_unmap(e);
+    cc_free(e->fds);
+
+    status = close(e->ring);
+    if (status < 0) {
+        log_warn("close io_uring fd %d failed, ignored: %s", e->ring,
+                strerror(errno));
+    }
+    e->ring = -1;
+
+    cc_free(e);
+
+    *evb = NULL;
+}
+
+static int
+_submit(struct event_base *evb, uint32_t min_complete, uint32_t flags,
+        void *arg, size_t argsz)
+{
+    int n;
+
+    n = _io_uring_enter(evb->ring, evb->npending, min_complete, flags, arg,
+            argsz);
+    if (n > 0) {
+        evb->npending -= (uint32_t)n;
+    }
+
+    return n;
+}
+
+static struct io_uring_sqe *
+_sqe_get(struct event_base *evb)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t tail = *evb->sq_tail;
+
+    if (tail - __atomic_load_n(evb->sq_head, __ATOMIC_ACQUIRE) ==
+            evb->sq_nentry) {
+        /* the queue is full, submit what is queued */
+        if (_submit(evb, 0, 0, NULL, 0) < 0 ||
+                tail - __atomic_load_n(evb->sq_head, __ATOMIC_ACQUIRE) ==
+                evb->sq_nentry) {
+            log_error("io_uring fd %d submission queue is full", evb->ring);
+            return NULL;
+        }
+    }
+
+    sqe = &evb->sqe[tail & evb->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+static void
+_sqe_queue(struct event_base *evb, struct io_uring_sqe *sqe)
+{
+    uint32_t tail = *evb->sq_tail;
+
+    evb->sq_array[tail & evb->sq_mask] = (uint32_t)(sqe - evb->sqe);
+    __atomic_store_n(evb->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    evb->npending++;
+}
+
+static int
+_poll_add(struct event_base *evb, int fd)
+{
+    struct event_fd *efd = &evb->fds[fd];
+    struct io_uring_sqe *sqe = _sqe_get(evb);
+
+    if (sqe == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = efd->events;
+    sqe->user_data = UD(fd, efd->gen);
+    _sqe_queue(evb, sqe);
+    efd->armed = true;
+
+    return 0;
+}
+
+static int
+_poll_remove(struct event_base *evb, int fd)
+{
+    struct event_fd *efd = &evb->fds[fd];
+    struct io_uring_sqe *sqe = _sqe_get(evb);
+
+    if (sqe == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UD(fd, efd->gen);
+    sqe->user_data = UD_IGNORE;
+    _sqe_queue(evb, sqe);
+    efd->armed = false;
+
+    return 0;
+}
+
+static int
+_event_add(struct event_base *evb, int fd, uint32_t events, void *data)
+{
+    uint32_t nfd;
+    struct event_fd *fds;
+
+    if ((uint32_t)fd >= evb->nfd) {
+        nfd = evb->nfd > NFD_MIN ? evb->nfd : NFD_MIN;
+        while (nfd <= (uint32_t)fd) {
+            nfd *= 2;
+        }
+        fds = cc_realloc(evb->fds, nfd * sizeof(*fds));
+        if (fds == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(fds + evb->nfd, 0, (nfd - evb->nfd) * sizeof(*fds));
+        evb->fds = fds;
+        evb->nfd = nfd;
+    }
+
+    /* like EPOLL_CTL_ADD, the events of a registered fd are not changed */
+    if (evb->fds[fd].events != 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    evb->fds[fd].data = data;
+    evb->fds[fd].events = events;
+
+    return _poll_add(evb, fd);
+}
+
+int
+event_add_read(struct event_base *evb, int fd, void *data)
+{
+    int status;
+
+    ASSERT(evb != NULL && evb->ring > 0);
+    ASSERT(fd >= 0);
+
+    status = _event_add(evb, fd, POLLIN, data);
+    if (status < 0 && errno != EEXIST) {
+        log_error("add read w/ io_uring fd %d on fd %d failed: %s", evb->ring,
+                fd, strerror(errno));
+    }
+
+    INCR(event_metrics, event_read);
+    log_verb("add read event to io_uring fd %d on fd %d", evb->ring, fd);
+
+    return status;
+}
+
+int
+event_add_write(struct event_base *evb, int fd, void *data)
+{
+    int status;
+
+    ASSERT(evb != NULL && evb->ring > 0);
+    ASSERT(fd >= 0);
+
+    status = _event_add(evb, fd, POLLOUT, data);
+    if (status < 0 && errno != EEXIST) {
+        log_error("add write w/ io_uring fd %d on fd %d failed: %s", evb->ring,
+                fd, strerror(errno));
+    }
+
+    INCR(event_metrics, event_write);
+    log_verb("add write event to io_uring fd %d on fd %d", evb->ring, fd);
+
+    return status;
+}
+
+int
+event_del(struct event_base *evb, int fd)
+{
+    int status = 0;
+    struct event_fd *efd;
+
+    ASSERT(evb != NULL && evb->ring > 0);
+    ASSERT(fd >= 0);
+
+    if ((uint32_t)fd >= evb->nfd || evb->fds[fd].events == 0) {
+        log_error("del w/ io_uring fd %d on fd %d failed: %s", evb->ring, fd,
+                strerror(ENOENT));
+        errno = ENOENT;
+        return -1;
+    }
+
+    efd = &evb->fds[fd];
+    if (efd->armed) {
+        status = _poll_remove(evb, fd);
+    }
+    efd->data = NULL;
+    efd->events = 0;
+    efd->armed = false;
+    efd->gen++;
+
+    log_verb("del fd %d from io_uring fd %d", fd, evb->ring);
+
+    return status;
+}
+
+/* handle a completion, return whether it is an event */
+static bool
+_event_handle(struct event_base *evb, uint64_t ud, int32_t res)
+{
+    int fd = UD_FD(ud);
+    struct event_fd *efd;
+    uint32_t events = 0;
+
+    if (ud == UD_IGNORE || (uint32_t)fd >= evb->nfd) {
+        return false;
+    }
+
+    efd = &evb->fds[fd];
+    if (efd->events == 0 || efd->gen != UD_GEN(ud)) {
+        /* the poll of an fd deleted since */
+        return false;
+    }
+    efd->armed = false;
+
+    log_verb("io_uring poll %04"PRIX32" on fd %d against data %p", res, fd,
+            efd->data);
+
+    if (res < 0) {
+        log_warn("poll on fd %d w/ io_uring fd %d failed: %s", fd, evb->ring,
+                strerror(-res));
+        events |= EVENT_ERR;
+    } else {
+        if (res & (POLLERR | POLLHUP)) {
+            events |= EVENT_ERR;
+        }
+
+        if (res & (POLLIN | POLLRDHUP)) {
+            events |= EVENT_READ;
+        }
+
+        if (res & POLLOUT) {
+            events |= EVENT_WRITE;
+        }
+    }
+
+    if (evb->cb != NULL) {
+        evb->cb(efd->data, events);
+    }
+
+    /* re-arm unless the callback deleted the fd (or deleted and added it) */
+    efd = &evb->fds[fd];
+    if (efd->events != 0 && !efd->armed) {
+        _poll_add(evb, fd);
+    }
+
+    return true;
+}
+
+/*
+ * submit the queued requests and wait for events with timeout (in
+ * millisecond), -1 waits indefinitely
+ */
+int
+event_wait(struct event_base *evb, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    uint32_t head, tail, flags;
+    int nevent, nreturned;
+    bool timedout = false;
+
+    ASSERT(evb != NULL);
+
+    nevent = evb->nevent;
+
+    ASSERT(evb->ring > 0);
+    ASSERT(nevent > 0);
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    for (;;) {
+        nreturned = 0;
+
+        /* submit the queued requests, and wait if there is nothing to reap */
+        head = *evb->cq_head;
+        tail = __atomic_load_n(evb->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail && timeout != 0) {
+            flags = IORING_ENTER_EXT_ARG | IORING_ENTER_GETEVENTS;
+            if (_submit(evb, 1, flags, &arg, sizeof(arg)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == ETIME) {
+                    timedout = true;
+                } else if (errno != EBUSY) {
+                    log_error("wait on io_uring fd %d with nevent %d and "
+                            "timeout %d failed: %s", evb->ring, nevent, timeout,
+                            strerror(errno));
+                    return -1;
+                }
+            }
+        } else if (evb->npending > 0) {
+            _submit(evb, 0, 0, NULL, 0);
+        }
+
+        INCR(event_metrics, event_loop);
+
+        /* the callbacks may queue requests, which go with the next wait */
+        while (nreturned < nevent) {
+            struct io_uring_cqe *cqe;
+            uint64_t ud;
+            int32_t res;
+
+            head = *evb->cq_head;
+            tail = __atomic_load_n(evb->cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                break;
+            }
+
+            cqe = &evb->cqe[head & evb->cq_mask];
+            ud = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(evb->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (_event_handle(evb, ud, res)) {
+                nreturned++;
+            }
+        }
+
+        if (nreturned > 0) {
+            INCR_N(event_metrics, event_total, nreturned);
+            log_verb("returned %d events from io_uring fd %d", nreturned,
+                    evb->ring);
+
+            return nreturned;
+        }
+
+        if (timeout == 0 || timedout) {
+            log_vverb("wait on io_uring fd %d with nevent %d timeout %d "
+                    "returned no events", evb->ring, nevent, timeout);
+            return 0;
+        }
+
+        /* only completions of removals and canceled polls, wait again */
+    }
+
+    NOT_REACHED();
+}
@@ -84,6 +84,57 @@ START_TEST(test_read)
 }
 END_TEST
 
+START_TEST(test_read_level)
+{
+#define DATA "foo bar baz"
+    struct event_base *event_base;
+    int random_pointer[2] = {1, 2};
+    struct pipe_conn *pipe;
+
+    test_reset();
+
+    event_base = event_base_create(1024, log_event);
+
+    pipe = pipe_conn_create();
+    ck_assert_int_eq(pipe_open(NULL, pipe), true);
+    ck_assert_int_eq(pipe_send(pipe, DATA, sizeof(DATA)), sizeof(DATA));
+
+    event_add_read(event_base, pipe_read_id(pipe), random_pointer);
+
+    /* data left unread is reported again */
+    event_wait(event_base, -1);
+    event_wait(event_base, -1);
+
+    ck_assert_int_eq(event_log_count, 2);
+    ck_assert_ptr_eq(event_log[1].arg, random_pointer);
+    ck_assert_int_eq(event_log[1].events, EVENT_READ);
+
+    /* the events of a registered fd are not changed by adding */
+    ck_assert_int_eq(event_add_read(event_base, pipe_read_id(pipe),
+                &random_pointer[1]), -1);
+    event_wait(event_base, -1);
+    ck_assert_int_eq(event_log_count, 3);
+    ck_assert_ptr_eq(event_log[2].arg, random_pointer);
+
+    /* but they are after the fd is deleted */
+    ck_assert_int_eq(event_del(event_base, pipe_read_id(pipe)), 0);
+    ck_assert_int_eq(event_add_read(event_base, pipe_read_id(pipe),
+                &random_pointer[1]), 0);
+    event_wait(event_base, -1);
+    ck_assert_int_eq(event_log_count, 4);
+    ck_assert_ptr_eq(event_log[3].arg, &random_pointer[1]);
+
+    ck_assert_int_eq(event_del(event_base, pipe_read_id(pipe)), 0);
+    event_wait(event_base, 100);
+    ck_assert_int_eq(event_log_count, 4);
+
+    event_base_destroy(&event_base);
+    pipe_close(pipe);
+    pipe_conn_destroy(&pipe);
+#undef DATA
+}
+END_TEST
+
 START_TEST(test_cannot_read)
 {
     struct event_base *event_base;
@@ -155,6 +206,7 @@ event_suite(void)
     suite_add_tcase(s, tc_event);
 
     tcase_add_test(tc_event, test_read);
+    tcase_add_test(tc_event, test_read_level);
     tcase_add_test(tc_event, test_cannot_read);
     tcase_add_test(tc_event, test_write);
 
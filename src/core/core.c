@@ -13,6 +13,7 @@ void
 core_run(void *arg_worker)
 {
     pthread_t worker, server;
+    uint32_t i;
     int ret;
 
     if (!admin_init || !server_init || !worker_init) {
@@ -20,10 +21,13 @@ core_run(void *arg_worker)
         return;
     }
 
-    ret = pthread_create(&worker, NULL, core_worker_evloop, arg_worker);
-    if (ret != 0) {
-        log_crit("pthread create failed for worker thread: %s", strerror(ret));
-        goto error;
+    for (i = 0; i < nworker; i++) {
+        ret = pthread_create(&worker, NULL, core_worker_evloop, arg_worker);
+        if (ret != 0) {
+            log_crit("pthread create failed for worker thread %"PRIu32": %s", i,
+                    strerror(ret));
+            goto error;
+        }
     }
 
     ret = pthread_create(&server, NULL, core_server_evloop, NULL);
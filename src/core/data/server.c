@@ -7,6 +7,7 @@
 
 #include <cc_debug.h>
 #include <cc_event.h>
+#include <cc_mm.h>
 #include <cc_ring_array.h>
 #include <channel/cc_channel.h>
 #include <channel/cc_pipe.h>
@@ -17,22 +18,8 @@
 #include <string.h>
 #include <sysexits.h>
 
-#ifdef USE_EVENT_FD
-#include <sys/eventfd.h>
-#endif
-
 #define SERVER_MODULE_NAME "core::server"
 
-#ifdef USE_EVENT_FD
-int efd_server_to_worker = -1;       /* server(w) -> worker(r) */
-int efd_worker_to_server = -1;       /* worker(w) -> server(r) */
-#else
-struct pipe_conn *pipe_new = NULL;   /* server(w) -> worker(r) */
-struct pipe_conn *pipe_term = NULL;  /* worker(w) -> server(r) */
-#endif
-struct ring_array *conn_new = NULL;  /* server(w) -> worker(r) */
-struct ring_array *conn_term = NULL; /* worker(w) -> server(r) */
-
 static server_metrics_st *server_metrics = NULL;
 
 static struct context context;
@@ -44,6 +31,11 @@ static channel_handler_st *hdl = &handlers;
 static struct addrinfo *server_ai;
 static struct buf_sock *server_sock; /* server buf_sock */
 
+/* accepted connections are handed to workers in a round-robin fashion,
+ * notify_retry marks workers whose new connection notification failed */
+static uint32_t next_worker = 0;
+static bool *notify_retry = NULL;
+
 /* Note: server thread currently owns the stream (buf_sock) pool. Other threads
  * either need to get the connection from server (the case for worker thread) or
  * have to directly create their own, instead of borrowing (the case for admin
@@ -63,46 +55,64 @@ _server_close(struct buf_sock *s)
 }
 
 static inline void
-_server_write_notification(void)
+_server_write_notification(uint32_t id)
 {
+    struct worker_pipe *wp = &worker_pipes[id];
+
+    notify_retry[id] = false;
+
 #ifdef USE_EVENT_FD
-    ASSERT(efd_server_to_worker != -1);
+    ASSERT(wp->efd_server_to_worker != -1);
 
     uint64_t u = 1;
-    ssize_t status = write(efd_server_to_worker, &u, sizeof(uint64_t));
+    ssize_t status = write(wp->efd_server_to_worker, &u, sizeof(uint64_t));
 
     if (status == CC_EAGAIN) {
         /* retry write */
         log_verb("server core: retry write to eventfd");
-        event_add_write(ctx->evb, efd_server_to_worker, NULL);
+        notify_retry[id] = true;
+        event_add_write(ctx->evb, wp->efd_server_to_worker, NULL);
     } else if (status == CC_ERROR) {
         log_error("could not write to eventfd - %d", status);
     }
 #else
-    ASSERT(pipe_new != NULL);
+    ASSERT(wp->pipe_new != NULL);
 
-    ssize_t status = pipe_send(pipe_new, "", 1);
+    ssize_t status = pipe_send(wp->pipe_new, "", 1);
 
     if (status == 0 || status == CC_EAGAIN) {
         /* retry write */
         log_verb("server core: retry send on pipe");
-        event_add_write(ctx->evb, pipe_write_id(pipe_new), NULL);
+        notify_retry[id] = true;
+        event_add_write(ctx->evb, pipe_write_id(wp->pipe_new), NULL);
     } else if (status == CC_ERROR) {
-        log_error("could not write to pipe - %s", strerror(pipe_new->err));
+        log_error("could not write to pipe - %s", strerror(wp->pipe_new->err));
     }
 #endif
 }
 
-/* pipe_read recycles returned streams from worker thread */
 static inline void
-_server_read_notification(void)
+_server_retry_notification(void)
+{
+    for (uint32_t id = 0; id < nworker; id++) {
+        if (notify_retry[id]) {
+            _server_write_notification(id);
+        }
+    }
+}
+
+/* pipe_read recycles returned streams from one worker thread */
+static inline void
+_server_read_worker(uint32_t id)
 {
+    struct worker_pipe *wp = &worker_pipes[id];
+
 #ifdef USE_EVENT_FD
-    ASSERT(efd_worker_to_server != -1);
+    ASSERT(wp->efd_worker_to_server != -1);
 
     uint64_t i;
 #else
-    ASSERT(pipe_term != NULL);
+    ASSERT(wp->pipe_term != NULL);
 
     char buf[RING_ARRAY_DEFAULT_CAP]; /* buffer for discarding pipe data */
     int i;
@@ -112,34 +122,48 @@ _server_read_notification(void)
     rstatus_i status;
 
 #ifdef USE_EVENT_FD
-    int rc = read(efd_worker_to_server, &i, sizeof(uint64_t));
+    int rc = read(wp->efd_worker_to_server, &i, sizeof(uint64_t));
     if (rc < 0) {
-        log_warn("not adding new connections due to eventfd error");
+        if (errno != EAGAIN) {
+            log_warn("not reclaiming connections due to eventfd error");
+        }
         return;
     }
 #else
-    i = pipe_recv(pipe_term, buf, RING_ARRAY_DEFAULT_CAP);
+    i = pipe_recv(wp->pipe_term, buf, RING_ARRAY_DEFAULT_CAP);
     if (i < 0) { /* errors, do not read from ring array */
-        log_warn("not reclaiming connections due to pipe error");
+        if (i != CC_EAGAIN) {
+            log_warn("not reclaiming connections due to pipe error");
+        }
         return;
     }
 #endif
 
     /* each byte in the pipe corresponds to a connection in the array */
     for (; i > 0; --i) {
-        status = ring_array_pop(&s, conn_term);
+        status = ring_array_pop(&s, wp->conn_term);
         if (status != CC_OK) {
             log_warn("event number does not match conn queue: missing %d conns",
                     i);
             return;
         }
-        log_verb("Recycling buf_sock %p from worker thread", s);
+        log_verb("Recycling buf_sock %p from worker thread %"PRIu32, s, id);
         hdl->term(s->ch);
         buf_sock_reset(s);
         buf_sock_return(&s);
     }
 }
 
+/* all workers share the same (NULL) event data, so check every one of them,
+ * pipes/eventfds with nothing to read return EAGAIN */
+static inline void
+_server_read_notification(void)
+{
+    for (uint32_t id = 0; id < nworker; id++) {
+        _server_read_worker(id);
+    }
+}
+
 /* returns true if a connection is present, false if no more pending */
 static inline bool
 _tcp_accept(struct buf_sock *ss)
@@ -195,8 +219,11 @@ _tcp_accept(struct buf_sock *ss)
         return false;
     }
 
-    /* push buf_sock to queue */
-    if (ring_array_push(&s, conn_new) != CC_OK) { /* close if can't enqueue */
+    /* push buf_sock to the queue of the next worker */
+    uint32_t id = next_worker;
+    next_worker = (next_worker + 1) % nworker;
+    if (ring_array_push(&s, worker_pipes[id].conn_new) != CC_OK) {
+        /* close if can't enqueue */
         log_error("new connection queue is full, closing connection");
         buf_sock_reset(s);
         buf_sock_return(&s);
@@ -204,7 +231,7 @@ _tcp_accept(struct buf_sock *ss)
     }
 
     /* notify worker, note this may fail and will be retried via write event */
-    _server_write_notification();
+    _server_write_notification(id);
 
     return true;
 }
@@ -234,7 +261,7 @@ _server_event(void *arg, uint32_t events)
         if (events & EVENT_WRITE) { /* retrying worker notification */
             log_verb("processing server write event on pipe");
             INCR(server_metrics, server_event_write);
-            _server_write_notification();
+            _server_retry_notification();
         }
         if (events & EVENT_ERR) {
             log_debug("processing server error event on pipe");
@@ -279,57 +306,6 @@ core_server_setup(server_options_st *options, server_metrics_st *metrics)
         nevent = option_uint(&options->server_nevent);
     }
 
-    /* setup shared data structures between server and worker */
-#ifdef USE_EVENT_FD
-    efd_server_to_worker = eventfd(0 /* intval */, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (efd_server_to_worker < 0) {
-        int err = errno;
-        log_error("Could not create event fd %s, abort", strerror(err));
-        goto error;
-    }
-    efd_worker_to_server = eventfd(0 /* intval */, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (efd_worker_to_server < 0) {
-        int err = errno;
-        log_error("Could not create event fd %s, abort", strerror(err));
-        goto error;
-    }
-#else
-    pipe_new = pipe_conn_create();
-    if (pipe_new == NULL) {
-        log_error("Could not create connection for pipe, abort");
-        goto error;
-    }
-    pipe_term = pipe_conn_create();
-    if (pipe_term == NULL) {
-        log_error("Could not create connection for pipe, abort");
-        goto error;
-    }
-
-    if (!pipe_open(NULL, pipe_new)) {
-        log_error("Could not open pipe for new connection: %s",
-                strerror(pipe_new->err));
-        goto error;
-    }
-    if (!pipe_open(NULL, pipe_term)) {
-        log_error("Could not open pipe for terminated connection: %s",
-                strerror(pipe_term->err));
-        goto error;
-    }
-
-    /* event_fd is set to nonblocking during creation */
-    pipe_set_nonblocking(pipe_new);
-    pipe_set_nonblocking(pipe_term);
-#endif
-
-    conn_new = ring_array_create(sizeof(struct buf_sock *),
-            RING_ARRAY_DEFAULT_CAP);
-    conn_term = ring_array_create(sizeof(struct buf_sock *),
-            RING_ARRAY_DEFAULT_CAP);
-    if (conn_new == NULL || conn_term == NULL) {
-        log_error("core setup failed: could not allocate conn array(s)");
-        goto error;
-    }
-
     ctx->timeout = timeout;
     ctx->evb = event_base_create(nevent, _server_event);
     if (ctx->evb == NULL) {
@@ -374,11 +350,6 @@ core_server_setup(server_options_st *options, server_metrics_st *metrics)
     c->level = CHANNEL_META;
 
     event_add_read(ctx->evb, hdl->rid(c), server_sock);
-#ifdef USE_EVENT_FD
-    event_add_read(ctx->evb, efd_worker_to_server, NULL);
-#else
-    event_add_read(ctx->evb, pipe_read_id(pipe_term), NULL);
-#endif
 
     server_init = true;
 
@@ -400,15 +371,7 @@ core_server_teardown(void)
         freeaddrinfo(server_ai);
         buf_sock_return(&server_sock);
     }
-    ring_array_destroy(&conn_term);
-    ring_array_destroy(&conn_new);
-#ifdef USE_EVENT_FD
-    close(efd_server_to_worker);
-    close(efd_worker_to_server);
-#else
-    pipe_conn_destroy(&pipe_new);
-    pipe_conn_destroy(&pipe_term);
-#endif
+    cc_free(notify_retry);
     server_metrics = NULL;
     server_init = false;
 }
@@ -429,9 +392,31 @@ _server_evwait(void)
     return CC_OK;
 }
 
+/* the per-worker pipes are created by core_worker_setup, which may run after
+ * core_server_setup, so we start watching them when the event loop starts */
+static void
+_server_watch_workers(void)
+{
+    notify_retry = cc_zalloc(sizeof(bool) * nworker);
+    if (notify_retry == NULL) {
+        log_crit("server core failed to watch worker threads: OOM");
+        exit(EX_OSERR);
+    }
+
+    for (uint32_t id = 0; id < nworker; id++) {
+#ifdef USE_EVENT_FD
+        event_add_read(ctx->evb, worker_pipes[id].efd_worker_to_server, NULL);
+#else
+        event_add_read(ctx->evb, pipe_read_id(worker_pipes[id].pipe_term), NULL);
+#endif
+    }
+}
+
 void *
 core_server_evloop(void *arg)
 {
+    _server_watch_workers();
+
     for(;;) {
         if (_server_evwait() != CC_OK) {
             log_crit("server core event loop exited due to failure");
@@ -1,17 +1,29 @@
 #pragma once
 
+#include <stdint.h>
+
 struct pipe_conn;
 struct ring_array;
 
-/* pipe for server/worker thread communication */
+/*
+ * Each worker thread has its own pair of notification channels and connection
+ * queues with the server thread, so the single-producer/single-consumer
+ * contract of ring_array holds regardless of the number of workers.
+ */
+struct worker_pipe {
+    /* pipe for server/worker thread communication */
 #ifdef USE_EVENT_FD
-extern int efd_server_to_worker;
-extern int efd_worker_to_server;
+    int efd_server_to_worker;       /* server(w) -> worker(r) */
+    int efd_worker_to_server;       /* worker(w) -> server(r) */
 #else
-extern struct pipe_conn *pipe_new;
-extern struct pipe_conn *pipe_term;
+    struct pipe_conn *pipe_new;     /* server(w) -> worker(r) */
+    struct pipe_conn *pipe_term;    /* worker(w) -> server(r) */
 #endif
 
-/* array holding accepted connections */
-extern struct ring_array *conn_new;
-extern struct ring_array *conn_term;
+    /* array holding accepted connections */
+    struct ring_array *conn_new;    /* server(w) -> worker(r) */
+    struct ring_array *conn_term;   /* worker(w) -> server(r) */
+};
+
+extern struct worker_pipe *worker_pipes;
+extern uint32_t nworker;
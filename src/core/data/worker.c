@@ -9,6 +9,7 @@
 #include <buffer/cc_dbuf.h>
 #include <cc_debug.h>
 #include <cc_event.h>
+#include <cc_mm.h>
 #include <cc_ring_array.h>
 #include <channel/cc_channel.h>
 #include <channel/cc_pipe.h>
@@ -21,15 +22,30 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+#ifdef USE_EVENT_FD
+#include <sys/eventfd.h>
+#endif
+
+#define NUMA_NODE_CPULIST "/sys/devices/system/node/node%"PRIu32"/cpulist"
 
 #define WORKER_MODULE_NAME "core::worker"
 
 worker_metrics_st *worker_metrics = NULL;
 worker_options_st *worker_options = NULL;
 
-static struct context context;
-static struct context *ctx = &context;
+struct worker_pipe *worker_pipes = NULL;
+uint32_t nworker = 0;
+
+/* each worker thread owns one event base and one pipe to the server thread,
+ * ctx and wp point to those of the calling worker thread */
+static struct context *contexts = NULL;
+static __thread struct context *ctx = NULL;
+static __thread struct worker_pipe *wp = NULL;
+static uint32_t worker_next_id = 0;
 
 static channel_handler_st handlers;
 static channel_handler_st *hdl = &handlers;
@@ -49,7 +65,11 @@ _worker_event_write(struct buf_sock *s)
     struct tcp_conn *c = s->ch;
 
     log_verb("writing on buf_sock %p", s);
-    status = buf_tcp_write(s);
+    if (processor->send != NULL) {
+        status = processor->send(s);
+    } else {
+        status = buf_tcp_write(s);
+    }
     if (status == CC_ERETRY || status == CC_EAGAIN) { /* retry write */
         /* by removing current masks and only listen to write event(s), we are
          * effectively stopping processing incoming data until we can write
@@ -83,7 +103,11 @@ _worker_event_read(struct buf_sock *s)
     log_verb("reading on buf_sock %p", s);
     /* TODO(kyang): consider refactoring dbuf_tcp_read and buf_tcp_read to have no return status
        at all, since the return status is already given by the connection state */
-    buf_tcp_read(s);
+    if (processor->recv != NULL) {
+        processor->recv(s);
+    } else {
+        buf_tcp_read(s);
+    }
     if (processor->read(&s->rbuf, &s->wbuf, &s->data) < 0) {
         log_debug("handler signals channel termination");
         s->ch->state = CHANNEL_TERM;
@@ -118,13 +142,13 @@ _worker_read_notification(void)
      * for the next read event in that case.
      */
 #ifdef USE_EVENT_FD
-    int rc = read(efd_server_to_worker, &i, sizeof(uint64_t));
+    int rc = read(wp->efd_server_to_worker, &i, sizeof(uint64_t));
     if (rc < 0) {
         log_warn("not adding new connections due to eventfd error");
         return;
     }
 #else
-    i = pipe_recv(pipe_new, buf, RING_ARRAY_DEFAULT_CAP);
+    i = pipe_recv(wp->pipe_new, buf, RING_ARRAY_DEFAULT_CAP);
     if (i < 0) { /* errors, do not read from ring array */
         log_warn("not adding new connections due to pipe error");
         return;
@@ -135,7 +159,7 @@ _worker_read_notification(void)
      * now get from the ring array
      */
     for (; i > 0; --i) {
-        status = ring_array_pop(&s, conn_new);
+        status = ring_array_pop(&s, wp->conn_new);
         if (status != CC_OK) {
             log_warn("event number does not match conn queue: missing %d conns",
                     i);
@@ -154,29 +178,29 @@ static inline void
 _worker_write_notification(void)
 {
 #ifdef USE_EVENT_FD
-    ASSERT(efd_worker_to_server != -1);
+    ASSERT(wp->efd_worker_to_server != -1);
 
     uint64_t u = 1;
-    ssize_t status = write(efd_worker_to_server, &u, sizeof(uint64_t));
+    ssize_t status = write(wp->efd_worker_to_server, &u, sizeof(uint64_t));
 
     if (status == CC_EAGAIN) {
         /* retry write */
         log_verb("server core: retry write to eventfd");
-        event_add_write(ctx->evb, efd_server_to_worker, NULL);
+        event_add_write(ctx->evb, wp->efd_worker_to_server, NULL);
     } else if (status == CC_ERROR) {
         log_error("could not write to eventfd - %d", status);
     }
 #else
-    ASSERT(pipe_term != NULL);
+    ASSERT(wp->pipe_term != NULL);
 
-    ssize_t status = pipe_send(pipe_term, "", 1);
+    ssize_t status = pipe_send(wp->pipe_term, "", 1);
 
     if (status == 0 || status == CC_EAGAIN) {
         /* retry write */
         log_verb("server core: retry send on pipe");
-        event_add_write(ctx->evb, pipe_write_id(pipe_term), NULL);
+        event_add_write(ctx->evb, pipe_write_id(wp->pipe_term), NULL);
     } else if (status == CC_ERROR) {
-        log_error("could not write to pipe - %s", strerror(pipe_term->err));
+        log_error("could not write to pipe - %s", strerror(wp->pipe_term->err));
     }
 #endif
 }
@@ -194,7 +218,7 @@ worker_ret_stream(struct buf_sock *s)
 
     /* push buf_sock to queue */
     INCR(worker_metrics, worker_ret_stream);
-    if (ring_array_push(&s, conn_term) != CC_OK) {
+    if (ring_array_push(&s, wp->conn_term) != CC_OK) {
         /* here we have no choice but to clean up the stream to avoid leak */
         log_error("term connection queue is full");
         hdl->term(s->ch);
@@ -229,6 +253,10 @@ _worker_event(void *arg, uint32_t events)
     } else {
         /* event on one of the connections */
 
+        if (processor->online != NULL) {
+            processor->online();
+        }
+
         if (events & EVENT_READ) {
             log_verb("processing worker read event on buf_sock %p", s);
             INCR(worker_metrics, worker_event_read);
@@ -264,11 +292,77 @@ _worker_event(void *arg, uint32_t events)
     }
 }
 
+static void
+_worker_pipe_destroy(struct worker_pipe *p)
+{
+    ring_array_destroy(&p->conn_term);
+    ring_array_destroy(&p->conn_new);
+#ifdef USE_EVENT_FD
+    if (p->efd_server_to_worker >= 0) {
+        close(p->efd_server_to_worker);
+    }
+    if (p->efd_worker_to_server >= 0) {
+        close(p->efd_worker_to_server);
+    }
+#else
+    pipe_conn_destroy(&p->pipe_new);
+    pipe_conn_destroy(&p->pipe_term);
+#endif
+}
+
+static rstatus_i
+_worker_pipe_create(struct worker_pipe *p)
+{
+#ifdef USE_EVENT_FD
+    p->efd_server_to_worker = eventfd(0 /* intval */, EFD_CLOEXEC | EFD_NONBLOCK);
+    p->efd_worker_to_server = eventfd(0 /* intval */, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (p->efd_server_to_worker < 0 || p->efd_worker_to_server < 0) {
+        log_error("Could not create event fd %s, abort", strerror(errno));
+        return CC_ERROR;
+    }
+#else
+    p->pipe_new = pipe_conn_create();
+    p->pipe_term = pipe_conn_create();
+    if (p->pipe_new == NULL || p->pipe_term == NULL) {
+        log_error("Could not create connection for pipe, abort");
+        return CC_ERROR;
+    }
+
+    if (!pipe_open(NULL, p->pipe_new)) {
+        log_error("Could not open pipe for new connection: %s",
+                strerror(p->pipe_new->err));
+        return CC_ERROR;
+    }
+    if (!pipe_open(NULL, p->pipe_term)) {
+        log_error("Could not open pipe for terminated connection: %s",
+                strerror(p->pipe_term->err));
+        return CC_ERROR;
+    }
+
+    /* event_fd is set to nonblocking during creation */
+    pipe_set_nonblocking(p->pipe_new);
+    pipe_set_nonblocking(p->pipe_term);
+#endif
+
+    p->conn_new = ring_array_create(sizeof(struct buf_sock *),
+            RING_ARRAY_DEFAULT_CAP);
+    p->conn_term = ring_array_create(sizeof(struct buf_sock *),
+            RING_ARRAY_DEFAULT_CAP);
+    if (p->conn_new == NULL || p->conn_term == NULL) {
+        log_error("core setup failed: could not allocate conn array(s)");
+        return CC_ERROR;
+    }
+
+    return CC_OK;
+}
+
 void
-core_worker_setup(worker_options_st *options, worker_metrics_st *metrics)
+core_worker_setup(worker_options_st *options, worker_metrics_st *metrics,
+        bool multi_worker)
 {
     int timeout = WORKER_TIMEOUT;
     int nevent = WORKER_NEVENT;
+    uint32_t nthread = WORKER_NTHREAD;
 
     log_info("set up the %s module", WORKER_MODULE_NAME);
 
@@ -283,15 +377,36 @@ core_worker_setup(worker_options_st *options, worker_metrics_st *metrics)
     if (options != NULL) {
         timeout = option_uint(&options->worker_timeout);
         nevent = option_uint(&options->worker_nevent);
+        nthread = option_uint(&options->worker_nthread);
     }
 
-    ctx->timeout = timeout;
-    ctx->evb = event_base_create(nevent, _worker_event);
-    if (ctx->evb == NULL) {
-        log_crit("failed to setup worker thread core; could not create event_base");
+    if (nthread == 0) {
+        log_crit("failed to setup worker thread core; need at least 1 worker");
         exit(EX_CONFIG);
     }
 
+    if (nthread > 1 && !multi_worker) {
+        log_crit("failed to setup worker thread core; %"PRIu32" workers "
+                "configured but the server supports only 1", nthread);
+        exit(EX_CONFIG);
+    }
+
+    nworker = nthread;
+    worker_next_id = 0;
+    contexts = cc_alloc(sizeof(struct context) * nworker);
+    worker_pipes = cc_alloc(sizeof(struct worker_pipe) * nworker);
+    if (contexts == NULL || worker_pipes == NULL) {
+        log_crit("failed to setup worker thread core; OOM");
+        exit(EX_CONFIG);
+    }
+    memset(worker_pipes, 0, sizeof(struct worker_pipe) * nworker);
+#ifdef USE_EVENT_FD
+    for (uint32_t i = 0; i < nworker; i++) {
+        worker_pipes[i].efd_server_to_worker = -1;
+        worker_pipes[i].efd_worker_to_server = -1;
+    }
+#endif
+
     /* worker thread does not handle accept/reject/open/term directly */
     hdl->accept = NULL;
     hdl->reject = NULL;
@@ -302,11 +417,28 @@ core_worker_setup(worker_options_st *options, worker_metrics_st *metrics)
     hdl->rid = (channel_id_fn)tcp_read_id;
     hdl->wid = (channel_id_fn)tcp_write_id;
 
+    for (uint32_t i = 0; i < nworker; i++) {
+        if (_worker_pipe_create(&worker_pipes[i]) != CC_OK) {
+            log_crit("failed to setup worker thread core; could not create "
+                    "pipe for worker %"PRIu32, i);
+            exit(EX_CONFIG);
+        }
+
+        contexts[i].timeout = timeout;
+        contexts[i].evb = event_base_create(nevent, _worker_event);
+        if (contexts[i].evb == NULL) {
+            log_crit("failed to setup worker thread core; could not create event_base");
+            exit(EX_CONFIG);
+        }
+
 #ifdef USE_EVENT_FD
-    event_add_read(ctx->evb, efd_server_to_worker, NULL);
+        event_add_read(contexts[i].evb, worker_pipes[i].efd_server_to_worker, NULL);
 #else
-    event_add_read(ctx->evb, pipe_read_id(pipe_new), NULL);
+        event_add_read(contexts[i].evb, pipe_read_id(worker_pipes[i].pipe_new), NULL);
 #endif
+    }
+
+    log_info("%"PRIu32" worker thread(s) configured", nworker);
 
     worker_init = true;
 }
@@ -319,7 +451,13 @@ core_worker_teardown(void)
     if (!worker_init) {
         log_warn("%s has never been setup", WORKER_MODULE_NAME);
     } else {
-        event_base_destroy(&(ctx->evb));
+        for (uint32_t i = 0; i < nworker; i++) {
+            event_base_destroy(&(contexts[i].evb));
+            _worker_pipe_destroy(&worker_pipes[i]);
+        }
+        cc_free(contexts);
+        cc_free(worker_pipes);
+        nworker = 0;
     }
     worker_metrics = NULL;
     worker_init = false;
@@ -330,6 +468,10 @@ _worker_evwait(void)
 {
     int n;
 
+    if (processor->offline != NULL) {
+        processor->offline();
+    }
+
     n = event_wait(ctx->evb, ctx->timeout);
     if (n < 0) {
         return n;
@@ -342,16 +484,90 @@ _worker_evwait(void)
     return CC_OK;
 }
 
+#ifndef __APPLE__
+/*
+ * read the cpus of the NUMA node of worker id (node id % #nodes), the nodes
+ * are assumed to be numbered without gaps, return false if there is no
+ * NUMA information
+ */
+static bool
+_worker_node_cpuset(uint32_t id, cpu_set_t *cpuset, uint32_t *node)
+{
+    char path[64], buf[1024], *s, *end;
+    uint32_t n_node = 0;
+    long lo, hi;
+    FILE *fp;
+
+    for (;;) {
+        snprintf(path, sizeof(path), NUMA_NODE_CPULIST, n_node);
+        if (access(path, R_OK) != 0) {
+            break;
+        }
+        n_node++;
+    }
+    if (n_node == 0) {
+        return false;
+    }
+
+    *node = id % n_node;
+    snprintf(path, sizeof(path), NUMA_NODE_CPULIST, *node);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    s = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (s == NULL) {
+        return false;
+    }
+
+    /* a cpu list such as "0-15,32-47" */
+    CPU_ZERO(cpuset);
+    while (*s != '\0' && *s != '\n') {
+        lo = strtol(s, &end, 10);
+        if (end == s) {
+            break;
+        }
+        hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            s = end;
+        }
+        for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpuset);
+        }
+        if (*s == ',') {
+            s++;
+        }
+    }
+
+    return CPU_COUNT(cpuset) > 0;
+}
+#endif
+
 void *
 core_worker_evloop(void *arg)
 {
     processor = arg;
 
+    uint32_t id = __atomic_fetch_add(&worker_next_id, 1, __ATOMIC_RELAXED);
+    if (id >= nworker) {
+        log_crit("more worker threads started than configured (%"PRIu32")",
+                nworker);
+        exit(EX_SOFTWARE);
+    }
+    ctx = &contexts[id];
+    wp = &worker_pipes[id];
+
+    INCR(worker_metrics, worker_thread_curr);
+
     int binding_core = option_uint(&worker_options->worker_binding_core);
 
 #ifndef __APPLE__
     if (binding_core != 0xffffffff) {
-      /* bind worker to the core */
+      /* bind worker i to core binding_core + i */
+      binding_core += id;
       cpu_set_t cpuset;
       pthread_t thread = pthread_self();
 
@@ -362,7 +578,24 @@ core_worker_evloop(void *arg)
           log_warn("fail to bind worker thread to core %d: %s",
                  binding_core, strerror(errno));
       } else {
-        log_info("binding worker thread to core %d", binding_core);
+        log_info("binding worker thread %"PRIu32" to core %d", id,
+                binding_core);
+      }
+    } else if (option_bool(&worker_options->worker_binding_numa)) {
+      /* spread the workers over the nodes, so that each one allocates from
+       * the memory of its own node */
+      cpu_set_t cpuset;
+      uint32_t node;
+
+      if (!_worker_node_cpuset(id, &cpuset, &node)) {
+          log_warn("no NUMA node information, worker thread %"PRIu32" is not "
+                 "bound", id);
+      } else if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                 &cpuset) != 0) {
+          log_warn("fail to bind worker thread to node %"PRIu32": %s", node,
+                 strerror(errno));
+      } else {
+        log_info("binding worker thread %"PRIu32" to node %"PRIu32, id, node);
       }
     }
 #else
@@ -8,12 +8,15 @@
 #define WORKER_TIMEOUT        100     /* in ms */
 #define WORKER_NEVENT         1024
 #define WORKER_BINDING_CORE   0xffffffff
+#define WORKER_NTHREAD        1
 
 /*          name                  type                default               description */
-#define WORKER_OPTION(ACTION)                                                                                      \
-    ACTION( worker_timeout,       OPTION_TYPE_UINT,   WORKER_TIMEOUT,       "evwait timeout"                      )\
-    ACTION( worker_nevent,        OPTION_TYPE_UINT,   WORKER_NEVENT,        "evwait max nevent returned"          )\
-    ACTION( worker_binding_core,  OPTION_TYPE_UINT,   WORKER_BINDING_CORE,  "which core pin the worker thread to" )
+#define WORKER_OPTION(ACTION)                                                                                                     \
+    ACTION( worker_timeout,       OPTION_TYPE_UINT,   WORKER_TIMEOUT,       "evwait timeout"                                     )\
+    ACTION( worker_nevent,        OPTION_TYPE_UINT,   WORKER_NEVENT,        "evwait max nevent returned"                         )\
+    ACTION( worker_binding_core,  OPTION_TYPE_UINT,   WORKER_BINDING_CORE,  "which core pin the (first) worker thread to"        )\
+    ACTION( worker_nthread,       OPTION_TYPE_UINT,   WORKER_NTHREAD,       "# worker threads, >1 if the server supports it"     )\
+    ACTION( worker_binding_numa,  OPTION_TYPE_BOOL,   false,                "pin worker i to the cpus of NUMA node i % #nodes"   )
 
 typedef struct {
     WORKER_OPTION(OPTION_DECLARE)
@@ -27,7 +30,8 @@ typedef struct {
     ACTION( worker_event_write,     METRIC_COUNTER, "# worker core_write events"    )\
     ACTION( worker_event_error,     METRIC_COUNTER, "# worker core_error events"    )\
     ACTION( worker_add_stream,      METRIC_COUNTER, "# worker adding a stream"      )\
-    ACTION( worker_ret_stream,      METRIC_COUNTER, "# worker returning a stream"   )
+    ACTION( worker_ret_stream,      METRIC_COUNTER, "# worker returning a stream"   )\
+    ACTION( worker_thread_curr,     METRIC_GAUGE,   "# worker threads running"      )
 
 typedef struct {
     CORE_WORKER_METRIC(METRIC_DECLARE)
@@ -42,13 +46,30 @@ typedef struct {
  * to core_worker_evloop().
  */
 struct buf;
+struct buf_sock;
 typedef int (*data_fn)(struct buf **, struct buf **, void **);
+typedef void (*data_thread_fn)(void);
+typedef rstatus_i (*data_recv_fn)(struct buf_sock *);
+typedef rstatus_i (*data_send_fn)(struct buf_sock *);
 struct data_processor {
     data_fn read;
     data_fn write;
     data_fn error;
+    /* optional, called before processing events on connections and before
+     * waiting for events, the worker holds no data between the two */
+    data_thread_fn online;
+    data_thread_fn offline;
+    /* optional, sends the wbuf in place of buf_tcp_write (with the same
+     * return status), for processors that send data outside of the wbuf */
+    data_send_fn send;
+    /* optional, reads in place of buf_tcp_read, for processors that receive
+     * data outside of the rbuf */
+    data_recv_fn recv;
 };
 
-void core_worker_setup(worker_options_st *options, worker_metrics_st *metrics);
+/* multi_worker: whether the server's storage and processor are safe to be
+ * used by more than one worker thread, otherwise worker_nthread must be 1 */
+void core_worker_setup(worker_options_st *options, worker_metrics_st *metrics,
+        bool multi_worker);
 void core_worker_teardown(void);
-void *core_worker_evloop(void *arg);
+void *core_worker_evloop(void *arg); /* called once per worker thread */
@@ -6,6 +6,9 @@ struct datapool;
 
 struct datapool *datapool_open(const char *path, const char *user_signature,
     size_t size, int *fresh, bool prefault);
+/* a fresh anonymous pool in huge pages of page_size bytes, NULL on failure */
+struct datapool *datapool_open_hugetlb(const char *user_signature,
+    size_t size, size_t page_size);
 void datapool_close(struct datapool *pool);
 
 void *datapool_addr(struct datapool *pool);
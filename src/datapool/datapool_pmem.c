@@ -11,6 +11,8 @@
 #include <inttypes.h>
 #include <libpmem.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #define DATAPOOL_SIGNATURE ("PELIKAN") /* 8 bytes */
 #define DATAPOOL_SIGNATURE_LEN (sizeof(DATAPOOL_SIGNATURE))
@@ -55,6 +57,7 @@ struct datapool {
     size_t mapped_len;
     int is_pmem;
     int file_backed;
+    int hugetlb;        /* anonymous huge page mapping */
 };
 
 static void
@@ -164,7 +167,7 @@ datapool_flag_clear(struct datapool *pool, uint64_t flag)
 struct datapool *
 datapool_open(const char *path, const char *user_signature, size_t size, int *fresh, bool prefault)
 {
-    struct datapool *pool = cc_alloc(sizeof(*pool));
+    struct datapool *pool = cc_zalloc(sizeof(*pool));
     if (pool == NULL) {
         log_error("unable to create allocate memory for pmem mapping");
         goto err_alloc;
@@ -245,6 +248,70 @@ err_alloc:
     return NULL;
 }
 
+/*
+ * Opens a fresh anonymous datapool backed by huge pages of page_size bytes
+ * (MAP_HUGETLB), the size is rounded up to the page size. Returns NULL if
+ * the huge pages cannot be mapped, e.g. when not enough are reserved.
+ */
+struct datapool *
+datapool_open_hugetlb(const char *user_signature, size_t size, size_t page_size)
+{
+#ifdef MAP_HUGETLB
+    struct datapool *pool;
+    size_t map_size;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+
+    if (user_signature == NULL ||
+        cc_strnlen(user_signature, DATAPOOL_USER_LAYOUT_LEN) == DATAPOOL_USER_LAYOUT_LEN) {
+        log_error("invalid user signature");
+        return NULL;
+    }
+
+    if (page_size == 0 || (page_size & (page_size - 1)) != 0) {
+        log_error("invalid huge page size %zu", page_size);
+        return NULL;
+    }
+
+#ifdef MAP_HUGE_SHIFT
+    flags |= __builtin_ctzl(page_size) << MAP_HUGE_SHIFT;
+#endif
+
+    pool = cc_zalloc(sizeof(*pool));
+    if (pool == NULL) {
+        log_error("unable to create allocate memory for datapool");
+        return NULL;
+    }
+
+    map_size = size + sizeof(struct datapool_header);
+    map_size = (map_size + page_size - 1) / page_size * page_size;
+
+    pool->addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (pool->addr == MAP_FAILED) {
+        log_error("mmap %zu bytes of %zu-byte huge pages failed: %s", map_size,
+            page_size, strerror(errno));
+        cc_free(pool);
+        return NULL;
+    }
+
+    pool->mapped_len = map_size;
+    pool->hugetlb = 1;
+
+    log_info("mapped datapool with size %zu in %zu-byte huge pages", map_size,
+        page_size);
+
+    pool->hdr = pool->addr;
+    pool->user_addr = (uint8_t *)pool->addr + sizeof(struct datapool_header);
+
+    datapool_initialize(pool, user_signature);
+    datapool_flag_set(pool, DATAPOOL_FLAG_DIRTY);
+
+    return pool;
+#else
+    log_error("huge pages are not supported");
+    return NULL;
+#endif
+}
+
 void
 datapool_close(struct datapool *pool)
 {
@@ -254,6 +321,9 @@ datapool_close(struct datapool *pool)
     if (pool->file_backed) {
         int ret = pmem_unmap(pool->addr, pool->mapped_len);
         ASSERT(ret == 0);
+    } else if (pool->hugetlb) {
+        int ret = munmap(pool->addr, pool->mapped_len);
+        ASSERT(ret == 0);
     } else {
         cc_free(pool->addr);
     }
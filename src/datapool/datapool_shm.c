@@ -1,59 +1,433 @@
 /*
- * Anonymous shared memory backed datapool.
- * Loses all its contents after closing.
+ * Shared memory backed datapool.
+ * Without a path, the pool is anonymous memory and loses all its contents
+ * after closing.
+ * With a path, the pool is a shared mapping of the file, which can be on
+ * tmpfs or hugetlbfs, and retains its contents if the pool has been closed
+ * correctly.
  */
 #include "datapool.h"
 
 #include <cc_debug.h>
 #include <cc_mm.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DATAPOOL_SIGNATURE ("PELIKAN") /* 8 bytes */
+#define DATAPOOL_SIGNATURE_LEN (sizeof(DATAPOOL_SIGNATURE))
+
+/*
+ * Size of the data pool header, same layout as the pmem datapool.
+ * Big enough to fit all necessary metadata, but most of this size is left
+ * unused for future expansion.
+ */
+
+#define DATAPOOL_INTERNAL_HEADER_LEN 2048
+#define DATAPOOL_USER_LAYOUT_LEN       48
+#define DATAPOOL_USER_HEADER_LEN     2048
+#define DATAPOOL_HEADER_LEN (DATAPOOL_INTERNAL_HEADER_LEN + DATAPOOL_USER_HEADER_LEN)
+#define DATAPOOL_VERSION 1
+
+#define DATAPOOL_FLAG_DIRTY (1 << 0)
+#define DATAPOOL_VALID_FLAGS (DATAPOOL_FLAG_DIRTY)
+
+#define PAGE_SIZE 4096
+
+/*
+ * Header at the beginning of the pool, it's verified every time the pool is
+ * opened.
+ */
+struct datapool_header {
+    uint8_t signature[DATAPOOL_SIGNATURE_LEN];
+    uint64_t version;
+    uint64_t size;
+    uint64_t flags;
+    uint8_t unused[DATAPOOL_INTERNAL_HEADER_LEN - 32];
+
+    uint8_t user_signature[DATAPOOL_USER_LAYOUT_LEN];
+    uint8_t user_data[DATAPOOL_USER_HEADER_LEN - DATAPOOL_USER_LAYOUT_LEN];
+};
+
+struct datapool {
+    void *addr;
+
+    struct datapool_header *hdr;
+    void *user_addr;
+    size_t mapped_len;
+    int file_backed;
+    int hugetlb;        /* anonymous huge page mapping */
+};
+
+static bool
+datapool_sync_hdr(struct datapool *pool)
+{
+    if (pool->file_backed &&
+            msync(pool->hdr, DATAPOOL_HEADER_LEN, MS_SYNC) < 0) {
+        log_error("sync datapool header failed: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+datapool_sync(struct datapool *pool)
+{
+    if (pool->file_backed &&
+            msync(pool->addr, pool->mapped_len, MS_SYNC) < 0) {
+        log_error("sync datapool failed: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void
+datapool_unmap(struct datapool *pool)
+{
+    if (munmap(pool->addr, pool->mapped_len) < 0) {
+        log_error("unmap datapool failed: %s", strerror(errno));
+    }
+}
+
+static bool
+datapool_valid_user_signature(struct datapool *pool, const char *user_name)
+{
+    if (cc_strcmp(pool->hdr->user_signature, user_name)) {
+        return false;
+    }
+    return true;
+}
+
+static bool
+datapool_valid(struct datapool *pool)
+{
+    if (cc_memcmp(pool->hdr->signature,
+          DATAPOOL_SIGNATURE, DATAPOOL_SIGNATURE_LEN) != 0) {
+        log_info("no signature found in datapool");
+        return false;
+    }
+
+    if (pool->hdr->version != DATAPOOL_VERSION) {
+        log_info("incompatible datapool version (is: %"PRIu64", expecting: %d)",
+            pool->hdr->version, DATAPOOL_VERSION);
+        return false;
+    }
+
+    if (pool->hdr->size != pool->mapped_len) {
+        log_info("datapool has a different size (is: %zu, expecting: %"PRIu64
+            ")", pool->mapped_len, pool->hdr->size);
+        return false;
+    }
+
+    if (pool->hdr->flags & ~DATAPOOL_VALID_FLAGS) {
+        log_error("datapool has invalid flags set");
+        return false;
+    }
+
+    if (pool->hdr->flags & DATAPOOL_FLAG_DIRTY) {
+        log_info("datapool has a valid header but is dirty");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+datapool_initialize(struct datapool *pool, const char *user_name)
+{
+    log_info("initializing fresh datapool");
+
+    /* 1. clear the header from any leftovers */
+    cc_memset(pool->hdr, 0, DATAPOOL_HEADER_LEN);
+    if (!datapool_sync_hdr(pool)) {
+        return false;
+    }
+
+    /* 2. fill in the data */
+    pool->hdr->version = DATAPOOL_VERSION;
+    pool->hdr->size = pool->mapped_len;
+    pool->hdr->flags = 0;
+    cc_memcpy(pool->hdr->user_signature, user_name, cc_strlen(user_name));
+    if (!datapool_sync_hdr(pool)) {
+        return false;
+    }
+
+    /* 3. set the signature */
+    cc_memcpy(pool->hdr->signature, DATAPOOL_SIGNATURE, DATAPOOL_SIGNATURE_LEN);
+    return datapool_sync_hdr(pool);
+}
+
+static bool
+datapool_flag_set(struct datapool *pool, uint64_t flag)
+{
+    pool->hdr->flags |= flag;
+    return datapool_sync_hdr(pool);
+}
+
+static bool
+datapool_flag_clear(struct datapool *pool, uint64_t flag)
+{
+    pool->hdr->flags &= ~flag;
+    return datapool_sync_hdr(pool);
+}
+
+/*
+ * map the file with a shared mapping, the file is created if it does not
+ * exist and resized to map_size (rounded up to the block size of the file
+ * system, which is the huge page size on hugetlbfs) if its size differs
+ */
+static void *
+datapool_map_file(const char *path, size_t map_size, size_t *mapped_len)
+{
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        log_error("open datapool file %s failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        log_error("stat datapool file %s failed: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_blksize > 0) {
+        map_size = (map_size + st.st_blksize - 1) / st.st_blksize *
+            st.st_blksize;
+    }
+
+    if ((size_t)st.st_size != map_size && ftruncate(fd, map_size) < 0) {
+        log_error("resize datapool file %s to %zu failed: %s", path, map_size,
+            strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* the mapping holds its own reference to the file */
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        log_error("mmap datapool file %s failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    *mapped_len = map_size;
+
+    return addr;
+}
+
+/*
+ * Opens, and if necessary initializes, a datapool that resides in the given
+ * file. If no file is provided, the pool is allocated through cc_zalloc.
+ *
+ * For the datapool to retain its contents, the datapool_close() call must
+ * finish successfully.
+ */
 struct datapool *
 datapool_open(const char *path, const char *user_signature, size_t size, int *fresh, bool prefault)
 {
-    if (path != NULL) {
-        log_warn("attempted to open a file-based data pool without"
-            "pmem features enabled");
-        return NULL;
+    struct datapool *pool = cc_zalloc(sizeof(*pool));
+    if (pool == NULL) {
+        log_error("unable to create allocate memory for datapool");
+        goto err_alloc;
+    }
+
+    if (user_signature == NULL) {
+        log_error("empty user signature");
+        goto err_map;
+    }
+
+    if (cc_strnlen(user_signature, DATAPOOL_USER_LAYOUT_LEN) == DATAPOOL_USER_LAYOUT_LEN ) {
+        log_error("user signature is too long %zu", cc_strlen(user_signature));
+        goto err_map;
     }
 
+    size_t map_size = size + sizeof(struct datapool_header);
+
+    if (path == NULL) {
+        pool->addr = cc_zalloc(map_size);
+        pool->mapped_len = map_size;
+        pool->file_backed = 0;
+        if (pool->addr == NULL) {
+            log_error("allocate datapool failed: %s", strerror(errno));
+        }
+    } else {
+        pool->addr = datapool_map_file(path, map_size, &pool->mapped_len);
+        pool->file_backed = 1;
+    }
+
+    if (pool->addr == NULL) {
+        goto err_map;
+    }
+
+    /* only the file mapping is prefaulted, anonymous memory is left as is */
+    if (prefault && pool->file_backed) {
+        log_info("prefault datapool");
+        volatile char *cur_addr = pool->addr;
+        char *addr_end = (char *)cur_addr + pool->mapped_len;
+        for (; cur_addr < addr_end; cur_addr += PAGE_SIZE) {
+            *cur_addr = *cur_addr;
+        }
+    }
+
+    log_info("mapped datapool %s with size %zu", path, pool->mapped_len);
+
+    pool->hdr = pool->addr;
+    pool->user_addr = (uint8_t *)pool->addr + sizeof(struct datapool_header);
+
     if (fresh) {
-        *fresh = 1;
+        *fresh = 0;
+    }
+
+    if (!pool->file_backed || !datapool_valid(pool)) {
+        if (fresh) {
+            *fresh = 1;
+        }
+
+        if (!datapool_initialize(pool, user_signature)) {
+            goto err_map_adr;
+        }
+    } else if (!datapool_valid_user_signature(pool, user_signature)) {
+        log_error("wrong user signature (%s) used for pool", user_signature);
+        goto err_map_adr;
+    }
+
+    if (!datapool_flag_set(pool, DATAPOOL_FLAG_DIRTY)) {
+        goto err_map_adr;
+    }
+
+    return pool;
+
+err_map_adr:
+    if (pool->file_backed) {
+        datapool_unmap(pool);
+    } else {
+        cc_free(pool->addr);
+    }
+err_map:
+    cc_free(pool);
+err_alloc:
+    return NULL;
+}
+
+/*
+ * Opens a fresh anonymous datapool backed by huge pages of page_size bytes
+ * (MAP_HUGETLB), the size is rounded up to the page size. Returns NULL if
+ * the huge pages cannot be mapped, e.g. when not enough are reserved.
+ */
+struct datapool *
+datapool_open_hugetlb(const char *user_signature, size_t size, size_t page_size)
+{
+#ifdef MAP_HUGETLB
+    struct datapool *pool;
+    size_t map_size;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+
+    if (user_signature == NULL ||
+        cc_strnlen(user_signature, DATAPOOL_USER_LAYOUT_LEN) == DATAPOOL_USER_LAYOUT_LEN) {
+        log_error("invalid user signature");
+        return NULL;
+    }
+
+    if (page_size == 0 || (page_size & (page_size - 1)) != 0) {
+        log_error("invalid huge page size %zu", page_size);
+        return NULL;
+    }
+
+#ifdef MAP_HUGE_SHIFT
+    flags |= __builtin_ctzl(page_size) << MAP_HUGE_SHIFT;
+#endif
+
+    pool = cc_zalloc(sizeof(*pool));
+    if (pool == NULL) {
+        log_error("unable to create allocate memory for datapool");
+        return NULL;
     }
 
-    return cc_zalloc(size);
+    map_size = size + sizeof(struct datapool_header);
+    map_size = (map_size + page_size - 1) / page_size * page_size;
+
+    pool->addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (pool->addr == MAP_FAILED) {
+        log_error("mmap %zu bytes of %zu-byte huge pages failed: %s", map_size,
+            page_size, strerror(errno));
+        cc_free(pool);
+        return NULL;
+    }
+
+    pool->mapped_len = map_size;
+    pool->hugetlb = 1;
+
+    log_info("mapped datapool with size %zu in %zu-byte huge pages", map_size,
+        page_size);
+
+    pool->hdr = pool->addr;
+    pool->user_addr = (uint8_t *)pool->addr + sizeof(struct datapool_header);
+
+    /* anonymous memory, the header is never synced so this cannot fail */
+    datapool_initialize(pool, user_signature);
+    datapool_flag_set(pool, DATAPOOL_FLAG_DIRTY);
+
+    return pool;
+#else
+    log_error("huge pages are not supported");
+    return NULL;
+#endif
 }
 
 void
 datapool_close(struct datapool *pool)
 {
+    /* the pool stays dirty, and is not reused on the next open, unless all
+     * of its contents made it to the file */
+    if (!datapool_sync(pool) ||
+            !datapool_flag_clear(pool, DATAPOOL_FLAG_DIRTY)) {
+        log_error("datapool is left dirty, its contents are lost");
+    }
+
+    if (pool->file_backed || pool->hugetlb) {
+        datapool_unmap(pool);
+    } else {
+        cc_free(pool->addr);
+    }
+
     cc_free(pool);
 }
 
 void *
 datapool_addr(struct datapool *pool)
 {
-    return pool;
+    return pool->user_addr;
 }
 
 size_t
 datapool_size(struct datapool *pool)
 {
-    return cc_alloc_usable_size(pool);
+    return pool->mapped_len - sizeof(struct datapool_header);
 }
 
-/*
- * NOTE: Abstraction in datapool required defining functions below
- *       datapool_get_user_data is currently used only in in pmem implementation
- *       datapool_set_user_data is called during teardown e.g. slab
- */
 void
 datapool_set_user_data(const struct datapool *pool, const void *user_data, size_t user_size)
 {
-
+    ASSERT(user_size < DATAPOOL_USER_HEADER_LEN - DATAPOOL_USER_LAYOUT_LEN);
+    cc_memcpy(pool->hdr->user_data, user_data, user_size);
 }
 
 void
 datapool_get_user_data(const struct datapool *pool, void *user_data, size_t user_size)
 {
-    NOT_REACHED();
+    ASSERT(user_size < DATAPOOL_USER_HEADER_LEN - DATAPOOL_USER_LAYOUT_LEN);
+    cc_memcpy(user_data, pool->hdr->user_data, user_size);
 }
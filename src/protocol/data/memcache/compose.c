@@ -235,6 +235,28 @@ error:
  * response specific functions
  */
 
+/* the line before the value of a value response, buf must have room for it */
+static inline int
+_value_hdr(struct buf **buf, const struct response *rsp,
+        const struct bstring *str, uint32_t vlen)
+{
+    int n = 0;
+
+    n += _write_bstring(buf, str);
+    n += _write_bstring(buf, &rsp->key);
+    n += _delim(buf);
+    n += _write_uint64(buf, rsp->flag);
+    n += _delim(buf);
+    n += _write_uint64(buf, vlen);
+    if (rsp->cas) {
+        n += _delim(buf);
+        n += _write_uint64(buf, rsp->vcas);
+    }
+    n += _crlf(buf);
+
+    return n;
+}
+
 int
 compose_rsp(struct buf **buf, const struct response *rsp)
 {
@@ -309,17 +331,7 @@ compose_rsp(struct buf **buf, const struct response *rsp)
                     + cas_len + vlen + CRLF_LEN * 2) != COMPOSE_OK) {
             goto error;
         }
-        n += _write_bstring(buf, str);
-        n += _write_bstring(buf, &rsp->key);
-        n += _delim(buf);
-        n += _write_uint64(buf, rsp->flag);
-        n += _delim(buf);
-        n += _write_uint64(buf, vlen);
-        if (rsp->cas) {
-            n += _delim(buf);
-            n += _write_uint64(buf, rsp->vcas);
-        }
-        n += _crlf(buf);
+        n += _value_hdr(buf, rsp, str, vlen);
         if (rsp->num) {
             n += _write_uint64(buf, rsp->vint);
         } else {
@@ -343,3 +355,25 @@ error:
 
     return CC_ENOMEM;
 }
+
+int
+compose_rsp_value_hdr(struct buf **buf, const struct response *rsp)
+{
+    int n;
+    struct bstring *str = &rsp_strings[RSP_VALUE];
+    int cas_len = rsp->cas * CC_UINT64_MAXLEN;
+
+    ASSERT(rsp->type == RSP_VALUE && !rsp->num);
+
+    if (_check_buf_size(buf, str->len + rsp->key.len + CC_UINT32_MAXLEN * 2
+                + cas_len + CRLF_LEN * 2) != COMPOSE_OK) {
+        INCR(compose_rsp_metrics, response_compose_ex);
+
+        return CC_ENOMEM;
+    }
+    n = _value_hdr(buf, rsp, str, rsp->vstr.len);
+
+    INCR(compose_rsp_metrics, response_compose);
+
+    return n;
+}
@@ -42,3 +42,7 @@ void compose_teardown(void);
 int compose_req(struct buf **buf, const struct request *req);
 
 int compose_rsp(struct buf **buf, const struct response *rsp);
+
+/* compose a value response up to its value, so that the caller can send the
+ * value from where it is stored, room is left in buf for the CRLF after it */
+int compose_rsp_value_hdr(struct buf **buf, const struct response *rsp);
@@ -12,6 +12,9 @@
 #include <cc_util.h>
 
 #include <ctype.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define PARSE_MODULE_NAME "protocol::memcache::parse"
 
@@ -19,6 +22,80 @@ static bool parse_init = false;
 static parse_req_metrics_st *parse_req_metrics = NULL;
 static parse_rsp_metrics_st *parse_rsp_metrics = NULL;
 
+/*
+ * a token ends at a space or CRLF, so finding where it ends means finding the
+ * next space or CR. On x86 with SSE4.2/AVX2 16/32 bytes are looked at a time,
+ * the kernel is picked by CPUID in parse_setup. The kernels never read at or
+ * beyond e, which is at most buf->wpos.
+ */
+static char *
+_delim_scan_scalar(char *p, char *e)
+{
+    while (p < e && *p != ' ' && *p != CR) {
+        p++;
+    }
+
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static char *
+_delim_scan_sse42(char *p, char *e)
+{
+    const __m128i delim = _mm_setr_epi8(' ', CR, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0);
+    int i;
+
+    for (; e - p >= 16; p += 16) {
+        i = _mm_cmpestri(delim, 2, _mm_loadu_si128((const __m128i *)p), 16,
+                _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16) {
+            return p + i;
+        }
+    }
+
+    return _delim_scan_scalar(p, e);
+}
+
+__attribute__((target("avx2")))
+static char *
+_delim_scan_avx2(char *p, char *e)
+{
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i cr = _mm256_set1_epi8(CR);
+    __m256i v;
+    __m128i u;
+    uint32_t m;
+
+    for (; e - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        m = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, cr)));
+        if (m != 0) {
+            return p + __builtin_ctz(m);
+        }
+    }
+    /* most keys are shorter than 32 bytes, do not leave all of them to the
+     * scalar loop */
+    if (e - p >= 16) {
+        u = _mm_loadu_si128((const __m128i *)p);
+        m = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(u, _mm256_castsi256_si128(sp)),
+                _mm_cmpeq_epi8(u, _mm256_castsi256_si128(cr))));
+        if (m != 0) {
+            return p + __builtin_ctz(m);
+        }
+        p += 16;
+    }
+
+    return _delim_scan_scalar(p, e);
+}
+#endif
+
+static char *(*_delim_scan)(char *p, char *e) = _delim_scan_scalar;
+
 void
 parse_setup(parse_req_metrics_st *req, parse_rsp_metrics_st *rsp)
 {
@@ -31,6 +108,18 @@ parse_setup(parse_req_metrics_st *req, parse_rsp_metrics_st *rsp)
     parse_req_metrics = req;
     parse_rsp_metrics = rsp;
 
+    _delim_scan = _delim_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        _delim_scan = _delim_scan_avx2;
+        log_info("memcache parser uses AVX2 token scanning");
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        _delim_scan = _delim_scan_sse42;
+        log_info("memcache parser uses SSE4.2 token scanning");
+    }
+#endif
+
     parse_init = true;
 }
 
@@ -44,6 +133,7 @@ parse_teardown(void)
     }
     parse_req_metrics = NULL;
     parse_rsp_metrics = NULL;
+    _delim_scan = _delim_scan_scalar;
     parse_init = false;
 }
 
@@ -151,54 +241,64 @@ _chase_crlf(struct buf *buf)
     return PARSE_EUNFIN;
 }
 
-static inline parse_rstatus_e
-_check_key(struct buf *buf, bool *end, struct bstring *t, char *p)
+/*
+ * skip the spaces before a token and find where it ends, a CR that is not
+ * followed by LF is part of the token. On PARSE_OK t is the token, which is
+ * empty if the line ends first, *end tells whether it ends with CRLF, and
+ * rpos is moved past the delimiter. Running out of data is PARSE_EUNFIN, and
+ * a token ending more than MAX_TOKEN_LEN bytes after rpos is PARSE_EOVERSIZE.
+ */
+static parse_rstatus_e
+_chase_token(struct buf *buf, bool *end, struct bstring *t)
 {
-    bool complete;
+    char *p = buf->rpos;
+    char *limit;
+    parse_rstatus_e status;
 
-    if (*p == ' ' && t->len == 0) { /* pre-key spaces */
-        return PARSE_EUNFIN;
+    limit = buf_rsize(buf) > MAX_TOKEN_LEN ? buf->rpos + MAX_TOKEN_LEN + 1 :
+        buf->wpos;
+    while (p < limit && *p == ' ') { /* pre-token spaces */
+        p++;
     }
 
-    complete = _token_end(end, buf, p);
-    if (complete) {
-        _forward_rpos(buf, *end, p);
+    t->data = p;
+    while ((p = _delim_scan(p, limit)) < limit) {
+        if (*p == ' ') {
+            *end = false;
+            break;
+        }
 
-        if (t->len == 0) {
-            return PARSE_EEMPTY;
-        } else {
-            return PARSE_OK;
+        status = _try_crlf(buf, p);
+        if (status == PARSE_EUNFIN) {
+            return PARSE_EUNFIN;
+        }
+        if (status == PARSE_OK) {
+            *end = true;
+            break;
         }
+        p++;
     }
-
-    /* the current character is part of the key */
-    if (t->len == 0) {
-        _token_begin(t, p);
-    } else {
-        t->len++;
+    if (p == limit) {
+        return limit < buf->wpos ? PARSE_EOVERSIZE : PARSE_EUNFIN;
     }
 
-    return PARSE_EUNFIN;
+    t->len = p - t->data;
+    _forward_rpos(buf, *end, p);
+
+    return PARSE_OK;
 }
 
 static parse_rstatus_e
 _chase_key(struct buf *buf, bool *end, struct bstring *t)
 {
-    char *p;
     parse_rstatus_e status;
 
-    for (p = buf->rpos; p < buf->wpos; p++) {
-        if (_token_oversize(buf, p)) {
-            return PARSE_EOVERSIZE;
-        }
-
-        status = _check_key(buf, end, t, p);
-        if (status != PARSE_EUNFIN) {
-            return status;
-        }
+    status = _chase_token(buf, end, t);
+    if (status == PARSE_OK && t->len == 0) {
+        return PARSE_EEMPTY;
     }
 
-    return PARSE_EUNFIN;
+    return status;
 }
 
 static inline parse_rstatus_e
@@ -227,6 +327,10 @@ _check_uint(uint64_t *num, struct buf *buf, bool *end, size_t *len,
         return PARSE_OK;
     }
 
+    if (*p == CR && buf->wpos == p + 1) { /* LF not received yet */
+        return PARSE_EUNFIN;
+    }
+
     /* incomplete token, parse the current digit */
     if (isdigit(*p)) {
         if (*num > max / 10) {
@@ -250,15 +354,59 @@ _check_uint(uint64_t *num, struct buf *buf, bool *end, size_t *len,
     return PARSE_EUNFIN;
 }
 
+/*
+ * convert the leading decimal digits of the 8 bytes at p at once (SWAR),
+ * return how many there are. At most 8 digits never overflow, the byte after
+ * them, if any, is left to _check_uint.
+ */
+static inline size_t
+_swar_digits(uint64_t *num, const char *p)
+{
+    uint64_t w, nd;
+    size_t n;
+
+    cc_memcpy(&w, p, sizeof(w));
+    /* a digit has 3 as its high nibble, also after adding 6 to it; a carry
+     * out of a non-digit only spoils the bytes after it */
+    nd = ((w & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL) |
+        (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) ^
+         0x3030303030303030ULL);
+    n = (nd == 0) ? 8 : (size_t)__builtin_ctzll(nd) / 8;
+    if (n == 0) {
+        return 0;
+    }
+
+    /* the first byte is the least significant, shift the digits to the top
+     * so the bytes shifted in become leading zeros, then combine pairwise */
+    w <<= 8 * (8 - n);
+    w = ((w & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    w = ((w & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    w = ((w & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    *num = w;
+
+    return n;
+}
+
 static parse_rstatus_e
 _chase_uint(uint64_t *num, struct buf *buf, bool *end, uint64_t max)
 {
-    char *p;
+    char *p = buf->rpos;
+    char *limit;
     parse_rstatus_e status;
     size_t len = 0;
 
     *num = 0;
-    for (p = buf->rpos; p < buf->wpos; p++) {
+    limit = buf_rsize(buf) > MAX_TOKEN_LEN ? buf->rpos + MAX_TOKEN_LEN + 1 :
+        buf->wpos;
+    while (p < limit && *p == ' ') { /* pre-number spaces */
+        p++;
+    }
+    if (limit - p >= 8) {
+        len = _swar_digits(num, p);
+        p += len;
+    }
+
+    for (; p < buf->wpos; p++) {
         if (_token_oversize(buf, p)) {
             return PARSE_EOVERSIZE;
         }
@@ -308,156 +456,126 @@ _parse_val(struct bstring *val, struct buf *buf, uint32_t nbyte)
  */
 
 static inline parse_rstatus_e
-_check_req_type(struct request *req, struct buf *buf, bool *end, struct bstring *t,
-        char *p)
+_check_req_type(struct request *req, struct bstring *t)
 {
-    bool complete;
-
-    if (*p == ' ' && t->len == 0) { /* pre-key spaces */
-        return PARSE_EUNFIN;
-    }
-
-    complete = _token_end(end, buf, p);
-    if (complete) {
-        _forward_rpos(buf, *end, p);
-
-        if (t->len == 0) {
-            log_warn("ill formatted request: empty request");
-
-            return PARSE_EEMPTY;
+    switch (t->len) {
+    case 3:
+        if (str3cmp(t->data, 'g', 'e', 't')) {
+            req->type = REQ_GET;
+            break;
         }
 
-        switch (t->len) {
-        case 3:
-            if (str3cmp(t->data, 'g', 'e', 't')) {
-                req->type = REQ_GET;
-                break;
-            }
-
-            if (str3cmp(t->data, 's', 'e', 't')) {
-                req->type = REQ_SET;
-                break;
-            }
-
-            if (str3cmp(t->data, 'a', 'd', 'd')) {
-                req->type = REQ_ADD;
-                break;
-            }
-
-            if (str3cmp(t->data, 'c', 'a', 's')) {
-                req->type = REQ_CAS;
-                break;
-            }
-
+        if (str3cmp(t->data, 's', 'e', 't')) {
+            req->type = REQ_SET;
             break;
+        }
 
-        case 4:
-            if (str4cmp(t->data, 'g', 'e', 't', 's')) {
-                req->type = REQ_GETS;
-                break;
-            }
-
-            if (str4cmp(t->data, 'i', 'n', 'c', 'r')) {
-                req->type = REQ_INCR;
-                break;
-            }
+        if (str3cmp(t->data, 'a', 'd', 'd')) {
+            req->type = REQ_ADD;
+            break;
+        }
 
-            if (str4cmp(t->data, 'd', 'e', 'c', 'r')) {
-                req->type = REQ_DECR;
-                break;
-            }
+        if (str3cmp(t->data, 'c', 'a', 's')) {
+            req->type = REQ_CAS;
+            break;
+        }
 
-            if (str4cmp(t->data, 'q', 'u', 'i', 't')) {
-                req->type = REQ_QUIT;
-                break;
-            }
+        break;
 
+    case 4:
+        if (str4cmp(t->data, 'g', 'e', 't', 's')) {
+            req->type = REQ_GETS;
             break;
+        }
 
-        case 5:
-            if (str5cmp(t->data, 'f', 'l', 'u', 's', 'h')) {
-                req->type = REQ_FLUSH;
-                break;
-            }
+        if (str4cmp(t->data, 'i', 'n', 'c', 'r')) {
+            req->type = REQ_INCR;
+            break;
+        }
 
+        if (str4cmp(t->data, 'd', 'e', 'c', 'r')) {
+            req->type = REQ_DECR;
             break;
+        }
 
-        case 6:
-            if (str6cmp(t->data, 'd', 'e', 'l', 'e', 't', 'e')) {
-                req->type = REQ_DELETE;
-                break;
-            }
+        if (str4cmp(t->data, 'q', 'u', 'i', 't')) {
+            req->type = REQ_QUIT;
+            break;
+        }
 
-            if (str6cmp(t->data, 'a', 'p', 'p', 'e', 'n', 'd')) {
-                req->type = REQ_APPEND;
-                break;
-            }
+        break;
 
+    case 5:
+        if (str5cmp(t->data, 'f', 'l', 'u', 's', 'h')) {
+            req->type = REQ_FLUSH;
             break;
+        }
 
-        case 7:
-            if (str7cmp(t->data, 'r', 'e', 'p', 'l', 'a', 'c', 'e')) {
-                req->type = REQ_REPLACE;
-                break;
-            }
+        break;
 
-            if (str7cmp(t->data, 'p', 'r', 'e', 'p', 'e', 'n', 'd')) {
-                req->type = REQ_PREPEND;
-                break;
-            }
+    case 6:
+        if (str6cmp(t->data, 'd', 'e', 'l', 'e', 't', 'e')) {
+            req->type = REQ_DELETE;
+            break;
+        }
 
+        if (str6cmp(t->data, 'a', 'p', 'p', 'e', 'n', 'd')) {
+            req->type = REQ_APPEND;
             break;
+        }
 
-        case 9:
-            if (str9cmp(t->data, 'f', 'l', 'u', 's', 'h', '_', 'a', 'l', 'l')) {
-                req->type = REQ_FLUSHALL;
-                break;
-            }
+        break;
 
+    case 7:
+        if (str7cmp(t->data, 'r', 'e', 'p', 'l', 'a', 'c', 'e')) {
+            req->type = REQ_REPLACE;
             break;
         }
 
-        if (req->type == REQ_UNKNOWN) { /* no match */
-            log_warn("ill formatted request: unknown command");
+        if (str7cmp(t->data, 'p', 'r', 'e', 'p', 'e', 'n', 'd')) {
+            req->type = REQ_PREPEND;
+            break;
+        }
 
-            return PARSE_EINVALID;
-        } else {
-            _forward_rpos(buf, *end, p);
+        break;
 
-            return PARSE_OK;
+    case 9:
+        if (str9cmp(t->data, 'f', 'l', 'u', 's', 'h', '_', 'a', 'l', 'l')) {
+            req->type = REQ_FLUSHALL;
+            break;
         }
+
+        break;
     }
 
-    /* token incomplete */
-    if (t->len == 0) {
-        _token_begin(t, p);
-    } else {
-        t->len++;
+    if (req->type == REQ_UNKNOWN) { /* no match */
+        log_warn("ill formatted request: unknown command");
+
+        return PARSE_EINVALID;
     }
 
-    return PARSE_EUNFIN;
+    return PARSE_OK;
 }
 
 static parse_rstatus_e
 _chase_req_type(struct request *req, struct buf *buf, bool *end)
 {
-    char *p;
     parse_rstatus_e status;
     struct bstring t;
 
     bstring_init(&t);
-    for (p = buf->rpos; p < buf->wpos; p++) {
-        if (_token_oversize(buf, p)) {
-            return PARSE_EOVERSIZE;
-        }
+    status = _chase_token(buf, end, &t);
+    if (status != PARSE_OK) {
+        return status;
+    }
 
-        status = _check_req_type(req, buf, end, &t, p);
-        if (status != PARSE_EUNFIN) {
-            return status;
-        }
+    if (t.len == 0) {
+        log_warn("ill formatted request: empty request");
+
+        return PARSE_EEMPTY;
     }
 
-    return PARSE_EUNFIN;
+    return _check_req_type(req, &t);
 }
 
 static inline parse_rstatus_e
@@ -479,70 +597,29 @@ _push_key(struct request *req, struct bstring *t)
 }
 
 
-static inline parse_rstatus_e
-_check_noreply(struct buf *buf, bool *end, struct bstring *t, char *p)
-{
-    bool complete;
-
-    if (*p == ' ' && t->len == 0) { /* pre-key spaces */
-        return PARSE_EUNFIN;
-    }
-
-    complete = _token_end(end, buf, p);
-    if (complete) {
-        _forward_rpos(buf, *end, p);
-
-        if (t->len == 0) {
-            return PARSE_EEMPTY;
-        }
-
-        if (t->len == 7 && str7cmp(t->data, 'n', 'o', 'r', 'e', 'p', 'l', 'y')) {
-            return PARSE_OK;
-        }
-
-        return PARSE_EINVALID;
-    }
-
-    /* token not complete */
-    if (t->len == 0) {
-        _token_begin(t, p);
-    } else {
-        t->len++;
-    }
-
-    return PARSE_EUNFIN;
-}
-
 static parse_rstatus_e
 _chase_noreply(struct request *req, struct buf *buf, bool *end)
 {
-    char *p;
+    parse_rstatus_e status;
     struct bstring t;
 
     bstring_init(&t);
-    for (p = buf->rpos; p < buf->wpos; p++) {
-        if (_token_oversize(buf, p)) {
-            return PARSE_EOVERSIZE;
-        }
+    status = _chase_token(buf, end, &t);
+    if (status != PARSE_OK) {
+        return status;
+    }
 
-        switch (_check_noreply(buf, end, &t, p)) {
-        case PARSE_EUNFIN:
-            break;
-        case PARSE_OK:
-            req->noreply = 1;
-        /* fall-through intended */
-        case PARSE_EEMPTY: /* noreply is optional, empty token OK */
-            return PARSE_OK;
-            break;
+    if (t.len == 0) { /* noreply is optional, empty token OK */
+        return PARSE_OK;
+    }
 
-        default:
-            return PARSE_EINVALID;
-            break;
-        }
+    if (t.len == 7 && str7cmp(t.data, 'n', 'o', 'r', 'e', 'p', 'l', 'y')) {
+        req->noreply = 1;
+
+        return PARSE_OK;
     }
 
-    /* if we get here, there can only be one state */
-    return PARSE_EUNFIN;
+    return PARSE_EINVALID;
 }
 
 
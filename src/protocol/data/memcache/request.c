@@ -3,6 +3,8 @@
 #include <cc_debug.h>
 #include <cc_pool.h>
 
+#include <pthread.h>
+
 #define REQUEST_MODULE_NAME "protocol::memcache::request"
 
 static bool request_init = false;
@@ -15,8 +17,15 @@ struct bstring req_strings[] = {
 #undef GET_STRING
 
 FREEPOOL(req_pool, reqq, request);
-static struct req_pool reqp;
-static bool reqp_init = false;
+/* pools are not thread-safe, each thread (e.g. worker) gets its own pool,
+ * created upon first use with its share of the size given at setup, and
+ * destroyed when the thread exits */
+static __thread struct req_pool reqp;
+static __thread bool reqp_init = false;
+static uint32_t reqp_total = REQ_POOLSIZE;
+static uint32_t reqp_max = REQ_POOLSIZE;
+static pthread_key_t reqp_key;
+static bool reqp_key_init = false;
 
 void
 request_reset(struct request *req)
@@ -124,11 +133,31 @@ request_pool_create(uint32_t max)
     }
 }
 
+/* called by pthread when a thread that has created its pool exits */
+static void
+_request_pool_exit(void *arg)
+{
+    if (reqp.nused > 0) {
+        log_warn("thread exits with %"PRIu32" reqs borrowed, request pool is "
+                "not destroyed", reqp.nused);
+        return;
+    }
+
+    request_pool_destroy();
+}
+
 struct request *
 request_borrow(void)
 {
     struct request *req;
 
+    if (!reqp_init) {
+        request_pool_create(reqp_max);
+        if (reqp_key_init) {
+            pthread_setspecific(reqp_key, &reqp);
+        }
+    }
+
     FREEPOOL_BORROW(req, &reqp, next, request_create);
     if (req == NULL) {
         log_debug("borrow req failed: OOM %d");
@@ -179,11 +208,43 @@ request_setup(request_options_st *options, request_metrics_st *metrics)
     if (options != NULL) {
         max = option_uint(&options->request_poolsize);
     }
+    reqp_total = max;
+    reqp_max = max;
     request_pool_create(max);
 
+    if (!reqp_key_init) {
+        if (pthread_key_create(&reqp_key, _request_pool_exit) != 0) {
+            log_crit("cannot create thread key for request pool");
+            exit(EXIT_FAILURE);
+        }
+        reqp_key_init = true;
+    }
+    pthread_setspecific(reqp_key, &reqp);
+
     request_init = true;
 }
 
+/* the pool size given at setup is split evenly among nthread threads, each of
+ * which creates its own pool upon first use; the calling thread (e.g. main)
+ * does not serve requests, so its pool is destroyed */
+void
+request_pool_nthread(uint32_t nthread)
+{
+    if (nthread == 0) {
+        nthread = 1;
+    }
+
+    /* a poolsize of 0 means unlimited, which is not split */
+    reqp_max = reqp_total / nthread + (reqp_total % nthread > 0);
+    log_info("request pool split across %"PRIu32" threads: max %"PRIu32
+            " per thread", nthread, reqp_max);
+
+    if (reqp_init) {
+        request_pool_destroy();
+        pthread_setspecific(reqp_key, NULL);
+    }
+}
+
 void
 request_teardown(void)
 {
@@ -192,7 +253,13 @@ request_teardown(void)
     if (!request_init) {
         log_warn("%s has never been setup", REQUEST_MODULE_NAME);
     }
-    request_pool_destroy();
+    if (reqp_init) {
+        request_pool_destroy();
+    }
+    if (reqp_key_init) {
+        pthread_key_delete(reqp_key);
+        reqp_key_init = false;
+    }
     request_metrics = NULL;
 
     request_init = false;
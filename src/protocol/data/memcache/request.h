@@ -107,6 +107,7 @@ struct request {
 
 void request_setup(request_options_st *options, request_metrics_st *metrics);
 void request_teardown(void);
+void request_pool_nthread(uint32_t nthread);
 
 struct request *request_create(void);
 void request_destroy(struct request **req);
@@ -4,6 +4,8 @@
 #include <cc_mm.h>
 #include <cc_pool.h>
 
+#include <pthread.h>
+
 #define RESPONSE_MODULE_NAME "protocol::memcache::response"
 
 static bool response_init = false;
@@ -16,8 +18,15 @@ struct bstring rsp_strings[] = {
 #undef GET_STRING
 
 FREEPOOL(rsp_pool, rspq, response);
-static struct rsp_pool rspp;
-static bool rspp_init = false;
+/* pools are not thread-safe, each thread (e.g. worker) gets its own pool,
+ * created upon first use with its share of the size given at setup, and
+ * destroyed when the thread exits */
+static __thread struct rsp_pool rspp;
+static __thread bool rspp_init = false;
+static uint32_t rspp_total = RSP_POOLSIZE;
+static uint32_t rspp_max = RSP_POOLSIZE;
+static pthread_key_t rspp_key;
+static bool rspp_key_init = false;
 
 void
 response_reset(struct response *rsp)
@@ -110,11 +119,31 @@ response_pool_create(uint32_t max)
     }
 }
 
+/* called by pthread when a thread that has created its pool exits */
+static void
+_response_pool_exit(void *arg)
+{
+    if (rspp.nused > 0) {
+        log_warn("thread exits with %"PRIu32" rsps borrowed, response pool is "
+                "not destroyed", rspp.nused);
+        return;
+    }
+
+    response_pool_destroy();
+}
+
 struct response *
 response_borrow(void)
 {
     struct response *rsp;
 
+    if (!rspp_init) {
+        response_pool_create(rspp_max);
+        if (rspp_key_init) {
+            pthread_setspecific(rspp_key, &rspp);
+        }
+    }
+
     FREEPOOL_BORROW(rsp, &rspp, next, response_create);
     if (rsp == NULL) {
         log_debug("borrow rsp failed: OOM %d");
@@ -190,11 +219,43 @@ response_setup(response_options_st *options, response_metrics_st *metrics)
         max = option_uint(&options->response_poolsize);
     }
 
+    rspp_total = max;
+    rspp_max = max;
     response_pool_create(max);
 
+    if (!rspp_key_init) {
+        if (pthread_key_create(&rspp_key, _response_pool_exit) != 0) {
+            log_crit("cannot create thread key for response pool");
+            exit(EXIT_FAILURE);
+        }
+        rspp_key_init = true;
+    }
+    pthread_setspecific(rspp_key, &rspp);
+
     response_init = true;
 }
 
+/* the pool size given at setup is split evenly among nthread threads, each of
+ * which creates its own pool upon first use; the calling thread (e.g. main)
+ * does not serve requests, so its pool is destroyed */
+void
+response_pool_nthread(uint32_t nthread)
+{
+    if (nthread == 0) {
+        nthread = 1;
+    }
+
+    /* a poolsize of 0 means unlimited, which is not split */
+    rspp_max = rspp_total / nthread + (rspp_total % nthread > 0);
+    log_info("response pool split across %"PRIu32" threads: max %"PRIu32
+            " per thread", nthread, rspp_max);
+
+    if (rspp_init) {
+        response_pool_destroy();
+        pthread_setspecific(rspp_key, NULL);
+    }
+}
+
 void
 response_teardown(void)
 {
@@ -204,7 +265,13 @@ response_teardown(void)
         log_warn("%s has never been setup", RESPONSE_MODULE_NAME);
     }
 
-    response_pool_destroy();
+    if (rspp_init) {
+        response_pool_destroy();
+    }
+    if (rspp_key_init) {
+        pthread_key_delete(rspp_key);
+        rspp_key_init = false;
+    }
     response_metrics = NULL;
 
     response_init = false;
@@ -99,6 +99,7 @@ struct response {
 
 void response_setup(response_options_st *options, response_metrics_st *metrics);
 void response_teardown(void);
+void response_pool_nthread(uint32_t nthread);
 
 struct response *response_create(void);
 void response_destroy(struct response **rsp);
@@ -187,10 +187,9 @@ fn gen_core() {
         .whitelist_var("server_init")
         .whitelist_var("worker_init")
         .whitelist_type("admin_options_st")
-        .whitelist_var("pipe_new")
-        .whitelist_var("pipe_term")
-        .whitelist_var("conn_new")
-        .whitelist_var("conn_term")
+        .whitelist_type("worker_pipe")
+        .whitelist_var("worker_pipes")
+        .whitelist_var("nworker")
         .whitelist_var("SERVER_.*")
         .whitelist_type("server_options_st")
         .whitelist_type("server_metrics_st")
@@ -158,6 +158,10 @@ pub unsafe fn core_run<DP: DataProcessor>(mut dp: DP) {
         read: Some(read_wrapper::<DP>),
         write: Some(write_wrapper::<DP>),
         error: Some(error_wrapper::<DP>),
+        online: None,
+        offline: None,
+        send: None,
+        recv: None,
     };
 
     assert!(DATA_PTR.is_null());
@@ -118,7 +118,7 @@ setup(void)
     admin_process_setup();
     core_admin_setup(&setting.admin);
     core_server_setup(&setting.server, &stats.server);
-    core_worker_setup(&setting.worker, &stats.worker);
+    core_worker_setup(&setting.worker, &stats.worker, false);
 
     /* adding recurring events to maintenance/admin thread */
     intvl = option_uint(&setting.pingserver.dlog_intvl);
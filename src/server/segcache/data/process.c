@@ -7,8 +7,11 @@
 #include <cc_array.h>
 #include <cc_debug.h>
 #include <cc_print.h>
+#include <channel/cc_tcp.h>
 #include <time/cc_timer.h>
 
+#include <sys/uio.h>
+
 #define SEGCACHE_PROCESS_MODULE_NAME "segcache::process"
 
 #define OVERSIZE_ERR_MSG "oversized value, cannot be stored"
@@ -21,6 +24,7 @@ typedef enum put_rstatus {
     PUT_OK,
     PUT_PARTIAL,
     PUT_ERROR,
+    PUT_REJECT, /* not admitted, taken as stored and evicted right away */
 } put_rstatus_e;
 
 static bool                 process_init = false;
@@ -32,6 +36,43 @@ static char                 prefill_kbuf[UINT8_MAX];
 static uint32_t             prefill_vsize;
 static char                 prefill_vbuf[ITEM_SIZE_MAX];
 static uint64_t             prefill_nkey;
+static uint32_t             zcopy_vlen = ZCOPY_VLEN;
+
+/*
+ * Values of at least zcopy_vlen bytes are not copied into wbuf by get/gets,
+ * a ref to the value is kept instead, and the send after processing writes
+ * wbuf and the values in one writev, with the values taken from the segs.
+ * The items returned by item_get are valid until the worker goes offline,
+ * which happens after the send, so the values that cannot be sent right away
+ * (the socket is full) are copied into wbuf then, before the refs expire.
+ * They are also copied before anything that may take the worker offline
+ * while allocating a seg: a request run on its own, or promoting the flash
+ * items of the keys of a pipeline.
+ */
+#define ZCOPY_NREF 256
+#define ZCOPY_NIOV (2 * ZCOPY_NREF + 1) /* must not exceed IOV_MAX */
+
+struct zcopy_ref {
+    uint32_t                off;    /* position in wbuf, from begin */
+    uint32_t                len;
+    char                    *data;
+};
+
+/* each worker composes and sends for one connection at a time */
+static __thread struct buf          **zcopy_wbuf;
+static __thread struct zcopy_ref    zcopy_ref[ZCOPY_NREF];
+static __thread uint32_t            zcopy_head; /* refs before it are sent */
+static __thread uint32_t            zcopy_nref;
+static __thread struct iovec        zcopy_iov[ZCOPY_NIOV];
+static __thread struct array        zcopy_iov_arr;
+
+static inline void
+_zcopy_reset(void)
+{
+    zcopy_wbuf = NULL;
+    zcopy_head = 0;
+    zcopy_nref = 0;
+}
 
 static void
 _prefill_seg(void)
@@ -83,8 +124,11 @@ process_setup(process_options_st *options, process_metrics_st *metrics)
         prefill_ksize = (uint32_t)option_uint(&options->prefill_ksize);
         prefill_vsize = (uint32_t)option_uint(&options->prefill_vsize);
         prefill_nkey = (uint64_t)option_uint(&options->prefill_nkey);
+        zcopy_vlen = (uint32_t)option_uint(&options->zcopy_vlen);
     }
 
+    _zcopy_reset();
+
     if (prefill) {
         _prefill_seg();
     }
@@ -101,6 +145,7 @@ process_teardown(void)
     }
 
     allow_flush = false;
+    _zcopy_reset();
     process_metrics = NULL;
     process_init = false;
 }
@@ -124,58 +169,77 @@ _set_dataflag(struct item *it, uint32_t flag)
     *p = flag;
 }
 
-static bool
-_get_key(struct response *rsp, struct bstring *key, bool cas)
+/* the number of keys of a multi-get looked up together */
+#define GET_BATCH 16
+
+static void
+_get_rsp(struct response *rsp, struct bstring *key, struct item *it,
+        uint64_t cas_v)
 {
-    struct item *it;
-    uint64_t cas_v;
+    rsp->type = RSP_VALUE;
+    rsp->key = *key;
+    rsp->flag = _get_dataflag(it);
+    rsp->vstr.len = it->vlen; /* do not use item_nval here */
+    rsp->vstr.data = item_val(it);
+    rsp->vcas = cas_v;
+    rsp->item = (void *) it;
+
+    if (hotkey_enabled && hotkey_sample(key)) {
+        log_debug("hotkey detected: %.*s", key->len, key->data);
+    }
 
-    it = item_get(key, &cas_v);
-    if (it != NULL) {
-        rsp->type = RSP_VALUE;
-        rsp->key = *key;
-        rsp->flag = _get_dataflag(it);
-        rsp->vstr.len = it->vlen; /* do not use item_nval here */
-        rsp->vstr.data = item_val(it);
-        rsp->vcas = cas ? cas_v : 0;
-        rsp->item = (void *) it;
+    log_verb("found key at %p, location %p", key, it);
+}
 
-        if (hotkey_enabled && hotkey_sample(key)) {
-            log_debug("hotkey detected: %.*s", key->len, key->data);
+/* release the items that cannot be returned for lack of rsp objects */
+static void
+_get_release(struct item **its, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        if (its[i] != NULL) {
+            item_release(its[i]);
         }
-
-        log_verb("found key at %p, location %p", key, it);
-        return true;
-    } else {
-        log_verb("key at %p not found", key);
-        return false;
     }
 }
 
 static void
 _process_get(struct response *rsp, struct request *req)
 {
-    struct bstring *key;
+    struct bstring *keys;
+    struct item *its[GET_BATCH];
     struct response *r = rsp;
-    uint32_t i;
+    uint32_t i, j, n, nkey = array_nelem(req->keys);
 
     INCR(process_metrics, get);
-    /* use chained responses, move to the next response if key is found. */
-    for (i = 0; i < array_nelem(req->keys); ++i) {
-        INCR(process_metrics, get_key);
-        key = array_get(req->keys, i);
-        if (_get_key(r, key, false)) {
+    /* items found in earlier batches are held by rsp until composed, so the
+     * flash items are promoted before any key is looked up */
+    item_promote_multi(array_first(req->keys), nkey);
+    /* look up keys in batches so that their cache misses overlap, and use
+     * chained responses, move to the next response if key is found. */
+    for (i = 0; i < nkey; i += n) {
+        n = nkey - i < GET_BATCH ? nkey - i : GET_BATCH;
+        keys = array_get(req->keys, i);
+        item_get_multi(keys, n, its, NULL);
+
+        for (j = 0; j < n; ++j) {
+            INCR(process_metrics, get_key);
+            if (its[j] == NULL) {
+                log_verb("key at %p not found", &keys[j]);
+                INCR(process_metrics, get_key_miss);
+                continue;
+            }
+
+            _get_rsp(r, &keys[j], its[j], 0);
             req->nfound++;
             r->cas = false;
             r = STAILQ_NEXT(r, next);
             if (r == NULL) {
+                _get_release(&its[j + 1], n - j - 1);
                 INCR(process_metrics, get_ex);
                 log_warn("get response incomplete due to lack of rsp objects");
                 return;
             }
             INCR(process_metrics, get_key_hit);
-        } else {
-            INCR(process_metrics, get_key_miss);
         }
     }
     r->type = RSP_END;
@@ -187,26 +251,40 @@ _process_get(struct response *rsp, struct request *req)
 static void
 _process_gets(struct response *rsp, struct request *req)
 {
-    struct bstring *key;
+    struct bstring *keys;
+    struct item *its[GET_BATCH];
+    uint64_t cas[GET_BATCH];
     struct response *r = rsp;
-    uint32_t i;
+    uint32_t i, j, n, nkey = array_nelem(req->keys);
 
     INCR(process_metrics, gets);
-    /* use chained responses, move to the next response if key is found. */
-    for (i = 0; i < array_nelem(req->keys); ++i) {
-        INCR(process_metrics, gets_key);
-        key = array_get(req->keys, i);
-        if (_get_key(r, key, true)) {
+    item_promote_multi(array_first(req->keys), nkey);
+    /* look up keys in batches so that their cache misses overlap, and use
+     * chained responses, move to the next response if key is found. */
+    for (i = 0; i < nkey; i += n) {
+        n = nkey - i < GET_BATCH ? nkey - i : GET_BATCH;
+        keys = array_get(req->keys, i);
+        item_get_multi(keys, n, its, cas);
+
+        for (j = 0; j < n; ++j) {
+            INCR(process_metrics, gets_key);
+            if (its[j] == NULL) {
+                log_verb("key at %p not found", &keys[j]);
+                INCR(process_metrics, gets_key_miss);
+                continue;
+            }
+
+            _get_rsp(r, &keys[j], its[j], cas[j]);
+            req->nfound++;
             r->cas = true;
             r = STAILQ_NEXT(r, next);
             if (r == NULL) {
+                _get_release(&its[j + 1], n - j - 1);
                 INCR(process_metrics, gets_ex);
                 log_warn("gets response incomplete due to lack of rsp objects");
+                return;
             }
-            req->nfound++;
             INCR(process_metrics, gets_key_hit);
-        } else {
-            INCR(process_metrics, gets_key_miss);
         }
     }
     r->type = RSP_END;
@@ -255,14 +333,16 @@ _error_rsp(struct response *rsp, item_rstatus_e status)
 }
 
 /*
- * for the first segment three return values are possible:
+ * for the first segment four return values are possible:
  *   - PUT_OK
  *   - PUT_PARTIAL
  *   - PUT_ERROR (error code given in *istatus)
+ *   - PUT_REJECT (the write is not admitted)
  *
- * for the following segment(s) two return values are possible:
+ * for the following segment(s) three return values are possible:
  *   - PUT_OK
  *   - PUT_PARTIAL
+ *   - PUT_REJECT (the rest of a value not admitted is dropped)
  */
 static put_rstatus_e
 _put(item_rstatus_e *istatus, struct request *req)
@@ -274,15 +354,23 @@ _put(item_rstatus_e *istatus, struct request *req)
     if (req->first) { /* self-contained req */
         struct bstring *key = array_first(req->keys);
         /* TODO(jason): might worthwhile add a new function for cal TTL */
-        *istatus = item_reserve(&it, key, &req->vstr, req->vlen, DATAFLAG_SIZE,
-                time_convert_proc_sec((time_i)req->expiry));
+        proc_time_i expire_at = time_convert_proc_sec((time_i)req->expiry);
+
         req->first = false;
+        if (item_admit(key, expire_at)) {
+            *istatus = item_reserve(&it, key, &req->vstr, req->vlen,
+                    DATAFLAG_SIZE, expire_at);
+        }
         req->reserved = it;
-    } else { /* backfill reserved item */
+    } else if (req->reserved != NULL) { /* backfill reserved item */
         it = req->reserved;
         item_backfill(it, &req->vstr);
     }
 
+    if (*istatus == ITEM_OK && it == NULL) { /* not admitted */
+        return req->partial ? PUT_PARTIAL : PUT_REJECT;
+    }
+
     if (!req->partial) {
         status = (*istatus == ITEM_OK) ? PUT_OK : PUT_ERROR;
     } else { /* should not update hash */
@@ -317,6 +405,11 @@ _process_set(struct response *rsp, struct request *req)
     if (status == PUT_PARTIAL) {
         return;
     }
+    if (status == PUT_REJECT) {
+        rsp->type = RSP_STORED;
+        INCR(process_metrics, set_stored);
+        return;
+    }
     if (status == PUT_ERROR) {
         _error_rsp(rsp, istatus);
         INCR(process_metrics, set_ex);
@@ -369,6 +462,11 @@ _process_add(struct response *rsp, struct request *req)
     if (status == PUT_PARTIAL) {
         return;
     }
+    if (status == PUT_REJECT) {
+        rsp->type = RSP_STORED;
+        INCR(process_metrics, add_stored);
+        return;
+    }
     if (status == PUT_ERROR) {
         req->swallow = 1;
         _error_rsp(rsp, istatus);
@@ -414,6 +512,11 @@ _process_replace(struct response *rsp, struct request *req)
     if (status == PUT_PARTIAL) {
         return;
     }
+    if (status == PUT_REJECT) {
+        rsp->type = RSP_STORED;
+        INCR(process_metrics, replace_stored);
+        return;
+    }
     if (status == PUT_ERROR) {
         req->swallow = 1;
         _error_rsp(rsp, istatus);
@@ -468,6 +571,11 @@ _process_cas(struct response *rsp, struct request *req)
     if (status == PUT_PARTIAL) {
         return;
     }
+    if (status == PUT_REJECT) {
+        rsp->type = RSP_STORED;
+        INCR(process_metrics, cas_stored);
+        return;
+    }
     if (status == PUT_ERROR) {
         req->swallow = 1;
         _error_rsp(rsp, istatus);
@@ -674,6 +782,230 @@ _cleanup(struct request *req, struct response *rsp, int card)
     req->rsp = rsp;
 }
 
+/* compose the response, leaving out a large value to be sent in place */
+static inline int
+_compose(struct buf **wbuf, struct response *rsp)
+{
+    struct zcopy_ref *ref;
+    int n;
+
+    if (zcopy_vlen == 0 || rsp->type != RSP_VALUE || rsp->num ||
+            rsp->vstr.len < zcopy_vlen || zcopy_nref == ZCOPY_NREF) {
+        return compose_rsp(wbuf, rsp);
+    }
+
+    n = compose_rsp_value_hdr(wbuf, rsp);
+    if (n < 0) {
+        return n;
+    }
+
+    ref = &zcopy_ref[zcopy_nref++];
+    ref->off = (uint32_t)((*wbuf)->wpos - (*wbuf)->begin);
+    ref->len = rsp->vstr.len;
+    ref->data = rsp->vstr.data;
+    zcopy_wbuf = wbuf;
+    n += buf_write(*wbuf, CRLF, CRLF_LEN);
+
+    INCR(process_metrics, zcopy_value);
+
+    return n + rsp->vstr.len;
+}
+
+/*
+ * copy the values not sent yet into their places in wbuf, after which wbuf
+ * holds all the data left to send, and no ref into the segs remains
+ */
+static rstatus_i
+_zcopy_settle(struct buf **wbuf)
+{
+    struct buf *buf;
+    struct zcopy_ref *ref;
+    uint32_t i, shift, end, total, len = 0;
+
+    ASSERT(zcopy_wbuf == wbuf);
+
+    for (i = zcopy_head; i < zcopy_nref; ++i) {
+        len += zcopy_ref[i].len;
+    }
+
+    total = len;
+    shift = (uint32_t)((*wbuf)->rpos - (*wbuf)->begin);
+    buf_lshift(*wbuf);
+    while (buf_wsize(*wbuf) < total) {
+        if (dbuf_double(wbuf) != CC_OK) {
+            log_error("cannot copy %" PRIu32 " bytes of values into wbuf",
+                    total);
+            _zcopy_reset();
+            return CC_ENOMEM;
+        }
+    }
+
+    /* move the data after each value up to make room for it, last first */
+    buf = *wbuf;
+    end = (uint32_t)(buf->wpos - buf->begin);
+    for (i = zcopy_nref; i > zcopy_head; --i) {
+        ref = &zcopy_ref[i - 1];
+        ref->off -= shift;
+        cc_memmove(buf->begin + ref->off + len, buf->begin + ref->off,
+                end - ref->off);
+        len -= ref->len;
+        cc_memcpy(buf->begin + ref->off + len, ref->data, ref->len);
+        end = ref->off;
+        INCR(process_metrics, zcopy_copy);
+    }
+    buf->wpos += total;
+
+    _zcopy_reset();
+
+    return CC_OK;
+}
+
+/*
+ * consecutive get/gets requests in rbuf are run together: the keys of all
+ * of them are looked up in batches, so that the cache misses of different
+ * requests overlap, and the responses are composed in order without
+ * borrowing response objects. Gets do not change the cache, so running them
+ * together does not change what any request sees, a request of another
+ * type ends the pipeline and is run on its own.
+ */
+#define PIPELINE_NREQ 16
+#define PIPELINE_NKEY 64
+
+static inline bool
+_pipeline_next(struct buf *rbuf)
+{
+    uint32_t rsize = buf_rsize(rbuf);
+
+    return (rsize > 4 && cc_memcmp(rbuf->rpos, "get ", 4) == 0) ||
+        (rsize > 5 && cc_memcmp(rbuf->rpos, "gets ", 5) == 0);
+}
+
+/* parse the gets after reqs[0], any other request is left in rbuf */
+static uint32_t
+_pipeline_parse(struct request **reqs, struct buf *rbuf)
+{
+    parse_rstatus_e status;
+    char *rpos;
+    uint32_t n = 1;
+
+    while (n < PIPELINE_NREQ && _pipeline_next(rbuf)) {
+        reqs[n] = request_borrow();
+        if (reqs[n] == NULL) {
+            break;
+        }
+
+        rpos = rbuf->rpos;
+        status = parse_req(reqs[n], rbuf);
+        if (status != PARSE_OK || reqs[n]->swallow ||
+                (reqs[n]->type != REQ_GET && reqs[n]->type != REQ_GETS)) {
+            /* incomplete or invalid, left to be parsed again on its own */
+            rbuf->rpos = rpos;
+            request_return(&reqs[n]);
+            break;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+static int
+_process_pipeline(struct request *req, struct buf *rbuf, struct buf **wbuf)
+{
+    struct request *reqs[PIPELINE_NREQ];
+    struct bstring keys[PIPELINE_NKEY];
+    struct item *its[PIPELINE_NKEY];
+    uint64_t cas[PIPELINE_NKEY];
+    struct response rsp;
+    struct request *r;
+    uint32_t i, n, m, nreq, nkey;
+    uint32_t lr = 0, lk = 0; /* the next key to look up, key lk of reqs[lr] */
+    uint32_t cr = 0, ck = 0; /* the next key to compose */
+    int status = 0;
+
+    reqs[0] = req;
+    nreq = _pipeline_parse(reqs, rbuf);
+    INCR(process_metrics, pipeline);
+    INCR_N(process_metrics, pipeline_req, nreq);
+
+    while (lr < nreq && status >= 0) {
+        for (n = 0; lr < nreq && n < PIPELINE_NKEY; n += m) {
+            nkey = array_nelem(reqs[lr]->keys);
+            m = nkey - lk < PIPELINE_NKEY - n ? nkey - lk : PIPELINE_NKEY - n;
+            cc_memcpy(&keys[n], array_get(reqs[lr]->keys, lk),
+                    m * sizeof(*keys));
+            lk += m;
+            if (lk == nkey) {
+                lr++;
+                lk = 0;
+            }
+        }
+
+        /* promoting may take the worker offline, after the values composed
+         * so far are copied, the keys are looked up again once promoted */
+        if (item_get_multi(keys, n, its, cas) > 0) {
+            if (zcopy_nref > 0 && _zcopy_settle(wbuf) != CC_OK) {
+                status = -1;
+                break;
+            }
+            item_promote_multi(keys, n);
+            item_get_multi(keys, n, its, cas);
+        }
+
+        for (i = 0; i < n && status >= 0; ++i) {
+            r = reqs[cr];
+            if (ck == 0) {
+                INCR(process_metrics, process_req);
+                if (r->type == REQ_GETS) {
+                    INCR(process_metrics, gets);
+                } else {
+                    INCR(process_metrics, get);
+                }
+            }
+
+            response_reset(&rsp);
+            if (r->type == REQ_GETS) {
+                INCR(process_metrics, gets_key);
+            } else {
+                INCR(process_metrics, get_key);
+            }
+            if (its[i] == NULL) {
+                log_verb("key at %p not found", &keys[i]);
+                if (r->type == REQ_GETS) {
+                    INCR(process_metrics, gets_key_miss);
+                } else {
+                    INCR(process_metrics, get_key_miss);
+                }
+            } else {
+                _get_rsp(&rsp, &keys[i], its[i], cas[i]);
+                rsp.cas = (r->type == REQ_GETS);
+                status = _compose(wbuf, &rsp);
+                if (r->type == REQ_GETS) {
+                    INCR(process_metrics, gets_key_hit);
+                } else {
+                    INCR(process_metrics, get_key_hit);
+                }
+            }
+
+            if (++ck == array_nelem(r->keys) && status >= 0) {
+                response_reset(&rsp);
+                rsp.type = RSP_END;
+                status = _compose(wbuf, &rsp);
+                log_verb("req %p processed in a pipeline of %" PRIu32, r,
+                        nreq);
+                cr++;
+                ck = 0;
+            }
+        }
+    }
+
+    for (i = 1; i < nreq; ++i) {
+        request_return(&reqs[i]);
+    }
+
+    return status;
+}
+
 int
 segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data)
 {
@@ -705,6 +1037,9 @@ segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data)
         return -1;
     }
 
+    /* the values of the previous read have been sent or copied by now */
+    _zcopy_reset();
+
     /* keep parse-process-compose until running out of data in rbuf */
     while (buf_rsize(*rbuf) > 0) {
         struct response *nr;
@@ -715,6 +1050,7 @@ segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data)
 
         status = parse_req(req, *rbuf);
         if (status == PARSE_EUNFIN) {
+            req->rsp = rsp; /* kept with req until the rest arrives */
             buf_lshift(*rbuf);
             return 0;
         }
@@ -740,6 +1076,19 @@ segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data)
             return -1;
         }
 
+        /* gets are run in a pipeline, unless each needs to be logged */
+        if (!klog_enabled &&
+                (req->type == REQ_GET || req->type == REQ_GETS)) {
+            if (_process_pipeline(req, *rbuf, wbuf) < 0) {
+                log_error("composing rsp erred");
+                INCR(process_metrics, process_ex);
+                _cleanup(req, rsp, 0);
+                return -1;
+            }
+            _cleanup(req, rsp, 0);
+            continue;
+        }
+
         /* find cardinality of the request and get enough response objects */
         card = array_nelem(req->keys) - 1; /* we already have one in rsp */
         if (req->type == REQ_GET || req->type == REQ_GETS) {
@@ -757,10 +1106,21 @@ segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data)
             }
         }
 
+        /* a request may change the segs referenced: incr/decr convert
+         * values in place, and allocating a seg for a write or a flash
+         * promotion may wait for a grace period offline, after which segs
+         * can be reused, so the values not sent yet are copied out first */
+        if (zcopy_nref > 0 && _zcopy_settle(wbuf) != CC_OK) {
+            INCR(process_metrics, process_ex);
+            _cleanup(req, rsp, card);
+            return -1;
+        }
+
         /* actual processing */
         process_request(rsp, req);
         if (req->partial) { /* implies end of rbuf w/o complete processing */
             /* in this case, do not attempt to log or write response */
+            req->rsp = rsp;
             buf_lshift(*rbuf);
             return 0;
         }
@@ -776,7 +1136,7 @@ segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data)
                 card = req->nfound + 1;
             }
             for (i = 0; i < card; nr = STAILQ_NEXT(nr, next), ++i) {
-                if (compose_rsp(wbuf, nr) < 0) {
+                if (_compose(wbuf, nr) < 0) {
                     log_error("composing rsp erred");
                     INCR(process_metrics, process_ex);
                     _cleanup(req, rsp, card);
@@ -813,6 +1173,8 @@ segcache_process_error(struct buf **rbuf, struct buf **wbuf, void **data)
 
     log_verb("post-error processing");
 
+    _zcopy_reset();
+
     /* normalize buffer size */
     buf_reset(*rbuf);
     dbuf_shrink(rbuf);
@@ -845,3 +1207,152 @@ segcache_process_error(struct buf **rbuf, struct buf **wbuf, void **data)
     return 0;
 }
 
+
+rstatus_i
+segcache_process_send(struct buf_sock *s)
+{
+    struct tcp_conn *c = s->ch;
+    struct buf *buf = s->wbuf;
+    struct zcopy_ref *ref;
+    struct iovec *iov;
+    char *pos;
+    size_t nbyte = 0;
+    ssize_t n;
+    uint32_t i;
+    rstatus_i status;
+
+    if (zcopy_nref == 0) {
+        return buf_tcp_write(s);
+    }
+
+    ASSERT(zcopy_wbuf == &s->wbuf);
+
+    /* wbuf up to each value, the value, ..., and wbuf after the last value */
+    array_data_assign(&zcopy_iov_arr, ZCOPY_NIOV,
+            sizeof(struct iovec), zcopy_iov);
+    pos = buf->rpos;
+    for (i = zcopy_head; i < zcopy_nref; ++i) {
+        ref = &zcopy_ref[i];
+        if (buf->begin + ref->off > pos) {
+            iov = array_push(&zcopy_iov_arr);
+            iov->iov_base = pos;
+            iov->iov_len = buf->begin + ref->off - pos;
+            nbyte += iov->iov_len;
+            pos = buf->begin + ref->off;
+        }
+        iov = array_push(&zcopy_iov_arr);
+        iov->iov_base = ref->data;
+        iov->iov_len = ref->len;
+        nbyte += ref->len;
+    }
+    if (buf->wpos > pos) {
+        iov = array_push(&zcopy_iov_arr);
+        iov->iov_base = pos;
+        iov->iov_len = buf->wpos - pos;
+        nbyte += iov->iov_len;
+    }
+
+    n = tcp_sendv(c, &zcopy_iov_arr, nbyte);
+    if (n < 0) {
+        if (n == CC_EAGAIN) {
+            log_verb("sendv on conn %p returns rescuable error: EAGAIN", c);
+            status = CC_EAGAIN;
+        } else {
+            log_info("sendv on conn %p returns other error: %d", c, n);
+            status = CC_ERROR;
+            c->state = CHANNEL_ERROR;
+            _zcopy_reset();
+
+            return status;
+        }
+        n = 0;
+    } else if ((size_t)n < nbyte) {
+        log_debug("unwritten data remain on conn %p, should retry", c);
+        status = CC_ERETRY;
+    } else {
+        buf->rpos = buf->wpos;
+        _zcopy_reset();
+
+        return CC_OK;
+    }
+
+    /* skip what has been sent, in the order of the iovecs */
+    for (; zcopy_head < zcopy_nref; ++zcopy_head) {
+        ref = &zcopy_ref[zcopy_head];
+        if ((size_t)n < (size_t)(buf->begin + ref->off - buf->rpos)) {
+            break;
+        }
+        n -= buf->begin + ref->off - buf->rpos;
+        buf->rpos = buf->begin + ref->off;
+        if ((size_t)n < ref->len) {
+            ref->data += n;
+            ref->len -= n;
+            n = 0;
+            break;
+        }
+        n -= ref->len;
+    }
+    buf->rpos += n;
+
+    if (_zcopy_settle(&s->wbuf) != CC_OK) {
+        status = CC_ERROR;
+        c->state = CHANNEL_ERROR;
+    }
+
+    return status;
+}
+
+/*
+ * once the item of a large value has been reserved (with the part of the
+ * value in rbuf), the rest of the value is received into the item, instead
+ * of into rbuf and then copied into the item by item_backfill. Only when the
+ * rest does not fit in rbuf anyway, because it takes one more recv for the
+ * CRLF and the requests after the value.
+ */
+rstatus_i
+segcache_process_recv(struct buf_sock *s)
+{
+    struct request *req = s->data;
+    struct tcp_conn *c = s->ch;
+    struct item *it;
+    struct bstring val;
+    ssize_t n;
+
+    if (req == NULL || req->rstate != REQ_PARTIAL || req->reserved == NULL ||
+            buf_rsize(s->rbuf) > 0 || req->nremain < buf_wsize(s->rbuf)) {
+        return buf_tcp_read(s);
+    }
+
+    it = req->reserved;
+    val.data = item_val(it) + it->vlen;
+    n = s->hdl->recv(c, val.data, req->nremain);
+    if (n < 0) {
+        if (n == CC_EAGAIN) {
+            return CC_OK;
+        }
+        log_info("recv on conn %p returns other error: %d", c, n);
+        c->state = CHANNEL_ERROR;
+
+        return CC_ERROR;
+    }
+    if (n == 0) {
+        c->state = CHANNEL_TERM;
+
+        return CC_ERDHUP;
+    }
+
+    log_verb("recv %zd bytes on conn %p into item %p", n, c, it);
+    INCR(process_metrics, direct_recv);
+    INCR_N(process_metrics, direct_recv_byte, n);
+
+    /* val is where item_backfill would copy it to, so there is no copy */
+    val.len = (uint32_t)n;
+    item_backfill(it, &val);
+    req->nremain -= val.len;
+    if (req->nremain > 0) {
+        return CC_OK;
+    }
+
+    /* the CRLF and whatever follows */
+    return buf_tcp_read(s);
+}
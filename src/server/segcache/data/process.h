@@ -10,14 +10,16 @@
 #define PREFILL_KSIZE 32
 #define PREFILL_VSIZE 32
 #define PREFILL_NKEY 400000000 /* 40M keys roughly fills up a 4GB heap with default seg & data sizes */
+#define ZCOPY_VLEN (4 * KiB)
 
 /*          name           type              default        description */
-#define PROCESS_OPTION(ACTION)                                                         \
-    ACTION( allow_flush,   OPTION_TYPE_BOOL, ALLOW_FLUSH,   "allow flush_all"         )\
-    ACTION( prefill,       OPTION_TYPE_BOOL, PREFILL,       "prefill slabs with data" )\
-    ACTION( prefill_ksize, OPTION_TYPE_UINT, PREFILL_KSIZE, "prefill key size"        )\
-    ACTION( prefill_vsize, OPTION_TYPE_UINT, PREFILL_VSIZE, "prefill val size"        )\
-    ACTION( prefill_nkey,  OPTION_TYPE_UINT, PREFILL_NKEY,  "prefill keys inserted"   )
+#define PROCESS_OPTION(ACTION)                                                                \
+    ACTION( allow_flush,   OPTION_TYPE_BOOL, ALLOW_FLUSH,   "allow flush_all"                )\
+    ACTION( prefill,       OPTION_TYPE_BOOL, PREFILL,       "prefill slabs with data"        )\
+    ACTION( prefill_ksize, OPTION_TYPE_UINT, PREFILL_KSIZE, "prefill key size"               )\
+    ACTION( prefill_vsize, OPTION_TYPE_UINT, PREFILL_VSIZE, "prefill val size"               )\
+    ACTION( prefill_nkey,  OPTION_TYPE_UINT, PREFILL_NKEY,  "prefill keys inserted"          )\
+    ACTION( zcopy_vlen,    OPTION_TYPE_UINT, ZCOPY_VLEN,    "min value len to send w/o copy" )
 /* prefilling can potentially follow a fairly complex config wrt key/value size
  * distribution and schema. However, basic performance testing around IO and
  * heap size can be greatly sped up without lengthy client-drive warm-up if we
@@ -85,7 +87,13 @@ typedef struct {
     ACTION( prepend_stored,    METRIC_COUNTER, "# prepend successes"   )\
     ACTION( prepend_notstored, METRIC_COUNTER, "# prepend not_founds"  )\
     ACTION( prepend_ex,        METRIC_COUNTER, "# prepend errors"      )\
-    ACTION( flush,             METRIC_COUNTER, "# flush_all requests"  )
+    ACTION( flush,             METRIC_COUNTER, "# flush_all requests"  )\
+    ACTION( zcopy_value,       METRIC_COUNTER, "# values sent in place")\
+    ACTION( zcopy_copy,        METRIC_COUNTER, "# values copied later" )\
+    ACTION( direct_recv,       METRIC_COUNTER, "# recv into items"     )\
+    ACTION( direct_recv_byte,  METRIC_COUNTER, "# value bytes in place")\
+    ACTION( pipeline,          METRIC_COUNTER, "# get pipelines run"   )\
+    ACTION( pipeline_req,      METRIC_COUNTER, "# gets in pipelines"   )
 
 typedef struct {
     PROCESS_METRIC(METRIC_DECLARE)
@@ -97,3 +105,5 @@ void process_teardown(void);
 int segcache_process_read(struct buf **rbuf, struct buf **wbuf, void **data);
 int segcache_process_write(struct buf **rbuf, struct buf **wbuf, void **data);
 int segcache_process_error(struct buf **rbuf, struct buf **wbuf, void **data);
+rstatus_i segcache_process_send(struct buf_sock *s);
+rstatus_i segcache_process_recv(struct buf_sock *s);
@@ -17,6 +17,10 @@ struct data_processor worker_processor = {
     segcache_process_read,
     segcache_process_write,
     segcache_process_error,
+    seg_thread_online,
+    seg_thread_offline,
+    segcache_process_send,
+    segcache_process_recv,
 };
 
 static void
@@ -123,12 +127,29 @@ setup(void)
     compose_setup(NULL, &stats.compose_rsp);
     klog_setup(&setting.klog, &stats.klog);
     hotkey_setup(&setting.hotkey);
+    nworker = option_uint(&setting.worker.worker_nthread);
+    if (nworker > 1) {
+        /* command logger and hotkey detection assume a single writer */
+        if (klog_enabled || hotkey_enabled) {
+            log_warn("klog and hotkey are disabled with %"PRIu32" worker "
+                    "threads", nworker);
+        }
+        klog_enabled = false;
+        hotkey_enabled = false;
+    }
+    /* each worker borrows from its own share of the request/response pools */
+    request_pool_nthread(nworker);
+    response_pool_nthread(nworker);
+    /* each worker may hold references to segments & reserve segs for merge */
+    if (option_uint(&setting.seg.seg_n_thread) < nworker) {
+        setting.seg.seg_n_thread.val.vuint = nworker;
+    }
     seg_setup(&setting.seg, &stats.seg);
     process_setup(&setting.process, &stats.process);
     admin_process_setup();
     core_admin_setup(&setting.admin);
     core_server_setup(&setting.server, &stats.server);
-    core_worker_setup(&setting.worker, &stats.worker);
+    core_worker_setup(&setting.worker, &stats.worker, true);
 
     /* adding recurring events to maintenance/admin thread */
     intvl = option_uint(&setting.segcache.dlog_intvl);
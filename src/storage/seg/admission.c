@@ -0,0 +1,203 @@
+#include "admission.h"
+#include "seg.h"
+
+#include <cc_debug.h>
+#include <cc_mm.h>
+
+#define XXH_INLINE_ALL
+#include <hash/xxhash.h>
+
+#include <pthread.h>
+
+extern seg_metrics_st *seg_metrics;
+
+/* the min number of counters per row, so a row is a whole number of words */
+#define ADMIT_MIN_WIDTH     64
+/* the number of increments a thread counts before adding them up */
+#define ADMIT_LOCAL_BATCH   64
+
+static uint8_t          *sketch      = NULL;   /* ADMIT_NROW rows */
+static uint32_t         sketch_width = 0;
+static uint32_t         admit_thresh = 0;
+
+static uint64_t         n_incr       = 0;      /* since the last aging */
+static uint64_t         age_intvl;
+static pthread_mutex_t  age_mtx      = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread uint32_t local_n_incr = 0;
+
+bool
+admit_setup(uint32_t width, uint32_t threshold)
+{
+    uint32_t w = ADMIT_MIN_WIDTH;
+
+    if (sketch != NULL) {
+        log_warn("admission filter has been set up");
+        admit_teardown();
+    }
+
+    if (threshold > UINT8_MAX) {
+        log_warn("admission threshold %" PRIu32 " is larger than the max "
+                 "count, use %d", threshold, UINT8_MAX);
+        threshold = UINT8_MAX;
+    }
+
+    while (w < width && w < (1u << 31)) {
+        w <<= 1;
+    }
+
+    sketch = cc_zalloc((size_t) w * ADMIT_NROW);
+    if (sketch == NULL) {
+        log_error("cannot allocate admission sketch of %zu bytes",
+            (size_t) w * ADMIT_NROW);
+        return false;
+    }
+
+    sketch_width = w;
+    admit_thresh = threshold;
+    age_intvl    = (uint64_t) w * ADMIT_AGE_FACTOR;
+    __atomic_store_n(&n_incr, 0, __ATOMIC_RELAXED);
+
+    log_info("admission sketch has %d rows of %" PRIu32 " counters, "
+             "threshold %" PRIu32, ADMIT_NROW, w, threshold);
+
+    return true;
+}
+
+void
+admit_teardown(void)
+{
+    cc_free(sketch);
+    sketch       = NULL;
+    sketch_width = 0;
+    admit_thresh = 0;
+}
+
+uint32_t
+admit_threshold(void)
+{
+    return admit_thresh;
+}
+
+/* the counters of a key, one per row, by double hashing */
+static inline void
+_counters(const char *key, uint32_t klen, uint8_t *c[ADMIT_NROW])
+{
+    uint64_t hv   = XXH3_64bits(key, klen);
+    uint32_t h1   = (uint32_t) hv;
+    uint32_t h2   = (uint32_t) (hv >> 32u) | 1u;
+    uint32_t mask = sketch_width - 1;
+
+    for (uint32_t i = 0; i < ADMIT_NROW; i++) {
+        c[i] = &sketch[(size_t) i * sketch_width + ((h1 + i * h2) & mask)];
+    }
+}
+
+static inline uint8_t
+_min_count(uint8_t *c[ADMIT_NROW], uint8_t *count)
+{
+    uint8_t min = UINT8_MAX;
+
+    for (uint32_t i = 0; i < ADMIT_NROW; i++) {
+        count[i] = __atomic_load_n(c[i], __ATOMIC_RELAXED);
+        if (count[i] < min) {
+            min = count[i];
+        }
+    }
+
+    return min;
+}
+
+/* halve all counters, 8 at a time */
+static void
+_age(void)
+{
+    uint64_t *w = (uint64_t *) sketch;
+    size_t   n  = (size_t) sketch_width * ADMIT_NROW / sizeof(uint64_t);
+
+    for (size_t i = 0; i < n; i++) {
+        __atomic_store_n(&w[i],
+            (__atomic_load_n(&w[i], __ATOMIC_RELAXED) >> 1u) &
+                0x7f7f7f7f7f7f7f7fULL, __ATOMIC_RELAXED);
+    }
+
+    INCR(seg_metrics, admit_age);
+    log_verb("admission sketch aged");
+}
+
+static inline void
+_count_incr(void)
+{
+    if (++local_n_incr < ADMIT_LOCAL_BATCH) {
+        return;
+    }
+
+    if (__atomic_add_fetch(&n_incr, local_n_incr, __ATOMIC_RELAXED) >=
+            age_intvl && pthread_mutex_trylock(&age_mtx) == 0) {
+        /* another thread may have aged the sketch since */
+        if (__atomic_load_n(&n_incr, __ATOMIC_RELAXED) >= age_intvl) {
+            _age();
+            __atomic_sub_fetch(&n_incr, age_intvl, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&age_mtx);
+    }
+    local_n_incr = 0;
+}
+
+/*
+ * conservative update: only the counters equal to the estimate are
+ * incremented, which keeps the counters of colliding keys lower, return
+ * the new estimate, accesses of saturated keys still count towards aging
+ */
+static inline uint32_t
+_record(const char *key, uint32_t klen)
+{
+    uint8_t *c[ADMIT_NROW];
+    uint8_t count[ADMIT_NROW];
+    uint8_t min;
+
+    _count_incr();
+
+    _counters(key, klen, c);
+    min = _min_count(c, count);
+    if (min == UINT8_MAX) {
+        return min;
+    }
+
+    for (uint32_t i = 0; i < ADMIT_NROW; i++) {
+        if (count[i] == min) {
+            __atomic_store_n(c[i], min + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return min + 1;
+}
+
+void
+admit_record(const char *key, uint32_t klen)
+{
+    ASSERT(sketch != NULL);
+
+    _record(key, klen);
+}
+
+bool
+admit_key(const char *key, uint32_t klen)
+{
+    ASSERT(sketch != NULL);
+
+    return _record(key, klen) >= admit_thresh;
+}
+
+uint32_t
+admit_estimate(const char *key, uint32_t klen)
+{
+    uint8_t *c[ADMIT_NROW];
+    uint8_t count[ADMIT_NROW];
+
+    ASSERT(sketch != NULL);
+
+    _counters(key, klen, c);
+
+    return _min_count(c, count);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The admission filter keeps the writes of keys seen only once (one-hit
+ * wonders) out of the TTL buckets it is enabled for, so that they do not
+ * fill segs which are only reclaimed by merge, and merge drops the items of
+ * keys that are no longer accessed first.
+ *
+ * It is a TinyLFU style count-min sketch of the recent accesses (writes and
+ * gets) of keys. The sketch has ADMIT_NROW rows of 8-bit saturating
+ * counters, an access of a key increments the smallest of its counters
+ * (one per row), and the estimated count of the key is the smallest of its
+ * counters. A write is admitted when the estimate, including the write,
+ * reaches the threshold. All counters are halved after ADMIT_AGE_FACTOR x
+ * width increments, so that the sketch follows the recent popularity.
+ *
+ * The sketch is shared by all threads and its counters are updated without
+ * locked instructions, concurrent increments of one counter may be lost,
+ * which matters as little as a hash collision. Each thread counts its
+ * increments locally and adds them to the shared count in batches.
+ */
+
+#define ADMIT_NROW          4
+#define ADMIT_AGE_FACTOR    10
+
+/*
+ * set up a sketch of width counters per row (rounded up to a power of 2),
+ * a write is admitted if its key is counted at least threshold times
+ */
+bool
+admit_setup(uint32_t width, uint32_t threshold);
+
+void
+admit_teardown(void);
+
+uint32_t
+admit_threshold(void);
+
+/* count an access of key */
+void
+admit_record(const char *key, uint32_t klen);
+
+/* count a write of key, return true if it is admitted */
+bool
+admit_key(const char *key, uint32_t klen);
+
+/* the estimated count of key */
+uint32_t
+admit_estimate(const char *key, uint32_t klen);
@@ -1,60 +1,204 @@
 
 #include "background.h"
+#include "hashtable.h"
 #include "item.h"
+#include "qsbr.h"
 #include "seg.h"
+#include "segevict.h"
 #include "ttlbucket.h"
 
 #include "cc_debug.h"
 #include "time/cc_wheel.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sysexits.h>
 #include <time.h>
 
 extern volatile bool        stop;
 extern volatile proc_time_i flush_at;
 extern pthread_t            bg_tid;
+extern pthread_t            *merge_tid;
+extern int                  n_merge_thread;
 extern struct ttl_bucket    ttl_buckets[MAX_N_TTL_BUCKET];
+extern bool                 use_thread_local_seg;
+extern struct seg_evict_info evict_info;
+extern seg_metrics_st       *seg_metrics;
 
+#define BG_MIN_WAIT_MS  200
+#define BG_MAX_WAIT_MS  1000
+#define BG_EXPIRE_NSEG  16      /* max # segs expired in one slice */
 
+/* writers wake up the background thread when free segs run low */
+static pthread_mutex_t      bg_mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       bg_cond = PTHREAD_COND_INITIALIZER;
+static bool                 bg_wakeup = false;
+
+/* merge threads wait on the number of free segs instead of a wakeup flag,
+ * since they are woken up together */
+static pthread_cond_t       merge_cond = PTHREAD_COND_INITIALIZER;
+
+
+/* after a flush, expire all segs created before the flush, this walks all
+ * TTL buckets, but flush is rare */
 static void
-check_seg_expire(void)
+flush_segs(void)
 {
     rstatus_i   status;
     struct seg  *seg;
     int32_t     seg_id, next_seg_id;
+
     for (int i = 0; i < MAX_N_TTL_BUCKET; i++) {
         seg_id = ttl_buckets[i].first_seg_id;
-        if (seg_id == -1) {
-            /* no object of this TTL */
-            continue;
-        }
 
-        seg = &heap.segs[seg_id];
-        /* curr_sec - 2 to avoid a slow client is still writing to
-         * the expiring segment  */
-        while (seg->create_at + seg->ttl < time_proc_sec() - 2 ||
-            seg->create_at < flush_at) {
-            log_debug("expire seg %"PRId32 ", create at %"PRId32 ", ttl %"PRId32
-            ", flushed at %"PRId32, seg_id, seg->create_at, seg->ttl, flush_at);
+        while (seg_id != -1) {
+            seg = &heap.segs[seg_id];
+            if (seg->create_at >= flush_at) {
+                break;
+            }
+
+            log_debug("flush seg %"PRId32 ", create at %"PRId32
+                ", flushed at %"PRId32, seg_id, seg->create_at, flush_at);
 
             next_seg_id = seg->next_seg_id;
 
             status = expire_seg(seg_id);
             if (status != CC_OK) {
-                log_error("error removing expired seg %d", seg_id);
-            }
-
-            if (next_seg_id == -1) {
-                break;
+                log_error("error removing flushed seg %d", seg_id);
             }
 
             seg_id = next_seg_id;
-            seg    = &heap.segs[seg_id];
         }
     }
 }
 
+/* expire at most BG_EXPIRE_NSEG segs whose TTL has passed, in the order of
+ * expiration time, so a burst of expiration is spread over several rounds,
+ * return false if there are more expired segs than the slice allows
+ *
+ * next_exp is set to the time the next seg expires, or -1 if there is none */
+static bool
+check_seg_expire(proc_time_i *next_exp)
+{
+    rstatus_i   status;
+    int32_t     bkt_idx, seg_id;
+    proc_time_i exp_at;
+
+    for (int n = 0; n < BG_EXPIRE_NSEG; n++) {
+        pthread_mutex_lock(&heap.mtx);
+        bkt_idx = ttl_bucket_next_to_expire();
+        if (bkt_idx == -1) {
+            pthread_mutex_unlock(&heap.mtx);
+            *next_exp = -1;
+            return true;
+        }
+        seg_id = ttl_buckets[bkt_idx].first_seg_id;
+        exp_at = ttl_buckets[bkt_idx].next_expiration_sec;
+        pthread_mutex_unlock(&heap.mtx);
+
+        *next_exp = exp_at;
+
+        /* curr_sec - 2 to avoid a slow client is still writing to
+         * the expiring segment  */
+        if (exp_at >= time_proc_sec() - 2) {
+            return true;
+        }
+
+        log_debug("expire seg %"PRId32 ", expire at %"PRId32, seg_id, exp_at);
+
+        status = expire_seg(seg_id);
+        if (status != CC_OK) {
+            /* the seg is being evicted, retry in the next round */
+            log_error("error removing expired seg %d", seg_id);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inline int32_t
+n_usable_free_seg(void)
+{
+    return __atomic_load_n(&heap.n_free_seg, __ATOMIC_RELAXED) -
+        heap.n_reserved_seg;
+}
+
+/* evict segs and return them to the free pool until there are
+ * free_high_wat free segs, so that writers rarely need to evict inline */
+static void
+background_evict(void)
+{
+    evict_rstatus_e status;
+    int32_t         seg_id;
+    int32_t         n_evict = 0;
+
+    if (evict_info.free_low_wat == 0 ||
+        n_usable_free_seg() >= evict_info.free_low_wat) {
+        return;
+    }
+
+    /* each eviction frees at least one seg, bound the number of attempts in
+     * case it does not, so that expiration is not delayed */
+    while (!stop && n_usable_free_seg() < evict_info.free_high_wat &&
+        n_evict++ < evict_info.free_high_wat) {
+        if (evict_info.policy == EVICT_MERGE_FIFO) {
+            status = seg_merge_evict(&seg_id);
+        } else {
+            status = seg_evict(&seg_id);
+        }
+
+        if (status != EVICT_OK) {
+            log_debug("background eviction stopped: %d", status);
+            break;
+        }
+
+        seg_add_to_freepool(seg_id, SEG_EVICTION);
+
+        INCR(seg_metrics, seg_evict_bg);
+
+        /* no pointer into segs or the hash table is held between evictions,
+         * do not hold up a grace period for the whole batch */
+        qsbr_quiescent();
+    }
+}
+
+void
+wake_background_thread(void)
+{
+    pthread_mutex_lock(&bg_mtx);
+    bg_wakeup = true;
+    pthread_cond_signal(&bg_cond);
+    if (n_merge_thread > 0) {
+        pthread_cond_broadcast(&merge_cond);
+    }
+    pthread_mutex_unlock(&bg_mtx);
+}
+
+static void
+background_wait(uint32_t wait_ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += wait_ms / 1000;
+    ts.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec  += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&bg_mtx);
+    while (!bg_wakeup && !stop) {
+        if (pthread_cond_timedwait(&bg_cond, &bg_mtx, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bg_wakeup = false;
+    pthread_mutex_unlock(&bg_mtx);
+}
+
 static void *
 background_main(void *data)
 {
@@ -64,15 +208,52 @@ background_main(void *data)
     pthread_setname_np(pthread_self(), "segBg");
 #endif
 
+    proc_time_i last_flush_at = -1;
+    proc_time_i next_exp;
+    uint32_t    wait_ms;
+    bool        done;
+
     log_info("Segcache background thread started");
 
     while (!stop) {
-        check_seg_expire();
+        if (use_thread_local_seg) {
+            ttl_bucket_reclaim_local_segs(LOCAL_SEG_IDLE_SEC);
+        }
 
-        // do we want to enable background eviction?
-        // merge_based_eviction();
+        if (flush_at != last_flush_at) {
+            last_flush_at = flush_at;
+            flush_segs();
+        }
+
+        done = check_seg_expire(&next_exp);
+
+        if (n_merge_thread == 0) {
+            background_evict();
+        }
+
+        /* migrate the hash table slice by slice until the resize is done */
+        while (!stop && hashtable_resize()) {
+            sched_yield();
+        }
+
+        /* drop the hash entries of lazily expired segs */
+        while (!stop && hashtable_sweep(false)) {
+            sched_yield();
+        }
+
+        if (!done) {
+            /* more expired segs, continue with the next slice */
+            continue;
+        }
+
+        /* sleep until the next seg expires, writers and flush wake us up
+         * earlier if needed */
+        wait_ms = BG_MAX_WAIT_MS;
+        if (next_exp != -1 && next_exp + 3 - time_proc_sec() <= 1) {
+            wait_ms = BG_MIN_WAIT_MS;
+        }
 
-        usleep(200000);
+        background_wait(wait_ms);
     }
 
     log_info("seg background thread stopped");
@@ -90,3 +271,55 @@ start_background_thread(void *arg)
     }
 }
 
+static void *
+merge_main(void *data)
+{
+#ifdef __APPLE__
+    pthread_setname_np("segMerge");
+#else
+    pthread_setname_np(pthread_self(), "segMerge");
+#endif
+
+    struct timespec ts;
+
+    /* merges read the hash table, including the one being migrated from
+     * during a resize, so merge threads are tracked like the workers */
+    qsbr_register();
+
+    while (!stop) {
+        /* merge threads take jobs from the same queue as the writers, so
+         * they evict from different TTL buckets */
+        background_evict();
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += BG_MAX_WAIT_MS / 1000;
+
+        qsbr_offline();
+        pthread_mutex_lock(&bg_mtx);
+        while (!stop && n_usable_free_seg() >= evict_info.free_low_wat) {
+            if (pthread_cond_timedwait(&merge_cond, &bg_mtx, &ts) ==
+                ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&bg_mtx);
+        qsbr_online();
+    }
+
+    qsbr_unregister();
+
+    return NULL;
+}
+
+void
+start_merge_threads(void)
+{
+    for (int i = 0; i < n_merge_thread; i++) {
+        int ret = pthread_create(&merge_tid[i], NULL, merge_main, NULL);
+        if (ret != 0) {
+            log_crit("pthread create failed for merge thread: %s",
+                strerror(ret));
+            exit(EX_OSERR);
+        }
+    }
+}
@@ -4,3 +4,10 @@
 
 void start_background_thread(void *arg);
 
+/* start n_merge_thread threads that evict segs ahead of demand in place of
+ * the background thread */
+void start_merge_threads(void);
+
+/* wake up the background thread to evict segs ahead of demand or to remove
+ * flushed segs */
+void wake_background_thread(void);
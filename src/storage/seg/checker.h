@@ -21,11 +21,11 @@ verify_ttlbucket_seg_list(void)
     struct seg *seg;
     int32_t seg_id;
 
-    pthread_mutex_lock(&heap.mtx);
-
     for (i = 0; i < MAX_N_TTL_BUCKET; i++) {
+        ttl_bucket_lock(i);
         seg_id = ttl_buckets[i].first_seg_id;
         if (seg_id == -1) {
+            ttl_bucket_unlock(i);
             continue;
         }
         while (seg_id >= 0) {
@@ -36,9 +36,8 @@ verify_ttlbucket_seg_list(void)
             }
             seg_id = seg->next_seg_id;
         }
+        ttl_bucket_unlock(i);
     }
-
-    pthread_mutex_unlock(&heap.mtx);
 }
 
 
@@ -65,7 +64,6 @@ verify_objstore(void)
         ASSERT(*(uint64_t *)(curr) == SEG_MAGIC);
         curr += sizeof(uint64_t);
 
-        ASSERT(seg->r_refcount < 64);
         ASSERT(seg->w_refcount < 64);
 
         while (curr - seg_data < seg->write_offset) {
@@ -197,14 +195,12 @@ print_free_seg_list(void)
 {
     log_debug(" free seg: ");
 
-    if (heap.free_seg_id == -1) {
-        return;
-    }
-
-    int seg_id = heap.free_seg_id;
-    while (seg_id != -1) {
-        SEG_PRINT(seg_id, "", log_debug);
-        seg_id = heap.segs[seg_id].next_seg_id;
+    for (int node = 0; node < heap.n_node; node++) {
+        int seg_id = FREE_SEG_ID(heap.free_seg_top[node]);
+        while (seg_id != -1) {
+            SEG_PRINT(seg_id, "", log_debug);
+            seg_id = heap.segs[seg_id].next_seg_id;
+        }
     }
 }
 
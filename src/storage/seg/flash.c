@@ -0,0 +1,336 @@
+#include "flash.h"
+#include "seg.h"
+
+#include <cc_debug.h>
+#include <cc_mm.h>
+#include <cc_util.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern seg_metrics_st *seg_metrics;
+
+static int              flash_fd     = -1;
+static size_t           flash_seg_size;
+static uint32_t         flash_n_seg  = 0;
+static uint32_t         *flash_gens  = NULL;
+static uint64_t         flash_n_write = 0;
+
+/* the staging seg collects the demoted items of flash seg stage_id, it is
+ * written out when full, appends and the switch to the next flash seg are
+ * protected by flash_mtx */
+static pthread_mutex_t  flash_mtx    = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t          *stage_buf   = NULL;
+static uint32_t         stage_id;
+static size_t           stage_off;
+
+/* the read buffer of each thread, freed when the thread exits */
+static pthread_key_t    read_buf_key;
+static pthread_once_t   read_buf_once = PTHREAD_ONCE_INIT;
+static __thread uint8_t *read_buf     = NULL;
+static __thread size_t  read_buf_size = 0;
+
+#define FLASH_READ_BUF_SIZE (flash_seg_size + 2 * FLASH_ALIGN)
+
+static void
+_read_buf_key_create(void)
+{
+    pthread_key_create(&read_buf_key, free);
+}
+
+static uint8_t *
+_read_buf(void)
+{
+    if (read_buf_size >= FLASH_READ_BUF_SIZE) {
+        return read_buf;
+    }
+
+    pthread_once(&read_buf_once, _read_buf_key_create);
+
+    free(read_buf);
+    read_buf_size = 0;
+    read_buf = aligned_alloc(FLASH_ALIGN, FLASH_READ_BUF_SIZE);
+    pthread_setspecific(read_buf_key, read_buf);
+    if (read_buf != NULL) {
+        read_buf_size = FLASH_READ_BUF_SIZE;
+    }
+
+    return read_buf;
+}
+
+bool
+flash_setup(const char *path, size_t size, size_t seg_size, bool direct)
+{
+    int flags = O_RDWR | O_CREAT;
+
+    if (flash_fd != -1) {
+        log_warn("flash tier has been set up");
+        flash_teardown();
+    }
+
+    if (seg_size % FLASH_ALIGN != 0) {
+        log_warn("seg size %zu is not a multiple of %d, flash IO is "
+                 "buffered", seg_size, FLASH_ALIGN);
+        direct = false;
+    }
+
+    flash_seg_size = seg_size;
+    flash_n_seg    = size / seg_size;
+    if (flash_n_seg < 2) {
+        log_error("flash tier of %zu bytes is less than two segs", size);
+        flash_n_seg = 0;
+        return false;
+    }
+
+#ifdef O_DIRECT
+    if (direct) {
+        flash_fd = open(path, flags | O_DIRECT, 0600);
+        if (flash_fd == -1 && errno == EINVAL) {
+            log_warn("%s does not support O_DIRECT, flash IO is buffered",
+                path);
+        }
+    }
+#endif
+    if (flash_fd == -1) {
+        flash_fd = open(path, flags, 0600);
+    }
+    if (flash_fd == -1) {
+        log_error("cannot open flash tier %s: %s", path, strerror(errno));
+        flash_n_seg = 0;
+        return false;
+    }
+
+    if (ftruncate(flash_fd, (off_t) seg_size * flash_n_seg) != 0) {
+        log_error("cannot size flash tier %s to %zu bytes: %s", path,
+            seg_size * flash_n_seg, strerror(errno));
+        flash_teardown();
+        return false;
+    }
+
+    flash_gens = cc_zalloc(sizeof(uint32_t) * flash_n_seg);
+    stage_buf  = aligned_alloc(FLASH_ALIGN, seg_size);
+    if (flash_gens == NULL || stage_buf == NULL) {
+        log_error("cannot allocate flash tier staging seg");
+        flash_teardown();
+        return false;
+    }
+    stage_id  = 0;
+    stage_off = 0;
+
+    log_info("flash tier %s has %" PRIu32 " segs of %zu bytes", path,
+        flash_n_seg, seg_size);
+
+    return true;
+}
+
+void
+flash_teardown(void)
+{
+    if (flash_fd != -1) {
+        close(flash_fd);
+        flash_fd = -1;
+    }
+
+    cc_free(flash_gens);
+    flash_gens = NULL;
+    free(stage_buf);
+    stage_buf = NULL;
+
+    flash_n_seg   = 0;
+    flash_n_write = 0;
+}
+
+uint32_t
+flash_nseg(void)
+{
+    return flash_n_seg;
+}
+
+uint64_t
+flash_nwrite(void)
+{
+    return __atomic_load_n(&flash_n_write, __ATOMIC_RELAXED);
+}
+
+uint32_t
+flash_gen(uint32_t seg_id)
+{
+    ASSERT(seg_id < flash_n_seg);
+
+    return __atomic_load_n(&flash_gens[seg_id], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * write the staging seg to its flash seg and move on to the next one,
+ * whose items on flash become stale, called with flash_mtx held
+ */
+static bool
+_stage_flush(void)
+{
+    off_t   off = (off_t) flash_seg_size * stage_id;
+    ssize_t n;
+
+    cc_memset(stage_buf + stage_off, 0, flash_seg_size - stage_off);
+
+    do {
+        n = pwrite(flash_fd, stage_buf, flash_seg_size, off);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != (ssize_t) flash_seg_size) {
+        log_error("write flash seg %" PRIu32 " failed: %s", stage_id,
+            n == -1 ? strerror(errno) : "short write");
+        INCR(seg_metrics, flash_write_ex);
+        return false;
+    }
+
+    INCR(seg_metrics, flash_write);
+    __atomic_add_fetch(&flash_n_write, 1, __ATOMIC_RELAXED);
+
+    stage_id = (stage_id + 1) % flash_n_seg;
+    __atomic_add_fetch(&flash_gens[stage_id], 1, __ATOMIC_RELEASE);
+    stage_off = 0;
+
+    return true;
+}
+
+bool
+flash_append(const struct item *it, proc_time_i create_at,
+             proc_time_i expire_at, struct flash_loc *loc)
+{
+    struct flash_rec *rec;
+    uint32_t         sz     = item_ntotal(it);
+    size_t           rec_sz = ROUND_UP(sizeof(*rec) + sz, 8);
+
+    if (flash_n_seg == 0 || rec_sz > flash_seg_size) {
+        return false;
+    }
+
+    pthread_mutex_lock(&flash_mtx);
+
+    if (stage_off + rec_sz > flash_seg_size && !_stage_flush()) {
+        pthread_mutex_unlock(&flash_mtx);
+        return false;
+    }
+
+    rec            = (struct flash_rec *) (stage_buf + stage_off);
+    rec->magic     = FLASH_REC_MAGIC;
+    rec->size      = sz;
+    rec->create_at = create_at;
+    rec->expire_at = expire_at;
+    cc_memcpy(rec + 1, it, sz);
+
+    loc->seg_id = stage_id;
+    loc->offset = stage_off;
+    loc->gen    = flash_gens[stage_id];
+
+    stage_off += rec_sz;
+
+    pthread_mutex_unlock(&flash_mtx);
+
+    return true;
+}
+
+static inline bool
+_rec_valid(const struct flash_rec *rec, uint32_t offset)
+{
+    return rec->magic == FLASH_REC_MAGIC && rec->size >= ITEM_HDR_SIZE &&
+        offset + sizeof(*rec) + rec->size <= flash_seg_size;
+}
+
+static bool
+_pread_all(uint8_t *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(flash_fd, buf, len, off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_warn("read flash at %lld failed: %s", (long long) off,
+                n == -1 ? strerror(errno) : "end of file");
+            return false;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return true;
+}
+
+struct item *
+flash_read(const struct flash_loc *loc, struct flash_rec *rec)
+{
+    uint8_t     *buf = _read_buf();
+    size_t      skip, len, need;
+    off_t       start;
+    struct item *it;
+
+    if (buf == NULL || loc->seg_id >= flash_n_seg ||
+        loc->offset + sizeof(*rec) > flash_seg_size) {
+        return NULL;
+    }
+
+    INCR(seg_metrics, flash_read);
+
+    /* the items of the staging seg are not on flash yet */
+    pthread_mutex_lock(&flash_mtx);
+    if (loc->seg_id == stage_id) {
+        it = NULL;
+        if (loc->gen == flash_gens[stage_id] &&
+            loc->offset + sizeof(*rec) <= stage_off) {
+            cc_memcpy(rec, stage_buf + loc->offset, sizeof(*rec));
+            if (_rec_valid(rec, loc->offset)) {
+                cc_memcpy(buf, stage_buf + loc->offset + sizeof(*rec),
+                    rec->size);
+                it = (struct item *) buf;
+            }
+        }
+        pthread_mutex_unlock(&flash_mtx);
+
+        goto done;
+    }
+    pthread_mutex_unlock(&flash_mtx);
+
+    /* read the aligned blocks of the record, the header first */
+    skip  = loc->offset % FLASH_ALIGN;
+    start = (off_t) flash_seg_size * loc->seg_id +
+        ROUND_DOWN(loc->offset, FLASH_ALIGN);
+    len   = ROUND_UP(skip + sizeof(*rec), FLASH_ALIGN);
+    if (!_pread_all(buf, len, start)) {
+        it = NULL;
+        goto done;
+    }
+
+    cc_memcpy(rec, buf + skip, sizeof(*rec));
+    if (!_rec_valid(rec, loc->offset)) {
+        it = NULL;
+        goto done;
+    }
+
+    need = ROUND_UP(skip + sizeof(*rec) + rec->size, FLASH_ALIGN);
+    if (need > len && !_pread_all(buf + len, need - len, start + len)) {
+        it = NULL;
+        goto done;
+    }
+
+    /* the flash seg may have been reused while we were reading */
+    it = flash_gen(loc->seg_id) == loc->gen ?
+        (struct item *) (buf + skip + sizeof(*rec)) : NULL;
+
+done:
+    if (it != NULL && item_ntotal(it) != rec->size) {
+        it = NULL;
+    }
+    if (it == NULL) {
+        INCR(seg_metrics, flash_read_ex);
+    }
+
+    return it;
+}
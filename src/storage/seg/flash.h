@@ -0,0 +1,85 @@
+#pragma once
+
+#include "item.h"
+
+#include <time/time.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The flash tier keeps warm items dropped by merge eviction in a file, e.g.,
+ * on a local NVMe drive, so that a later get finds them and promotes them
+ * back to DRAM instead of missing.
+ *
+ * The file is a ring of flash segs of seg_size bytes. Demoted items are
+ * appended to a DRAM staging seg, which is written to its flash seg with one
+ * pwrite when it is full, then the next flash seg (the oldest one) is
+ * reused. Each flash seg has a generation that is bumped when it is reused,
+ * the hash table entry of a flash item holds the flash seg id and (the low
+ * bits of) the generation, so the entries of a reused flash seg are
+ * recognized as stale and dropped.
+ *
+ * On flash, an item is preceded by a flash_rec header, readers check the
+ * header and the key, because the generation in the hash table entry only
+ * has a few bits.
+ */
+
+#define FLASH_ALIGN         4096        /* O_DIRECT alignment */
+#define FLASH_REC_MAGIC     0x464c5348u /* "FLSH" */
+
+struct flash_rec {
+    uint32_t    magic;
+    uint32_t    size;       /* item_ntotal of the item after the header */
+    proc_time_i create_at;  /* of the seg the item was evicted from */
+    proc_time_i expire_at;
+};
+
+/* the location of an item on flash */
+struct flash_loc {
+    uint32_t    seg_id;
+    uint32_t    offset;     /* of the flash_rec in the flash seg */
+    uint32_t    gen;        /* of the flash seg when the item was written */
+};
+
+/*
+ * open (or create) the flash file at path of size bytes, in flash segs of
+ * seg_size bytes, with O_DIRECT if direct is true and the file system
+ * supports it (tmpfs does not), return false if the file cannot be used
+ */
+bool
+flash_setup(const char *path, size_t size, size_t seg_size, bool direct);
+
+void
+flash_teardown(void);
+
+/* the number of flash segs, 0 if the flash tier is not set up */
+uint32_t
+flash_nseg(void);
+
+/* the number of flash segs written since setup */
+uint64_t
+flash_nwrite(void);
+
+/* the current generation of a flash seg */
+uint32_t
+flash_gen(uint32_t seg_id);
+
+/*
+ * append the item evicted from a seg created at create_at and expiring at
+ * expire_at, and return its location in loc, return false if the flash
+ * tier is not set up or the write fails
+ */
+bool
+flash_append(const struct item *it, proc_time_i create_at,
+             proc_time_i expire_at, struct flash_loc *loc);
+
+/*
+ * read the item at loc into a buffer of the calling thread, which is valid
+ * until the next read by the thread, its header is returned in rec,
+ * return NULL if the flash seg has been reused since loc was taken, or the
+ * record is not valid
+ */
+struct item *
+flash_read(const struct flash_loc *loc, struct flash_rec *rec);
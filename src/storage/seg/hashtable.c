@@ -1,22 +1,24 @@
 
 
 #include "hashtable.h"
+#include "flash.h"
 #include "item.h"
+#include "qsbr.h"
 #include "seg.h"
 
 #include <cc_mm.h>
 #define XXH_INLINE_ALL
 #include <hash/xxhash.h>
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sysexits.h>
+#if defined(__x86_64__) || defined(__i386__)
 #include <x86intrin.h>
+#endif
 
 /* TODO(jason): use static allocated array
- * TODO(jason): add bucket array shrink
- * TODO(juncheng): one way to increase hash table load is to use cuckoo hash
- * with bucket
  * */
 
 extern int n_thread;
@@ -41,6 +43,8 @@ extern int n_thread;
 #define FREQ_BIT_SHIFT          44ul
 #define SEG_ID_BIT_SHIFT        20ul
 #define OFFSET_UNIT_IN_BIT      3ul     /* offset is in 8-byte unit */
+/* the top bit of the seg id field marks an item on the flash tier */
+#define FLASH_TIER_BIT          0x0000080000000000ul
 
 /* this bit indicates whether the frequency has increased in the current sec */
 #define FREQ_INC_INDICATOR_MASK  0x0008000000000000ul
@@ -48,7 +52,8 @@ extern int n_thread;
 
 /* mast for bucket info */
 #define LOCK_MASK               0xff00000000000000ul
-#define BUCKET_CHAIN_LEN_MASK   0x00ff000000000000ul
+#define BUCKET_MIGRATED         0x0080000000000000ul  /* moved to new table */
+#define BUCKET_CHAIN_LEN_MASK   0x007f000000000000ul
 #define TS_MASK                 0x0000ffff00000000ul  /* ts in bucket info */
 #define CAS_MASK                0x00000000fffffffful
 
@@ -64,12 +69,78 @@ extern int n_thread;
 #define LOCKED                  0x0100000000000000ul
 #define UNLOCKED                0x0000000000000000ul
 
+/* spin-wait hint for a reader waiting out a bucket writer */
+static inline void
+_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield" ::: "memory");
+#endif
+}
+
 extern seg_metrics_st *seg_metrics;
 
-static struct hash_table    hash_table;
+/* all writes go to hash_table, during a resize the items of hash_table->prev
+ * are migrated to hash_table bucket by bucket */
+static struct hash_table    *hash_table            = NULL;
 static bool                 hash_table_initialized = false;
+static bool                 hash_resize            = false;
+static bool                 two_choice             = false;
+static uint32_t             hash_power_min;
+static uint64_t             migrate_pos            = 0;
+static uint64_t             n_bkt_alloc            = 0;
+/* the table replaced by the last resize, lock-free readers may still be
+ * reading it, so it is freed once its retire epoch expires, like a seg */
+static struct hash_table    *retired_table         = NULL;
+static uint64_t             retired_epoch;
 static __thread __uint128_t g_lehmer64_state       = 1;
 
+/* with lazy expiration, the seg id field of item info stores the seg id in
+ * the low seg_id_n_bit bits and the generation of the seg above them */
+static bool                 lazy_expire            = false;
+static uint64_t             seg_id_n_bit           = 24;
+static uint64_t             seg_id_lo_mask         = 0xfffffful;
+static uint32_t             seg_gen_mask           = 0;
+/* the number of bits of the seg id field, its top bit is taken by
+ * FLASH_TIER_BIT with the flash tier */
+static uint64_t             seg_field_n_bit        = 24;
+
+/* with the flash tier, the seg id field of a flash item stores the flash seg
+ * id in the low flash_id_n_bit bits and (the low bits of) the generation of
+ * the flash seg above them, a sweep is started after every
+ * flash_sweep_nwrite flash seg writes, so that the entries of reused flash
+ * segs are dropped before their generation wraps around */
+static bool                 flash_tier             = false;
+static uint64_t             flash_id_n_bit         = 0;
+static uint64_t             flash_id_lo_mask       = 0;
+static uint32_t             flash_gen_mask         = 0;
+static uint64_t             flash_sweep_nwrite     = 0;
+static uint64_t             flash_sweep_at         = 0;
+
+/* the sweep of stale entries, only run by the background thread,
+ * sweep_req is the first sweep that has not been asked for yet */
+static struct hash_table    *sweep_table           = NULL;
+static uint64_t             sweep_pos              = 0;
+static uint64_t             sweep_started          = 0;
+static uint64_t             sweep_done             = 0;
+static uint64_t             sweep_req              = 0;
+static bool                 sweep_active           = false;
+static proc_time_i          sweep_last             = 0;
+
+/* the pool of overflown buckets, free buckets are linked through their first
+ * slot, bkt_free_top packs the first free bucket with an ABA tag, the chunks
+ * are linked through their first bucket and only freed on teardown */
+static uint64_t             bkt_free_top           = 0;
+static uint64_t             *bkt_chunks            = NULL;
+static pthread_mutex_t      bkt_chunk_mtx          = PTHREAD_MUTEX_INITIALIZER;
+
+/* the huge page size of the tables (0 for regular pages), and whether the
+ * tables and overflown buckets are interleaved over the NUMA nodes */
+static size_t               ht_hugepage_size       = 0;
+static bool                 ht_interleave          = false;
+
 #define HASHSIZE(_n)        (1ULL << (_n))
 #define HASHMASK(_n)        (HASHSIZE(_n) - 1)
 #define CAL_HV(key, klen)   _get_hv_xxhash(key, klen)
@@ -82,7 +153,10 @@ static __thread __uint128_t g_lehmer64_state       = 1;
  * we perform OR with 0x0001000000000000ul */
 #define GET_TAG(item_info)      ((item_info) & TAG_MASK)
 #define GET_FREQ(item_info)     (((item_info) & FREQ_MASK) >> FREQ_BIT_SHIFT)
-#define GET_SEG_ID(item_info)   (((item_info) & SEG_ID_MASK) >> SEG_ID_BIT_SHIFT)
+#define GET_SEG_ID(item_info)                                                  \
+    ((((item_info) & SEG_ID_MASK) >> SEG_ID_BIT_SHIFT) & seg_id_lo_mask)
+#define GET_SEG_GEN(item_info)                                                 \
+    ((uint32_t) (((item_info) & SEG_ID_MASK) >> (SEG_ID_BIT_SHIFT + seg_id_n_bit)))
 #define GET_SEG_ID_NON_DECR(item_info)   (((item_info) & SEG_ID_MASK) >> SEG_ID_BIT_SHIFT)
 
 #if defined DEBUG_MODE
@@ -95,8 +169,22 @@ static __thread __uint128_t g_lehmer64_state       = 1;
 #define GET_OFFSET(item_info)   (((item_info) & OFFSET_MASK) << OFFSET_UNIT_IN_BIT)
 #define CLEAR_FREQ(item_info)   ((item_info) & (~FREQ_MASK))
 
+#define GET_FLASH_ID(item_info)                                                \
+    (((item_info) >> SEG_ID_BIT_SHIFT) & flash_id_lo_mask)
+#define GET_FLASH_GEN(item_info)                                               \
+    ((uint32_t) ((item_info) >> (SEG_ID_BIT_SHIFT + flash_id_n_bit)) & flash_gen_mask)
+
 #define CAL_TAG_FROM_HV(hv) (((hv) & TAG_MASK) | 0x0010000000000000ul)
-#define GET_BUCKET(hv)      (&hash_table.table[((hv) & (hash_table.hash_mask))])
+#define GET_BUCKET(ht, hv)  (&(ht)->table[((hv) & ((ht)->hash_mask))])
+
+/* the bits flipped in the bucket index to get the alternate bucket, it is
+ * odd so that the two buckets of an item are never the same */
+#define ALT_BUCKET_OFFSET(tag)                                                 \
+    (((((tag) >> TAG_BIT_SHIFT) * 0x9e3779b97f4a7c15ul) >> 32u) | 1u)
+
+/* the max number of head buckets a reader checks, two buckets in both
+ * tables during a resize in two-choice mode */
+#define HASH_N_CAND_MAX     4
 
 #define GET_TS(bucket_ptr)          (((*(bucket_ptr)) & TS_MASK) >> TS_BIT_SHIFT)
 #define GET_CAS(bucket_ptr)         ((*(bucket_ptr)) & CAS_MASK)
@@ -104,8 +192,18 @@ static __thread __uint128_t g_lehmer64_state       = 1;
 /* calculate the number of buckets in the bucket chain */
 #define GET_BUCKET_CHAIN_LEN(bucket_ptr)                                       \
     ((((*(bucket_ptr)) & BUCKET_CHAIN_LEN_MASK) >> BUCKET_CHAIN_LEN_BIT_SHIFT) + 1)
+/* the new bucket must be linked before lock-free readers see the length */
 #define INCR_BUCKET_CHAIN_LEN(bucket_ptr)                                      \
-                ((*(bucket_ptr)) += 0x0001000000000000ul)
+    __atomic_fetch_add((bucket_ptr), 0x0001000000000000ul, __ATOMIC_RELEASE)
+/* the item moved into the last slot must be visible before the length */
+#define DECR_BUCKET_CHAIN_LEN(bucket_ptr)                                      \
+    __atomic_fetch_sub((bucket_ptr), 0x0001000000000000ul, __ATOMIC_RELEASE)
+
+/* the top of the free bucket list, a 48-bit pointer and a 16-bit ABA tag */
+#define BKT_PTR_MASK                0x0000fffffffffffful
+#define BKT_FREE_PTR(top)           ((uint64_t *) ((top) & BKT_PTR_MASK))
+#define BKT_FREE_ABA(top)           ((top) >> 48u)
+#define BKT_FREE_TOP(bkt, aba)      ((uint64_t) (bkt) | ((uint64_t) (aba) << 48u))
 
 #define CAS_SLOT(slot_ptr, expect_ptr, new_val)                                \
     __atomic_compare_exchange_n(                                               \
@@ -144,20 +242,20 @@ static __thread __uint128_t g_lehmer64_state       = 1;
 #define lock(bucket_ptr)                                                        \
     do {                                                                        \
         while (__atomic_test_and_set(                                           \
-            ((uint8_t *)(bucket_ptr) + 7), __ATOMIC_RELAXED)) {                 \
+            ((uint8_t *)(bucket_ptr) + 7), __ATOMIC_ACQUIRE)) {                 \
             ;                                                                   \
         }                                                                       \
     } while (0)
 
 #define unlock(bucket_ptr)                                                      \
     do {                                                                        \
-        __atomic_clear(((uint8_t *)(bucket_ptr) + 7), __ATOMIC_RELAXED);        \
+        __atomic_clear(((uint8_t *)(bucket_ptr) + 7), __ATOMIC_RELEASE);        \
     } while (0)
 
 #define unlock_and_update_cas(bucket_ptr)                                       \
     do {                                                                        \
         *bucket_ptr += 1;                                                       \
-        __atomic_clear(((uint8_t *)(bucket_ptr) + 7), __ATOMIC_RELAXED);        \
+        __atomic_clear(((uint8_t *)(bucket_ptr) + 7), __ATOMIC_RELEASE);        \
     } while (0)
 #endif
 
@@ -217,21 +315,163 @@ _item_free(uint64_t item_info, bool mark_tombstone)
     it->deleted = true;
 }
 
+/*
+ * whether the item info points to a seg that has expired lazily since the
+ * info was built, the item it points to may have been overwritten,
+ * so a stale entry is dropped without touching the item or the seg
+ */
+static inline bool
+_info_flash(uint64_t item_info)
+{
+    return flash_tier && (item_info & FLASH_TIER_BIT);
+}
+
+static inline bool
+_info_stale(uint64_t item_info)
+{
+    if (_info_flash(item_info)) {
+        return GET_FLASH_GEN(item_info) !=
+            (flash_gen(GET_FLASH_ID(item_info)) & flash_gen_mask);
+    }
+
+    return lazy_expire && GET_SEG_GEN(item_info) !=
+        __atomic_load_n(&heap.segs[GET_SEG_ID(item_info)].gen,
+            __ATOMIC_ACQUIRE);
+}
+
 static inline bool
 _same_item(const char *key, uint32_t klen, uint64_t item_info)
 {
-    struct item *oit = _info_to_item(item_info);
+    struct item *oit;
+
+    /* the key of a flash item is on flash, only the tag is compared in the
+     * hash table */
+    if (_info_flash(item_info)) {
+        return false;
+    }
+
+    oit = _info_to_item(item_info);
+
+    /* lock-free readers may see an item being overwritten, do not compare
+     * beyond the end of the segment */
+    if (GET_OFFSET(item_info) + ITEM_HDR_SIZE + oit->olen + klen >
+            heap.seg_size) {
+        return false;
+    }
+
     return ((oit->klen == klen) && cc_memcmp(item_key(oit), key, klen) == 0);
 }
 
+/*
+ * compare the tags of all N_SLOT_PER_BUCKET slots of a bucket with tag,
+ * return a bitmask with bit i set if the tag of slot i matches,
+ * a bucket is one cache line, so with AVX2/AVX-512 the whole bucket is
+ * compared at once, the kernel is picked by CPUID in hashtable_setup;
+ * other architectures use the scalar kernel
+ */
+static uint32_t
+_tag_match_scalar(const uint64_t *bkt, uint64_t tag)
+{
+    uint32_t match = 0;
+
+    for (uint32_t i = 0; i < N_SLOT_PER_BUCKET; i++) {
+        match |= (uint32_t)(GET_TAG(bkt[i]) == tag) << i;
+    }
+
+    return match;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static uint32_t
+_tag_match_avx2(const uint64_t *bkt, uint64_t tag)
+{
+    __m256i mask = _mm256_set1_epi64x((long long)TAG_MASK);
+    __m256i t    = _mm256_set1_epi64x((long long)tag);
+    __m256i lo   = _mm256_loadu_si256((const __m256i *)bkt);
+    __m256i hi   = _mm256_loadu_si256((const __m256i *)(bkt + 4));
+
+    lo = _mm256_cmpeq_epi64(_mm256_and_si256(lo, mask), t);
+    hi = _mm256_cmpeq_epi64(_mm256_and_si256(hi, mask), t);
+
+    return (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(lo)) |
+        ((uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4u);
+}
+
+__attribute__((target("avx512f")))
+static uint32_t
+_tag_match_avx512(const uint64_t *bkt, uint64_t tag)
+{
+    __m512i v = _mm512_loadu_si512((const void *)bkt);
+
+    return _mm512_cmpeq_epi64_mask(
+        _mm512_and_si512(v, _mm512_set1_epi64((long long)TAG_MASK)),
+        _mm512_set1_epi64((long long)tag));
+}
+#endif
+
+static uint32_t (*_tag_match)(const uint64_t *bkt, uint64_t tag) =
+    _tag_match_scalar;
+
+/*
+ * return the slots of a bucket storing item info whose tag matches,
+ * the first slot of the head bucket is bucket info and the last slot
+ * is a pointer if there is a next bucket, neither holds item info
+ */
+static inline uint32_t
+_bucket_match(const uint64_t *bkt, uint64_t tag, bool head, bool has_next)
+{
+    uint32_t slot_mask = (1u << N_SLOT_PER_BUCKET) - 1;
+
+    if (head) {
+        slot_mask &= ~1u;
+    }
+    if (has_next) {
+        slot_mask &= ~(1u << (N_SLOT_PER_BUCKET - 1));
+    }
+
+    return _tag_match(bkt, tag) & slot_mask;
+}
+
+/*
+ * the next bucket in the chain for lock-free readers, the chain can be
+ * compacted during the scan, then the last slot holds item info (which
+ * always has a tag) or 0 instead of a pointer, the reader stops the scan
+ * and sees the changed cas
+ */
+static inline uint64_t *
+_next_bucket(const uint64_t *bkt)
+{
+    uint64_t next = __atomic_load_n(&bkt[N_SLOT_PER_BUCKET - 1],
+        __ATOMIC_RELAXED);
+
+    return next == 0 || GET_TAG(next) != 0 ? NULL : (uint64_t *) next;
+}
+
 static inline uint64_t
 _build_item_info(uint64_t tag, uint64_t seg_id, uint64_t offset)
 {
     ASSERT(offset % 8 == 0);
     uint64_t item_info = tag | (seg_id << 20u) | (offset >> 3u);
+    if (lazy_expire) {
+        item_info |= (uint64_t) __atomic_load_n(&heap.segs[seg_id].gen,
+            __ATOMIC_RELAXED) << (SEG_ID_BIT_SHIFT + seg_id_n_bit);
+    }
     return item_info;
 }
 
+static inline uint64_t
+_build_flash_info(uint64_t tag, const struct flash_loc *loc)
+{
+    ASSERT(loc->offset % 8 == 0);
+
+    return tag | FLASH_TIER_BIT |
+        ((uint64_t) (loc->gen & flash_gen_mask) <<
+            (SEG_ID_BIT_SHIFT + flash_id_n_bit)) |
+        ((uint64_t) loc->seg_id << SEG_ID_BIT_SHIFT) |
+        (loc->offset >> OFFSET_UNIT_IN_BIT);
+}
+
 #define SET_BIT(u64, pos) ((u64) | (1ul << (pos)))
 #define GET_BIT(u64, pos) ((u64) & (1ul << (pos)))
 #define CHECK_BIT(u64, pos) GET_BIT(u64, pos)
@@ -252,53 +492,314 @@ _get_hv_xxhash(const char *key, size_t klen)
 
 
 /*
- * Allocate table given size
+ * map the table in huge pages of ht_hugepage_size, return NULL if there are
+ * not enough huge pages, the mapping is zeroed and rounded up to the page size
+ */
+static uint64_t *
+_hashtable_map_hugetlb(size_t size, size_t *map_size)
+{
+#ifdef MAP_HUGETLB
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    void *addr;
+
+#ifdef MAP_HUGE_SHIFT
+    flags |= __builtin_ctzl(ht_hugepage_size) << MAP_HUGE_SHIFT;
+#endif
+
+    size = (size + ht_hugepage_size - 1) & ~(ht_hugepage_size - 1);
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (addr == MAP_FAILED) {
+        log_warn("cannot map hash table in %zu-byte huge pages, use regular "
+                 "pages", ht_hugepage_size);
+        return NULL;
+    }
+
+    *map_size = size;
+    return addr;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Allocate table given size, the memory policy is set before the table is
+ * zeroed, so that the pages are allocated on the right nodes
  */
 static inline uint64_t *
-_hashtable_alloc(uint64_t n_slot)
+_hashtable_alloc(uint64_t n_slot, size_t *map_size)
 {
-    uint64_t *table =
-                 aligned_alloc(N_BYTE_PER_BUCKET, sizeof(uint64_t) * n_slot);
+    size_t size = sizeof(uint64_t) * n_slot;
+    uint64_t *table = NULL;
+
+    *map_size = 0;
+    if (ht_hugepage_size > 0) {
+        table = _hashtable_map_hugetlb(size, map_size);
+    }
+
     if (table == NULL) {
-        log_crit("cannot create hash table");
+        table = aligned_alloc(N_BYTE_PER_BUCKET, size);
+        if (table == NULL) {
+            log_crit("cannot create hash table");
+            exit(EX_CONFIG);
+        }
+#ifdef MADV_HUGEPAGE
+        /* USE_HUGEPAGE */
+        madvise(table, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (ht_interleave) {
+        seg_numa_interleave(table, size, *map_size > 0 ? ht_hugepage_size : 0);
+    }
+
+    cc_memset(table, 0, size);
+
+    return table;
+}
+
+/*
+ * add a chunk of overflown buckets to the pool, the first bucket of the
+ * chunk links the chunks, the rest are pushed to the free list at once
+ */
+static void
+_bucket_pool_grow(void)
+{
+    uint64_t *chunk, *bkt;
+    uint64_t n_bkt = HASH_BUCKET_CHUNK_SIZE / N_BYTE_PER_BUCKET;
+    uint64_t top;
+
+    pthread_mutex_lock(&bkt_chunk_mtx);
+
+    if (BKT_FREE_PTR(__atomic_load_n(&bkt_free_top, __ATOMIC_ACQUIRE))
+            != NULL) {
+        /* another thread has grown the pool */
+        pthread_mutex_unlock(&bkt_chunk_mtx);
+        return;
+    }
+
+    chunk = aligned_alloc(HASH_BUCKET_CHUNK_SIZE, HASH_BUCKET_CHUNK_SIZE);
+    if (chunk == NULL) {
+        log_crit("cannot allocate overflown hash buckets");
         exit(EX_CONFIG);
     }
-    cc_memset(table, 0, sizeof(uint64_t) * n_slot);
+    ASSERT(((uint64_t) chunk & ~BKT_PTR_MASK) == 0);
 
 #ifdef MADV_HUGEPAGE
-    /* USE_HUGEPAGE */
-    madvise(table, sizeof(uint64_t) * n_slot, MADV_HUGEPAGE);
+    madvise(chunk, HASH_BUCKET_CHUNK_SIZE, MADV_HUGEPAGE);
 #endif
+    if (ht_interleave) {
+        seg_numa_interleave(chunk, HASH_BUCKET_CHUNK_SIZE, 0);
+    }
 
-    return table;
+    chunk[0]   = (uint64_t) bkt_chunks;
+    bkt_chunks = chunk;
+
+    for (uint64_t i = 1; i < n_bkt - 1; i++) {
+        bkt    = &chunk[i * N_SLOT_PER_BUCKET];
+        bkt[0] = (uint64_t) (bkt + N_SLOT_PER_BUCKET);
+    }
+
+    bkt = &chunk[(n_bkt - 1) * N_SLOT_PER_BUCKET];
+    top = __atomic_load_n(&bkt_free_top, __ATOMIC_RELAXED);
+    do {
+        bkt[0] = (uint64_t) BKT_FREE_PTR(top);
+    } while (!__atomic_compare_exchange_n(&bkt_free_top, &top,
+        BKT_FREE_TOP(&chunk[N_SLOT_PER_BUCKET], BKT_FREE_ABA(top) + 1),
+        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    pthread_mutex_unlock(&bkt_chunk_mtx);
+
+    log_verb("add %" PRIu64 " overflown hash buckets to the pool", n_bkt - 1);
 }
 
-void
-hashtable_setup(uint32_t hash_power)
+/*
+ * take a zeroed overflown bucket from the pool, a bucket we are popping can
+ * be popped and reused by another thread in the meantime, so its first slot
+ * may not be a free bucket, but then the ABA tag has changed and we retry
+ */
+static uint64_t *
+_bucket_alloc(void)
 {
+    uint64_t top = __atomic_load_n(&bkt_free_top, __ATOMIC_ACQUIRE);
+    uint64_t *bkt, next;
+
+    while (true) {
+        bkt = BKT_FREE_PTR(top);
+        if (bkt == NULL) {
+            _bucket_pool_grow();
+            top = __atomic_load_n(&bkt_free_top, __ATOMIC_ACQUIRE);
+            continue;
+        }
 
-    ASSERT(hash_power > 0);
+        next = __atomic_load_n(&bkt[0], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&bkt_free_top, &top,
+                BKT_FREE_TOP(BKT_FREE_PTR(next), BKT_FREE_ABA(top) + 1),
+                false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
 
-    if (hash_table_initialized) {
-        log_warn("hash table has been initialized");
-        hashtable_teardown();
+    for (uint32_t i = 0; i < N_SLOT_PER_BUCKET; i++) {
+        __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+    }
+
+    return bkt;
+}
+
+/*
+ * give an overflown bucket back to the pool, lock-free readers that loaded
+ * the chain before it was unlinked may still read it, they only see stale
+ * item info and retry because the cas of the head bucket has changed
+ */
+static void
+_bucket_free(uint64_t *bkt)
+{
+    uint64_t top = __atomic_load_n(&bkt_free_top, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(&bkt[0], (uint64_t) BKT_FREE_PTR(top),
+            __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&bkt_free_top, &top,
+        BKT_FREE_TOP(bkt, BKT_FREE_ABA(top) + 1), false,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    INCR(seg_metrics, hash_bucket_free);
+}
+
+static void
+_bucket_pool_teardown(void)
+{
+    uint64_t *chunk;
+
+    while (bkt_chunks != NULL) {
+        chunk      = bkt_chunks;
+        bkt_chunks = (uint64_t *) chunk[0];
+        free(chunk);
+    }
+
+    bkt_free_top = 0;
+}
+
+static struct hash_table *
+_hashtable_create(uint32_t hash_power)
+{
+    struct hash_table *ht = cc_alloc(sizeof(struct hash_table));
+    if (ht == NULL) {
+        log_crit("cannot create hash table");
+        exit(EX_CONFIG);
     }
 
     /* init members */
-    hash_table.hash_power = hash_power;
+    ht->hash_power = hash_power;
     uint64_t n_slot = HASHSIZE(hash_power);
     /* N_SLOT_PER_BUCKET slots are in one bucket, so hash_mask last
      * N_SLOT_PER_BUCKET_LOG2 bits should be zero */
-    hash_table.hash_mask =
+    ht->hash_mask =
         (n_slot - 1) & (0xfffffffffffffffful << N_SLOT_PER_BUCKET_LOG2);
+    ht->prev = NULL;
 
     /* alloc table */
-    hash_table.table = _hashtable_alloc(n_slot);
-
-    hash_table_initialized = true;
+    ht->table = _hashtable_alloc(n_slot, &ht->map_size);
 
     log_info("create hash table of %" PRIu64 " entries %" PRIu64 " buckets",
         n_slot, n_slot >> N_SLOT_PER_BUCKET_LOG2);
+
+    return ht;
+}
+
+static void
+_hashtable_free(struct hash_table *ht)
+{
+    uint64_t n_bkt = HASHSIZE(ht->hash_power - N_SLOT_PER_BUCKET_LOG2);
+    uint64_t *bkt, *next_bkt;
+    int      bkt_chain_len;
+
+    /* give the overflown buckets back to the pool */
+    for (uint64_t idx = 0; idx < n_bkt; idx++) {
+        bkt           = &ht->table[idx * N_SLOT_PER_BUCKET];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        for (int i = 0; i < bkt_chain_len; i++) {
+            next_bkt = (uint64_t *) bkt[N_SLOT_PER_BUCKET - 1];
+            if (i > 0) {
+                _bucket_free(bkt);
+            }
+            bkt = next_bkt;
+        }
+        if (bkt_chain_len > 0) {
+            _bucket_free(bkt);
+        }
+    }
+
+    if (ht->map_size > 0) {
+        munmap(ht->table, ht->map_size);
+    } else {
+        cc_free(ht->table);
+    }
+    cc_free(ht);
+}
+
+void
+hashtable_setup(uint32_t hash_power, bool resize, bool use_two_choice,
+        size_t hugepage_size, bool interleave)
+{
+
+    ASSERT(hash_power > 0);
+
+    if (hash_table_initialized) {
+        log_warn("hash table has been initialized");
+        hashtable_teardown();
+    }
+
+    ht_hugepage_size = hugepage_size;
+    ht_interleave    = interleave;
+    hash_table     = _hashtable_create(hash_power);
+    hash_resize    = resize;
+    two_choice     = use_two_choice;
+    hash_power_min = MIN(hash_power, HASH_POWER_MIN);
+    migrate_pos    = 0;
+    n_bkt_alloc    = 0;
+
+    lazy_expire    = false;
+    seg_id_n_bit   = 24;
+    seg_id_lo_mask = 0xfffffful;
+    seg_gen_mask   = 0;
+    seg_field_n_bit = 24;
+
+    flash_tier         = false;
+    flash_id_n_bit     = 0;
+    flash_id_lo_mask   = 0;
+    flash_gen_mask     = 0;
+    flash_sweep_nwrite = 0;
+    flash_sweep_at     = 0;
+
+    sweep_table    = NULL;
+    sweep_pos      = 0;
+    sweep_started  = 0;
+    sweep_done     = 0;
+    sweep_req      = 0;
+    sweep_active   = false;
+    sweep_last     = 0;
+
+    _tag_match = _tag_match_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        _tag_match = _tag_match_avx512;
+        log_info("hash table uses AVX-512 tag matching");
+    } else if (__builtin_cpu_supports("avx2")) {
+        _tag_match = _tag_match_avx2;
+        log_info("hash table uses AVX2 tag matching");
+    }
+#endif
+
+    if (two_choice) {
+        log_info("hash table uses two-choice buckets");
+    }
+
+    /* so that the first overflows do not wait for a chunk */
+    _bucket_pool_grow();
+
+    hash_table_initialized = true;
 }
 
 void
@@ -309,111 +810,755 @@ hashtable_teardown(void)
         return;
     }
 
-    cc_free(hash_table.table);
-    hash_table.table = NULL;
+    if (hash_table->prev != NULL) {
+        _hashtable_free(hash_table->prev);
+    }
+    _hashtable_free(hash_table);
+    hash_table = NULL;
+
+    if (retired_table != NULL) {
+        _hashtable_free(retired_table);
+        retired_table = NULL;
+    }
+
+    _bucket_pool_teardown();
 
     hash_table_initialized = false;
 }
 
-/**
- * insert an item into hash table
- * insert has two steps, insert and possibly delete
- * insert and delete must be completed in the same pass (atomic or locked),
- * otherwise it cannot guarantee correctness
- *
- * procedure:
- * scan through all slots of the head bucket,
- * 1. if we found the item, replace with new item
- * 2. if we found an empty slot first, we store new item in empty slots and
- *      2-1. remove the old item if the old item is in the head bucket,
- *      2-2. if we do not find it in the head bucket, we stop searching, and
- *          let the clean up to eviction time
- * 3. if old item is not found in the first bucket nor empty bucket,
- *      we continue to search
+/*
+ * drop the stale entries in the locked bucket chain of head_bkt, return the
+ * number of entries dropped, and the first slot freed in free_slot
  */
-
-void
-hashtable_put(struct item *it, const uint64_t seg_id, const uint64_t offset)
+static uint32_t
+_drop_stale(uint64_t *head_bkt, uint64_t **free_slot)
 {
-    const char     *key = item_key(it);
-    const uint32_t klen = item_nkey(it);
-
-    uint64_t hv        = CAL_HV(key, klen);
-    uint64_t tag       = CAL_TAG_FROM_HV(hv);
-    uint64_t *head_bkt = GET_BUCKET(hv);
-    uint64_t *bkt      = head_bkt;
-
-    INCR(seg_metrics, hash_insert);
-
-    /* 12-bit tag, 8-bit counter,
-     * 24-bit seg id, 20-bit offset (in the unit of 8-byte) */
-    uint64_t item_info, insert_item_info;
-    insert_item_info = _build_item_info(tag, seg_id, offset);
+    uint64_t *bkt   = head_bkt;
+    uint64_t item_info;
+    uint32_t n_drop = 0;
+    int      bkt_chain_len, n_item_slot;
 
-    lock(head_bkt);
+    if (!lazy_expire && !flash_tier) {
+        return 0;
+    }
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt);
-    int n_item_slot;
+    bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt) - 1;
     do {
-        /* the last slot will be a pointer to the next
-         * bucket if there is next bucket */
-        n_item_slot = bkt_chain_len > 1 ?
+        n_item_slot = bkt_chain_len > 0 ?
                       N_SLOT_PER_BUCKET - 1 :
                       N_SLOT_PER_BUCKET;
-
-        for (int i = 0; i < n_item_slot; i++) {
-            if (bkt == head_bkt && i == 0) {
-                /* the first slot of the head bucket is bucket into */
-                continue;
-            }
-
+        for (int i = bkt == head_bkt ? 1 : 0; i < n_item_slot; i++) {
             item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
-            if (GET_TAG(item_info) != tag) {
-                if (insert_item_info != 0 && item_info == 0) {
-                    /* store item info in the first empty slot */
-                    __atomic_store_n(&bkt[i], insert_item_info, __ATOMIC_RELAXED);
-                    insert_item_info = 0;
-                }
+            if (item_info == 0 || !_info_stale(item_info)) {
                 continue;
             }
-            /* a potential hit */
-            if (!_same_item(key, klen, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
+
+            __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+            if (n_drop++ == 0 && free_slot != NULL) {
+                *free_slot = &bkt[i];
             }
+        }
+        bkt_chain_len -= 1;
+        bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+    } while (bkt_chain_len >= 0);
 
-            /* found the item, now atomic update (or delete if already inserted)
-             * read and write 8-byte on x86 is always atomic */
-            __atomic_store_n(&bkt[i], insert_item_info, __ATOMIC_RELAXED);
-            insert_item_info = 0;
+    INCR_N(seg_metrics, hash_stale_drop, n_drop);
 
-            /* now mark the old item as deleted, update stat */
-            _item_free(item_info, false);
+    return n_drop;
+}
 
-            /* there could be pointers to stale objects later in the bucket,
-             * we leave the clean up to future eviction time */
-            goto finish;
-        }
+/*
+ * drop the flash entries whose tag matches in the locked bucket chain of
+ * head_bkt before the key is written, the key of a flash item is not
+ * compared without reading it from flash, so an item of another key with
+ * the same tag is dropped as well, return the number of entries dropped
+ */
+static uint32_t
+_drop_flash(uint64_t *head_bkt, uint64_t tag)
+{
+    uint64_t *bkt   = head_bkt;
+    uint32_t match, n_drop = 0;
+    int      bkt_chain_len, i;
 
-        if (insert_item_info == 0) {
-            /* item has been inserted, do not check next bucket to delete
-             * old item, the info will be gc when item is evicted */
-            goto finish;
-        }
+    if (!flash_tier) {
+        return 0;
+    }
 
-        /* if there are overflown buckets, we continue to check */
-        bkt_chain_len -= 1;
-        if (bkt_chain_len > 0) {
-            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+    bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt) - 1;
+    do {
+        match = _bucket_match(bkt, tag, bkt == head_bkt, bkt_chain_len > 0);
+        while (match != 0) {
+            i = __builtin_ctz(match);
+            match &= match - 1;
+
+            if (_info_flash(__atomic_load_n(&bkt[i], __ATOMIC_RELAXED))) {
+                __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                n_drop += 1;
+            }
         }
-    } while (bkt_chain_len > 0);
+        bkt_chain_len -= 1;
+        bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+    } while (bkt_chain_len >= 0);
+
+    INCR_N(seg_metrics, flash_drop, n_drop);
+
+    return n_drop;
+}
+
+/*
+ * shorten the locked bucket chain of head_bkt while the items of its last
+ * bucket fit in the empty slots before it, including the pointer slot of
+ * the bucket before it, the emptied buckets go back to the pool,
+ * return whether the chain has changed
+ */
+static bool
+_compact_chain(uint64_t *head_bkt)
+{
+    uint64_t *bkt, *prev, *last;
+    uint64_t left_over;
+    uint32_t match, live, n_empty;
+    int      bkt_chain_len, i;
+    bool     compacted = false;
+
+    while ((bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt)) > 1) {
+        /* count the empty slots before the last bucket */
+        n_empty = 0;
+        prev    = bkt = head_bkt;
+        for (int k = 0; k < bkt_chain_len - 1; k++) {
+            n_empty += __builtin_popcount(
+                _bucket_match(bkt, 0, bkt == head_bkt, true));
+            prev = bkt;
+            bkt  = (uint64_t *) bkt[N_SLOT_PER_BUCKET - 1];
+        }
+        last = bkt;
+        live = ~_bucket_match(last, 0, false, false) &
+            ((1u << N_SLOT_PER_BUCKET) - 1);
+
+        if ((uint32_t) __builtin_popcount(live) > n_empty + 1) {
+            break;
+        }
+
+        /* move the items of the last bucket to the front of the chain */
+        left_over = 0;
+        bkt       = head_bkt;
+        match     = _bucket_match(bkt, 0, true, true);
+        while (live != 0) {
+            i = __builtin_ctz(live);
+            live &= live - 1;
+
+            while (match == 0 && bkt != prev) {
+                bkt   = (uint64_t *) bkt[N_SLOT_PER_BUCKET - 1];
+                match = _bucket_match(bkt, 0, false, true);
+            }
+            if (match == 0) {
+                ASSERT(left_over == 0);
+                left_over = last[i];
+                continue;
+            }
+
+            __atomic_store_n(&bkt[__builtin_ctz(match)], last[i],
+                __ATOMIC_RELAXED);
+            match &= match - 1;
+        }
+
+        /* the pointer slot of prev becomes an item slot */
+        __atomic_store_n(&prev[N_SLOT_PER_BUCKET - 1], left_over,
+            __ATOMIC_RELAXED);
+        DECR_BUCKET_CHAIN_LEN(head_bkt);
+
+        _bucket_free(last);
+        compacted = true;
+    }
+
+    return compacted;
+}
+
+/*
+ * the alternate head bucket of an item in two-choice mode, it only depends
+ * on the tag and flips the same bits of the bucket index both ways, so an
+ * item can be moved between its two buckets without reading its key
+ */
+static inline uint64_t *
+_alt_bucket(const struct hash_table *ht, const uint64_t *bkt, uint64_t tag)
+{
+    uint64_t idx = (uint64_t) (bkt - ht->table) >> N_SLOT_PER_BUCKET_LOG2;
+
+    idx ^= ALT_BUCKET_OFFSET(tag) & (ht->hash_mask >> N_SLOT_PER_BUCKET_LOG2);
+
+    return &ht->table[idx << N_SLOT_PER_BUCKET_LOG2];
+}
+
+/* store the head buckets of hv in ht in bkts, return the number of them */
+static inline int
+_cand_buckets(const struct hash_table *ht, uint64_t hv, uint64_t tag,
+              uint64_t **bkts)
+{
+    bkts[0] = GET_BUCKET(ht, hv);
+    if (!two_choice) {
+        return 1;
+    }
+
+    bkts[1] = _alt_bucket(ht, bkts[0], tag);
+
+    return bkts[1] == bkts[0] ? 1 : 2;
+}
+
+/* lock the head buckets in address order, so that writers locking two
+ * buckets do not deadlock */
+static inline void
+_lock_cands(uint64_t **bkts, int n)
+{
+    uint64_t *tmp;
+
+    if (n == 2 && bkts[1] < bkts[0]) {
+        tmp     = bkts[0];
+        bkts[0] = bkts[1];
+        bkts[1] = tmp;
+    }
+
+    for (int c = 0; c < n; c++) {
+        lock(bkts[c]);
+    }
+}
+
+static inline void
+_unlock_cands(uint64_t **bkts, int n, bool changed)
+{
+    for (int c = 0; c < n; c++) {
+        if (changed) {
+            unlock_and_update_cas(bkts[c]);
+        } else {
+            unlock(bkts[c]);
+        }
+    }
+}
+
+/* the empty item slots of a head bucket */
+static inline uint32_t
+_head_empty(const uint64_t *head_bkt)
+{
+    return _bucket_match(head_bkt, 0, true, GET_BUCKET_CHAIN_LEN(head_bkt) > 1);
+}
+
+/*
+ * make room in one of the locked head buckets bkts by moving one of its
+ * items to the alternate bucket of the item, which can in turn move one of
+ * its items, up to HASH_DISPLACE_DEPTH moves, the buckets on the path are
+ * only try-locked so that we do not deadlock with other writers, the moves
+ * are done from the end of the path, so an item is never missing from both
+ * of its buckets, return the freed slot or NULL
+ */
+static uint64_t *
+_displace(const struct hash_table *ht, uint64_t **bkts, int n)
+{
+    uint64_t *path[HASH_DISPLACE_DEPTH + 1];
+    int      slot[HASH_DISPLACE_DEPTH];
+    uint64_t *bkt, *dst = NULL;
+    uint64_t item_info;
+    uint32_t empty;
+    int      depth, n_item_slot;
+
+    for (int walk = 0; walk < HASH_DISPLACE_WALK && dst == NULL; walk++) {
+        path[0] = bkts[walk % n];
+        for (depth = 0; depth < HASH_DISPLACE_DEPTH; depth++) {
+            bkt         = path[depth];
+            n_item_slot = GET_BUCKET_CHAIN_LEN(bkt) > 1 ?
+                          N_SLOT_PER_BUCKET - 2 :
+                          N_SLOT_PER_BUCKET - 1;
+            slot[depth] = 1 + (int) ((prand() >> 32u) % n_item_slot);
+            item_info   = bkt[slot[depth]];
+            if (item_info == 0) {
+                break;
+            }
+
+            path[depth + 1] = _alt_bucket(ht, bkt, GET_TAG(item_info));
+            if (path[depth + 1] == bkt ||
+                __atomic_test_and_set((uint8_t *)path[depth + 1] + 7,
+                    __ATOMIC_ACQUIRE)) {
+                /* no alternate, or locked by us or another writer */
+                break;
+            }
+            if (*path[depth + 1] & BUCKET_MIGRATED) {
+                /* a resize has started since we locked bkts */
+                unlock(path[depth + 1]);
+                break;
+            }
+
+            empty = _head_empty(path[depth + 1]);
+            if (empty == 0) {
+                continue;
+            }
+
+            /* found an empty slot, move the items along the path */
+            dst = &path[depth + 1][__builtin_ctz(empty)];
+            for (int k = depth; k >= 0; k--) {
+                __atomic_store_n(dst, path[k][slot[k]], __ATOMIC_RELAXED);
+                dst = &path[k][slot[k]];
+            }
+            __atomic_store_n(dst, 0, __ATOMIC_RELAXED);
+            INCR_N(seg_metrics, hash_displace, depth + 1);
+
+            depth += 1;
+            break;
+        }
+
+        /* path[1..depth] are locked by us */
+        for (int k = 1; k <= depth; k++) {
+            if (dst != NULL) {
+                unlock_and_update_cas(path[k]);
+            } else {
+                unlock(path[k]);
+            }
+        }
+    }
+
+    return dst;
+}
+
+/*
+ * store item_info in the locked head buckets bkts of ht (and their bucket
+ * chains), the head bucket with the most empty slots is preferred,
+ * a bucket is allocated when all slots are taken and no item can be moved
+ */
+static void
+_insert_info(const struct hash_table *ht, uint64_t **bkts, int n,
+             uint64_t item_info)
+{
+    uint64_t *bkt, *slot = NULL, *new_bkt;
+    uint32_t match;
+    int      bkt_chain_len, n_empty = 0;
+
+    for (int c = 0; c < n; c++) {
+        match = _head_empty(bkts[c]);
+        if (__builtin_popcount(match) > n_empty) {
+            n_empty = __builtin_popcount(match);
+            slot    = &bkts[c][__builtin_ctz(match)];
+        }
+    }
+
+    /* then the overflown buckets */
+    for (int c = 0; c < n && slot == NULL; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        while (bkt_chain_len > 0 && slot == NULL) {
+            bkt_chain_len -= 1;
+            bkt   = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+            match = _bucket_match(bkt, 0, false, bkt_chain_len > 0);
+            if (match != 0) {
+                slot = &bkt[__builtin_ctz(match)];
+            }
+        }
+    }
+
+    /* reuse the slot of a stale entry before moving or growing the chain */
+    for (int c = 0; c < n && slot == NULL; c++) {
+        _drop_stale(bkts[c], &slot);
+    }
+
+    if (slot == NULL && n > 1) {
+        slot = _displace(ht, bkts, n);
+    }
+
+    if (slot != NULL) {
+        __atomic_store_n(slot, item_info, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* we have searched every bucket, but have not found an empty slot,
+     * so we need to allocate a new array, this is very rare */
+    INCR(seg_metrics, hash_bucket_alloc);
+    __atomic_add_fetch(&n_bkt_alloc, 1, __ATOMIC_RELAXED);
+
+    bkt           = bkts[0];
+    bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+    while (bkt_chain_len-- > 0) {
+        bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+    }
+
+    new_bkt = _bucket_alloc();
+    /* move the last item from last bucket to new bucket */
+    new_bkt[0] = bkt[N_SLOT_PER_BUCKET - 1];
+    new_bkt[1] = item_info;
+
+    __atomic_store_n(&bkt[N_SLOT_PER_BUCKET - 1], (uint64_t) new_bkt,
+        __ATOMIC_RELAXED);
+
+    INCR_BUCKET_CHAIN_LEN(bkts[0]);
+    log_verb("increase bucket chain to len %d", GET_BUCKET_CHAIN_LEN(bkts[0]));
+    /* this is for debugging, chain length in production should not so large */
+    ASSERT(GET_BUCKET_CHAIN_LEN(bkts[0]) <= 16);
+}
+
+/*
+ * insert item_info of a migrated item into the current table, return false
+ * if a newer version of the item has been migrated, all versions of a key
+ * are in the same old bucket and are scanned from the newest, and writers
+ * do not write the key to the current table before the old bucket is
+ * migrated, so a match can only be a newer version migrated before,
+ * in two-choice mode, a key has only one version in the table
+ */
+static bool
+_migrate_item(struct hash_table *ht, uint64_t item_info)
+{
+    struct item *it = _info_to_item(item_info);
+    uint64_t    hv  = CAL_HV(item_key(it), it->klen);
+    uint64_t    tag = CAL_TAG_FROM_HV(hv);
+    uint64_t    *bkts[2];
+    uint64_t    *bkt;
+    uint32_t    match;
+    int         n, bkt_chain_len, i;
+
+    ASSERT(GET_TAG(item_info) == tag);
+
+    n = _cand_buckets(ht, hv, tag, bkts);
+    _lock_cands(bkts, n);
+
+    for (int c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
+
+                if (_info_stale(bkt[i])) {
+                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                    INCR(seg_metrics, hash_stale_drop);
+                    continue;
+                }
+
+                if (_same_item(item_key(it), it->klen, bkt[i])) {
+                    _unlock_cands(bkts, n, true);
+                    return false;
+                }
+            }
+
+            if (bkt_chain_len == 0) {
+                break;
+            }
+            bkt_chain_len -= 1;
+            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+        } while (true);
+    }
+
+    _insert_info(ht, bkts, n, item_info);
+
+    _unlock_cands(bkts, n, true);
+    return true;
+}
+
+/*
+ * move the items in the bucket chain of head_bkt in ht->prev to ht,
+ * the bucket is left empty and marked as migrated, outdated items are
+ * removed, the overflown buckets go back to the pool
+ */
+static void
+_migrate_bucket(struct hash_table *ht, uint64_t *head_bkt)
+{
+    uint64_t *bkt = head_bkt;
+    uint64_t item_info;
+    int      bkt_chain_len, n_item_slot;
+
+    if (__atomic_load_n(head_bkt, __ATOMIC_ACQUIRE) & BUCKET_MIGRATED) {
+        return;
+    }
+
+    lock(head_bkt);
+
+    if (*head_bkt & BUCKET_MIGRATED) {
+        unlock(head_bkt);
+        return;
+    }
+
+    bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt) - 1;
+    do {
+        n_item_slot = bkt_chain_len > 0 ?
+                      N_SLOT_PER_BUCKET - 1 :
+                      N_SLOT_PER_BUCKET;
+        for (int i = bkt == head_bkt ? 1 : 0; i < n_item_slot; i++) {
+            item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+            if (item_info == 0) {
+                continue;
+            }
+
+            if (_info_stale(item_info)) {
+                INCR(seg_metrics, hash_stale_drop);
+            } else if (_info_flash(item_info)) {
+                /* the key is needed to find the new bucket */
+                INCR(seg_metrics, flash_drop);
+            } else if (!_migrate_item(ht, item_info)) {
+                _item_free(item_info, false);
+            }
+            __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+        }
+        bkt_chain_len -= 1;
+        bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+    } while (bkt_chain_len >= 0);
+
+    _compact_chain(head_bkt);
+
+    INCR(seg_metrics, hash_bucket_migrate);
+
+    __atomic_fetch_or(head_bkt, BUCKET_MIGRATED, __ATOMIC_RELAXED);
+    unlock_and_update_cas(head_bkt);
+}
+
+/*
+ * lock the head buckets of hv for writing and store them in bkts, return
+ * the number of them, writers only change the current table, so the
+ * buckets in the old table are migrated first if a resize is in progress
+ */
+static inline int
+_lock_buckets(uint64_t hv, uint64_t tag, uint64_t **bkts,
+              struct hash_table **ht_ret)
+{
+    struct hash_table *ht, *prev;
+    uint64_t          *old_bkts[2];
+    int               n, c;
+
+    while (true) {
+        ht   = __atomic_load_n(&hash_table, __ATOMIC_ACQUIRE);
+        prev = __atomic_load_n(&ht->prev, __ATOMIC_ACQUIRE);
+        if (prev != NULL) {
+            n = _cand_buckets(prev, hv, tag, old_bkts);
+            for (c = 0; c < n; c++) {
+                _migrate_bucket(ht, old_bkts[c]);
+            }
+        }
+
+        n = _cand_buckets(ht, hv, tag, bkts);
+        _lock_cands(bkts, n);
+        for (c = 0; c < n && (*bkts[c] & BUCKET_MIGRATED) == 0; c++) {
+        }
+        if (c == n) {
+            if (ht_ret != NULL) {
+                *ht_ret = ht;
+            }
+            return n;
+        }
+
+        /* a resize has started since we loaded the table */
+        _unlock_cands(bkts, n, false);
+    }
+}
+
+/*
+ * store the head buckets of hv for reading in bkts, return the number of
+ * them, a bucket is in the old table if it has not been migrated yet,
+ * the bucket could be migrated after this returns, readers check
+ * BUCKET_MIGRATED and the cas to detect it, in two-choice mode, an item
+ * can be in any of the buckets of both tables during a resize, so all of
+ * them are returned and checked with the cas
+ */
+static inline int
+_find_buckets(uint64_t hv, uint64_t tag, uint64_t **bkts)
+{
+    struct hash_table *ht   = __atomic_load_n(&hash_table, __ATOMIC_ACQUIRE);
+    struct hash_table *prev = __atomic_load_n(&ht->prev, __ATOMIC_ACQUIRE);
+    int               n;
+
+    if (two_choice) {
+        n = _cand_buckets(ht, hv, tag, bkts);
+        if (prev != NULL) {
+            n += _cand_buckets(prev, hv, tag, bkts + n);
+        }
+        return n;
+    }
+
+    if (prev != NULL) {
+        bkts[0] = GET_BUCKET(prev, hv);
+        if ((__atomic_load_n(bkts[0], __ATOMIC_ACQUIRE) &
+                BUCKET_MIGRATED) == 0) {
+            return 1;
+        }
+    }
+
+    bkts[0] = GET_BUCKET(ht, hv);
+    return 1;
+}
+
+/*
+ * in two-choice mode, the key is looked up in both buckets before the item
+ * is inserted, so that a key has at most one version in the table
+ */
+static void
+_put_two_choice(const char *key, uint32_t klen, uint64_t hv, uint64_t tag,
+                uint64_t seg_id, uint64_t offset)
+{
+    struct hash_table *ht;
+    uint64_t          *bkts[2], *bkt;
+    uint64_t          item_info, insert_item_info;
+    uint32_t          match;
+    int               n, bkt_chain_len, i;
+
+    n = _lock_buckets(hv, tag, bkts, &ht);
+    insert_item_info = _build_item_info(tag, seg_id, offset);
+
+    for (int c = 0; c < n; c++) {
+        _drop_flash(bkts[c], tag);
+    }
+
+    for (int c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
+
+                item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+                if (_info_stale(item_info)) {
+                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                    INCR(seg_metrics, hash_stale_drop);
+                    continue;
+                }
+                if (!_same_item(key, klen, item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
+
+                /* found the item, replace it in place */
+                __atomic_store_n(&bkt[i], insert_item_info, __ATOMIC_RELAXED);
+                _item_free(item_info, false);
+                _unlock_cands(bkts, n, true);
+                return;
+            }
+            bkt_chain_len -= 1;
+            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+        } while (bkt_chain_len >= 0);
+    }
+
+    _insert_info(ht, bkts, n, insert_item_info);
+    _unlock_cands(bkts, n, true);
+}
+
+/**
+ * insert an item into hash table
+ * insert has two steps, insert and possibly delete
+ * insert and delete must be completed in the same pass (atomic or locked),
+ * otherwise it cannot guarantee correctness
+ *
+ * procedure:
+ * scan through all slots of the head bucket,
+ * 1. if we found the item, replace with new item
+ * 2. if we found an empty slot first, we store new item in empty slots and
+ *      2-1. remove the old item if the old item is in the head bucket,
+ *      2-2. if we do not find it in the head bucket, we continue to search
+ *          the rest of the chain, and remove the old item there
+ * 3. if old item is not found in the first bucket nor empty bucket,
+ *      we continue to search
+ *
+ * the old item is always marked deleted, so a key has at most one live item
+ * in the segs, recovery relies on this as it cannot tell which of two
+ * versions was written last
+ */
+
+void
+hashtable_put(struct item *it, const uint64_t seg_id, const uint64_t offset)
+{
+    const char     *key = item_key(it);
+    const uint32_t klen = item_nkey(it);
+
+    uint64_t hv  = CAL_HV(key, klen);
+    uint64_t tag = CAL_TAG_FROM_HV(hv);
+    uint64_t *bkts[2], *head_bkt, *bkt, *slot;
+
+    INCR(seg_metrics, hash_insert);
+
+    if (two_choice) {
+        _put_two_choice(key, klen, hv, tag, seg_id, offset);
+        return;
+    }
+
+    _lock_buckets(hv, tag, bkts, NULL);
+    head_bkt = bkt = bkts[0];
+
+    /* the new version hides an older one in DRAM, but not one on flash */
+    _drop_flash(head_bkt, tag);
+
+    /* 12-bit tag, 8-bit counter,
+     * 24-bit seg id, 20-bit offset (in the unit of 8-byte) */
+    uint64_t item_info, insert_item_info;
+    insert_item_info = _build_item_info(tag, seg_id, offset);
+
+    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt);
+    uint32_t match;
+    int i;
+    do {
+        /* the last slot will be a pointer to the next
+         * bucket if there is next bucket */
+        match = _bucket_match(bkt, tag, bkt == head_bkt, bkt_chain_len > 1);
+        while (match != 0) {
+            i = __builtin_ctz(match);
+            match &= match - 1;
+
+            item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+            if (GET_TAG(item_info) != tag) {
+                continue;
+            }
+            if (_info_stale(item_info)) {
+                /* the slot becomes empty and can be used below */
+                __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                INCR(seg_metrics, hash_stale_drop);
+                continue;
+            }
+            /* a potential hit */
+            if (!_same_item(key, klen, item_info)) {
+                INCR(seg_metrics, hash_tag_collision);
+                continue;
+            }
+
+            /* found the item, now atomic update (or delete if already inserted)
+             * read and write 8-byte on x86 is always atomic */
+            __atomic_store_n(&bkt[i], insert_item_info, __ATOMIC_RELAXED);
+            insert_item_info = 0;
+
+            /* now mark the old item as deleted, update stat */
+            _item_free(item_info, false);
+
+            goto finish;
+        }
+
+        /* the old item is not in this bucket, store item info in the first
+         * empty slot (an empty slot has tag 0), the old item may still be
+         * later in the chain */
+        if (insert_item_info != 0) {
+            match = _bucket_match(bkt, 0, bkt == head_bkt, bkt_chain_len > 1);
+            if (match != 0) {
+                i = __builtin_ctz(match);
+                __atomic_store_n(&bkt[i], insert_item_info, __ATOMIC_RELAXED);
+                insert_item_info = 0;
+            }
+        }
+
+        /* if there are overflown buckets, we continue to check */
+        bkt_chain_len -= 1;
+        if (bkt_chain_len > 0) {
+            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+        }
+    } while (bkt_chain_len > 0);
+
+    if (insert_item_info == 0) {
+        /* item has been inserted, and there is no old item */
+        goto finish;
+    }
+
+    /* reuse the slot of a stale entry before growing the chain */
+    if (_drop_stale(head_bkt, &slot) > 0) {
+        __atomic_store_n(slot, insert_item_info, __ATOMIC_RELAXED);
+        insert_item_info = 0;
+        goto finish;
+    }
 
     /* we have searched every bucket, but have not found the old item
      * nor inserted new item - so we need to allocate a new array,
      * this is very rare */
     INCR(seg_metrics, hash_bucket_alloc);
+    __atomic_add_fetch(&n_bkt_alloc, 1, __ATOMIC_RELAXED);
 
-    uint64_t *new_bkt = cc_zalloc(sizeof(uint64_t) * N_SLOT_PER_BUCKET);
+    uint64_t *new_bkt = _bucket_alloc();
     /* move the last item from last bucket to new bucket */
     new_bkt[0] = bkt[N_SLOT_PER_BUCKET - 1];
     new_bkt[1] = insert_item_info;
@@ -436,51 +1581,71 @@ hashtable_delete(const struct bstring *key)
 {
     INCR(seg_metrics, hash_remove);
 
-    bool     deleted = false;
+    bool     deleted = false, dropped = false;
     uint64_t item_info;
 
-    uint64_t hv        = CAL_HV(key->data, key->len);
-    uint64_t tag       = CAL_TAG_FROM_HV(hv);
-    uint64_t *head_bkt = GET_BUCKET(hv);
-    uint64_t *bkt      = head_bkt;
-
-    lock(head_bkt);
+    uint64_t hv  = CAL_HV(key->data, key->len);
+    uint64_t tag = CAL_TAG_FROM_HV(hv);
+    uint64_t *bkts[2], *bkt;
+    int      n   = _lock_buckets(hv, tag, bkts, NULL);
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt) - 1;
-    int n_item_slot;
-    do {
-        n_item_slot =
-            bkt_chain_len > 0 ?
-            N_SLOT_PER_BUCKET - 1 :
-            N_SLOT_PER_BUCKET;
+    int bkt_chain_len;
+    uint32_t match;
+    int i;
+    for (int c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
 
-        for (int i = 0; i < n_item_slot; i++) {
-            if (bkt == head_bkt && i == 0) {
-                continue;
-            }
+                item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+                if (GET_TAG(item_info) != tag) {
+                    continue;
+                }
+                if (_info_stale(item_info)) {
+                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                    INCR(seg_metrics, hash_stale_drop);
+                    dropped = true;
+                    continue;
+                }
+                if (_info_flash(item_info)) {
+                    /* most likely this key, the key is not read from flash
+                     * with the bucket locked */
+                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                    INCR(seg_metrics, flash_drop);
+                    deleted = true;
+                    continue;
+                }
+                /* a potential hit */
+                if (!_same_item(key->data, key->len, item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
+                /* found the item, now delete */
+                /* if this is the first and most up-to-date hash table entry
+                 * we need to mark tombstone, this is for recovery */
+                _item_free(item_info, !deleted);
+                __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
 
-            item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
-            if (GET_TAG(item_info) != tag) {
-                continue;
-            }
-            /* a potential hit */
-            if (!_same_item(key->data, key->len, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
+                deleted = true;
             }
-            /* found the item, now delete */
-            /* if this is the first and most up-to-date hash table entry
-             * we need to mark tombstone, this is for recovery */
-            _item_free(item_info, !deleted);
-            __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+            bkt_chain_len -= 1;
+            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+        } while (bkt_chain_len >= 0);
+    }
 
-            deleted = true;
+    if (deleted || dropped) {
+        for (int c = 0; c < n; c++) {
+            _compact_chain(bkts[c]);
         }
-        bkt_chain_len -= 1;
-        bkt        = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
-    } while (bkt_chain_len >= 0);
+    }
+
+    /* let lock-free readers know the bucket has changed */
+    _unlock_cands(bkts, n, deleted || dropped);
 
-    unlock(head_bkt);
     return deleted;
 }
 
@@ -498,20 +1663,23 @@ hashtable_delete(const struct bstring *key)
  * to mark tombstone, while tombstone is used to find out which an object is
  * an up-to-date object
  *
+ * if loc is not NULL, the entry of the up-to-date item is replaced by the
+ * entry of its copy on flash at loc instead of being removed
  */
-bool
-hashtable_evict(const char *oit_key, const uint32_t oit_klen,
-                const uint64_t seg_id, const uint64_t offset)
+static bool
+_evict(const char *oit_key, const uint32_t oit_klen, const uint64_t seg_id,
+       const uint64_t offset, const struct flash_loc *loc)
 {
     INCR(seg_metrics, hash_evict);
 
-    uint64_t hv        = CAL_HV(oit_key, oit_klen);
-    uint64_t tag       = CAL_TAG_FROM_HV(hv);
-    uint64_t *head_bkt = GET_BUCKET(hv);
-    uint64_t *bkt      = head_bkt;
+    uint64_t hv  = CAL_HV(oit_key, oit_klen);
+    uint64_t tag = CAL_TAG_FROM_HV(hv);
+    uint64_t *bkts[2], *bkt;
+    int      n;
 
     uint64_t item_info;
-    uint64_t oit_info  = _build_item_info(tag, seg_id, offset);
+    uint64_t oit_info;
+    uint64_t new_info = loc == NULL ? 0 : _build_flash_info(tag, loc);
 
     bool first_match = true, item_outdated = true, found_oit = false;
 
@@ -519,293 +1687,772 @@ hashtable_evict(const char *oit_key, const uint32_t oit_klen,
      * opportunistic concurrency control and atomics, see hashtable_relink_it
      * basically we need to make sure the slot we store into has not been
      * updated since we check */
-    lock(head_bkt);
+    n        = _lock_buckets(hv, tag, bkts, NULL);
+    oit_info = _build_item_info(tag, seg_id, offset);
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(head_bkt) - 1;
-    int n_item_slot;
-    do {
-        n_item_slot =
-            bkt_chain_len > 0 ?
-            N_SLOT_PER_BUCKET - 1 :
-            N_SLOT_PER_BUCKET;
+    int bkt_chain_len;
+    uint32_t match;
+    int i;
+    for (int c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
 
-        for (int i = 0; i < n_item_slot; i++) {
-            if (bkt == head_bkt && i == 0) {
-                continue;
+                item_info = CLEAR_FREQ(__atomic_load_n(&bkt[i], __ATOMIC_RELAXED));
+                if (GET_TAG(item_info) != tag) {
+                    continue;
+                }
+                if (_info_stale(item_info)) {
+                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                    INCR(seg_metrics, hash_stale_drop);
+                    continue;
+                }
+                /* a potential hit */
+                if (!_same_item(oit_key, oit_klen, item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
+
+                if (first_match) {
+                    first_match = false;
+                    if (oit_info == item_info) {
+                        /* item to evict is up-to-date */
+                        _item_free(item_info, false);
+                        __atomic_store_n(&bkt[i], new_info, __ATOMIC_RELAXED);
+                        item_outdated = false;
+                        found_oit     = true;
+                    }
+                } else {
+                    /* not first match, delete hash table entry,
+                     * mark tombstone only when oit is the most up-to-date entry */
+                    if (item_info == oit_info) {
+                        ASSERT(found_oit == false);
+                        found_oit = true;
+                    }
+
+                    _item_free(item_info, !item_outdated);
+                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+                }
             }
+            bkt_chain_len -= 1;
+            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+        } while (bkt_chain_len >= 0);
+    }
 
-            item_info = CLEAR_FREQ(bkt[i]);
-            if (GET_TAG(item_info) != tag) {
-                continue;
+    /* the slots freed may allow the overflown buckets to be released */
+    for (int c = 0; c < n; c++) {
+        _compact_chain(bkts[c]);
+    }
+
+    _unlock_cands(bkts, n, true);
+
+    return found_oit;
+}
+
+bool
+hashtable_evict(const char *oit_key, const uint32_t oit_klen,
+                const uint64_t seg_id, const uint64_t offset)
+{
+    return _evict(oit_key, oit_klen, seg_id, offset, NULL);
+}
+
+bool
+hashtable_demote(const char *oit_key, const uint32_t oit_klen,
+                 const uint64_t seg_id, const uint64_t offset,
+                 const struct flash_loc *loc)
+{
+    ASSERT(flash_tier);
+
+    return _evict(oit_key, oit_klen, seg_id, offset, loc);
+}
+
+bool
+hashtable_promote(struct item *it, const uint64_t seg_id,
+                  const uint64_t offset, const struct flash_loc *loc)
+{
+    const char     *key = item_key(it);
+    const uint32_t klen = item_nkey(it);
+
+    uint64_t hv  = CAL_HV(key, klen);
+    uint64_t tag = CAL_TAG_FROM_HV(hv);
+    uint64_t *bkts[2], *bkt;
+    uint64_t flash_info, item_info;
+    uint32_t match;
+    bool     promoted = false;
+    int      n, bkt_chain_len, i;
+
+    ASSERT(flash_tier);
+
+    n          = _lock_buckets(hv, tag, bkts, NULL);
+    flash_info = _build_flash_info(tag, loc);
+    item_info  = _build_item_info(tag, seg_id, offset);
+
+    for (int c = 0; c < n && !promoted; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
+
+                if (CLEAR_FREQ(__atomic_load_n(&bkt[i], __ATOMIC_RELAXED)) ==
+                        flash_info) {
+                    __atomic_store_n(&bkt[i], item_info, __ATOMIC_RELAXED);
+                    promoted = true;
+                    break;
+                }
             }
-            /* a potential hit */
-            if (!_same_item(oit_key, oit_klen, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
+            bkt_chain_len -= 1;
+            bkt = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
+        } while (bkt_chain_len >= 0 && !promoted);
+    }
+
+    _unlock_cands(bkts, n, promoted);
+
+    if (!promoted) {
+        /* the key has been written or deleted since it was read from flash */
+        _item_free(item_info, false);
+    }
+
+    return promoted;
+}
+
+
+/*
+ * readers do not take the bucket lock, writers hold the lock while changing
+ * a bucket chain and bump the cas in the bucket info when they are done,
+ * so a lock-free scan is valid if the bucket info has the same lock and cas
+ * before and after the scan (seqlock), otherwise the reader retries
+ */
+static inline uint64_t
+_bucket_info_read_begin(const uint64_t *first_bkt)
+{
+    uint64_t bkt_info;
+
+    while (((bkt_info = __atomic_load_n(first_bkt, __ATOMIC_ACQUIRE)) &
+            LOCK_MASK) != 0) {
+        _cpu_relax();
+    }
+
+    return bkt_info;
+}
+
+static inline bool
+_bucket_info_read_retry(const uint64_t *first_bkt, uint64_t bkt_info)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return ((__atomic_load_n(first_bkt, __ATOMIC_RELAXED) ^ bkt_info) &
+            (LOCK_MASK | CAS_MASK)) != 0;
+}
+
+/* an item can move between the buckets of a key, so a scan of them is only
+ * valid if none of them has changed */
+static inline bool
+_buckets_read_retry(uint64_t **bkts, const uint64_t *bkt_infos, int n)
+{
+    for (int c = 0; c < n; c++) {
+        if (_bucket_info_read_retry(bkts[c], bkt_infos[c])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#ifdef STORE_FREQ_IN_HASHTABLE
+/*
+ * clear the indicator of all items in the bucket that the frequency has
+ * increased in curr sec, this is done once per sec by the reader that
+ * updates the ts in the bucket info, the ts is only updated when the bucket
+ * is not locked, so it does not race with writers
+ */
+static inline void
+_clear_freq_indicator(uint64_t *first_bkt)
+{
+    uint64_t curr_ts  = ((uint64_t) time_proc_sec()) & PROC_TS_MASK;
+    uint64_t bkt_info = __atomic_load_n(first_bkt, __ATOMIC_ACQUIRE);
+    uint64_t *bkt     = first_bkt;
+    int      bkt_chain_len, n_item_slot;
+
+    if (curr_ts == GET_TS(&bkt_info) || (bkt_info & LOCK_MASK) != 0) {
+        return;
+    }
+
+    if (!__atomic_compare_exchange_n(first_bkt, &bkt_info,
+            (bkt_info & (~TS_MASK)) | (curr_ts << TS_BIT_SHIFT), false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        /* another reader is clearing or a writer is holding the lock */
+        return;
+    }
+
+    bkt_chain_len = GET_BUCKET_CHAIN_LEN(&bkt_info) - 1;
+    do {
+        n_item_slot = bkt_chain_len > 0 ?
+                      N_SLOT_PER_BUCKET - 1 :
+                      N_SLOT_PER_BUCKET;
+        for (int i = bkt == first_bkt ? 1 : 0; i < n_item_slot; i++) {
+            /* clear the indicator bit */
+            __atomic_fetch_and(&bkt[i], CLEAR_FREQ_SMOOTH_MASK, __ATOMIC_RELAXED);
+        }
+        bkt_chain_len -= 1;
+        bkt = _next_bucket(bkt);
+    } while (bkt_chain_len >= 0 && bkt != NULL);
+}
+
+static inline void
+_freq_incr(uint64_t *slot, uint64_t item_info)
+{
+    uint64_t freq = GET_FREQ(item_info);
+
+    if (freq >= 127) {
+        /* counter caps at 127 */
+        return;
+    }
+
+    if (freq <= 16 || prand() % freq == 0) {
+        /* increase frequency by 1
+         * if freq <= 16 or with prob 1/freq */
+        freq = ((freq + 1) | 0x80ul) << FREQ_BIT_SHIFT;
+    }
+    else {
+        /* we do not increase frequency, but mark that
+         * we have already tried at current sec */
+        freq = (freq | 0x80ul) << FREQ_BIT_SHIFT;
+    }
+    uint64_t new_val = (item_info & (~FREQ_MASK)) | freq;
+
+    /* best effort, the update is lost if another thread changes the slot,
+     * functions that compare item_info clear the frequency first */
+    __atomic_compare_exchange_n(slot, &item_info, new_val, false,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#endif
+
+static struct item *
+_hashtable_get(const char *key, const uint32_t klen, const uint64_t hv,
+              int32_t *seg_id,
+              uint64_t *cas)
+{
+    INCR(seg_metrics, hash_lookup);
+
+    uint64_t    tag        = CAL_TAG_FROM_HV(hv);
+    uint64_t    *bkts[HASH_N_CAND_MAX];
+    uint64_t    bkt_infos[HASH_N_CAND_MAX];
+    uint64_t    *bkt;
+    uint64_t    item_info;
+    uint32_t    match;
+    int         n, c, bkt_chain_len, i;
+
+retry:
+    n = _find_buckets(hv, tag, bkts);
+
+    for (c = 0; c < n; c++) {
+#ifdef STORE_FREQ_IN_HASHTABLE
+        _clear_freq_indicator(bkts[c]);
+#endif
+
+        bkt_infos[c] = _bucket_info_read_begin(bkts[c]);
+        if (!two_choice && (bkt_infos[c] & BUCKET_MIGRATED)) {
+            /* migrated after we found it */
+            goto retry;
+        }
+    }
+
+    /* try to find the item in the hash table */
+    for (c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(&bkt_infos[c]) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
+
+                item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+                if (GET_TAG(item_info) != tag) {
+                    continue;
+                }
+                if (_info_stale(item_info)) {
+                    /* readers do not write the bucket, the entry is dropped
+                     * by the next writer that locks it or by the sweep */
+                    continue;
+                }
+                /* a potential hit */
+                if (!_same_item(key, klen, item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
+
+                /* no reference is taken on the seg, it is not reused until
+                 * this thread passes a quiescent state, see qsbr.h */
+                if (_buckets_read_retry(bkts, bkt_infos, n)) {
+                    /* updated/deleted by other thread during the scan */
+                    INCR(seg_metrics, hash_lookup_retry);
+                    goto retry;
+                }
+
+                if (!seg_is_accessible(GET_SEG_ID(item_info))) {
+                    /* not accessible: it will be removed by other threads */
+                    return NULL;
+                }
+
+                if (cas) {
+                    *cas = GET_CAS(&bkt_infos[c]);
+                }
+
+#if defined DEBUG_MODE
+                *seg_id = GET_SEG_ID_NON_DECR(item_info);
+                ASSERT(heap.segs[GET_SEG_ID(item_info)].seg_id_non_decr == *seg_id);
+#else
+                *seg_id = GET_SEG_ID(item_info);
+#endif
+
+#ifdef STORE_FREQ_IN_HASHTABLE
+                _freq_incr(&bkt[i], item_info);
+#endif
+
+                return (struct item *) (heap.base + heap.seg_size *
+                            GET_SEG_ID(item_info) + GET_OFFSET(item_info));
+            }
+            bkt_chain_len -= 1;
+            bkt = _next_bucket(bkt);
+        } while (bkt_chain_len >= 0 && bkt != NULL);
+    }
+
+    if (_buckets_read_retry(bkts, bkt_infos, n)) {
+        INCR(seg_metrics, hash_lookup_retry);
+        goto retry;
+    }
+
+    return NULL;
+}
+
+struct item *
+hashtable_get(const char *key, const uint32_t klen,
+              int32_t *seg_id,
+              uint64_t *cas)
+{
+    return _hashtable_get(key, klen, CAL_HV(key, klen), seg_id, cas);
+}
+
+uint32_t
+hashtable_get_flash(const char *key, const uint32_t klen,
+                    struct flash_loc *locs, const uint32_t n_max)
+{
+    uint64_t hv  = CAL_HV(key, klen);
+    uint64_t tag = CAL_TAG_FROM_HV(hv);
+    uint64_t *bkts[HASH_N_CAND_MAX];
+    uint64_t bkt_infos[HASH_N_CAND_MAX];
+    uint64_t *bkt;
+    uint64_t item_info;
+    uint32_t match, gen, n_loc;
+    int      n, c, bkt_chain_len, i;
+
+    if (!flash_tier) {
+        return 0;
+    }
+
+retry:
+    n_loc = 0;
+    n     = _find_buckets(hv, tag, bkts);
+
+    for (c = 0; c < n; c++) {
+        bkt_infos[c] = _bucket_info_read_begin(bkts[c]);
+        if (!two_choice && (bkt_infos[c] & BUCKET_MIGRATED)) {
+            goto retry;
+        }
+    }
+
+    for (c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(&bkt_infos[c]) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0 && n_loc < n_max) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
+
+                item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+                if (GET_TAG(item_info) != tag || !_info_flash(item_info)) {
+                    continue;
+                }
+
+                /* the full generation is checked again after the read */
+                gen = flash_gen(GET_FLASH_ID(item_info));
+                if (GET_FLASH_GEN(item_info) != (gen & flash_gen_mask)) {
+                    continue;
+                }
+
+                locs[n_loc].seg_id = GET_FLASH_ID(item_info);
+                locs[n_loc].offset = GET_OFFSET(item_info);
+                locs[n_loc].gen    = gen;
+                n_loc += 1;
             }
+            bkt_chain_len -= 1;
+            bkt = _next_bucket(bkt);
+        } while (bkt_chain_len >= 0 && bkt != NULL);
+    }
+
+    if (_buckets_read_retry(bkts, bkt_infos, n)) {
+        INCR(seg_metrics, hash_lookup_retry);
+        goto retry;
+    }
+
+    return n_loc;
+}
+
+/* prefetch the items in the head bucket whose tag matches */
+static inline void
+_prefetch_candidates(const uint64_t *first_bkt, uint64_t tag)
+{
+    uint64_t item_info;
+    int      n_item_slot = GET_BUCKET_CHAIN_LEN(first_bkt) > 1 ?
+                           N_SLOT_PER_BUCKET - 1 :
+                           N_SLOT_PER_BUCKET;
+
+    for (int i = 1; i < n_item_slot; i++) {
+        item_info = __atomic_load_n(&first_bkt[i], __ATOMIC_RELAXED);
+        if (GET_TAG(item_info) == tag && !_info_flash(item_info)) {
+            __builtin_prefetch(heap.base + heap.seg_size *
+                GET_SEG_ID(item_info) + GET_OFFSET(item_info), 0, 3);
+        }
+    }
+
+    if (n_item_slot != N_SLOT_PER_BUCKET) {
+        __builtin_prefetch((void *)first_bkt[N_SLOT_PER_BUCKET - 1], 0, 3);
+    }
+}
 
-            if (first_match) {
-                first_match = false;
-                if (oit_info == item_info) {
-                    /* item to evict is up-to-date */
-                    _item_free(item_info, false);
-                    __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
-                    item_outdated = false;
-                    found_oit     = true;
-                }
-            } else {
-                /* not first match, delete hash table entry,
-                 * mark tombstone only when oit is the most up-to-date entry */
-                if (item_info == oit_info) {
-                    ASSERT(found_oit == false);
-                    found_oit = true;
-                }
+void
+hashtable_get_batch(const struct bstring *keys, uint32_t n,
+                    struct item **its, int32_t *seg_ids, uint64_t *cas)
+{
+    uint64_t hv[HASHTABLE_GET_BATCH];
+    uint64_t *bkts[HASH_N_CAND_MAX];
+    uint32_t i, j, n_batch;
+    int      c, n_bkts;
+
+    for (i = 0; i < n; i += n_batch) {
+        n_batch = n - i < HASHTABLE_GET_BATCH ? n - i : HASHTABLE_GET_BATCH;
+
+        /* hash all keys and start loading their head buckets */
+        for (j = 0; j < n_batch; j++) {
+            hv[j]  = CAL_HV(keys[i + j].data, keys[i + j].len);
+            n_bkts = _find_buckets(hv[j], CAL_TAG_FROM_HV(hv[j]), bkts);
+            for (c = 0; c < n_bkts; c++) {
+                __builtin_prefetch(bkts[c], 0, 3);
+            }
+        }
 
-                _item_free(bkt[i], !item_outdated);
-                __atomic_store_n(&bkt[i], 0, __ATOMIC_RELAXED);
+        /* the head buckets are (hopefully) in cache by now, start loading
+         * the items whose tag matches, the lookups below verify the key */
+        for (j = 0; j < n_batch; j++) {
+            n_bkts = _find_buckets(hv[j], CAL_TAG_FROM_HV(hv[j]), bkts);
+            for (c = 0; c < n_bkts; c++) {
+                _prefetch_candidates(bkts[c], CAL_TAG_FROM_HV(hv[j]));
             }
         }
-        bkt_chain_len -= 1;
-        bkt        = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
-    } while (bkt_chain_len >= 0);
 
-    unlock(head_bkt);
+        for (j = 0; j < n_batch; j++) {
+            its[i + j] = _hashtable_get(keys[i + j].data, keys[i + j].len,
+                hv[j], &seg_ids[i + j], cas == NULL ? NULL : &cas[i + j]);
+        }
+    }
+}
+
 
-    return found_oit;
+static void
+_hashtable_resize_start(uint32_t hash_power)
+{
+    struct hash_table *ht = _hashtable_create(hash_power);
+
+    /* hashtable_resize frees the retired table before a new resize starts */
+    ASSERT(retired_table == NULL);
+
+    log_info("resize hash table from 2^%" PRIu32 " to 2^%" PRIu32 " entries",
+        hash_table->hash_power, hash_power);
+
+    ht->prev    = hash_table;
+    migrate_pos = 0;
+    __atomic_store_n(&n_bkt_alloc, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hash_table, ht, __ATOMIC_RELEASE);
 }
 
+/* the number of items above which the table grows, two-choice buckets
+ * rarely overflow until 13/16 of the slots (93% of the item slots) are used */
+static inline uint64_t
+_load_max(uint64_t n_slot)
+{
+    return two_choice ? n_slot / 16 * 13 : n_slot / 4 * 3;
+}
 
-#ifdef STORE_FREQ_IN_HASHTABLE
-struct item *
-hashtable_get(const char *key, const uint32_t klen,
-              int32_t *seg_id,
-              uint64_t *cas)
+bool
+hashtable_resize(void)
 {
-    INCR(seg_metrics, hash_lookup);
+    struct hash_table *prev;
+    uint64_t          n_bkt, n_slot, n_item = 0;
+    uint32_t          hash_power;
 
-    uint64_t    hv         = CAL_HV(key, klen);
-    uint64_t    tag        = CAL_TAG_FROM_HV(hv);
-    uint64_t    *first_bkt = GET_BUCKET(hv);
-    uint64_t    *bkt       = first_bkt;
-    uint64_t    offset;
-    struct item *it;
+    if (!hash_resize) {
+        return false;
+    }
 
-    uint64_t item_info;
+    prev = hash_table->prev;
+    if (prev != NULL) {
+        /* migrate a slice of buckets, writers migrate the buckets they
+         * write to, so the migrated buckets are skipped quickly */
+        n_bkt = HASHSIZE(prev->hash_power - N_SLOT_PER_BUCKET_LOG2);
+        for (uint32_t i = 0; i < HASH_MIGRATE_NBUCKET && migrate_pos < n_bkt;
+             i++, migrate_pos++) {
+            _migrate_bucket(hash_table,
+                &prev->table[migrate_pos * N_SLOT_PER_BUCKET]);
+        }
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(first_bkt) - 1;
-    int n_item_slot;
-
-    uint64_t curr_ts = ((uint64_t) time_proc_sec()) & PROC_TS_MASK;
-    if (curr_ts != GET_TS(first_bkt)) {
-        /* clear the indicator of all items in the bucket that
-         * the frequency has increased in curr sec */
-        lock(first_bkt);
-
-        if (curr_ts != GET_TS(first_bkt)) {
-            /* update ts */
-            *first_bkt = ((*first_bkt) & (~TS_MASK)) | (curr_ts << TS_BIT_SHIFT);
-            do {
-                n_item_slot = bkt_chain_len > 0 ?
-                              N_SLOT_PER_BUCKET - 1 :
-                              N_SLOT_PER_BUCKET;
-                for (int i = 0; i < n_item_slot; i++) {
-                    if (bkt == first_bkt && i == 0) {
-                        continue;
-                    }
-                    /* clear the indicator bit */
-                    __atomic_fetch_and(&bkt[i], CLEAR_FREQ_SMOOTH_MASK, __ATOMIC_RELAXED);
-                }
-                bkt_chain_len -= 1;
-                bkt        = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
-            } while (bkt_chain_len >= 0);
+        if (migrate_pos < n_bkt) {
+            return true;
         }
 
-        unlock(first_bkt);
+        __atomic_store_n(&hash_table->prev, NULL, __ATOMIC_RELEASE);
+        retired_table = prev;
+        retired_epoch = qsbr_retire();
+        log_info("hash table resized to 2^%" PRIu32 " entries",
+            hash_table->hash_power);
 
-        /* reset bucket and bucket chain length */
-        bkt           = first_bkt;
-        bkt_chain_len = GET_BUCKET_CHAIN_LEN(first_bkt) - 1;
+        return false;
     }
 
-    lock(first_bkt);
-    /* try to find the item in the hash table */
-    do {
-        n_item_slot = bkt_chain_len > 0 ?
-                      N_SLOT_PER_BUCKET - 1 :
-                      N_SLOT_PER_BUCKET;
+    if (retired_table != NULL) {
+        if (!qsbr_expired(retired_epoch)) {
+            /* readers of the retired table have not all finished */
+            return false;
+        }
+        _hashtable_free(retired_table);
+        retired_table = NULL;
+    }
 
-        for (int i = 0; i < n_item_slot; i++) {
-            if (bkt == first_bkt && i == 0) {
-                continue;
-            }
+    for (int32_t i = 0; i < heap.max_nseg; i++) {
+        n_item += __atomic_load_n(&heap.segs[i].n_live_item, __ATOMIC_RELAXED);
+    }
 
-            item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
-            if (GET_TAG(item_info) != tag) {
-                continue;
-            }
-            /* a potential hit */
-            if (!_same_item(key, klen, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
-            }
-            if (cas) {
-                *cas = GET_CAS(first_bkt);
-            }
+    hash_power = hash_table->hash_power;
+    n_slot     = HASHSIZE(hash_power);
+    n_bkt      = n_slot >> N_SLOT_PER_BUCKET_LOG2;
+    if ((n_item > _load_max(n_slot) ||
+         __atomic_load_n(&n_bkt_alloc, __ATOMIC_RELAXED) > n_bkt / 8) &&
+        hash_power < HASH_POWER_MAX) {
+        /* grow to the load factor of 0.75 in one resize if we fall behind */
+        do {
+            hash_power += 1;
+            n_slot <<= 1u;
+        } while (n_item > _load_max(n_slot) && hash_power < HASH_POWER_MAX);
+
+        INCR(seg_metrics, hash_grow);
+        _hashtable_resize_start(hash_power);
+
+        return true;
+    }
 
+    if (n_item < n_slot / 8 && hash_power > hash_power_min) {
+        INCR(seg_metrics, hash_shrink);
+        _hashtable_resize_start(hash_power - 1);
+
+        return true;
+    }
+
+    return false;
+}
+
+bool
+hashtable_lazy_expire(int32_t max_nseg)
+{
 #if defined DEBUG_MODE
-            *seg_id = GET_SEG_ID_NON_DECR(item_info);
-            ASSERT(heap.segs[GET_SEG_ID(item_info)].seg_id_non_decr == *seg_id);
+    /* seg_id_non_decr uses all bits of the seg id field */
+    log_warn("lazy expiration is not supported in debug mode");
+    return false;
 #else
-            *seg_id = GET_SEG_ID(item_info);
-#endif
+    uint64_t n_bit = 1;
 
-            struct seg *seg = &heap.segs[GET_SEG_ID(item_info)];
-            int ref_cnt = __atomic_add_fetch(&seg->r_refcount, 1, __ATOMIC_RELAXED);
-            ASSERT(ref_cnt <= n_thread);
+    while ((1ul << n_bit) < (uint64_t) max_nseg) {
+        n_bit += 1;
+    }
 
-            if (!seg_is_accessible(GET_SEG_ID(item_info)) ||
-                    __atomic_load_n(&bkt[i], __ATOMIC_RELAXED) != item_info) {
-                /* not accessible: it will be removed by other threads,
-                 * item_info change: updated/deleted/accessed by other thread */
+    if (seg_field_n_bit - n_bit < SEG_GEN_NBIT_MIN) {
+        log_warn("%" PRId32 " segs leave less than %d generation bits in "
+                 "item info, lazy expiration is disabled", max_nseg,
+                 SEG_GEN_NBIT_MIN);
+        return false;
+    }
 
-                __atomic_sub_fetch(&seg->r_refcount, 1, __ATOMIC_RELAXED);
+    lazy_expire    = true;
+    seg_id_n_bit   = n_bit;
+    seg_id_lo_mask = (1ul << n_bit) - 1;
+    seg_gen_mask   = (1u << (seg_field_n_bit - n_bit)) - 1;
 
-                unlock(first_bkt);
-                return NULL;
-            }
+    log_info("lazy expiration uses %" PRIu64 " generation bits",
+        seg_field_n_bit - n_bit);
 
-            offset = GET_OFFSET(item_info);
-            it = (struct item *) (heap.base + heap.seg_size * GET_SEG_ID(item_info) + offset);
-
-            /* item found, try to update the frequency */
-            uint64_t freq = GET_FREQ(item_info);
-            if (freq < 127) {
-                /* counter caps at 127 */
-                if (freq <= 16 || prand() % freq == 0) {
-                    /* increase frequency by 1
-                     * if freq <= 16 or with prob 1/freq */
-                    freq = ((freq + 1) | 0x80ul) << FREQ_BIT_SHIFT;
-                }
-                else {
-                    /* we do not increase frequency, but mark that
-                     * we have already tried at current sec */
-                    freq = (freq | 0x80ul) << FREQ_BIT_SHIFT;
-                }
-                uint64_t new_val = (item_info & (~FREQ_MASK)) | freq;
+    return true;
+#endif
+}
+
+bool
+hashtable_flash(uint32_t n_flash_seg, int32_t max_nseg)
+{
+#if defined DEBUG_MODE
+    /* seg_id_non_decr uses all bits of the seg id field */
+    log_warn("the flash tier is not supported in debug mode");
+    return false;
+#else
+    uint64_t n_bit = 1;
 
-                /* we can also use atomics here, but it comes with caveat,
-                 * if we use atomic, then we cannot use compare_exchange in
-                 * other func because the compare will fail due to freq incr */
-//                lock(first_bkt);
-                __atomic_compare_exchange_n(&bkt[i], &item_info, new_val, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
-//                unlock(first_bkt);
+    ASSERT(!lazy_expire);
 
-            }
-            /* done frequency update section */
+    while ((1ul << n_bit) < (uint64_t) n_flash_seg) {
+        n_bit += 1;
+    }
 
-            unlock(first_bkt);
-            return it;
-        }
-        bkt_chain_len -= 1;
-        bkt        = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
-    } while (bkt_chain_len >= 0);
+    if ((uint64_t) max_nseg > (1ul << (seg_field_n_bit - 1)) ||
+        n_bit + SEG_GEN_NBIT_MIN > seg_field_n_bit - 1) {
+        log_warn("%" PRId32 " segs and %" PRIu32 " flash segs do not fit in "
+                 "item info, the flash tier is disabled", max_nseg,
+                 n_flash_seg);
+        return false;
+    }
 
-    unlock(first_bkt);
-    return NULL;
+    seg_field_n_bit    = seg_field_n_bit - 1;
+    seg_id_lo_mask     = (1ul << seg_field_n_bit) - 1;
+
+    flash_tier         = true;
+    flash_id_n_bit     = n_bit;
+    flash_id_lo_mask   = (1ul << n_bit) - 1;
+    flash_gen_mask     = (1u << (seg_field_n_bit - n_bit)) - 1;
+    /* a flash seg is reused once every n_flash_seg writes */
+    flash_sweep_nwrite = (uint64_t) n_flash_seg * ((flash_gen_mask + 1) / 4);
+    flash_sweep_at     = flash_nwrite();
+
+    log_info("the flash tier uses %" PRIu64 " generation bits",
+        seg_field_n_bit - n_bit);
+
+    return true;
+#endif
 }
-#else
-struct item *
-hashtable_get(const char *key, const uint32_t klen,
-              int32_t *seg_id,
-              uint64_t *cas)
+
+/* the first sweep that starts after now */
+static inline uint64_t
+_sweep_mark(void)
 {
-    INCR(seg_metrics, hash_lookup);
+    uint64_t mark = sweep_started + 1;
 
-    uint64_t    hv         = CAL_HV(key, klen);
-    uint64_t    tag        = CAL_TAG_FROM_HV(hv);
-    uint64_t    *first_bkt = GET_BUCKET(hv);
-    uint64_t    *bkt       = first_bkt;
-    struct item *it;
-    int i;
+    if (sweep_req < mark) {
+        sweep_req = mark;
+    }
 
-    uint64_t item_info;
-    static uint64_t scan_len_sum = 0;
-    static uint64_t scan_cnt = 0;
+    return mark;
+}
 
-    // scan_cnt += 1;
-    // if (scan_cnt % 100000000 == 0) {
-    //     printf("%.2lf\n", (double) scan_len_sum / scan_cnt);
-    // }
+/* drop the stale entries of one bucket chain and shorten the chain */
+static inline void
+_sweep_bucket(uint64_t *head_bkt)
+{
+    lock(head_bkt);
 
-    lock(first_bkt);
+    if (_drop_stale(head_bkt, NULL) > 0) {
+        _compact_chain(head_bkt);
+        unlock_and_update_cas(head_bkt);
+    } else {
+        unlock(head_bkt);
+    }
+}
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(first_bkt) - 1;
-    int n_item_slot;
+bool
+hashtable_sweep(bool now)
+{
+    uint64_t n_bkt;
 
-    /* try to find the item in the hash table */
-    do {
-        n_item_slot = bkt_chain_len > 0 ?
-                      N_SLOT_PER_BUCKET - 1 :
-                      N_SLOT_PER_BUCKET;
+    if (hash_table->prev != NULL) {
+        /* stale entries are dropped during migration, sweep afterwards */
+        return hashtable_resize();
+    }
 
-        for (i = 0; i < n_item_slot; i++) {
-            if (bkt == first_bkt && i == 0) {
-                continue;
-            }
+    if (flash_tier && flash_nwrite() - flash_sweep_at >= flash_sweep_nwrite) {
+        flash_sweep_at = flash_nwrite();
+        _sweep_mark();
+    }
 
-            item_info = bkt[i];
-            if (GET_TAG(item_info) != tag) {
-                continue;
-            }
-            /* a potential hit */
-            if (!_same_item(key, klen, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
-            }
-            if (cas) {
-                *cas = GET_CAS(first_bkt);
-            }
+    if (!sweep_active) {
+        if (sweep_req <= sweep_done ||
+            (!now && time_proc_sec() - sweep_last < HASH_SWEEP_SEC)) {
+            return false;
+        }
 
-#if defined DEBUG_MODE
-            *seg_id = GET_SEG_ID_NON_DECR(item_info);
-            ASSERT(heap.segs[GET_SEG_ID(item_info)].seg_id_non_decr == *seg_id);
-#else
-            *seg_id = GET_SEG_ID(item_info);
-#endif
+        sweep_started += 1;
+        sweep_active   = true;
+        sweep_table    = NULL;
+    }
+
+    if (sweep_table != hash_table) {
+        /* the table has been resized, entries may have moved */
+        sweep_table = hash_table;
+        sweep_pos   = 0;
+    }
 
-            struct seg *seg = &heap.segs[GET_SEG_ID(item_info)];
-            int ref_cnt = __atomic_add_fetch(&seg->r_refcount, 1, __ATOMIC_RELAXED);
-            ASSERT(ref_cnt <= n_thread);
+    n_bkt = HASHSIZE(sweep_table->hash_power - N_SLOT_PER_BUCKET_LOG2);
+    for (uint32_t i = 0; i < HASH_SWEEP_NBUCKET && sweep_pos < n_bkt;
+         i++, sweep_pos++) {
+        _sweep_bucket(&sweep_table->table[sweep_pos * N_SLOT_PER_BUCKET]);
+    }
 
-            if (!seg_is_accessible(GET_SEG_ID(item_info)) ||
-                __atomic_load_n(&bkt[i], __ATOMIC_RELAXED) != item_info) {
-                /* not accessible: it will be removed by other threads,
-                 * item_info change: updated/deleted/accessed by other thread */
+    if (sweep_pos < n_bkt) {
+        return true;
+    }
 
-                __atomic_sub_fetch(&seg->r_refcount, 1, __ATOMIC_RELAXED);
+    sweep_active = false;
+    sweep_done   = sweep_started;
+    sweep_last   = time_proc_sec();
+    INCR(seg_metrics, hash_sweep);
 
-                scan_len_sum += i;
-                unlock(first_bkt);
-                return NULL;
-            }
+    return false;
+}
 
-            it = (struct item *) (heap.base + heap.seg_size *
-                        GET_SEG_ID(item_info) + GET_OFFSET(item_info));
+/* wait until the sweep mark has finished */
+static void
+_sweep_wait(uint64_t mark)
+{
+    while (sweep_done < mark) {
+        hashtable_sweep(true);
+    }
+}
 
-            scan_len_sum += i;
-            unlock(first_bkt);
-            return it;
-        }
-        bkt_chain_len -= 1;
-        bkt        = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
-        scan_len_sum += 8;
-    } while (bkt_chain_len >= 0);
+void
+hashtable_expire_seg(int32_t seg_id)
+{
+    struct seg *seg = &heap.segs[seg_id];
+    uint32_t   gen  = (seg->gen + 1) & seg_gen_mask;
+
+    ASSERT(lazy_expire);
+
+    /* the entries of the gen we move to must be gone, the sweep done before
+     * the last wrap dropped the ones of the last gen of the previous round,
+     * and the sweep after the last bump dropped all other older ones */
+    if (gen == seg_gen_mask) {
+        _sweep_wait(seg->wrap_sweep);
+    } else if (gen == 0) {
+        _sweep_wait(seg->stale_sweep);
+    }
 
-    scan_len_sum += i;
-    unlock(first_bkt);
-    return NULL;
+    __atomic_store_n(&seg->gen, gen, __ATOMIC_RELEASE);
+
+    seg->stale_sweep = _sweep_mark();
+    if (gen == 0) {
+        seg->wrap_sweep = seg->stale_sweep;
+    }
 }
-#endif
 
 
 /**
@@ -817,51 +2464,53 @@ hashtable_get_no_freq_incr(const char *key, const uint32_t klen,
                            int32_t *seg_id,
                            uint64_t *cas)
 {
-    uint64_t    hv         = CAL_HV(key, klen);
-    uint64_t    tag        = CAL_TAG_FROM_HV(hv);
-    uint64_t    *first_bkt = GET_BUCKET(hv);
-    uint64_t    *bkt       = first_bkt;
+    uint64_t    hv  = CAL_HV(key, klen);
+    uint64_t    tag = CAL_TAG_FROM_HV(hv);
+    uint64_t    *bkts[HASH_N_CAND_MAX];
+    uint64_t    *bkt;
     uint64_t    offset;
     struct item *it;
+    int         n   = _find_buckets(hv, tag, bkts);
 
     /* 16-bit tag, 28-bit seg id, 20-bit offset (in the unit of 8-byte) */
     uint64_t item_info;
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(first_bkt) - 1;
-    int n_item_slot;
-    do {
-        n_item_slot = bkt_chain_len > 0 ?
-                      N_SLOT_PER_BUCKET - 1 :
-                      N_SLOT_PER_BUCKET;
-
-        for (int i = 0; i < n_item_slot; i++) {
-            if (bkt == first_bkt && i == 0) {
-                continue;
-            }
+    int bkt_chain_len;
+    uint32_t match;
+    int i;
+    for (int c = 0; c < n; c++) {
+        bkt           = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(bkt) - 1;
+        do {
+            match = _bucket_match(bkt, tag, bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
 
-            item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
-            if (GET_TAG(item_info) != tag) {
-                continue;
-            }
-            /* a potential hit */
-            if (!_same_item(key, klen, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
-            }
-            if (cas) {
-                *cas = GET_CAS(first_bkt);
-            }
+                item_info = __atomic_load_n(&bkt[i], __ATOMIC_RELAXED);
+                if (GET_TAG(item_info) != tag || _info_stale(item_info)) {
+                    continue;
+                }
+                /* a potential hit */
+                if (!_same_item(key, klen, item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
+                if (cas) {
+                    *cas = GET_CAS(bkts[c]);
+                }
 
-            *seg_id = GET_SEG_ID(item_info);
-            offset = GET_OFFSET(item_info);
-            it     = (struct item *) (heap.base + heap.seg_size * (*seg_id)
-                + offset);
+                *seg_id = GET_SEG_ID(item_info);
+                offset = GET_OFFSET(item_info);
+                it     = (struct item *) (heap.base + heap.seg_size * (*seg_id)
+                    + offset);
 
-            return it;
-        }
-        bkt_chain_len -= 1;
-        bkt        = (uint64_t *) (bkt[N_SLOT_PER_BUCKET - 1]);
-    } while (bkt_chain_len >= 0);
+                return it;
+            }
+            bkt_chain_len -= 1;
+            bkt = _next_bucket(bkt);
+        } while (bkt_chain_len >= 0 && bkt != NULL);
+    }
 
     return NULL;
 }
@@ -877,50 +2526,65 @@ hashtable_get_it_freq(const char *it_key, const uint32_t it_klen,
     uint64_t hv  = CAL_HV(it_key, it_klen);
     uint64_t tag = CAL_TAG_FROM_HV(hv);
 
-    uint64_t *first_bkt        = GET_BUCKET(hv);
-    uint64_t *curr_bkt         = first_bkt;
-    uint64_t curr_item_info;
+    uint64_t *bkts[HASH_N_CAND_MAX], *curr_bkt;
+    uint64_t bkt_infos[HASH_N_CAND_MAX], curr_item_info;
     uint64_t item_info_to_find = _build_item_info(tag, seg_id, offset);
     int      freq              = 0;
 
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(first_bkt) - 1;
-    int n_item_slot;
-    do {
-        n_item_slot = bkt_chain_len > 0 ?
-                      N_SLOT_PER_BUCKET - 1 :
-                      N_SLOT_PER_BUCKET;
+    int n, c, bkt_chain_len;
+    uint32_t match;
+    int i;
 
-        for (int i = 0; i < n_item_slot; i++) {
-            if (curr_bkt == first_bkt && i == 0) {
-                continue;
-            }
+retry:
+    /* the item can be moved by a hash table resize during the scan */
+    n = _find_buckets(hv, tag, bkts);
+    for (c = 0; c < n; c++) {
+        bkt_infos[c] = _bucket_info_read_begin(bkts[c]);
+        if (!two_choice && (bkt_infos[c] & BUCKET_MIGRATED)) {
+            goto retry;
+        }
+    }
 
-            curr_item_info = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
-            if (GET_TAG(curr_item_info) != tag) {
-                continue;
-            }
+    for (c = 0; c < n; c++) {
+        curr_bkt      = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(&bkt_infos[c]) - 1;
+        do {
+            match = _bucket_match(curr_bkt, tag, curr_bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
 
-            curr_item_info = CLEAR_FREQ(curr_item_info);
-            if (curr_item_info == item_info_to_find) {
                 curr_item_info = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
-                freq = GET_FREQ(curr_item_info) & 0x7Ful;
+                if (GET_TAG(curr_item_info) != tag || _info_stale(curr_item_info)) {
+                    continue;
+                }
 
-                return freq;
-            }
+                curr_item_info = CLEAR_FREQ(curr_item_info);
+                if (curr_item_info == item_info_to_find) {
+                    curr_item_info = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
+                    freq = GET_FREQ(curr_item_info) & 0x7Ful;
 
-            /* a potential hit */
-            if (!_same_item(it_key, it_klen, curr_item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
-            }
+                    return freq;
+                }
+
+                /* a potential hit */
+                if (!_same_item(it_key, it_klen, curr_item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
 
-            /* the item to find is outdated */
-            return 0;
+                /* the item to find is outdated */
+                return 0;
 
-        }
-        bkt_chain_len -= 1;
-        curr_bkt   = (uint64_t *) (curr_bkt[N_SLOT_PER_BUCKET - 1]);
-    } while (bkt_chain_len >= 0);
+            }
+            bkt_chain_len -= 1;
+            curr_bkt = _next_bucket(curr_bkt);
+        } while (bkt_chain_len >= 0 && curr_bkt != NULL);
+    }
+
+    if (_buckets_read_retry(bkts, bkt_infos, n)) {
+        goto retry;
+    }
 
     return -1;
 }
@@ -941,75 +2605,82 @@ hashtable_relink_it(const char *oit_key, const uint32_t oit_klen,
 {
     INCR(seg_metrics, hash_relink);
 
-    uint64_t hv         = CAL_HV(oit_key, oit_klen);
-    uint64_t tag        = CAL_TAG_FROM_HV(hv);
-    uint64_t *first_bkt = GET_BUCKET(hv);
-    uint64_t *curr_bkt  = first_bkt;
+    uint64_t hv  = CAL_HV(oit_key, oit_klen);
+    uint64_t tag = CAL_TAG_FROM_HV(hv);
+    uint64_t *bkts[2], *curr_bkt;
+    int      n   = _lock_buckets(hv, tag, bkts, NULL);
     uint64_t item_info, item_info_with_freq;
     bool item_outdated = true, first_match = true;
 
     uint64_t oit_info = _build_item_info(tag, old_seg_id, old_offset);
     uint64_t nit_info = _build_item_info(tag, new_seg_id, new_offset);
 
-    lock(first_bkt);
-
-    int bkt_chain_len = GET_BUCKET_CHAIN_LEN(first_bkt) - 1;
-    int n_item_slot;
-    do {
-        n_item_slot = bkt_chain_len > 0 ?
-                      N_SLOT_PER_BUCKET - 1 :
-                      N_SLOT_PER_BUCKET;
-
-        for (int i = 0; i < n_item_slot; i++) {
-            if (curr_bkt == first_bkt && i == 0) {
-                continue;
-            }
-
-            item_info_with_freq = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
-            item_info = CLEAR_FREQ(item_info_with_freq);
-            if (GET_TAG(item_info) != tag) {
-                continue;
-            }
+    int bkt_chain_len;
+    uint32_t match;
+    int i;
+    for (int c = 0; c < n; c++) {
+        curr_bkt      = bkts[c];
+        bkt_chain_len = GET_BUCKET_CHAIN_LEN(curr_bkt) - 1;
+        do {
+            match = _bucket_match(curr_bkt, tag, curr_bkt == bkts[c], bkt_chain_len > 0);
+            while (match != 0) {
+                i = __builtin_ctz(match);
+                match &= match - 1;
+
+                item_info_with_freq = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
+                item_info = CLEAR_FREQ(item_info_with_freq);
+                if (GET_TAG(item_info) != tag) {
+                    continue;
+                }
+                if (_info_stale(item_info)) {
+                    __atomic_store_n(&curr_bkt[i], 0, __ATOMIC_RELAXED);
+                    INCR(seg_metrics, hash_stale_drop);
+                    continue;
+                }
 
-            /* a potential hit */
-            if (!_same_item(oit_key, oit_klen, item_info)) {
-                INCR(seg_metrics, hash_tag_collision);
-                continue;
-            }
+                /* a potential hit */
+                if (!_same_item(oit_key, oit_klen, item_info)) {
+                    INCR(seg_metrics, hash_tag_collision);
+                    continue;
+                }
 
-            if (first_match) {
-                if (oit_info == item_info) {
-                    /* item is not updated, but do notice that if we do not use
-                     * locking in hashtable_get when incr frequency, we could
-                     * have item_info change due to frequency */
-//                    lock(first_bkt);
-                    if (CLEAR_FREQ(__atomic_load_n(
-                        &curr_bkt[i], __ATOMIC_RELAXED)) == oit_info) {
-                        __atomic_store_n(&curr_bkt[i], nit_info, __ATOMIC_RELAXED);
-                        item_outdated = false;
-                        _item_free(oit_info, false);
+                if (first_match) {
+                    if (oit_info == item_info) {
+                        /* item is not updated, but do notice that if we do not use
+                         * locking in hashtable_get when incr frequency, we could
+                         * have item_info change due to frequency */
+                        if (CLEAR_FREQ(__atomic_load_n(
+                            &curr_bkt[i], __ATOMIC_RELAXED)) == oit_info) {
+                            __atomic_store_n(&curr_bkt[i], nit_info, __ATOMIC_RELAXED);
+                            item_outdated = false;
+                            _item_free(oit_info, false);
+                        }
                     }
-//                    unlock(first_bkt);
+                    first_match = false;
+                } else {
+                    /* not first match, delete */
+                    _item_free(item_info, false);
+                    __atomic_store_n(&curr_bkt[i], 0, __ATOMIC_RELAXED);
                 }
-                first_match = false;
-            } else {
-                /* not first match, delete */
-                _item_free(curr_bkt[i], false);
-                __atomic_store_n(&curr_bkt[i], 0, __ATOMIC_RELAXED);
             }
-        }
-        bkt_chain_len -= 1;
-        curr_bkt   = (uint64_t *) (curr_bkt[N_SLOT_PER_BUCKET - 1]);
-    } while (bkt_chain_len >= 0);
+            bkt_chain_len -= 1;
+            curr_bkt = (uint64_t *) (curr_bkt[N_SLOT_PER_BUCKET - 1]);
+        } while (bkt_chain_len >= 0);
+    }
+
+    /* older versions removed above may leave overflown buckets empty */
+    for (int c = 0; c < n; c++) {
+        _compact_chain(bkts[c]);
+    }
 
-    unlock(first_bkt);
+    _unlock_cands(bkts, n, true);
     return !item_outdated;
 }
 
 void
 hashtable_stat(int *item_cnt_ptr, int *bucket_cnt_ptr)
 {
-#define BUCKET_HEAD(idx) (&hash_table.table[(idx) * N_SLOT_PER_BUCKET])
+#define BUCKET_HEAD(idx) (&hash_table->table[(idx) * N_SLOT_PER_BUCKET])
 
     *item_cnt_ptr   = 0;
     *bucket_cnt_ptr = 0;
@@ -1020,7 +2691,7 @@ hashtable_stat(int *item_cnt_ptr, int *bucket_cnt_ptr)
     uint64_t item_info, *head_bkt, *curr_bkt;
 
     for (uint64_t bucket_idx = 0;
-         bucket_idx < HASHSIZE(hash_table.hash_power - N_SLOT_PER_BUCKET_LOG2);
+         bucket_idx < HASHSIZE(hash_table->hash_power - N_SLOT_PER_BUCKET_LOG2);
          bucket_idx++) {
 
         head_bkt      = curr_bkt = BUCKET_HEAD(bucket_idx);
@@ -1058,7 +2729,7 @@ void
 scan_hashtable_find_seg(int32_t target_seg_id)
 {
 #ifdef CC_ASSERT_PANIC
-#define BUCKET_HEAD(idx) (&hash_table.table[(idx) * N_SLOT_PER_BUCKET])
+#define BUCKET_HEAD(idx) (&hash_table->table[(idx) * N_SLOT_PER_BUCKET])
     /* expensive debug */
     log_warn("scan_hashtable_find_seg is expensive func");
 
@@ -1071,7 +2742,7 @@ scan_hashtable_find_seg(int32_t target_seg_id)
     struct item *it;
 
     int n_bkt_in_table =
-            HASHSIZE(hash_table.hash_power - N_SLOT_PER_BUCKET_LOG2);
+            HASHSIZE(hash_table->hash_power - N_SLOT_PER_BUCKET_LOG2);
 
     for (uint64_t bucket_idx = 0; bucket_idx < n_bkt_in_table; bucket_idx++) {
         curr_bkt      = head_bkt = BUCKET_HEAD(bucket_idx);
@@ -1088,7 +2759,7 @@ scan_hashtable_find_seg(int32_t target_seg_id)
 
                 item_info = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
 
-                if (item_info == 0) {
+                if (item_info == 0 || _info_flash(item_info)) {
                     continue;
                 }
 
@@ -1118,7 +2789,7 @@ void
 verify_hashtable(void)
 {
 #if defined CC_ASSERT_PANIC
-#define BUCKET_HEAD(idx) (&hash_table.table[(idx) * N_SLOT_PER_BUCKET])
+#define BUCKET_HEAD(idx) (&hash_table->table[(idx) * N_SLOT_PER_BUCKET])
 
     int         bkt_chain_len;
     uint64_t    item_info;
@@ -1131,7 +2802,7 @@ verify_hashtable(void)
     uint64_t n_item = 0;
 
     int n_bkt_in_table =
-            HASHSIZE(hash_table.hash_power - N_SLOT_PER_BUCKET_LOG2);
+            HASHSIZE(hash_table->hash_power - N_SLOT_PER_BUCKET_LOG2);
 
     for (uint64_t bucket_idx = 0; bucket_idx < n_bkt_in_table; bucket_idx++) {
         curr_bkt      = head_bkt = BUCKET_HEAD(bucket_idx);
@@ -1149,11 +2820,12 @@ verify_hashtable(void)
 //                item_info = curr_bkt[i];
                 item_info = __atomic_load_n(&curr_bkt[i], __ATOMIC_RELAXED);
 
-                if (item_info == 0) {
+                if (item_info == 0 || _info_stale(item_info) ||
+                    _info_flash(item_info)) {
                     continue;
                 }
 
-                seg_id = ((item_info & SEG_ID_MASK) >> SEG_ID_BIT_SHIFT);
+                seg_id = GET_SEG_ID(item_info);
                 offset = (item_info & OFFSET_MASK) << OFFSET_UNIT_IN_BIT;
                 it     = (struct item *) (heap.base + heap.seg_size * seg_id
                     + offset);
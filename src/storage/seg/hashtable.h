@@ -2,6 +2,8 @@
 
 #include "item.h"
 
+struct flash_loc;
+
 /**
  * bulk-chaining hashtable
  * we use a bulk-chaining hash table, hash table is divided into buckets, where
@@ -11,10 +13,13 @@
  *
  * Bucket overflow
  * if there are more than 7 items hashed into this bucket,
- * we call the bucket overflows, a new bucket is allocated (currently malloc),
+ * we call the bucket overflows, a new bucket is taken from a pool of
+ * cache-line aligned buckets carved from HASH_BUCKET_CHUNK_SIZE chunks,
  * the last slot of the head bucket becomes a pointer to the allocated bucket,
  * the item info stored in the last slot of the head bucket is copied to the
- * first slot of the new bucket.
+ * first slot of the new bucket. When eviction, deletion or the sweep frees
+ * enough slots, the items of the last bucket are moved to the front of the
+ * chain and the bucket goes back to the pool.
  * For example, if we have 8 item pointers, then we will use 2 buckets
  * one is part of the hash table and one is allocated on-demand,
  * the first bucket stores bucket info + 6 item info + 1 pointer to next bucket
@@ -50,16 +55,34 @@
  * Bucket info
  * As mentioned above, the first array of head bucket only store 7 item info,
  * because the first slot store bucket info:
- * lock (8-bit) + bucket chain length (8-bit) + cas (32-bit) +
- * shared last access timestamp
+ * lock (8-bit) + migrated flag (1-bit) + bucket chain length (7-bit) +
+ * cas (32-bit) + shared last access timestamp
  *
  * If the number of extra array is larger than zero,
  * then last slot is used to store pointer to the extra array.
  *
+ * The lock is only taken by writers, which bump the cas when they release
+ * the lock. Readers scan the bucket chain without the lock and retry if the
+ * lock or the cas has changed during the scan (like a seqlock), so the cas
+ * of a bucket changes on every update, delete, eviction and relink of any
+ * item in the bucket.
+ *
  * Each item info (fake pointer) is composed of
  * tag (12-bit) + 8-bit frequency counter + seg_id (24-bit) +
  * offset in the unit of 8-byte (20-bit)
  *
+ * With lazy expiration, the seg_id field stores the seg id in as many low
+ * bits as needed for the number of segs, and the generation of the seg in
+ * the rest. Expiring a seg bumps its generation instead of removing its
+ * items, the entries of an older generation are stale, they are skipped by
+ * lookups and dropped by writers, resize and a background sweep.
+ *
+ * With the flash tier, the top bit of the seg id field marks an item demoted
+ * to flash, the rest of the field stores the flash seg id and generation the
+ * same way, see flash.h. Only the tag of a flash item is in memory, so a
+ * lookup that misses in memory reads the flash items whose tag matches, and
+ * writers drop them when the key is written or deleted.
+ *
  *
  *              64-byte bucket (7 item into + one stat)
  *
@@ -71,9 +94,10 @@
  *                  ▼                                ▼
  *      ┌────────────────────────┐         ┌──────────────────────┐
  *      │      32-bit cas        │         │      12-bit tag      │
- *      │ 8-bit bucket chain len │         │  8-bit freq counter  │
- *      │      8-bit lock        │         │    24-bit seg id     │
- *      │    16-bit unused       │         │    20-bit offset     │
+ *      │ 7-bit bucket chain len │         │  8-bit freq counter  │
+ *      │ 1-bit migrated flag    │         │    24-bit seg id     │
+ *      │      8-bit lock        │         │    20-bit offset     │
+ *      │    16-bit timestamp    │         │                      │
  *      └────────────────────────┘         └──────────────────────┘
  *
  *
@@ -119,27 +143,97 @@
  */
 
 
-/* todo(juncheng):
- * 1. replace overflow bucket memory allocation from malloc to static allocation,
- *      this is not necessary at this moment, a proper allocated hash table
- *      should not have too many overflown buckets, maybe add a stat
- *
- */
-
-
 struct hash_table {
     uint32_t hash_power;
     uint64_t hash_mask; /* avoid repeated computation*/
     uint64_t *table;
+    size_t map_size; /* the size of the huge page mapping, 0 if not mapped */
+    struct hash_table *prev; /* the table being migrated to this one */
 };
 
+/* the hash table does not shrink below 2^HASH_POWER_MIN entries
+ * or the configured size, whichever is smaller */
+#define HASH_POWER_MIN          16
+#define HASH_POWER_MAX          32
+/* the number of buckets migrated in one call of hashtable_resize */
+#define HASH_MIGRATE_NBUCKET    4096
+/* lazy expiration needs at least this many generation bits */
+#define SEG_GEN_NBIT_MIN        4
+/* the max number of items moved to make room for an insert in a full
+ * two-choice bucket, and the number of random walks to find them */
+#define HASH_DISPLACE_DEPTH     8
+#define HASH_DISPLACE_WALK      4
+/* overflown buckets are allocated in chunks of this size (a huge page),
+ * one chunk is allocated on setup and the chunks are kept until teardown */
+#define HASH_BUCKET_CHUNK_SIZE  (2 * MiB)
+/* the number of buckets swept in one call of hashtable_sweep */
+#define HASH_SWEEP_NBUCKET      4096
+/* the min interval between two sweeps, unless a seg waits for one */
+#define HASH_SWEEP_SEC          1
 
+/*
+ * when resize is true, the table grows to 2x of its size when the load
+ * factor is above 0.75 (0.81 with two-choice buckets) or too many overflown
+ * buckets are allocated, and shrinks to 1/2 when the load factor is below 1/8
+ *
+ * when two_choice is true, an item can be stored in either of two head
+ * buckets, the second one is derived from the tag, so that items can be
+ * moved to their other bucket to make room (bucketized cuckoo hashing),
+ * lookups check both buckets, but the table can be filled to a much higher
+ * load before buckets overflow
+ *
+ * when hugepage_size is not 0, the tables are mapped in huge pages of that
+ * size if there are enough, when interleave is true, the tables and the
+ * overflown buckets are interleaved over the NUMA nodes
+ */
 void
-hashtable_setup(uint32_t hash_power);
+hashtable_setup(uint32_t hash_power, bool resize, bool two_choice,
+        size_t hugepage_size, bool interleave);
 
 void
 hashtable_teardown(void);
 
+/*
+ * called periodically by the background thread, starts a resize if needed
+ * and migrates up to HASH_MIGRATE_NBUCKET buckets if a resize is in
+ * progress, during which lookups check both tables, and writers migrate
+ * the old bucket before writing to the new table,
+ * return true if there are buckets left to migrate
+ */
+bool
+hashtable_resize(void);
+
+/*
+ * encode a seg generation in item info for lazy expiration, return false if
+ * max_nseg segs leave too few bits for it, called after hashtable_setup
+ */
+bool
+hashtable_lazy_expire(int32_t max_nseg);
+
+/*
+ * keep the items demoted to n_flash_seg flash segs in the table, return
+ * false if max_nseg segs and n_flash_seg flash segs leave too few bits for
+ * it, called after hashtable_setup and before hashtable_lazy_expire
+ */
+bool
+hashtable_flash(uint32_t n_flash_seg, int32_t max_nseg);
+
+/*
+ * make the hash entries of the seg stale in O(1), the generation wraps
+ * around, so this may wait for a sweep to drop the entries of the next
+ * generation, only called by the background thread
+ */
+void
+hashtable_expire_seg(int32_t seg_id);
+
+/*
+ * called periodically by the background thread, drops the stale entries of
+ * up to HASH_SWEEP_NBUCKET buckets if a sweep is due, or sooner if now,
+ * return true if the sweep has buckets left
+ */
+bool
+hashtable_sweep(bool now);
+
 
 void
 hashtable_put(struct item *it, uint64_t seg_id, uint64_t offset);
@@ -156,10 +250,48 @@ bool
 hashtable_evict(const char *oit_key, uint32_t oit_klen, uint64_t seg_id,
         uint64_t offset);
 
+/*
+ * evict the item like hashtable_evict, but if it is up-to-date, its entry
+ * points to its copy on flash at loc instead of being removed
+ */
+bool
+hashtable_demote(const char *oit_key, uint32_t oit_klen, uint64_t seg_id,
+        uint64_t offset, const struct flash_loc *loc);
+
+/*
+ * replace the entry of the flash item at loc by the entry of its copy it
+ * in memory, return false (and free it) if the key has been written or
+ * deleted since loc was looked up
+ */
+bool
+hashtable_promote(struct item *it, uint64_t seg_id, uint64_t offset,
+        const struct flash_loc *loc);
+
+/*
+ * find the locations of up to n_max flash items whose tag matches the key,
+ * the key of each one has to be checked after reading it from flash
+ */
+uint32_t
+hashtable_get_flash(const char *key, uint32_t klen, struct flash_loc *locs,
+        uint32_t n_max);
+
 struct item *
 hashtable_get(const char *key, uint32_t klen, int32_t *seg_id,
         uint64_t *cas);
 
+/* the number of keys hashed and prefetched together in hashtable_get_batch */
+#define HASHTABLE_GET_BATCH 16
+
+/*
+ * look up n keys, the result of keys[i] is stored in its[i], seg_ids[i] and
+ * cas[i] (if cas is not NULL) the same way as hashtable_get,
+ * all head buckets and candidate items of a batch are prefetched before any
+ * key is compared, so that the cache misses of different keys overlap
+ */
+void
+hashtable_get_batch(const struct bstring *keys, uint32_t n,
+        struct item **its, int32_t *seg_ids, uint64_t *cas);
+
 
 bool
 hashtable_relink_it(const char *oit_key, uint32_t oit_klen,
@@ -1,4 +1,7 @@
 #include "item.h"
+#include "admission.h"
+#include "background.h"
+#include "flash.h"
 #include "hashtable.h"
 #include "seg.h"
 #include "ttlbucket.h"
@@ -17,6 +20,12 @@ extern proc_time_i flush_at;
 extern struct hash_table *hash_table;
 extern seg_metrics_st *seg_metrics;
 extern seg_perttl_metrics_st perttl[MAX_N_TTL_BUCKET];
+extern bool use_flash;
+extern bool use_admit;
+extern struct ttl_bucket ttl_buckets[MAX_N_TTL_BUCKET];
+
+/* the max number of flash items with the tag of a key read on a get */
+#define ITEM_FLASH_NLOC 4
 
 static __thread __uint128_t g_lehmer64_state       = 1;
 
@@ -164,6 +173,89 @@ _item_freq_incr(struct item *it) {
 }
 #endif
 
+/*
+ * copy the flash item fit at loc to a new item and replace the entry of the
+ * flash item by the entry of the new item, return false if the key has been
+ * written or deleted since loc was looked up
+ */
+static bool
+_item_promote(struct item *fit, const struct flash_rec *rec,
+              const struct flash_loc *loc)
+{
+    struct item    *it;
+    struct bstring key, val;
+    int32_t        seg_id, offset;
+    bool           promoted;
+
+    key.data = item_key(fit);
+    key.len  = fit->klen;
+    val.data = item_val(fit);
+    val.len  = fit->vlen;
+
+    if (item_reserve(&it, &key, &val, val.len, fit->olen, rec->expire_at) !=
+            ITEM_OK) {
+        return false;
+    }
+
+    if (fit->olen > 0) {
+        cc_memcpy(item_optional(it), item_optional(fit), fit->olen);
+    }
+    it->is_num = fit->is_num;
+
+    seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
+    offset = ((uint8_t *)it) - heap.base - heap.seg_size * seg_id;
+
+    promoted = hashtable_promote(it, (uint64_t)seg_id, (uint64_t)offset, loc);
+
+    seg_w_deref(seg_id);
+
+    return promoted;
+}
+
+/*
+ * look up a key that is not in memory on the flash tier, a flash item that
+ * has not expired or been flushed is promoted to memory, the item in memory
+ * is returned
+ *
+ * the flash item is read synchronously, the worker has no way to put a
+ * request aside until the read completes
+ */
+static struct item *
+_item_get_flash(const struct bstring *key, uint64_t *cas)
+{
+    struct flash_loc locs[ITEM_FLASH_NLOC];
+    struct flash_rec rec;
+    struct item      *fit;
+    uint32_t         n;
+    int32_t          seg_id;
+
+    n = hashtable_get_flash(key->data, key->len, locs, ITEM_FLASH_NLOC);
+    for (uint32_t i = 0; i < n; i++) {
+        fit = flash_read(&locs[i], &rec);
+        if (fit == NULL || fit->klen != key->len ||
+            cc_memcmp(item_key(fit), key->data, key->len) != 0) {
+            continue;
+        }
+
+        if (rec.expire_at <= time_proc_sec() || rec.create_at < flush_at) {
+            log_vverb("flash it '%.*s' expired or flushed", key->len,
+                key->data);
+            return NULL;
+        }
+
+        /* if not promoted, a newer version may have been written since */
+        if (_item_promote(fit, &rec, &locs[i])) {
+            INCR(seg_metrics, flash_hit);
+            log_vverb("get it '%.*s' promoted from flash", key->len,
+                key->data);
+        }
+
+        return hashtable_get(key->data, key->len, &seg_id, cas);
+    }
+
+    return NULL;
+}
+
 /**
  * find the key in the cache and return,
  * return NULL if not in the cache (never added or evicted, or expired)
@@ -186,6 +278,14 @@ item_get(const struct bstring *key, uint64_t *cas)
     it = hashtable_get(key->data, key->len, &seg_id, cas);
 #endif
 
+    if (use_admit) {
+        admit_record(key->data, key->len);
+    }
+
+    if (it == NULL && use_flash) {
+        it = _item_get_flash(key, cas);
+    }
+
     if (it == NULL) {
         log_vverb("get it '%.*s' not found", key->len, key->data);
 
@@ -205,15 +305,108 @@ item_get(const struct bstring *key, uint64_t *cas)
     return it;
 }
 
+uint32_t
+item_get_multi(const struct bstring *keys, uint32_t n, struct item **its,
+        uint64_t *cas)
+{
+    struct flash_loc loc;
+    int32_t seg_ids[HASHTABLE_GET_BATCH];
+    uint32_t i, j, n_batch, n_flash = 0;
+
+    for (i = 0; i < n; i += n_batch) {
+        n_batch = n - i < HASHTABLE_GET_BATCH ? n - i : HASHTABLE_GET_BATCH;
+
+        hashtable_get_batch(&keys[i], n_batch, &its[i], seg_ids,
+                cas == NULL ? NULL : &cas[i]);
+
+        for (j = i; j < i + n_batch; j++) {
+            if (use_admit) {
+                admit_record(keys[j].data, keys[j].len);
+            }
+            if (its[j] == NULL) {
+                /* promoting may allocate a seg and take the worker offline,
+                 * which the caller has to prepare for, see item_promote_multi */
+                if (use_flash &&
+                        hashtable_get_flash(keys[j].data, keys[j].len, &loc, 1)
+                        > 0) {
+                    n_flash++;
+                }
+                log_vverb("get it '%.*s' not found", keys[j].len, keys[j].data);
+                continue;
+            }
+
+#if defined DEBUG_MODE
+            ASSERT(seg_ids[j - i] ==
+                heap.segs[seg_ids[j - i] % heap.max_nseg].seg_id_non_decr);
+#endif
+
+#if defined CC_ASSERT_PANIC || defined CC_ASSERT_LOG
+            ASSERT(its[j]->magic == ITEM_MAGIC);
+#endif
+
+#ifndef STORE_FREQ_IN_HASHTABLE
+            _item_freq_incr(its[j]);
+#endif
+
+            log_vverb("get it key %.*s", keys[j].len, keys[j].data);
+        }
+    }
+
+    return n_flash;
+}
+
+void
+item_promote_multi(const struct bstring *keys, uint32_t n)
+{
+    int32_t seg_id;
+
+    if (!use_flash) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (hashtable_get_no_freq_incr(keys[i].data, keys[i].len, &seg_id,
+                NULL) == NULL) {
+            _item_get_flash(&keys[i], NULL);
+        }
+    }
+}
+
 void
 item_release(struct item *it)
 {
-    int32_t seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
-    struct seg *seg = &heap.segs[seg_id];
+    /* item_get does not take a reference on the seg, the seg is kept until
+     * the worker announces a quiescent state */
+    (void)it;
+}
+
+bool
+item_admit(const struct bstring *key, proc_time_i expire_at)
+{
+    int32_t ttl_bucket_idx;
 
-    int16_t ref_cnt = __atomic_sub_fetch(&seg->r_refcount, 1, __ATOMIC_RELAXED);
+    if (!use_admit) {
+        return true;
+    }
+
+    ttl_bucket_idx = find_ttl_bucket_idx(expire_at - time_proc_sec());
+    if (!ttl_buckets[ttl_bucket_idx].admit) {
+        return true;
+    }
+
+    if (admit_key(key->data, key->len)) {
+        INCR(seg_metrics, admit_accept);
+        return true;
+    }
 
-    ASSERT(ref_cnt >= 0);
+    /* the write is taken as stored and evicted right away, so the older
+     * version of the key must not be found */
+    INCR(seg_metrics, admit_reject);
+    hashtable_delete(key);
+
+    log_vverb("write of '%.*s' not admitted", key->len, key->data);
+
+    return false;
 }
 
 /* add this function because in multi-threaded benchmarks, the time may jump and
@@ -303,7 +496,9 @@ item_backfill(struct item *it, const struct bstring *val)
 {
     ASSERT(it != NULL);
 
-    cc_memcpy(item_val(it) + it->vlen, val->data, val->len);
+    if (val->data != item_val(it) + it->vlen) {
+        cc_memcpy(item_val(it) + it->vlen, val->data, val->len);
+    }
 
     it->vlen += val->len;
 
@@ -369,4 +564,7 @@ item_flush(void)
     time_update();
     flush_at = time_proc_sec();
     log_info("all keys flushed at %" PRIu32, flush_at);
+
+    /* let the background thread remove the flushed segs */
+    wake_background_thread();
 }
@@ -202,7 +202,8 @@ item_rstatus_e
 item_decr(uint64_t *vint, struct item *it, uint64_t delta);
 
 /*
- * decrement the ref counter
+ * done with an item returned by item_get, the item can be accessed until the
+ * worker goes offline (seg_thread_offline)
  */
 void
 item_release(struct item *it);
@@ -212,6 +213,28 @@ item_release(struct item *it);
 struct item *
 item_get(const struct bstring *key, uint64_t *cas);
 
+/*
+ * acquire the items of n keys, its[i] is NULL if keys[i] is not found,
+ * cas can be NULL, otherwise cas[i] is set for every item found,
+ * lookups of different keys are overlapped, which is faster than calling
+ * item_get n times
+ *
+ * only memory is looked up, the number of keys not found that may have an
+ * item on the flash tier is returned, those are found once promoted by
+ * item_promote_multi
+ */
+uint32_t
+item_get_multi(const struct bstring *keys, uint32_t n, struct item **its,
+        uint64_t *cas);
+
+/*
+ * promote to memory the flash items of the keys not in memory, this may
+ * allocate a seg and take the worker offline, so no item returned before
+ * can be accessed after it
+ */
+void
+item_promote_multi(const struct bstring *keys, uint32_t n);
+
 /* this function does insert or update */
 void
 item_insert(struct item *it);
@@ -227,11 +250,18 @@ item_reserve(struct item **it_p, const struct bstring *key,
         const struct bstring *val, uint32_t vlen, uint8_t olen,
         proc_time_i expire_at);
 
+/* whether a write of key expiring at expire_at passes the admission filter,
+ * if it does not, the key is deleted and the write should be dropped */
+bool
+item_admit(const struct bstring *key, proc_time_i expire_at);
+
 item_rstatus_e
 item_reserve_with_ttl(struct item **it_p, const struct bstring *key,
                       const struct bstring *val, uint32_t vlen, uint8_t olen,
                       delta_time_i ttl);
 
+/* append val to the value of a reserved item, val may have been received in
+ * place already, i.e. at item_val(it) + it->vlen, then it is not copied */
 void
 item_backfill(struct item *it, const struct bstring *val);
 
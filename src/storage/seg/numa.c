@@ -0,0 +1,146 @@
+#include "numa.h"
+
+#include <cc_debug.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#define NUMA_ONLINE_PATH    "/sys/devices/system/node/online"
+#define NUMA_MASK_NBIT      64
+
+/* the online nodes, read once */
+static uint64_t online_mask = 0;
+
+/* parse a node list such as "0-1,3" into a bitmask */
+static uint64_t
+_parse_node_list(const char *s)
+{
+    uint64_t mask = 0;
+    long     lo, hi;
+    char     *end;
+
+    while (*s != '\0' && *s != '\n') {
+        lo = strtol(s, &end, 10);
+        if (end == s) {
+            break;
+        }
+        hi = lo;
+        s  = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            s  = end;
+        }
+        for (long n = lo; n <= hi && n < NUMA_MASK_NBIT; n++) {
+            mask |= 1ul << n;
+        }
+        if (*s == ',') {
+            s++;
+        }
+    }
+
+    return mask;
+}
+
+static uint64_t
+_online_mask(void)
+{
+    char buf[256];
+    FILE *fp;
+
+    if (online_mask != 0) {
+        return online_mask;
+    }
+
+    fp = fopen(NUMA_ONLINE_PATH, "r");
+    if (fp != NULL) {
+        if (fgets(buf, sizeof(buf), fp) != NULL) {
+            online_mask = _parse_node_list(buf);
+        }
+        fclose(fp);
+    }
+
+    if (online_mask == 0) {
+        online_mask = 1;
+    }
+
+    return online_mask;
+}
+
+int
+seg_numa_n_node(void)
+{
+    return NUMA_MASK_NBIT - __builtin_clzl(_online_mask());
+}
+
+int
+seg_numa_node(void)
+{
+#if defined __linux__ && defined SYS_getcpu
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return (int) node;
+    }
+#endif
+
+    return 0;
+}
+
+#if defined __linux__ && defined SYS_mbind
+static bool
+_mbind(void *addr, size_t len, size_t page_size, int mode, uint64_t mask)
+{
+    uintptr_t start, end;
+
+    if (page_size == 0) {
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+    }
+
+    start = ((uintptr_t) addr + page_size - 1) & ~(page_size - 1);
+    end   = ((uintptr_t) addr + len) & ~(page_size - 1);
+    if (start >= end) {
+        return true;
+    }
+
+    /* the kernel reads maxnode - 1 bits of the mask */
+    if (syscall(SYS_mbind, start, end - start, mode, &mask,
+            NUMA_MASK_NBIT + 1, MPOL_MF_MOVE) != 0) {
+        log_warn("mbind %p len %zu mode %d failed: %s", (void *) start,
+            (size_t) (end - start), mode, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+bool
+seg_numa_interleave(void *addr, size_t len, size_t page_size)
+{
+#if defined __linux__ && defined SYS_mbind
+    return _mbind(addr, len, page_size, MPOL_INTERLEAVE, _online_mask());
+#else
+    return false;
+#endif
+}
+
+bool
+seg_numa_prefer(void *addr, size_t len, size_t page_size, int node)
+{
+    ASSERT(node >= 0 && node < NUMA_MASK_NBIT);
+
+#if defined __linux__ && defined SYS_mbind
+    return _mbind(addr, len, page_size, MPOL_PREFERRED, 1ul << node);
+#else
+    return false;
+#endif
+}
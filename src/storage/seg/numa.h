@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * NUMA placement of the seg heap and the hash table.
+ *
+ * The memory policy of a range is set with mbind(2) before the range is
+ * written, so that its pages are allocated on the intended nodes when they
+ * are first touched, pages that are already there are moved. The system
+ * calls are used directly, so there is no dependency on libnuma, and all
+ * functions fall back to a single node where NUMA is not supported.
+ */
+
+/* the max number of nodes with their own free seg pool */
+#define SEG_NUMA_MAX_NODE   16
+
+/* memory placement policies, the values of option seg_numa */
+typedef enum seg_numa_policy {
+    SEG_NUMA_NONE       = 0,    /* the default policy of the process */
+    SEG_NUMA_INTERLEAVE = 1,    /* heap and hash table interleaved */
+    SEG_NUMA_LOCAL      = 2,    /* heap split in per-node seg pools, writers
+                                 * take segs from the pool of their node */
+} seg_numa_policy_e;
+
+/* the number of nodes (the highest online node + 1), at least 1 */
+int
+seg_numa_n_node(void);
+
+/* the node of the cpu the calling thread runs on, 0 if unknown */
+int
+seg_numa_node(void);
+
+/*
+ * interleave the pages of [addr, addr + len) over all online nodes,
+ * page_size is the page size of the mapping (0 for the base page size),
+ * only the whole pages in the range are affected
+ */
+bool
+seg_numa_interleave(void *addr, size_t len, size_t page_size);
+
+/* allocate the pages of [addr, addr + len) on node if possible */
+bool
+seg_numa_prefer(void *addr, size_t len, size_t page_size, int node);
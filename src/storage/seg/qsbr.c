@@ -0,0 +1,147 @@
+#include "qsbr.h"
+
+#include <cc_debug.h>
+
+#include <sched.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+#define QSBR_CACHELINE_SIZE 64
+
+/* epoch of a thread that holds no pointer into segs */
+#define QSBR_OFFLINE 0
+
+/* each thread record is on its own cacheline, so that announcing a quiescent
+ * state does not write to memory shared with other threads */
+struct qsbr_thread {
+    uint64_t    epoch;      /* global epoch seen at the last quiescent state,
+                             * QSBR_OFFLINE if the thread is offline */
+    bool        in_use;
+} __attribute__((aligned(QSBR_CACHELINE_SIZE)));
+
+static uint64_t           global_epoch = 1;
+static struct qsbr_thread threads[QSBR_MAX_THREAD];
+static int32_t            n_slot_used  = 0;     /* high watermark of slots */
+
+static __thread int32_t   local_idx    = -1;
+
+
+void
+qsbr_register(void)
+{
+    int32_t i;
+
+    if (local_idx != -1) {
+        return;
+    }
+
+    for (i = 0; i < QSBR_MAX_THREAD; i++) {
+        bool in_use = false;
+        if (__atomic_compare_exchange_n(&threads[i].in_use, &in_use, true,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (i == QSBR_MAX_THREAD) {
+        /* an untracked reader could see its segs reused under it */
+        log_crit("more than %d threads registered for seg reclamation",
+            QSBR_MAX_THREAD);
+        exit(EX_SOFTWARE);
+    }
+
+    local_idx = i;
+
+    int32_t n_used = __atomic_load_n(&n_slot_used, __ATOMIC_RELAXED);
+    while (n_used <= i && !__atomic_compare_exchange_n(&n_slot_used, &n_used,
+            i + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    qsbr_online();
+}
+
+void
+qsbr_unregister(void)
+{
+    if (local_idx == -1) {
+        return;
+    }
+
+    qsbr_offline();
+    __atomic_store_n(&threads[local_idx].in_use, false, __ATOMIC_RELEASE);
+    local_idx = -1;
+}
+
+void
+qsbr_offline(void)
+{
+    if (local_idx == -1) {
+        return;
+    }
+
+    /* all reads from segs happen before going offline */
+    __atomic_store_n(&threads[local_idx].epoch, QSBR_OFFLINE, __ATOMIC_RELEASE);
+}
+
+void
+qsbr_online(void)
+{
+    if (local_idx == -1) {
+        return;
+    }
+
+    __atomic_store_n(&threads[local_idx].epoch,
+        __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    /* pairs with qsbr_retire and qsbr_expired: either the retiring thread
+     * sees this epoch, or we see the seg removed from the hash table */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+qsbr_quiescent(void)
+{
+    qsbr_online();
+}
+
+uint64_t
+qsbr_retire(void)
+{
+    return __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+bool
+qsbr_expired(uint64_t epoch)
+{
+    int32_t  n_used = __atomic_load_n(&n_slot_used, __ATOMIC_ACQUIRE);
+    uint64_t thread_epoch;
+
+    for (int32_t i = 0; i < n_used; i++) {
+        if (i == local_idx) {
+            continue;
+        }
+
+        thread_epoch = __atomic_load_n(&threads[i].epoch, __ATOMIC_SEQ_CST);
+        if (thread_epoch != QSBR_OFFLINE && thread_epoch < epoch) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+qsbr_wait(uint64_t epoch)
+{
+    if (qsbr_expired(epoch)) {
+        return;
+    }
+
+    /* other threads may be waiting for us at the same time */
+    qsbr_offline();
+
+    while (!qsbr_expired(epoch)) {
+        sched_yield();
+    }
+
+    qsbr_online();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Quiescent-state-based reclamation (QSBR) of segs.
+ *
+ * Readers do not take a reference on the seg they read from, instead each
+ * registered thread announces a quiescent state, a point where it holds no
+ * pointer into any seg, once per event loop iteration. A thread blocking on
+ * events goes offline and does not hold up anyone while it sleeps.
+ *
+ * When a seg is retired (made inaccessible and removed from the hash table),
+ * it is stamped with a new global epoch, the seg data can only be reused after
+ * every online thread has announced a quiescent state with an epoch no
+ * smaller than this one (a grace period).
+ *
+ * Workers and merge threads register. Threads that never register (the
+ * background thread, tests) are not tracked, so they must not read from segs
+ * or a retired hash table that can be freed concurrently; the background
+ * thread is the one that frees the retired hash table.
+ */
+
+#define QSBR_MAX_THREAD 256
+
+/**
+ * register the calling thread and mark it online, no-op if already registered
+ */
+void
+qsbr_register(void);
+
+/**
+ * unregister the calling thread, it is not tracked afterwards
+ */
+void
+qsbr_unregister(void);
+
+/**
+ * the calling thread holds no pointer into segs from now on until it goes
+ * online again, it does not delay any grace period while offline
+ */
+void
+qsbr_offline(void);
+
+/**
+ * the calling thread may access segs again, no-op if not registered
+ */
+void
+qsbr_online(void);
+
+/**
+ * announce a quiescent state, equivalent to going offline and online again
+ */
+void
+qsbr_quiescent(void);
+
+/**
+ * start a new epoch and return it, called after a seg becomes unreachable
+ */
+uint64_t
+qsbr_retire(void);
+
+/**
+ * whether all other online threads have passed a quiescent state since epoch
+ * was retired, the calling thread must not hold pointers to retired segs
+ */
+bool
+qsbr_expired(uint64_t epoch);
+
+/**
+ * wait until epoch expires, the calling thread is offline while waiting
+ */
+void
+qsbr_wait(uint64_t epoch);
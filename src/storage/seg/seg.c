@@ -1,8 +1,11 @@
 #include "seg.h"
+#include "admission.h"
 #include "background.h"
 #include "constant.h"
+#include "flash.h"
 #include "hashtable.h"
 #include "item.h"
+#include "qsbr.h"
 #include "segevict.h"
 #include "ttlbucket.h"
 #include "datapool/datapool.h"
@@ -16,6 +19,7 @@
 #include <string.h>
 #include <sysexits.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #ifdef USE_PMEM
 #include "libpmem.h"
@@ -37,10 +41,44 @@ seg_perttl_metrics_st perttl[MAX_N_TTL_BUCKET];
 
 proc_time_i   flush_at = -1;
 bool use_cas = false;
+bool use_thread_local_seg = false;
+bool use_lazy_expire = false;
+bool use_flash = false;
+bool use_admit = false;
 pthread_t     bg_tid;
-int           n_thread = 1;
+pthread_t     *merge_tid     = NULL;
+int           n_thread       = 1;
+int           n_merge_thread = 0;
 volatile bool stop     = false;
 
+/* the prefault state of each seg, a free seg is only taken once it is
+ * prefaulted, NULL unless the heap is being prefaulted in the background */
+#define SEG_PREFAULT_TODO   0
+#define SEG_PREFAULT_BUSY   1
+#define SEG_PREFAULT_DONE   2
+static uint8_t         *prefault_state     = NULL;
+static size_t          prefault_page_size;
+/* prefault threads take segs in the order of seg id with this cursor */
+static int32_t         prefault_next_seg_id;
+static uint32_t        n_prefault_running;
+static pthread_t       *prefault_tid       = NULL;
+static uint32_t        n_prefault_thread   = 0;
+static struct duration prefault_d;
+
+#define SEG_PERSIST_VERSION 1
+
+/* saved in the user data of the datapool at shutdown, the segs are only
+ * recovered if the heap layout is the same */
+struct seg_persist_info {
+    uint32_t    version;
+    uint32_t    seg_hdr_size;
+    uint64_t    seg_size;
+    uint64_t    heap_size;
+    uint32_t    item_hdr_size;
+    proc_time_i flush_at;
+    int64_t     time_started;   /* unix time when proc time is 0 */
+};
+
 static char *seg_state_change_str[] = {
     "allocation",
     "concurrent_get",
@@ -81,45 +119,57 @@ dump_seg_info(void)
 }
 
 /**
- * wait until no other threads are accessing the seg (refcount == 0)
+ * wait until no other threads are writing to the seg (w_refcount == 0),
+ * readers do not hold a refcount, they are waited for with a grace period
+ * before the seg is reused, see seg_retire
  */
 void
 seg_wait_refcnt(int32_t seg_id)
 {
-    struct seg *seg          = &heap.segs[seg_id];
+    struct seg *seg = &heap.segs[seg_id];
     ASSERT(seg->accessible != 1);
-    bool       r_log_printed = false, w_log_printed = false;
-    int        r_ref, w_ref;
+    int        w_ref;
 
     w_ref = __atomic_load_n(&(seg->w_refcount), __ATOMIC_RELAXED);
-    r_ref = __atomic_load_n(&(seg->r_refcount), __ATOMIC_RELAXED);
 
-    if (w_ref) {
-        log_verb("wait for seg %d refcount, current read refcount "
-                 "%d, write refcount %d",
-            seg_id, r_ref, w_ref);
-        w_log_printed = true;
+    if (w_ref == 0) {
+        return;
     }
 
+    log_verb("wait for seg %d refcount, current write refcount %d",
+        seg_id, w_ref);
+
     while (w_ref) {
         sched_yield();
         w_ref = __atomic_load_n(&(seg->w_refcount), __ATOMIC_RELAXED);
     }
 
-    if (r_ref) {
-        log_verb("wait for seg %d refcount, current read refcount "
-                 "%d, write refcount %d",
-            seg_id, r_ref, w_ref);
-        r_log_printed = true;
-    }
+    log_verb("wait for seg %d refcount finishes", seg_id);
+}
 
-    while (r_ref) {
-        sched_yield();
-        r_ref = __atomic_load_n(&(seg->r_refcount), __ATOMIC_RELAXED);
-    }
+void
+seg_retire(int32_t seg_id)
+{
+    struct seg *seg = &heap.segs[seg_id];
+    ASSERT(seg->accessible != 1);
+
+    /* readers that found the seg before it was removed from the hash table
+     * have announced an older epoch */
+    __atomic_store_n(&seg->retire_epoch, qsbr_retire(), __ATOMIC_RELAXED);
+}
 
-    if (r_log_printed || w_log_printed)
-        log_verb("wait for seg %d refcount finishes", seg_id);
+void
+seg_thread_online(void)
+{
+    /* workers register on their first event */
+    qsbr_register();
+    qsbr_online();
+}
+
+void
+seg_thread_offline(void)
+{
+    qsbr_offline();
 }
 
 /**
@@ -212,6 +262,8 @@ seg_init(int32_t seg_id)
     seg->create_at = time_proc_sec();
     seg->merge_at  = 0;
 
+    seg->retire_epoch = 0;
+
     seg->accessible = 1;
 
     seg->n_hit         = 0;
@@ -226,9 +278,8 @@ rm_seg_from_ttl_bucket(int32_t seg_id)
     struct ttl_bucket *ttl_bucket = &ttl_buckets[find_ttl_bucket_idx(seg->ttl)];
     ASSERT(seg->ttl == ttl_bucket->ttl);
 
-    /* all modification to seg chain needs to be protected by lock
-     * TODO(juncheng): can change to the TTL lock? */
-    ASSERT(pthread_mutex_trylock(&heap.mtx) != 0);
+    /* all modification to seg chain needs to be protected by lock */
+    ASSERT(pthread_mutex_trylock(&ttl_bucket->chain_mtx) != 0);
 
     int32_t prev_seg_id = seg->prev_seg_id;
     int32_t next_seg_id = seg->next_seg_id;
@@ -236,7 +287,7 @@ rm_seg_from_ttl_bucket(int32_t seg_id)
     if (prev_seg_id == -1) {
         ASSERT(ttl_bucket->first_seg_id == seg_id);
 
-        ttl_bucket->first_seg_id = next_seg_id;
+        ttl_bucket_set_first_seg(find_ttl_bucket_idx(seg->ttl), next_seg_id);
     }
     else {
         heap.segs[prev_seg_id].next_seg_id = next_seg_id;
@@ -251,6 +302,12 @@ rm_seg_from_ttl_bucket(int32_t seg_id)
         heap.segs[next_seg_id].prev_seg_id = prev_seg_id;
     }
 
+    /* next_seg_to_merge is only changed under chain lock, keep it pointing to
+     * a seg in this chain so mergers never start from a freed/reused seg */
+    if (ttl_bucket->next_seg_to_merge == seg_id) {
+        ttl_bucket->next_seg_to_merge = next_seg_id;
+    }
+
     ttl_bucket->n_seg -= 1;
     ASSERT(ttl_bucket->n_seg >= 0);
 
@@ -335,9 +392,9 @@ rm_all_item_on_seg(int32_t seg_id, enum seg_state_change reason)
 #endif
 
     /* remove segment from TTL bucket */
-    pthread_mutex_lock(&heap.mtx);
+    ttl_bucket_lock(find_ttl_bucket_idx(seg->ttl));
     rm_seg_from_ttl_bucket(seg_id);
-    pthread_mutex_unlock(&heap.mtx);
+    ttl_bucket_unlock(find_ttl_bucket_idx(seg->ttl));
 
     while (curr - seg_data < offset) {
         /* check both offset and n_live_item is because when a segment is expiring
@@ -384,10 +441,10 @@ rm_all_item_on_seg(int32_t seg_id, enum seg_state_change reason)
 
     /* all operation up till here does not require refcount to be 0
      * because the data on the segment is not cleared yet,
-     * now we are ready to clear the segment data, we need to check refcount.
+     * now we need to wait for the writers on this segment.
      * Because we have already locked the segment before removing entries
      * from hashtable, ideally by the time we have removed all hashtable
-     * entries, all previous requests on this segment have all finished */
+     * entries, all previous writes on this segment have all finished */
     seg_wait_refcnt(seg_id);
 
     /* optimistic concurrency control:
@@ -428,29 +485,257 @@ rm_all_item_on_seg(int32_t seg_id, enum seg_state_change reason)
     ASSERT(seg->n_live_item == 0);
     ASSERT(seg->live_bytes == 0 || seg->live_bytes == 8);
 
+    /* no new reader can find the seg, the ones still reading are waited for
+     * before the seg is reused */
+    seg_retire(seg_id);
+
+    return true;
+}
+
+/*
+ * expire the seg without removing its items one by one, the hash table
+ * entries of the items become stale when the seg generation is bumped,
+ * and are dropped lazily, see hashtable_expire_seg
+ */
+static bool
+expire_seg_lazy(int32_t seg_id)
+{
+    struct seg *seg = &heap.segs[seg_id];
+
+    if (__atomic_exchange_n(&seg->evictable, 0, __ATOMIC_RELAXED) == 0) {
+        SEG_PRINT(seg_id, "expiring unevictable seg", log_warn);
+
+        INCR(seg_metrics, seg_evict_ex);
+        return false;
+    }
+
+    __atomic_store_n(&seg->accessible, 0, __ATOMIC_RELAXED);
+
+    SEG_PRINT(seg_id, seg_state_change_str[SEG_EXPIRATION], log_debug);
+
+    ttl_bucket_lock(find_ttl_bucket_idx(seg->ttl));
+    rm_seg_from_ttl_bucket(seg_id);
+    ttl_bucket_unlock(find_ttl_bucket_idx(seg->ttl));
+
+    /* slow writers insert into the hash table before they release the seg,
+     * so their entries become stale too */
+    seg_wait_refcnt(seg_id);
+
+    hashtable_expire_seg(seg_id);
+    __atomic_store_n(&seg->n_live_item, 0, __ATOMIC_RELAXED);
+
+    seg_retire(seg_id);
+
     return true;
 }
 
 rstatus_i
 expire_seg(int32_t seg_id)
 {
-    bool success = rm_all_item_on_seg(seg_id, SEG_EXPIRATION);
+    bool success = use_lazy_expire ? expire_seg_lazy(seg_id) :
+        rm_all_item_on_seg(seg_id, SEG_EXPIRATION);
     if (!success) {
         return CC_ERROR;
     }
 
-    int status = pthread_mutex_lock(&heap.mtx);
-    ASSERT(status == 0);
-
     seg_add_to_freepool(seg_id, SEG_EXPIRATION);
 
-    pthread_mutex_unlock(&heap.mtx);
-
     INCR(seg_metrics, seg_expire);
 
     return CC_OK;
 }
 
+/* the node whose free pool the seg belongs to, node k has the segs
+ * [ceil(k * max_nseg / n_node), ceil((k + 1) * max_nseg / n_node)) */
+static inline int
+_seg_node(int32_t seg_id)
+{
+    return (int) ((int64_t) seg_id * heap.n_node / heap.max_nseg);
+}
+
+static inline int32_t
+_node_first_seg(int node)
+{
+    return (int32_t) (((int64_t) node * heap.max_nseg + heap.n_node - 1) /
+        heap.n_node);
+}
+
+/* push the seg onto the lock-free free pool stack of its node */
+static inline void
+_seg_push_free(int32_t seg_id)
+{
+    struct seg *seg     = &heap.segs[seg_id];
+    uint64_t   *top_ptr = &heap.free_seg_top[_seg_node(seg_id)];
+    uint64_t   top      = __atomic_load_n(top_ptr, __ATOMIC_RELAXED);
+
+    seg->prev_seg_id = -1;
+    for (;;) {
+        __atomic_store_n(&seg->next_seg_id, FREE_SEG_ID(top), __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(top_ptr, &top,
+                FREE_SEG_TOP(seg_id, FREE_SEG_TAG(top) + 1), false,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        INCR(seg_metrics, seg_free_retry);
+    }
+}
+
+/* pop a seg from the lock-free free pool stack of node, -1 if it is empty,
+ * the tag of the stack top changes on every push and pop, so a pop that
+ * has read the next seg of a top that is popped and pushed back by other
+ * threads in the meantime fails its CAS (ABA) */
+static inline int32_t
+_seg_pop_free_node(int node)
+{
+    uint64_t *top_ptr = &heap.free_seg_top[node];
+    uint64_t top      = __atomic_load_n(top_ptr, __ATOMIC_ACQUIRE);
+    int32_t  seg_id, next_seg_id;
+
+    for (;;) {
+        seg_id = FREE_SEG_ID(top);
+        if (seg_id == -1) {
+            return -1;
+        }
+
+        next_seg_id = __atomic_load_n(&heap.segs[seg_id].next_seg_id,
+            __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(top_ptr, &top,
+                FREE_SEG_TOP(next_seg_id, FREE_SEG_TAG(top) + 1), false,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return seg_id;
+        }
+        INCR(seg_metrics, seg_free_retry);
+    }
+}
+
+/* pop a free seg, from the pool of the node we run on if it has one */
+static inline int32_t
+_seg_pop_free(void)
+{
+    int     node = 0;
+    int32_t seg_id;
+
+    if (heap.n_node > 1) {
+        node = seg_numa_node() % heap.n_node;
+    }
+
+    for (int i = 0; i < heap.n_node; i++) {
+        seg_id = _seg_pop_free_node((node + i) % heap.n_node);
+        if (seg_id != -1) {
+            if (i > 0) {
+                INCR(seg_metrics, seg_numa_remote);
+            }
+            return seg_id;
+        }
+    }
+
+    return -1;
+}
+
+static inline bool
+_seg_free_empty(void)
+{
+    for (int i = 0; i < heap.n_node; i++) {
+        if (FREE_SEG_ID(__atomic_load_n(&heap.free_seg_top[i],
+                __ATOMIC_RELAXED)) != -1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* take one from the free seg count if more than n_keep segs are free */
+static inline bool
+_seg_take_free_cnt(int32_t n_keep)
+{
+    int32_t n_free = __atomic_load_n(&heap.n_free_seg, __ATOMIC_RELAXED);
+
+    do {
+        if (n_free <= n_keep) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&heap.n_free_seg, &n_free,
+        n_free - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/* move limbo segs whose grace period has expired to the free pool stack,
+ * return the retire epoch of the first seg left in limbo, 0 if none */
+static uint64_t
+_seg_reclaim_limbo(void)
+{
+    int32_t  seg_id;
+    uint64_t epoch = 0;
+
+    pthread_mutex_lock(&heap.limbo_mtx);
+
+    while (heap.limbo_head != -1) {
+        seg_id = heap.limbo_head;
+        if (!qsbr_expired(heap.segs[seg_id].retire_epoch)) {
+            epoch = heap.segs[seg_id].retire_epoch;
+            break;
+        }
+
+        heap.limbo_head = heap.segs[seg_id].next_seg_id;
+        if (heap.limbo_head == -1) {
+            heap.limbo_tail = -1;
+        }
+
+        _seg_push_free(seg_id);
+        heap.n_limbo_seg -= 1;
+    }
+
+    ASSERT(heap.n_limbo_seg >= 0);
+    UPDATE_VAL(seg_metrics, seg_limbo, heap.n_limbo_seg);
+
+    pthread_mutex_unlock(&heap.limbo_mtx);
+
+    return epoch;
+}
+
+/*
+ * touch every page of the seg so that writes to it do not fault, the data
+ * are written back as they are, a seg must not be written to meanwhile
+ */
+static void
+_seg_prefault_pages(int32_t seg_id)
+{
+    volatile uint8_t *curr = get_seg_data_start(seg_id);
+    uint8_t          *end  = (uint8_t *) curr + heap.seg_size;
+
+    for (; curr < end; curr += prefault_page_size) {
+        *curr = *curr;
+    }
+}
+
+/*
+ * prefault the seg unless another thread has, in which case wait for it to
+ * finish, return true if the seg is prefaulted by us
+ */
+static bool
+_seg_prefault(int32_t seg_id)
+{
+    uint8_t state = SEG_PREFAULT_TODO;
+
+    if (__atomic_compare_exchange_n(&prefault_state[seg_id], &state,
+            SEG_PREFAULT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        _seg_prefault_pages(seg_id);
+        __atomic_store_n(&prefault_state[seg_id], SEG_PREFAULT_DONE,
+            __ATOMIC_RELEASE);
+
+        return true;
+    }
+
+    while (state != SEG_PREFAULT_DONE) {
+        sched_yield();
+        state = __atomic_load_n(&prefault_state[seg_id], __ATOMIC_ACQUIRE);
+    }
+
+    return false;
+}
+
 /**
  * get a seg from free pool,
  *
@@ -460,60 +745,68 @@ expire_seg(int32_t seg_id)
 int32_t
 seg_get_from_freepool(bool use_reserved)
 {
-    int32_t seg_id_ret, next_seg_id;
-
-    int status = pthread_mutex_lock(&heap.mtx);
-
-    if (status != 0) {
-        log_warn("fail to lock seg free pool");
-        pthread_mutex_unlock(&heap.mtx);
+    int32_t  seg_id_ret, n_free;
+    uint64_t epoch;
+
+    /* a seg in the stack or in limbo is set aside for us once we have taken
+     * one from the count, because the count is increased after the seg is
+     * added to the free pool */
+    if (!_seg_take_free_cnt(use_reserved ? 0 : heap.n_reserved_seg)) {
+        if (evict_info.free_low_wat > 0) {
+            wake_background_thread();
+        }
 
         return -1;
     }
 
-    if (heap.n_free_seg == 0 ||
-        (!use_reserved && heap.n_free_seg <= heap.n_reserved_seg)) {
-        pthread_mutex_unlock(&heap.mtx);
+    n_free = __atomic_load_n(&heap.n_free_seg, __ATOMIC_RELAXED);
+    UPDATE_VAL(seg_metrics, seg_free, n_free);
 
-        return -1;
-    }
-
-    heap.n_free_seg -= 1;
-    ASSERT(heap.n_free_seg >= 0);
+    while ((seg_id_ret = _seg_pop_free()) == -1) {
+        epoch = _seg_reclaim_limbo();
+        if (!_seg_free_empty()) {
+            continue;
+        }
 
-    seg_id_ret = heap.free_seg_id;
-    ASSERT(seg_id_ret >= 0);
+        if (epoch != 0) {
+            /* all free segs have been retired recently, waiting for the
+             * readers is much cheaper than evicting another seg */
+            INCR(seg_metrics, seg_grace_wait);
+            qsbr_wait(epoch);
+        } else {
+            /* the seg set aside for us is being moved to the stack */
+            sched_yield();
+        }
+    }
 
-    next_seg_id = heap.segs[seg_id_ret].next_seg_id;
-    heap.free_seg_id = next_seg_id;
-    if (next_seg_id != -1) {
-        heap.segs[next_seg_id].prev_seg_id = -1;
+    if (prefault_state != NULL &&
+        __atomic_load_n(&prefault_state[seg_id_ret], __ATOMIC_ACQUIRE) !=
+            SEG_PREFAULT_DONE) {
+        /* the heap is being prefaulted in the background */
+        if (_seg_prefault(seg_id_ret)) {
+            INCR(seg_metrics, seg_prefault_inline);
+        }
     }
 
     ASSERT(heap.segs[seg_id_ret].write_offset == 0);
 
-    pthread_mutex_unlock(&heap.mtx);
+    if (n_free - heap.n_reserved_seg < evict_info.free_low_wat) {
+        /* evict before the next writers run out of free segs */
+        wake_background_thread();
+    }
 
     return seg_id_ret;
 }
 
 /**
- * add evicted/allocated seg to free pool,
- * caller should grab the heap lock before calling this function
+ * add evicted/allocated seg to free pool, a retired seg that readers may
+ * still be accessing is kept in limbo until its grace period expires
  **/
 void
 seg_add_to_freepool(int32_t seg_id, enum seg_state_change reason)
 {
-    ASSERT(pthread_mutex_trylock(&heap.mtx) != 0);
-
     struct seg *seg = &heap.segs[seg_id];
-    seg->next_seg_id = heap.free_seg_id;
-    seg->prev_seg_id = -1;
-    if (heap.free_seg_id != -1) {
-        ASSERT(heap.segs[heap.free_seg_id].prev_seg_id == -1);
-        heap.segs[heap.free_seg_id].prev_seg_id = seg_id;
-    }
-    heap.free_seg_id = seg_id;
+    int32_t    n_free;
 
     /* we set all free segs as locked to prevent it being evicted
      * before finishing setup */
@@ -525,10 +818,33 @@ seg_add_to_freepool(int32_t seg_id, enum seg_state_change reason)
     seg->write_offset = 0;
     seg->live_bytes   = 0;
 
-    heap.n_free_seg += 1;
+    if (qsbr_expired(seg->retire_epoch)) {
+        _seg_push_free(seg_id);
+    } else {
+        pthread_mutex_lock(&heap.limbo_mtx);
+
+        seg->next_seg_id = -1;
+        seg->prev_seg_id = -1;
+        if (heap.limbo_tail == -1) {
+            heap.limbo_head = seg_id;
+        } else {
+            heap.segs[heap.limbo_tail].next_seg_id = seg_id;
+        }
+        heap.limbo_tail = seg_id;
+
+        heap.n_limbo_seg += 1;
+        UPDATE_VAL(seg_metrics, seg_limbo, heap.n_limbo_seg);
+
+        pthread_mutex_unlock(&heap.limbo_mtx);
+    }
+
+    n_free = __atomic_add_fetch(&heap.n_free_seg, 1, __ATOMIC_RELEASE);
+    UPDATE_VAL(seg_metrics, seg_free, n_free);
 
     log_vverb("add %s seg %d to free pool, %d free segs",
-        seg_state_change_str[reason], seg_id, heap.n_free_seg);
+        seg_state_change_str[reason], seg_id, n_free);
+    /* n_free is only read by stats & logging, either may be compiled out */
+    (void)n_free;
 }
 
 /**
@@ -559,6 +875,13 @@ seg_get_new(void)
         }
 
         if (status == EVICT_OK) {
+            INCR(seg_metrics, seg_evict_inline);
+
+            /* readers may still be on the seg we have just evicted */
+            if (!qsbr_expired(heap.segs[seg_id_ret].retire_epoch)) {
+                INCR(seg_metrics, seg_grace_wait);
+                qsbr_wait(heap.segs[seg_id_ret].retire_epoch);
+            }
             break;
         }
 
@@ -567,6 +890,9 @@ seg_get_new(void)
 
             INCR(seg_metrics, seg_evict_retry);
         }
+
+        /* merges by other threads may have returned segs to the pool */
+        seg_id_ret = seg_get_from_freepool(false);
     }
 
     if (seg_id_ret == -1) {
@@ -594,13 +920,61 @@ heap_init(void)
     }
 }
 
+/* seg headers and the TTL bucket chains are saved after the seg data */
+static inline size_t
+seg_persist_size(void)
+{
+    return SEG_HDR_SIZE * heap.max_nseg + sizeof(int32_t) * 2 * MAX_N_TTL_BUCKET;
+}
+
+/*
+ * set the memory policy of the heap before the segs are written, with
+ * per-node pools, the segs of each node are allocated on the node
+ */
+static void
+_heap_place(void)
+{
+    int32_t first, last;
+
+    if (heap.numa == SEG_NUMA_INTERLEAVE) {
+        seg_numa_interleave(heap.base, heap.heap_size, heap.hugepage_size);
+    } else if (heap.numa == SEG_NUMA_LOCAL) {
+        for (int node = 0; node < heap.n_node; node++) {
+            first = _node_first_seg(node);
+            last  = _node_first_seg(node + 1);
+            seg_numa_prefer(heap.base + heap.seg_size * first,
+                heap.seg_size * (last - first), heap.hugepage_size, node);
+        }
+    }
+}
+
 static int
 setup_heap_mem(void)
 {
     int datapool_fresh = 1;
 
-    heap.pool = datapool_open(heap.poolpath, heap.poolname, heap.heap_size,
-        &datapool_fresh, heap.prefault);
+    heap.pool = NULL;
+    if (heap.hugepage_size > 0) {
+        if (heap.poolpath != NULL) {
+            log_warn("seg_hugepage is ignored with a datapool file, put the "
+                     "file on hugetlbfs instead");
+            heap.hugepage_size = 0;
+        } else {
+            heap.pool = datapool_open_hugetlb(heap.poolname,
+                heap.heap_size + seg_persist_size(), heap.hugepage_size);
+        }
+        if (heap.pool == NULL && heap.hugepage_size > 0) {
+            log_warn("cannot map the heap in %zu-byte huge pages, use regular "
+                     "pages", heap.hugepage_size);
+            heap.hugepage_size = 0;
+        }
+    }
+
+    if (heap.pool == NULL) {
+        /* the heap is prefaulted in parallel after it is recovered */
+        heap.pool = datapool_open(heap.poolpath, heap.poolname,
+            heap.heap_size + seg_persist_size(), &datapool_fresh, false);
+    }
 
     if (heap.pool == NULL || datapool_addr(heap.pool) == NULL) {
         log_crit("create datapool failed: %s - %zu bytes for %" PRIu32 " segs",
@@ -612,10 +986,428 @@ setup_heap_mem(void)
         heap.max_nseg);
 
     heap.base = datapool_addr(heap.pool);
+    _heap_place();
 
     return datapool_fresh;
 }
 
+/*
+ * save the seg headers and the TTL bucket chains into the datapool, so that
+ * the segs can be recovered after restart if the datapool is file-backed
+ */
+static void
+seg_heap_save(void)
+{
+    struct seg_persist_info info;
+    struct seg              *saved_segs;
+    int32_t                 *saved_chains;
+
+    if (use_thread_local_seg) {
+        /* link all thread-local active segs so that they are saved */
+        ttl_bucket_reclaim_local_segs(0);
+    }
+
+    saved_segs   = (struct seg *) (heap.base + heap.heap_size);
+    saved_chains = (int32_t *) (saved_segs + heap.max_nseg);
+
+    cc_memcpy(saved_segs, heap.segs, SEG_HDR_SIZE * heap.max_nseg);
+    for (int32_t i = 0; i < MAX_N_TTL_BUCKET; i++) {
+        saved_chains[i * 2]     = ttl_buckets[i].first_seg_id;
+        saved_chains[i * 2 + 1] = ttl_buckets[i].last_seg_id;
+    }
+
+    info.version       = SEG_PERSIST_VERSION;
+    info.seg_size      = heap.seg_size;
+    info.heap_size     = heap.heap_size;
+    info.seg_hdr_size  = SEG_HDR_SIZE;
+    info.item_hdr_size = ITEM_HDR_SIZE;
+    info.time_started  = time_started();
+    info.flush_at      = flush_at;
+
+    datapool_set_user_data(heap.pool, &info, sizeof(info));
+}
+
+/*
+ * insert the items on a recovered seg into the hash table, deleted items are
+ * skipped, and the live bytes/items of the seg are counted again
+ */
+static void
+seg_recover_items(int32_t seg_id)
+{
+    struct seg  *seg      = &heap.segs[seg_id];
+    uint8_t     *seg_data = get_seg_data_start(seg_id);
+    uint8_t     *curr     = seg_data;
+    uint8_t     *end      = seg_data + MIN(seg->write_offset, heap.seg_size);
+    struct item *it;
+    uint32_t    sz, n_item = 0;
+    size_t      n_byte = 0;
+
+#if defined CC_ASSERT_PANIC || defined CC_ASSERT_LOG
+    ASSERT(*(uint64_t *) (curr) == SEG_MAGIC);
+    curr += sizeof(uint64_t);
+#endif
+
+    seg->n_live_item = 0;
+    seg->live_bytes  = curr - seg_data;
+
+    while (curr + ITEM_HDR_SIZE <= end) {
+        it = (struct item *) curr;
+        if (it->klen == 0 && it->vlen == 0) {
+            /* the rest of the seg has not been written */
+            break;
+        }
+
+#if defined CC_ASSERT_PANIC || defined CC_ASSERT_LOG
+        ASSERT(it->magic == ITEM_MAGIC);
+#endif
+        sz = item_ntotal(it);
+        if (curr + sz > end) {
+            log_warn("seg %d has a truncated item at offset %d", seg_id,
+                (int) (curr - seg_data));
+            break;
+        }
+
+        if (!it->deleted) {
+            /* hashtable_put marked the older versions of the key deleted
+             * when this one was written, so this is the only live version */
+            __atomic_add_fetch(&seg->n_live_item, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&seg->live_bytes, sz, __ATOMIC_RELAXED);
+
+#if defined DEBUG_MODE
+            hashtable_put(it, (uint64_t) seg->seg_id_non_decr,
+                (uint64_t) (curr - seg_data));
+#else
+            hashtable_put(it, (uint64_t) seg_id, (uint64_t) (curr - seg_data));
+#endif
+
+            n_item += 1;
+            n_byte += sz;
+        }
+
+        curr += sz;
+    }
+
+    INCR_N(seg_metrics, item_curr, n_item);
+    INCR_N(seg_metrics, item_curr_bytes, n_byte);
+    PERTTL_INCR_N(find_ttl_bucket_idx(seg->ttl), item_curr, n_item);
+    PERTTL_INCR_N(find_ttl_bucket_idx(seg->ttl), item_curr_bytes, n_byte);
+
+    INCR(seg_metrics, seg_recover_seg);
+    INCR_N(seg_metrics, seg_recover_item, n_item);
+}
+
+/* recovery threads take segs in the order of seg id with this cursor */
+static int32_t recover_next_seg_id;
+
+static void *
+seg_recover_main(void *arg)
+{
+    int32_t seg_id;
+
+    while ((seg_id = __atomic_fetch_add(&recover_next_seg_id, 1,
+        __ATOMIC_RELAXED)) < heap.max_nseg) {
+        if (!heap.segs[seg_id].recovered) {
+            continue;
+        }
+
+        seg_recover_items(seg_id);
+    }
+
+    return NULL;
+}
+
+/*
+ * insert the items of all recovered segs into the hash table, the segs are
+ * scanned by seg_recover_thread threads (including the caller) in parallel,
+ * which is safe because each live key has only one (non-deleted) item:
+ * neither the seg id nor the create_at of the segs tells which of two
+ * versions was written last, so hashtable_put deletes the older version
+ * wherever it is in the bucket chain
+ */
+static void
+seg_recover_all_items(void)
+{
+    uint32_t  n_recover_thread = option_uint(&seg_options->seg_recover_thread);
+    pthread_t *tids;
+    uint32_t  n_started = 0;
+
+    if (n_recover_thread == 0) {
+        long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n_recover_thread = n_cpu > 0 ? n_cpu : 1;
+    }
+
+    recover_next_seg_id = 0;
+
+    tids = cc_alloc(sizeof(pthread_t) * n_recover_thread);
+    for (uint32_t i = 1; tids != NULL && i < n_recover_thread; i++) {
+        if (pthread_create(&tids[n_started], NULL, seg_recover_main, NULL)
+            != 0) {
+            log_warn("fail to start seg recovery thread, %" PRIu32
+                     " threads are used", n_started + 1);
+            break;
+        }
+        n_started += 1;
+    }
+
+    seg_recover_main(NULL);
+
+    for (uint32_t i = 0; i < n_started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    cc_free(tids);
+}
+
+static void
+seg_prefault_done(void)
+{
+    duration_stop(&prefault_d);
+    UPDATE_VAL(seg_metrics, seg_prefault_time_ms,
+        (uint64_t) duration_ms(&prefault_d));
+    log_info("prefaulted %zu bytes of heap in %.0f ms", heap.heap_size,
+        duration_ms(&prefault_d));
+}
+
+static void *
+seg_prefault_main(void *arg)
+{
+    int32_t seg_id;
+
+    while (!stop && (seg_id = __atomic_fetch_add(&prefault_next_seg_id, 1,
+        __ATOMIC_RELAXED)) < heap.max_nseg) {
+        if (_seg_prefault(seg_id)) {
+            INCR(seg_metrics, seg_prefault_seg);
+        }
+    }
+
+    /* the last thread to finish reports the time */
+    if (__atomic_sub_fetch(&n_prefault_running, 1, __ATOMIC_ACQ_REL) == 0 &&
+        !stop) {
+        seg_prefault_done();
+    }
+
+    return NULL;
+}
+
+static void
+seg_prefault_join(void)
+{
+    for (uint32_t i = 0; i < n_prefault_thread; i++) {
+        pthread_join(prefault_tid[i], NULL);
+    }
+    cc_free(prefault_tid);
+    prefault_tid      = NULL;
+    n_prefault_thread = 0;
+
+    cc_free(prefault_state);
+    prefault_state = NULL;
+}
+
+/*
+ * prefault the segs of a file-backed heap with seg_prefault_thread threads
+ * (including the caller), the recovered segs have been faulted in by the
+ * recovery, when the prefault is lazy, the threads run in the background,
+ * and a writer taking a free seg that is not prefaulted yet prefaults it
+ */
+static void
+seg_prefault_heap(void)
+{
+    uint32_t n        = option_uint(&seg_options->seg_prefault_thread);
+    uint32_t n_caller = heap.prefault_lazy ? 0 : 1;
+
+    if (n == 0) {
+        long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n = n_cpu > 0 ? n_cpu : 1;
+    }
+
+    prefault_state = cc_zalloc(heap.max_nseg);
+    if (prefault_state == NULL) {
+        log_warn("cannot allocate prefault states, the heap is not "
+                 "prefaulted");
+        return;
+    }
+    for (int32_t i = 0; i < heap.max_nseg; i++) {
+        if (heap.segs[i].recovered) {
+            prefault_state[i] = SEG_PREFAULT_DONE;
+        }
+    }
+
+    prefault_page_size   = (size_t) sysconf(_SC_PAGESIZE);
+    prefault_next_seg_id = 0;
+    n_prefault_running   = n;
+    n_prefault_thread    = 0;
+    duration_start(&prefault_d);
+
+    prefault_tid = cc_alloc(sizeof(pthread_t) * n);
+    for (uint32_t i = n_caller; prefault_tid != NULL && i < n; i++) {
+        if (pthread_create(&prefault_tid[n_prefault_thread], NULL,
+            seg_prefault_main, NULL) != 0) {
+            log_warn("fail to start seg prefault thread, %" PRIu32
+                     " threads are used", n_prefault_thread + n_caller);
+            break;
+        }
+        n_prefault_thread += 1;
+    }
+
+    /* the threads not started do not finish */
+    if (__atomic_sub_fetch(&n_prefault_running,
+        n - n_caller - n_prefault_thread, __ATOMIC_ACQ_REL) == 0) {
+        if (n_prefault_thread > 0) {
+            /* lazy, and the threads are done already */
+            seg_prefault_done();
+            return;
+        }
+        /* lazy, but no thread to prefault in the background */
+        n_prefault_running = 1;
+        n_caller           = 1;
+    }
+
+    if (n_caller > 0) {
+        seg_prefault_main(NULL);
+        /* all segs are prefaulted, writers need not check any more */
+        seg_prefault_join();
+    }
+}
+
+/*
+ * recover the segs saved at the last clean shutdown, the seg headers and
+ * the TTL bucket chains are restored, the items on unexpired segs are
+ * inserted into the hash table, and the other segs are added to free pool,
+ * return false if the saved heap has a different layout
+ */
+static bool
+seg_heap_recover(void)
+{
+    struct seg_persist_info info;
+    struct seg              *saved_segs, *seg;
+    int32_t                 *saved_chains;
+    struct ttl_bucket       *ttl_bucket;
+    int32_t                 seg_id, next_seg_id, n_walked;
+    int32_t                 n_seg = 0, n_item = 0;
+    proc_time_i             delta, now = time_proc_sec();
+    struct duration         d;
+
+    datapool_get_user_data(heap.pool, &info, sizeof(info));
+    if (info.version != SEG_PERSIST_VERSION ||
+        info.seg_size != heap.seg_size || info.heap_size != heap.heap_size ||
+        info.seg_hdr_size != SEG_HDR_SIZE ||
+        info.item_hdr_size != ITEM_HDR_SIZE) {
+        log_warn("datapool %s has a different heap layout, segs are not "
+                 "recovered", heap.poolpath);
+
+        return false;
+    }
+
+    saved_segs   = (struct seg *) (heap.base + heap.heap_size);
+    saved_chains = (int32_t *) (saved_segs + heap.max_nseg);
+
+    cc_memcpy(heap.segs, saved_segs, SEG_HDR_SIZE * heap.max_nseg);
+
+    /* proc time of the last run starts at a different unix time */
+    delta = (proc_time_i) (info.time_started - time_started());
+
+    pthread_mutex_lock(&heap.mtx);
+
+    for (int32_t i = 0; i < heap.max_nseg; i++) {
+        heap.segs[i].seg_id       = i;
+        heap.segs[i].recovered    = 0;
+        heap.segs[i].w_refcount   = 0;
+        heap.segs[i].retire_epoch = 0;
+        heap.segs[i].gen          = 0;
+        heap.segs[i].stale_sweep  = 0;
+        heap.segs[i].wrap_sweep   = 0;
+        heap.segs[i].evictable    = 0;
+        heap.segs[i].accessible   = 0;
+    }
+
+    for (int32_t i = 0; i < MAX_N_TTL_BUCKET; i++) {
+        ttl_bucket = &ttl_buckets[i];
+        seg_id     = saved_chains[i * 2];
+        n_walked   = 0;
+
+        while (seg_id >= 0 && seg_id < heap.max_nseg &&
+            n_walked++ < heap.max_nseg) {
+            seg         = &heap.segs[seg_id];
+            next_seg_id = seg->next_seg_id;
+
+            if (seg->recovered || find_ttl_bucket_idx(seg->ttl) != i ||
+                seg->create_at <= info.flush_at ||
+                seg->create_at + delta + seg->ttl <= now) {
+                /* expired or flushed */
+                seg_id = next_seg_id;
+                continue;
+            }
+
+            seg->create_at += delta;
+            if (seg->merge_at != 0) {
+                seg->merge_at += delta;
+            }
+
+            /* segs created before this process started must not look
+             * flushed */
+            if (seg->create_at <= flush_at) {
+                flush_at = seg->create_at - 1;
+            }
+
+            n_seg += 1;
+
+            seg->prev_seg_id = ttl_bucket->last_seg_id;
+            seg->next_seg_id = -1;
+            if (ttl_bucket->last_seg_id == -1) {
+                ttl_bucket->first_seg_id = seg_id;
+            } else {
+                heap.segs[ttl_bucket->last_seg_id].next_seg_id = seg_id;
+            }
+            ttl_bucket->last_seg_id = seg_id;
+            ttl_bucket->n_seg += 1;
+
+            seg->recovered  = 1;
+            seg->accessible = 1;
+            seg->evictable  = 1;
+
+            PERTTL_INCR(i, seg_curr);
+
+            seg_id = next_seg_id;
+        }
+
+        if (ttl_bucket->first_seg_id != -1) {
+            ttl_bucket_update_expiration(i);
+        }
+    }
+
+    heap.n_free_seg = 0;
+    for (int32_t i = heap.max_nseg - 1; i >= 0; i--) {
+        if (heap.segs[i].recovered) {
+            continue;
+        }
+#ifdef DEBUG_MODE
+        heap.segs[i].seg_id_non_decr = i;
+#endif
+        seg_add_to_freepool(i, SEG_ALLOCATION);
+    }
+
+    pthread_mutex_unlock(&heap.mtx);
+
+    UPDATE_VAL(seg_metrics, seg_recover_total, n_seg);
+    duration_start(&d);
+
+    seg_recover_all_items();
+
+    duration_stop(&d);
+    UPDATE_VAL(seg_metrics, seg_recover_time_ms, (uint64_t) duration_ms(&d));
+
+    for (int32_t i = 0; i < heap.max_nseg; i++) {
+        if (heap.segs[i].recovered) {
+            n_item += heap.segs[i].n_live_item;
+        }
+    }
+
+    log_info("recovered %" PRId32 " items on %" PRId32 " segs from datapool "
+             "%s in %.0f ms (%.0f items/sec)", n_item, n_seg, heap.poolpath,
+        duration_ms(&d), n_item / MAX(duration_sec(&d), 1e-6));
+
+    return true;
+}
+
 static rstatus_i
 seg_heap_setup(void)
 {
@@ -626,15 +1418,11 @@ seg_heap_setup(void)
 
     dram_fresh = setup_heap_mem();
     pthread_mutex_init(&heap.mtx, NULL);
+    pthread_mutex_init(&heap.limbo_mtx, NULL);
 
     heap.segs = cc_zalloc(seg_hdr_sz);
 
-    if (!dram_fresh) {
-        /* TODO(jason): recover */
-        ;
-    }
-    else {
-        pthread_mutex_lock(&heap.mtx);
+    if (dram_fresh || !seg_heap_recover()) {
         heap.n_free_seg = 0;
         for (int32_t i = heap.max_nseg - 1; i >= 0; i--) {
             heap.segs[i].seg_id          = i;
@@ -646,7 +1434,10 @@ seg_heap_setup(void)
 
             seg_add_to_freepool(i, SEG_ALLOCATION);
         }
-        pthread_mutex_unlock(&heap.mtx);
+    }
+
+    if (heap.prefault && heap.poolpath != NULL) {
+        seg_prefault_heap();
     }
 
     return CC_OK;
@@ -658,15 +1449,36 @@ seg_teardown(void)
     log_info("tear down the %s module", SEG_MODULE_NAME);
 
     stop = true;
+    wake_background_thread();
 
     pthread_join(bg_tid, NULL);
+    for (int i = 0; i < n_merge_thread; i++) {
+        pthread_join(merge_tid[i], NULL);
+    }
+    cc_free(merge_tid);
+    n_merge_thread = 0;
+    seg_prefault_join();
 
     if (!seg_initialized) {
         log_warn("%s has never been set up", SEG_MODULE_NAME);
         return;
     }
 
+    seg_heap_save();
+    datapool_close(heap.pool);
+    heap.pool = NULL;
+    heap.base = NULL;
+
+    cc_free(heap.segs);
+    heap.segs = NULL;
+    pthread_mutex_destroy(&heap.mtx);
+    pthread_mutex_destroy(&heap.limbo_mtx);
+
     hashtable_teardown();
+    flash_teardown();
+    use_flash = false;
+    admit_teardown();
+    use_admit = false;
 
     segevict_teardown();
     ttl_bucket_teardown();
@@ -680,6 +1492,8 @@ seg_teardown(void)
 void
 seg_setup(seg_options_st *options, seg_metrics_st *metrics)
 {
+    struct duration d;
+
     log_info("set up the %s module", SEG_MODULE_NAME);
 
     if (seg_initialized) {
@@ -687,6 +1501,7 @@ seg_setup(seg_options_st *options, seg_metrics_st *metrics)
         seg_teardown();
     }
 
+    duration_start(&d);
     seg_metrics = metrics;
 
     if (options == NULL) {
@@ -704,40 +1519,127 @@ seg_setup(seg_options_st *options, seg_metrics_st *metrics)
     heap.heap_size = option_uint(&seg_options->heap_mem);
     log_verb("cache size %" PRIu64, heap.heap_size);
 
-    heap.free_seg_id = -1;
+    for (int i = 0; i < SEG_NUMA_MAX_NODE; i++) {
+        heap.free_seg_top[i] = FREE_SEG_TOP(-1, 0);
+    }
+    heap.limbo_head  = -1;
+    heap.limbo_tail  = -1;
+    heap.n_limbo_seg = 0;
     heap.prealloc    = option_bool(&seg_options->seg_prealloc);
     heap.prefault    = option_bool(&seg_options->datapool_prefault);
+    heap.prefault_lazy = option_bool(&seg_options->seg_prefault_lazy);
 
     heap.poolpath = option_str(&seg_options->datapool_path);
     heap.poolname = option_str(&seg_options->datapool_name);
 
     heap.n_reserved_seg = 0;
 
+    heap.hugepage_size = option_uint(&seg_options->seg_hugepage) * MiB;
+    heap.numa          = option_uint(&seg_options->seg_numa);
+    heap.n_node        = 1;
+    if (heap.numa == SEG_NUMA_LOCAL) {
+        heap.n_node = MIN(seg_numa_n_node(), SEG_NUMA_MAX_NODE);
+        log_info("seg heap is split in %d per-node pools", heap.n_node);
+    } else if (heap.numa > SEG_NUMA_LOCAL) {
+        log_warn("unknown seg_numa %u, use the default placement", heap.numa);
+        heap.numa = SEG_NUMA_NONE;
+    }
+
     use_cas = option_bool(&seg_options->seg_use_cas);
+    use_thread_local_seg = option_bool(&seg_options->seg_thread_local);
+
+    /* the hash table is shared by all nodes, so it is interleaved with
+     * either NUMA policy */
+    hashtable_setup(option_uint(&seg_options->hash_power),
+        option_bool(&seg_options->hash_resize),
+        option_bool(&seg_options->hash_two_choice),
+        heap.hugepage_size, heap.numa != SEG_NUMA_NONE);
+    /* flash items take the top bit of the seg id field, so the flash tier
+     * is set up before the generation bits are decided */
+    use_flash = false;
+    if (option_str(&seg_options->seg_flash_path) != NULL) {
+        use_flash = flash_setup(option_str(&seg_options->seg_flash_path),
+                option_uint(&seg_options->seg_flash_size), heap.seg_size,
+                option_bool(&seg_options->seg_flash_direct)) &&
+            hashtable_flash(flash_nseg(), heap.heap_size / heap.seg_size);
+        if (!use_flash) {
+            flash_teardown();
+        }
+    }
+    /* before the heap is set up, recovered items are inserted with gen */
+    use_lazy_expire = option_bool(&seg_options->seg_lazy_expire) &&
+        hashtable_lazy_expire(heap.heap_size / heap.seg_size);
 
-    hashtable_setup(option_uint(&seg_options->hash_power));
+    /* TTL bucket chains are restored when the heap is recovered */
+    ttl_bucket_setup();
+
+    use_admit = false;
+    if (option_uint(&seg_options->seg_admit_threshold) > 0) {
+        use_admit = admit_setup(option_uint(&seg_options->seg_admit_width),
+            option_uint(&seg_options->seg_admit_threshold));
+    }
+    if (use_admit) {
+        ttl_bucket_admit(option_uint(&seg_options->seg_admit_ttl_min),
+            option_uint(&seg_options->seg_admit_ttl_max));
+    }
 
     if (seg_heap_setup() != CC_OK) {
         log_crit("Could not setup seg heap info");
         goto error;
     }
 
-    ttl_bucket_setup();
-
     evict_info.merge_opt.seg_n_merge     =
         option_uint(&seg_options->seg_n_merge);
     evict_info.merge_opt.seg_n_max_merge =
         option_uint(&seg_options->seg_n_max_merge);
+    evict_info.merge_opt.flash_min_freq  =
+        option_uint(&seg_options->seg_flash_min_freq);
     segevict_setup(option_uint(&options->seg_evict_opt),
         option_uint(&seg_options->seg_mature_time));
+    evict_info.free_low_wat  = option_uint(&seg_options->seg_free_low_wat);
+    evict_info.free_high_wat = option_uint(&seg_options->seg_free_high_wat);
+    if (evict_info.policy == EVICT_NONE) {
+        evict_info.free_low_wat = 0;
+    }
+    if (evict_info.free_low_wat > heap.max_nseg / 2) {
+        log_warn("seg_free_low_wat %d is too large, use %d",
+            evict_info.free_low_wat, heap.max_nseg / 2);
+        evict_info.free_low_wat = heap.max_nseg / 2;
+    }
+    if (evict_info.free_high_wat < evict_info.free_low_wat) {
+        evict_info.free_high_wat = evict_info.free_low_wat;
+    }
+    if (evict_info.free_high_wat > heap.max_nseg / 2) {
+        evict_info.free_high_wat = heap.max_nseg / 2;
+    }
+
+    /* merge threads only evict in the background */
+    n_merge_thread = 0;
+    if (evict_info.free_low_wat > 0) {
+        n_merge_thread = option_uint(&seg_options->seg_merge_thread);
+    }
+
     if (evict_info.policy == EVICT_MERGE_FIFO) {
-        heap.n_reserved_seg = n_thread;
+        /* the background or each merge thread needs one reserved seg to
+         * merge */
+        heap.n_reserved_seg = n_thread + (evict_info.free_low_wat > 0);
+        if (n_merge_thread > 0) {
+            heap.n_reserved_seg = n_thread + n_merge_thread;
+        }
     }
 
     start_background_thread(NULL);
+    if (n_merge_thread > 0) {
+        merge_tid = cc_zalloc(sizeof(pthread_t) * n_merge_thread);
+        start_merge_threads();
+    }
 
     seg_initialized = true;
 
+    duration_stop(&d);
+    UPDATE_VAL(seg_metrics, seg_setup_time_ms, (uint64_t) duration_ms(&d));
+    log_info("set up the seg heap in %.0f ms", duration_ms(&d));
+
     log_info("Seg header size: %d, item header size: %d, eviction algorithm %s",
         SEG_HDR_SIZE, ITEM_HDR_SIZE, eviction_policy_names[evict_info.policy]);
 
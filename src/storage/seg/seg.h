@@ -2,6 +2,7 @@
 
 #include "datapool/datapool.h"
 #include "item.h"
+#include "numa.h"
 #include "segevict.h"
 
 #include <cc_define.h>
@@ -57,9 +58,7 @@ struct seg {
     int32_t prev_seg_id;   /* prev seg in ttl_bucket or free pool */
     int32_t next_seg_id;   /* next seg in ttl_bucket or free pool */
 
-    int16_t         w_refcount;    /* # concurrent reads, >0 means the seg
-                                    * cannot be evicted */
-    int16_t         r_refcount;    /* # concurrent writes, >0 means the seg
+    int16_t         w_refcount;    /* # concurrent writes, >0 means the seg
                                     * cannot be evicted */
 
     int32_t         n_hit;         /* only update when the seg is sealed */
@@ -70,6 +69,14 @@ struct seg {
     delta_time_i    ttl;
     proc_time_i     merge_at;
 
+    uint64_t        retire_epoch;  /* readers may access the seg until this
+                                    * epoch expires, see qsbr.h */
+
+    uint32_t        gen;           /* bumped when the seg expires lazily, hash
+                                    * entries of an older gen are stale */
+    uint64_t        stale_sweep;   /* hash table sweeps that drop the */
+    uint64_t        wrap_sweep;    /* stale entries before gen wraps */
+
 #if defined DEBUG_MODE
     int32_t         seg_id_non_decr;/* a keep increasing seg id, and wraps
                                      * only when it overflows, debug used */
@@ -96,11 +103,20 @@ struct seg_heapinfo {
     size_t              seg_size;
 
     uint8_t             *base;          /* address where seg data starts */
-    int32_t             n_free_seg;     /* # seg allocated */
+    int32_t             n_free_seg;     /* # free segs, updated after the
+                                         * seg is added to the free pool */
     int32_t             max_nseg;       /* max # seg allowed */
     size_t              heap_size;
 
-    int32_t             free_seg_id;    /* this is the head of free pool */
+    uint64_t            free_seg_top[SEG_NUMA_MAX_NODE];
+                                        /* heads of the lock-free free pool
+                                         * stacks (one per node) and their
+                                         * ABA tags */
+    int32_t             n_node;         /* # nodes with their own free pool */
+    pthread_mutex_t     limbo_mtx;      /* protects the limbo list */
+    int32_t             limbo_head;     /* free segs waiting for readers to */
+    int32_t             limbo_tail;     /* pass a grace period, FIFO order */
+    int32_t             n_limbo_seg;    /* # limbo segs, part of n_free_seg */
 
     char                *poolpath;
     char                *poolname;
@@ -108,14 +124,25 @@ struct seg_heapinfo {
 
     uint32_t            prealloc : 1;
     uint32_t            prefault : 1;
+    uint32_t            prefault_lazy : 1;
+
+    size_t              hugepage_size;  /* 0 if not mapped with MAP_HUGETLB */
+    seg_numa_policy_e   numa;
 
     int32_t             n_reserved_seg;
 
-    pthread_mutex_t     mtx;
+    pthread_mutex_t     mtx;            /* protects the TTL bucket
+                                         * expiration index */
 
     proc_time_i         time_started;
 };
 
+/* the free pool stack top packs the head seg id and a tag that changes on
+ * every push and pop */
+#define FREE_SEG_TOP(seg_id, tag) (((uint64_t)(tag) << 32u) | (uint32_t)(seg_id))
+#define FREE_SEG_ID(top)          ((int32_t)((top) & 0xffffffffu))
+#define FREE_SEG_TAG(top)         ((uint32_t)((top) >> 32u))
+
 
 enum seg_state_change {
     SEG_ALLOCATION = 0,
@@ -136,17 +163,38 @@ enum seg_state_change {
 #define SEG_PREALLOC true
 #define SEG_EVICT_OPT EVICT_MERGE_FIFO
 #define SEG_USE_CAS true
+#define SEG_THREAD_LOCAL false
 #define ITEM_SIZE_MAX (SEG_SIZE - ITEM_HDR_SIZE)
 #define HASH_POWER 16
+#define HASH_RESIZE false
+#define HASH_TWO_CHOICE false
+#define SEG_LAZY_EXPIRE false
 #define N_THREAD 1
 #define SEG_DATAPOOL NULL
 #define SEG_DATAPOOL_PREFAULT true
 #define SEG_DATAPOOL_NAME "seg_datapool"
+#define SEG_RECOVER_THREAD 0
+#define SEG_PREFAULT_THREAD 0
+#define SEG_PREFAULT_LAZY false
+#define SEG_HUGEPAGE 0
+#define SEG_NUMA 0
+#define SEG_FLASH_PATH NULL
+#define SEG_FLASH_SIZE (1024 * MiB)
+#define SEG_FLASH_DIRECT true
+#define SEG_FLASH_MIN_FREQ 1
+#define SEG_ADMIT_THRESHOLD 0
+#define SEG_ADMIT_WIDTH (1 << 20)
+#define SEG_ADMIT_TTL_MIN 0
+#define SEG_ADMIT_TTL_MAX 0
 
 #define SEG_MATURE_TIME 20
 #define SEG_N_MAX_MERGE 8
 #define SEG_N_MERGE     4
 
+#define SEG_FREE_LOW_WAT    0
+#define SEG_FREE_HIGH_WAT   0
+#define SEG_MERGE_THREAD    0
+
 
 /*          name                    type            default                 description */
 #define SEG_OPTION(ACTION)                                                                                                                                                               \
@@ -158,11 +206,31 @@ enum seg_state_change {
     ACTION(seg_mature_time,     OPTION_TYPE_UINT,   SEG_MATURE_TIME,        "min time before a segment can be considered for eviction"                                                  )\
     ACTION(seg_n_max_merge,     OPTION_TYPE_UINT,   SEG_N_MAX_MERGE,        "max number of segments can be evicted/merged in one eviction"                                              )\
     ACTION(seg_n_merge,         OPTION_TYPE_UINT,   SEG_N_MERGE,            "the target number of segment to be evicted/merge in one eviction"                                          )\
+    ACTION(seg_free_low_wat,    OPTION_TYPE_UINT,   SEG_FREE_LOW_WAT,       "start background eviction when # free segs is below this, 0 to disable"                                    )\
+    ACTION(seg_free_high_wat,   OPTION_TYPE_UINT,   SEG_FREE_HIGH_WAT,      "stop background eviction when # free segs reaches this"                                                    )\
+    ACTION(seg_merge_thread,    OPTION_TYPE_UINT,   SEG_MERGE_THREAD,       "# threads for background merge eviction, 0 to evict in the background thread"                              )\
     ACTION(hash_power,          OPTION_TYPE_UINT,   HASH_POWER,             "Power for lookup hash table"                                                                               )\
+    ACTION(hash_resize,         OPTION_TYPE_BOOL,   HASH_RESIZE,            "grow/shrink the hash table online with the number of items"                                                )\
+    ACTION(hash_two_choice,     OPTION_TYPE_BOOL,   HASH_TWO_CHOICE,        "store an item in one of two buckets, moving items to make room for a higher load"                          )\
+    ACTION(seg_lazy_expire,     OPTION_TYPE_BOOL,   SEG_LAZY_EXPIRE,        "expire segs in O(1), stale hash entries are dropped lazily"                                                )\
     ACTION(seg_n_thread,        OPTION_TYPE_UINT,   N_THREAD,               "number of threads"                                                                                         )\
-    ACTION(datapool_path,       OPTION_TYPE_STR,    SEG_DATAPOOL,           "Path to DRAM data pool"                                                                                    )\
+    ACTION(seg_thread_local,    OPTION_TYPE_BOOL,   SEG_THREAD_LOCAL,       "each thread writes to its own active seg in each TTL bucket"                                               )\
+    ACTION(seg_hugepage,        OPTION_TYPE_UINT,   SEG_HUGEPAGE,           "back the heap and hash table with huge pages of this many MiB (2 or 1024), 0 for transparent huge pages"   )\
+    ACTION(seg_numa,            OPTION_TYPE_UINT,   SEG_NUMA,               "NUMA placement (0: none, 1: interleave, 2: per-node seg pools, writers take segs of their node)"           )\
+    ACTION(datapool_path,       OPTION_TYPE_STR,    SEG_DATAPOOL,           "Path to data pool file (tmpfs/hugetlbfs), segs are kept across restarts"                                   )\
     ACTION(datapool_name,       OPTION_TYPE_STR,    SEG_DATAPOOL_NAME,      "Seg DRAM data pool name"                                                                                   )\
-    ACTION(datapool_prefault,   OPTION_TYPE_BOOL,   SEG_DATAPOOL_PREFAULT,  "Prefault Pmem"                                                                                             )
+    ACTION(datapool_prefault,   OPTION_TYPE_BOOL,   SEG_DATAPOOL_PREFAULT,  "Prefault Pmem"                                                                                             )\
+    ACTION(seg_prefault_thread, OPTION_TYPE_UINT,   SEG_PREFAULT_THREAD,    "# threads prefaulting the heap of a datapool file at setup, 0 for # cores"                                 )\
+    ACTION(seg_prefault_lazy,   OPTION_TYPE_BOOL,   SEG_PREFAULT_LAZY,      "serve during the prefault, writers prefault the free segs they take first"                                 )\
+    ACTION(seg_recover_thread,  OPTION_TYPE_UINT,   SEG_RECOVER_THREAD,     "# threads rebuilding the hash table from the datapool on restart, 0 for # cores"                           )\
+    ACTION(seg_flash_path,      OPTION_TYPE_STR,    SEG_FLASH_PATH,         "file (e.g., on a local NVMe drive) keeping the warm items dropped by merge, NULL to disable"               )\
+    ACTION(seg_flash_size,      OPTION_TYPE_UINT,   SEG_FLASH_SIZE,         "size of the flash tier file (byte)"                                                                        )\
+    ACTION(seg_flash_direct,    OPTION_TYPE_BOOL,   SEG_FLASH_DIRECT,       "bypass the page cache (O_DIRECT) for flash IO if the file system supports it"                              )\
+    ACTION(seg_flash_min_freq,  OPTION_TYPE_UINT,   SEG_FLASH_MIN_FREQ,     "min frequency of an item dropped by merge to be demoted to flash"                                          )\
+    ACTION(seg_admit_threshold, OPTION_TYPE_UINT,   SEG_ADMIT_THRESHOLD,    "admit a write if its key has been written or read this many times recently, 0 to disable"                  )\
+    ACTION(seg_admit_width,     OPTION_TYPE_UINT,   SEG_ADMIT_WIDTH,        "# counters per row of the admission sketch (one byte each, 4 rows)"                                        )\
+    ACTION(seg_admit_ttl_min,   OPTION_TYPE_UINT,   SEG_ADMIT_TTL_MIN,      "admission applies to the TTL buckets of TTL at least this"                                                 )\
+    ACTION(seg_admit_ttl_max,   OPTION_TYPE_UINT,   SEG_ADMIT_TTL_MAX,      "admission applies to the TTL buckets of TTL at most this, 0 for no limit"                                  )
 
 typedef struct {
     SEG_OPTION(OPTION_DECLARE)
@@ -177,23 +245,62 @@ typedef struct {
     ACTION(seg_evict,           METRIC_COUNTER,     "# seg evictions"                       )\
     ACTION(seg_evict_retry,     METRIC_COUNTER,     "# retried seg eviction"                )\
     ACTION(seg_evict_ex,        METRIC_COUNTER,     "# segs evict exceptions"               )\
+    ACTION(seg_evict_inline,    METRIC_COUNTER,     "# evictions on the write path"         )\
+    ACTION(seg_evict_bg,        METRIC_COUNTER,     "# evictions by background thread"      )\
+    ACTION(seg_free,            METRIC_GAUGE,       "# free segs"                           )\
+    ACTION(seg_free_retry,      METRIC_COUNTER,     "# free pool push/pop CAS retries"      )\
+    ACTION(seg_limbo,           METRIC_GAUGE,       "# free segs waiting for grace period"  )\
+    ACTION(seg_grace_wait,      METRIC_COUNTER,     "# times waited for grace period"       )\
+    ACTION(seg_numa_remote,     METRIC_COUNTER,     "# segs taken from another NUMA node"   )\
     ACTION(seg_expire,          METRIC_COUNTER,     "# segs removed due to expiration"      )\
     ACTION(seg_merge,           METRIC_COUNTER,     "# seg merge"                           )\
+    ACTION(seg_merge_sched,     METRIC_COUNTER,     "# scans queueing merge jobs"           )\
+    ACTION(seg_merge_skip,      METRIC_COUNTER,     "# merge jobs skipped, bucket busy"     )\
     ACTION(seg_evict_age_sum,   METRIC_COUNTER,     "sum of ages of all evicted seg"        )\
     ACTION(seg_evict_seg_cnt,   METRIC_COUNTER,     "# evicted segs"                        )\
+    ACTION(seg_local_link,      METRIC_COUNTER,     "# thread local segs linked to ttl bucket")\
+    ACTION(seg_chain_contend,   METRIC_COUNTER,     "# contended ttl bucket chain locks"    )\
+    ACTION(seg_local_reclaim,   METRIC_COUNTER,     "# idle thread local segs reclaimed"    )\
     ACTION(seg_curr,            METRIC_GAUGE,       "# active segs"                         )\
+    ACTION(seg_recover_total,   METRIC_GAUGE,       "# segs to recover on restart"          )\
+    ACTION(seg_recover_seg,     METRIC_COUNTER,     "# segs recovered on restart"           )\
+    ACTION(seg_recover_item,    METRIC_COUNTER,     "# items recovered on restart"          )\
+    ACTION(seg_recover_time_ms, METRIC_GAUGE,       "time spent recovering items (ms)"      )\
+    ACTION(seg_prefault_seg,    METRIC_COUNTER,     "# segs prefaulted at setup"            )\
+    ACTION(seg_prefault_inline, METRIC_COUNTER,     "# segs prefaulted by writers"          )\
+    ACTION(seg_prefault_time_ms, METRIC_GAUGE,      "time spent prefaulting the heap (ms)"  )\
+    ACTION(seg_setup_time_ms,   METRIC_GAUGE,       "time to set up, until serving (ms)"    )\
     ACTION(item_curr,           METRIC_GAUGE,       "# current items"                       )\
     ACTION(item_curr_bytes,     METRIC_GAUGE,       "# used bytes including item header"    )\
     ACTION(item_alloc,          METRIC_COUNTER,     "# items allocated"                     )\
     ACTION(item_alloc_ex,       METRIC_COUNTER,     "# item alloc errors"                   )\
     ACTION(hash_lookup,         METRIC_COUNTER,     "# hash lookups"                        )\
+    ACTION(hash_lookup_retry,   METRIC_COUNTER,     "# hash lookups retried on update"      )\
     ACTION(hash_insert,         METRIC_COUNTER,     "# hash inserts"                        )\
     ACTION(hash_remove,         METRIC_COUNTER,     "# hash deletes"                        )\
     ACTION(hash_remove_it,      METRIC_COUNTER,     "# hash item deletes"                   )\
     ACTION(hash_evict,          METRIC_COUNTER,     "# hash evicts"                         )\
     ACTION(hash_bucket_alloc,   METRIC_COUNTER,     "# overflown hash bucket allocations"   )\
+    ACTION(hash_bucket_free,    METRIC_COUNTER,     "# overflown hash buckets released"     )\
+    ACTION(hash_displace,       METRIC_COUNTER,     "# items moved to their other bucket"   )\
+    ACTION(hash_bucket_migrate, METRIC_COUNTER,     "# hash buckets migrated on resize"     )\
+    ACTION(hash_grow,           METRIC_COUNTER,     "# hash table grows"                    )\
+    ACTION(hash_shrink,         METRIC_COUNTER,     "# hash table shrinks"                  )\
     ACTION(hash_relink,         METRIC_COUNTER,     "# relink operations"                   )\
-    ACTION(hash_tag_collision,  METRIC_COUNTER,     "# tag collision"                       )
+    ACTION(hash_tag_collision,  METRIC_COUNTER,     "# tag collision"                       )\
+    ACTION(hash_stale_drop,     METRIC_COUNTER,     "# stale hash entries dropped"          )\
+    ACTION(hash_sweep,          METRIC_COUNTER,     "# hash table sweeps of stale entries"  )\
+    ACTION(flash_demote,        METRIC_COUNTER,     "# items demoted to flash on merge"     )\
+    ACTION(flash_write,         METRIC_COUNTER,     "# flash segs written"                  )\
+    ACTION(flash_write_ex,      METRIC_COUNTER,     "# flash seg write errors"              )\
+    ACTION(flash_read,          METRIC_COUNTER,     "# items read from flash"               )\
+    ACTION(flash_read_ex,       METRIC_COUNTER,     "# flash reads failed or outdated"      )\
+    ACTION(flash_hit,           METRIC_COUNTER,     "# items promoted from flash on get"    )\
+    ACTION(flash_drop,          METRIC_COUNTER,     "# flash entries dropped (write/resize)")\
+    ACTION(admit_accept,        METRIC_COUNTER,     "# writes admitted"                     )\
+    ACTION(admit_reject,        METRIC_COUNTER,     "# writes rejected, key seen too rarely")\
+    ACTION(admit_merge_drop,    METRIC_COUNTER,     "# items dropped by merge, seen rarely" )\
+    ACTION(admit_age,           METRIC_COUNTER,     "# admission sketch agings"             )
 
 typedef struct {
     SEG_METRIC(METRIC_DECLARE)
@@ -324,11 +431,28 @@ int32_t
 seg_get_from_freepool(bool use_reserved);
 
 /**
- * wait until no other threads are accessing the seg (refcount == 0)
+ * wait until no other threads are writing to the seg (w_refcount == 0)
  */
 void
 seg_wait_refcnt(int32_t seg_id);
 
+/**
+ * mark the seg as retired, the seg must be inaccessible and removed from the
+ * hash table, it can be reused once readers pass the grace period
+ */
+void
+seg_retire(int32_t seg_id);
+
+/**
+ * the calling worker thread starts/stops accessing the cache, a worker goes
+ * offline before waiting for events so that retired segs can be reused
+ */
+void
+seg_thread_online(void);
+
+void
+seg_thread_offline(void);
+
 /**
  * remove the segment from the TTL bucket and segment chain
  */
@@ -345,7 +469,8 @@ dump_seg_info(void);
         log("%12s, seg %6d create_at time %6d, merge at %6d"                    \
         ", age %4d, ttl %6d, evictable %u, accessible %u"                       \
         ", write offset %7d, occupied size %7d"                                 \
-        ", %4d items, n_hit %6d, read refcount %2d, write refcount %2d"         \
+        ", %4d items, n_hit %6d, retire epoch %6" PRIu64                       \
+        ", write refcount %2d"                                                  \
         ", prev_seg %4d, next_seg %4d",                                         \
         msg, id, heap.segs[id].create_at, heap.segs[id].merge_at,               \
         heap.segs[id].merge_at > 0 ?                                            \
@@ -357,7 +482,7 @@ dump_seg_info(void);
         __atomic_load_n(&(heap.segs[id].live_bytes), __ATOMIC_RELAXED),         \
         __atomic_load_n(&(heap.segs[id].n_live_item), __ATOMIC_RELAXED),        \
         __atomic_load_n(&(heap.segs[id].n_hit), __ATOMIC_RELAXED),              \
-        __atomic_load_n(&(heap.segs[id].r_refcount), __ATOMIC_RELAXED),         \
+        __atomic_load_n(&(heap.segs[id].retire_epoch), __ATOMIC_RELAXED),       \
         __atomic_load_n(&(heap.segs[id].w_refcount), __ATOMIC_RELAXED),         \
         heap.segs[id].prev_seg_id, heap.segs[id].next_seg_id);                  \
     } while (0)
@@ -281,6 +281,7 @@ segevict_setup(evict_policy_e ev_policy, uintmax_t seg_mature_time)
     // mopt->stop_ratio   = mopt->target_ratio * (mopt->seg_n_merge - 1) + 0.05;
     mopt->stop_ratio   = 0.9; 
     mopt->stop_bytes   = (int32_t) (heap.seg_size * mopt->stop_ratio);
+    seg_merge_reset();
 
     srand(time(NULL));
     segevict_initialized = true;
@@ -37,6 +37,10 @@ struct merge_opts {
     double  stop_ratio;
     int32_t stop_bytes;
 
+    /* the items dropped by merge with at least this frequency are demoted
+     * to the flash tier */
+    int32_t flash_min_freq;
+
 };
 
 struct seg_evict_info {
@@ -47,6 +51,12 @@ struct seg_evict_info {
     /* segment younger than seg_mature_time should not be selected */
     int32_t             seg_mature_time;
 
+    /* the background thread evicts when the number of free segs (excluding
+     * the ones reserved for merge) falls below free_low_wat, until it
+     * reaches free_high_wat, 0 disables background eviction */
+    int32_t             free_low_wat;
+    int32_t             free_high_wat;
+
     proc_time_i         last_update_time;
 
     int32_t             *ranked_seg_id;  /* ranked seg ids from the least
@@ -74,9 +84,16 @@ seg_evictable(struct seg *seg);
 evict_rstatus_e
 seg_evict(int32_t *evicted_seg_id);
 
+/* evict by merging segs, the segs to merge are handed out as jobs from a
+ * queue shared by all threads, so concurrent evictions work on different
+ * TTL buckets */
 evict_rstatus_e
 seg_merge_evict(int32_t *seg_id_ret);
 
+/* drop the queued merge jobs */
+void
+seg_merge_reset(void);
+
 void
 segevict_setup(evict_policy_e ev_policy, uintmax_t seg_mature_time);
 
@@ -1,18 +1,25 @@
 
 #include "seg.h"
+#include "admission.h"
+#include "flash.h"
 #include "hashtable.h"
 #include "item.h"
+#include "qsbr.h"
 #include "segevict.h"
 #include "ttlbucket.h"
 
 #include <cc_mm.h>
 
+#include <stdlib.h>
 #include <sys/types.h>
 
 extern struct seg_evict_info evict_info;
 extern struct ttl_bucket     ttl_buckets[MAX_N_TTL_BUCKET];
 extern seg_metrics_st        *seg_metrics; 
 extern seg_perttl_metrics_st perttl[MAX_N_TTL_BUCKET];
+extern bool                  use_thread_local_seg;
+extern bool                  use_flash;
+extern bool                  use_admit;
 
 static uint64_t seg_evict_seg_cnt = 0; 
 static uint64_t seg_evict_seg_sum = 0; 
@@ -106,52 +113,70 @@ find_n_consecutive_evictable_seg(struct seg *seg)
 }
 
 /**
- * lock at most seg_n_max_merge segments to prevent other threads evicting
+ * lock at most seg_n_max_merge segments to prevent other threads evicting,
+ * and move next_seg_to_merge of the TTL bucket past them
+ *
+ * return false if fewer than two segments can be locked, e.g., the segments
+ * have been expired or evicted since we found them, in which case nothing
+ * is locked
  */
-static void
-prep_seg_to_merge(int32_t start_seg_id,
+static bool
+prep_seg_to_merge(int32_t bkt_idx,
+                  int32_t start_seg_id,
                   struct seg *segs_to_merge[],
                   int *n_evictable_seg,
-                  double *merge_keep_ratio, 
-                  int32_t *next_seg_to_merge)
+                  double *merge_keep_ratio)
 {
 
     *n_evictable_seg = 0;
+    struct ttl_bucket *ttl_bkt = &ttl_buckets[bkt_idx];
     int32_t    curr_seg_id = start_seg_id;
     struct seg *curr_seg;
     uint64_t n_live_bytes = 0; 
 
-    /* TODO(juncheng): do we need lock */
-    pthread_mutex_lock(&heap.mtx);
+    /* changes to next_seg_to_merge (other than resetting to -1) are protected
+     * by the chain lock, the same as seg chain, so it always points to a seg
+     * in this chain */
+    ttl_bucket_lock(bkt_idx);
     for (int i = 0; i < evict_info.merge_opt.seg_n_max_merge; i++) {
         if (curr_seg_id == -1) {
-            *next_seg_to_merge = -1; 
             break;
         }
 
-#ifdef USE_THREAD_LOCAL_SEG
-        if (n_live_bytes > heap.seg_size + heap.seg_size >> 1) {
-            *next_seg_to_merge = curr_seg_id;
-            break; 
+        if (use_thread_local_seg &&
+            n_live_bytes > heap.seg_size + (heap.seg_size >> 1)) {
+            /* other threads may merge the rest concurrently */
+            break;
         }
-#endif 
 
         curr_seg = &heap.segs[curr_seg_id];
-        if (!seg_evictable(curr_seg)) {
+        if (!seg_evictable(curr_seg) || curr_seg->ttl != ttl_bkt->ttl) {
             break;
-//            curr_seg_id = curr_seg->next_seg_id;
-//            continue;
         }
         uint8_t evictable = __atomic_exchange_n(&curr_seg->evictable, 0, __ATOMIC_RELAXED);
+        if (evictable == 0) {
+            /* picked by another thread */
+            break;
+        }
         n_live_bytes += curr_seg->live_bytes;
 
-#ifdef CC_ASSERT_PANIC
-        ASSERT(evictable = 1);
-#endif
         segs_to_merge[(*n_evictable_seg)++] = curr_seg;
         curr_seg_id = curr_seg->next_seg_id;
     }
-    pthread_mutex_unlock(&heap.mtx);
+
+    if (*n_evictable_seg < 2) {
+        for (int i = 0; i < *n_evictable_seg; i++) {
+            __atomic_store_n(&segs_to_merge[i]->evictable, 1, __ATOMIC_RELAXED);
+        }
+        *n_evictable_seg = 0;
+        ttl_bkt->next_seg_to_merge = -1;
+        ttl_bucket_unlock(bkt_idx);
+
+        return false;
+    }
+
+    ttl_bkt->next_seg_to_merge = curr_seg_id;
+    ttl_bucket_unlock(bkt_idx);
 
     /* calculate how many bytes should be retained from each seg */
     int target_n_seg_to_merge = evict_info.merge_opt.seg_n_merge;
@@ -163,7 +188,7 @@ prep_seg_to_merge(int32_t start_seg_id,
         merge_keep_ratio[i] = 1.0 / target_n_seg_to_merge;
     }
 
-    ASSERT(*n_evictable_seg > 1);
+    return true;
 }
 
 static inline void
@@ -175,7 +200,7 @@ replace_seg_in_chain(int32_t new_seg_id, int32_t old_seg_id)
     struct ttl_bucket *tb = &ttl_buckets[find_ttl_bucket_idx(old_seg->ttl)];
 
     /* all modification to seg chain needs to be protected by lock */
-    ASSERT(pthread_mutex_trylock(&heap.mtx) != 0);
+    ASSERT(pthread_mutex_trylock(&tb->chain_mtx) != 0);
 
     int32_t prev_seg_id = old_seg->prev_seg_id;
     int32_t next_seg_id = old_seg->next_seg_id;
@@ -183,7 +208,7 @@ replace_seg_in_chain(int32_t new_seg_id, int32_t old_seg_id)
     if (prev_seg_id == -1) {
         ASSERT(tb->first_seg_id == old_seg_id);
 
-        tb->first_seg_id = new_seg_id;
+        ttl_bucket_set_first_seg(find_ttl_bucket_idx(old_seg->ttl), new_seg_id);
     }
     else {
         heap.segs[prev_seg_id].next_seg_id = new_seg_id;
@@ -194,27 +219,249 @@ replace_seg_in_chain(int32_t new_seg_id, int32_t old_seg_id)
 
     new_seg->prev_seg_id = prev_seg_id;
     new_seg->next_seg_id = next_seg_id;
+
+    if (tb->next_seg_to_merge == old_seg_id) {
+        tb->next_seg_to_merge = next_seg_id;
+    }
 }
 
 
-evict_rstatus_e
-seg_merge_evict(int32_t *seg_id_ret)
+/* a merge job is a run of segs in a TTL bucket that looked evictable when the
+ * scheduler scanned the bucket, the segs are checked again when the job runs,
+ * n_seg == 1 asks to force evict the first seg of the bucket */
+struct merge_job {
+    int32_t bkt_idx;
+    int32_t start_seg_id;
+    int32_t n_seg;
+};
+
+#define MERGE_QUEUE_SIZE 64
+
+/* at most one job per TTL bucket is queued, so threads that run out of free
+ * segs at the same time merge different buckets */
+static struct merge_job merge_queue[MERGE_QUEUE_SIZE];
+static uint32_t         mq_head = 0;
+static uint32_t         mq_tail = 0;
+static bool             mq_queued[MAX_N_TTL_BUCKET];
+static pthread_mutex_t  mq_mtx    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  sched_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int32_t          sched_bkt_idx = 0;   /* where the last scan started */
+
+void
+seg_merge_reset(void)
 {
-    struct merge_opts *mopt = &evict_info.merge_opt;
-    struct seg        *seg  = NULL;
+    pthread_mutex_lock(&mq_mtx);
+    mq_head = mq_tail = 0;
+    memset(mq_queued, 0, sizeof(mq_queued));
+    pthread_mutex_unlock(&mq_mtx);
+
+    sched_bkt_idx = rand() % MAX_N_TTL_BUCKET;
+}
+
+static bool
+merge_queue_pop(struct merge_job *job)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&mq_mtx);
+    if (mq_head != mq_tail) {
+        *job = merge_queue[mq_head % MERGE_QUEUE_SIZE];
+        mq_head++;
+        mq_queued[job->bkt_idx] = false;
+        found = true;
+    }
+    pthread_mutex_unlock(&mq_mtx);
+
+    return found;
+}
+
+static bool
+merge_queue_push(int32_t bkt_idx, int32_t start_seg_id, int32_t n_seg)
+{
+    bool pushed = false;
+
+    pthread_mutex_lock(&mq_mtx);
+    if (mq_tail - mq_head < MERGE_QUEUE_SIZE && !mq_queued[bkt_idx]) {
+        merge_queue[mq_tail % MERGE_QUEUE_SIZE] = (struct merge_job) {
+            .bkt_idx = bkt_idx, .start_seg_id = start_seg_id, .n_seg = n_seg};
+        mq_tail++;
+        mq_queued[bkt_idx] = true;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&mq_mtx);
+
+    return pushed;
+}
+
+/* find where the next merge of the bucket starts, caller should hold the
+ * merge lock of the bucket, return false if there is nothing to evict */
+static bool
+find_merge_job(int32_t bkt_idx, int32_t *start_seg_id, int32_t *n_seg)
+{
+    struct ttl_bucket *ttl_bkt = &ttl_buckets[bkt_idx];
+    struct seg        *seg;
+    int32_t           seg_id;
+    int32_t           first_seg_age;
+
+    /* it may be updated by threads holding the chain lock only */
+    seg_id = __atomic_load_n(&ttl_bkt->next_seg_to_merge, __ATOMIC_RELAXED);
+    if (seg_id == -1) {
+        seg_id = ttl_bkt->first_seg_id;
+        if (seg_id == -1) {
+            return false;
+        }
+    }
+
+    seg = find_n_consecutive_evictable_seg(&heap.segs[seg_id]);
+    if (seg == NULL && seg_id != ttl_bkt->first_seg_id &&
+        ttl_bkt->first_seg_id != -1) {
+        /* we started in the middle of the seg chain, there may be evictable
+         * segs early in the chain */
+        seg = find_n_consecutive_evictable_seg(
+            &heap.segs[ttl_bkt->first_seg_id]);
+    }
+    if (seg != NULL) {
+        *start_seg_id = seg->seg_id;
+        *n_seg        = evict_info.merge_opt.seg_n_max_merge;
+        return true;
+    }
+
+    /* cannot find enough evictable seg in this TTL bucket,
+     * resetting to -1 (chain head) is always safe */
+    __atomic_store_n(&ttl_bkt->next_seg_to_merge, -1, __ATOMIC_RELAXED);
+    seg_id = ttl_bkt->first_seg_id;
+    if (seg_id == -1) {
+        return false;
+    }
+
+    first_seg_age = time_proc_sec() - heap.segs[seg_id].create_at;
+    if (heap.segs[seg_id].merge_at > 0) {
+        first_seg_age = time_proc_sec() - heap.segs[seg_id].merge_at;
+    }
+    /* the first segment in this bucket has not been evicted for a long time,
+     * this can happen if there is a corner case we have not considered,
+     * so evict it, one magic parameter here */
+    bool seg_too_old = first_seg_age > (cal_mean_eviction_age() * 10);
+    if (n_evicted_seg() > 100 && seg_too_old) {
+        *start_seg_id = seg_id;
+        *n_seg        = 1;
+        return true;
+    }
+
+    return false;
+}
+
+/* pressure is sampled before sorting, writers keep changing it */
+struct merge_cand {
+    int32_t  bkt_idx;
+    uint32_t pressure;
+};
+
+static int
+cmp_evict_pressure(const void *a, const void *b)
+{
+    uint32_t pa = ((const struct merge_cand *)a)->pressure;
+    uint32_t pb = ((const struct merge_cand *)b)->pressure;
+
+    return pa < pb ? 1 : (pa > pb ? -1 : 0);
+}
+
+/**
+ * scan the TTL buckets and queue one merge job for each bucket that has segs
+ * to evict, buckets that have linked more segs since they were last merged
+ * are queued first, buckets being merged by other threads are skipped, the
+ * one with the highest pressure is returned in busy_bkt_idx (-1 if none)
+ *
+ * return the number of jobs queued
+ */
+static int
+merge_sched(int32_t *busy_bkt_idx)
+{
+    static struct merge_cand cand[MAX_N_TTL_BUCKET];
 
-    int32_t           bkt_idx;
     struct ttl_bucket *ttl_bkt;
-    int               i;
+    int32_t           n_cand = 0;
+    int32_t           bkt_idx, start_seg_id, n_seg;
+    int               n_job  = 0;
+
+    *busy_bkt_idx = -1;
+
+    /* another thread is filling the queue, wait for it instead of scanning
+     * the same buckets */
+    if (pthread_mutex_trylock(&sched_mtx) != 0) {
+        qsbr_offline();
+        pthread_mutex_lock(&sched_mtx);
+        qsbr_online();
+
+        if (__atomic_load_n(&mq_tail, __ATOMIC_RELAXED) !=
+            __atomic_load_n(&mq_head, __ATOMIC_RELAXED)) {
+            pthread_mutex_unlock(&sched_mtx);
+            return 1;
+        }
+    }
 
-    int32_t     seg_id;
-    int32_t     first_seg_age;
+    INCR(seg_metrics, seg_merge_sched);
 
-    /* they are thread local because each thread keeps its own merge progress */
-    static __thread int32_t last_bkt_idx = -1;
-    if (last_bkt_idx == -1) {
-        last_bkt_idx = rand() % MAX_N_TTL_BUCKET;
+    /* rotate the start so that buckets with the same pressure take turns */
+    for (int i = 0; i < MAX_N_TTL_BUCKET; i++) {
+        bkt_idx = (sched_bkt_idx + i) % MAX_N_TTL_BUCKET;
+        if (ttl_buckets[bkt_idx].first_seg_id != -1) {
+            cand[n_cand].bkt_idx  = bkt_idx;
+            cand[n_cand].pressure = __atomic_load_n(
+                &ttl_buckets[bkt_idx].evict_pressure, __ATOMIC_RELAXED);
+            n_cand++;
+        }
     }
+    sched_bkt_idx = (sched_bkt_idx + 1) % MAX_N_TTL_BUCKET;
+
+    /* qsort is not stable, but ties are rare once the buckets have aged */
+    qsort(cand, n_cand, sizeof(cand[0]), cmp_evict_pressure);
+
+    for (int i = 0; i < n_cand && n_job < MERGE_QUEUE_SIZE; i++) {
+        bkt_idx = cand[i].bkt_idx;
+        ttl_bkt = &ttl_buckets[bkt_idx];
+
+        if (pthread_mutex_trylock(&ttl_bkt->mtx) != 0) {
+            /* being merged, it will be scanned again in the next round */
+            if (*busy_bkt_idx == -1) {
+                *busy_bkt_idx = bkt_idx;
+            }
+            continue;
+        }
+
+        if (find_merge_job(bkt_idx, &start_seg_id, &n_seg) &&
+            merge_queue_push(bkt_idx, start_seg_id, n_seg)) {
+            /* decay instead of reset, so that a bucket that keeps linking
+             * segs gets more merges than the ones that rarely do */
+            __atomic_store_n(&ttl_bkt->evict_pressure,
+                __atomic_load_n(&ttl_bkt->evict_pressure,
+                    __ATOMIC_RELAXED) >> 1u, __ATOMIC_RELAXED);
+            n_job++;
+        } else {
+            /* age the buckets not queued so that they are not starved */
+            __atomic_add_fetch(&ttl_bkt->evict_pressure, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_unlock(&ttl_bkt->mtx);
+    }
+
+    pthread_mutex_unlock(&sched_mtx);
+
+    return n_job;
+}
+
+/**
+ * run a merge job, if block is false and the bucket is being merged by
+ * another thread, skip it and return EVICT_CANNOT_LOCK_SEG; if block is true,
+ * wait for the bucket and find the segs to merge again after getting it
+ *
+ * return EVICT_OTHER if the segs of the job are no longer evictable
+ */
+static evict_rstatus_e
+merge_job_run(struct merge_job *job, bool block, int32_t *seg_id_ret)
+{
+    struct merge_opts *mopt    = &evict_info.merge_opt;
+    struct ttl_bucket *ttl_bkt = &ttl_buckets[job->bkt_idx];
 
     /* they thread local beacuse we would like to reduce memory allocations */
     static __thread struct seg **segs_to_merge   = NULL;
@@ -227,125 +474,115 @@ seg_merge_evict(int32_t *seg_id_ret)
         merge_keep_ratio = cc_zalloc(sizeof(double) * mopt->seg_n_max_merge);
     }
 
-    /* we use MAX_N_TTL_BUCKET + 1 here because we start in the middle of
-     * a segment chain (next_seg_to_merge), so it is possible there are no other
-     * evictable segments except the ones early in the segment chain.
-     *
-     * For example,
-     * if there is only one TTL bucket, we need to check this
-     * ttl bucket again after reaching the end */
-    for (i = 0; i < MAX_N_TTL_BUCKET + 1; i++) {
-        bkt_idx = (last_bkt_idx + i) % MAX_N_TTL_BUCKET;
-        ttl_bkt = &ttl_buckets[bkt_idx];
-        if (ttl_buckets[bkt_idx].first_seg_id == -1) {
-            /* empty TTL bucket */
-            continue;
-        }
-
-        /* with more than 16 threads and 20% write, this lock becomes
-         * the bottleneck;
-         * as an alternative, we can try_lock,
-         * but the problem is that because threads get seg at the same time,
-         * if there are limited number of active TTL buckets,
-         * only one thread will be able to evict; other threads will not
-         * be able to get a new seg
-         *
-         * so for scalability, we need thread local active seg and
-         * maintain a watermark on free seg and have
-         * background thread to evict before every thread asks for a seg at
-         * the same time, currently not implemented
-         *
-         * in NSDI work, we simply retry and return if an eviction fails
-         */
+    if (block) {
+        /* the thread holding the lock may wait for a grace period in
+         * merge_segs, so do not hold it up while blocking on the lock */
+        qsbr_offline();
         pthread_mutex_lock(&ttl_bkt->mtx);
-//        if (pthread_mutex_trylock(&ttl_bkt->mtx) != 0) {
-//            continue;
-//        }
-
-        seg = ttl_bkt->next_seg_to_merge != -1 ?
-              &heap.segs[ttl_bkt->next_seg_to_merge] :
-              &heap.segs[ttl_bkt->first_seg_id];
-
-        seg = find_n_consecutive_evictable_seg(seg);
-        if (seg == NULL) {
-            /* cannot find enough evictable seg in this TTL bucket */
-            ttl_buckets[bkt_idx].next_seg_to_merge = -1;
-            seg_id        = ttl_buckets[bkt_idx].first_seg_id;
-            if (seg_id != -1) {
-                first_seg_age = time_proc_sec() - heap.segs[seg_id].create_at;
-                if (heap.segs[seg_id].merge_at > 0) {
-                    first_seg_age = time_proc_sec() - heap.segs[seg_id].merge_at;
-                }
-                /* the first segment in this bucket has not been evicted for a long time,
-                 * this can happen if there is a corner case we have not considered,
-                 * so evict it, one magic parameter here */
-                bool seg_too_old = first_seg_age > (cal_mean_eviction_age() * 10);
-
-                if (n_evicted_seg() > 100 && seg_too_old) {
-                    bool success = rm_all_item_on_seg(seg_id, SEG_FORCE_EVICTION);
-                    if (success) {
-                        last_bkt_idx = bkt_idx + 1;
-                        pthread_mutex_unlock(&ttl_bkt->mtx);
-
-                        *seg_id_ret = seg_id;
-                        return EVICT_OK;
-                    }
-                }
-            }
+        qsbr_online();
 
-            /* next ttl bucket please */
+        if (!find_merge_job(job->bkt_idx, &job->start_seg_id, &job->n_seg)) {
             pthread_mutex_unlock(&ttl_bkt->mtx);
-            continue;
+            return EVICT_OTHER;
         }
+    } else if (pthread_mutex_trylock(&ttl_bkt->mtx) != 0) {
+        INCR(seg_metrics, seg_merge_skip);
+        return EVICT_CANNOT_LOCK_SEG;
+    }
 
-        int32_t next_seg_to_merge = -1; 
-        /* we have found enough consecutive evictable segments,
-         * block the eviction of next seg_n_max_merge segments */
-        prep_seg_to_merge(seg->seg_id, segs_to_merge,
-            &n_evictable_seg, merge_keep_ratio, &next_seg_to_merge);
+    if (job->n_seg == 1) {
+        /* the first seg may have expired since the job was queued */
+        if (ttl_bkt->first_seg_id == job->start_seg_id &&
+            rm_all_item_on_seg(job->start_seg_id, SEG_FORCE_EVICTION)) {
+            pthread_mutex_unlock(&ttl_bkt->mtx);
 
-#ifdef USE_THREAD_LOCAL_SEG
-        ttl_buckets[bkt_idx].next_seg_to_merge = next_seg_to_merge;
+            *seg_id_ret = job->start_seg_id;
+            return EVICT_OK;
+        }
 
-        // move this from after merge to before merge, could cause a bug, 
-        // but this change signifcantly reduces contention 
-        // but we trade off some efficiency for scalability, need a better design
         pthread_mutex_unlock(&ttl_bkt->mtx);
+        return EVICT_OTHER;
+    }
 
+    /* block the eviction of next seg_n_max_merge segments */
+    if (!prep_seg_to_merge(job->bkt_idx, job->start_seg_id, segs_to_merge,
+        &n_evictable_seg, merge_keep_ratio)) {
+        /* the segs have changed since the job was queued */
+        pthread_mutex_unlock(&ttl_bkt->mtx);
+        return EVICT_OTHER;
+    }
+
+    if (use_thread_local_seg) {
+        /* the merged segs are locked and next_seg_to_merge has moved
+         * past them, so other threads can merge the following segs of
+         * this bucket while we are merging, this trades off some merge
+         * efficiency for scalability */
+        pthread_mutex_unlock(&ttl_bkt->mtx);
+        merge_segs(segs_to_merge, n_evictable_seg, merge_keep_ratio);
+    } else {
         merge_segs(segs_to_merge, n_evictable_seg, merge_keep_ratio);
+        pthread_mutex_unlock(&ttl_bkt->mtx);
+    }
 
-#else 
-        ttl_buckets[bkt_idx].next_seg_to_merge =
-            merge_segs(segs_to_merge, n_evictable_seg, merge_keep_ratio);
+    *seg_id_ret = segs_to_merge[0]->seg_id;
+    return EVICT_OK;
+}
 
-        pthread_mutex_unlock(&ttl_bkt->mtx);
-#endif 
 
+evict_rstatus_e
+seg_merge_evict(int32_t *seg_id_ret)
+{
+    struct merge_job job;
+    evict_rstatus_e  status;
+    int32_t          busy_bkt_idx = -1;
+    int32_t          sched_busy_bkt_idx;
+    int              n_sched      = 0;
+    int              n_job;
+
+    /* jobs are taken from the queue, the thread that finds the queue empty
+     * fills it, a bucket being merged by another thread is skipped instead
+     * of waited on, so threads running out of free segs at the same time
+     * spread over the buckets
+     *
+     * the queue is refilled at most twice, in case the jobs of the first
+     * scan are taken by other threads before we get to them */
+    while (true) {
+        if (!merge_queue_pop(&job)) {
+            if (n_sched++ == 2) {
+                break;
+            }
+            n_job = merge_sched(&sched_busy_bkt_idx);
+            if (busy_bkt_idx == -1) {
+                busy_bkt_idx = sched_busy_bkt_idx;
+            }
+            if (n_job == 0 || !merge_queue_pop(&job)) {
+                break;
+            }
+        }
 
-        last_bkt_idx = bkt_idx;
+        status = merge_job_run(&job, false, seg_id_ret);
+        if (status == EVICT_OK) {
+            return EVICT_OK;
+        }
 
-//        *seg_id_ret = seg_get_from_freepool(false);
-//        log_warn("get seg %d", *seg_id_ret);
-//        if (*seg_id_ret == -1)
-//            return EVICT_NO_AVAILABLE_SEG;
+        if (status == EVICT_CANNOT_LOCK_SEG && busy_bkt_idx == -1) {
+            busy_bkt_idx = job.bkt_idx;
+        }
+    }
 
-        *seg_id_ret = segs_to_merge[0]->seg_id;
-        return EVICT_OK;
+    /* all the buckets with segs to evict are being merged, wait for one of
+     * them rather than failing the write */
+    if (busy_bkt_idx != -1) {
+        job.bkt_idx = busy_bkt_idx;
+        if (merge_job_run(&job, true, seg_id_ret) == EVICT_OK) {
+            return EVICT_OK;
+        }
     }
 
     /* reach here means we cannot find any segment to merge,
      * it might be 1. the mature time is too large
      * 2. there is limited number of active TTL buckets and the thread won't be
      * able to lock that bucket */
-//    pthread_mutex_lock(&heap.mtx);
-//    if (heap.n_free_seg > heap.n_reserved_seg) {
-//        *seg_id_ret = seg_get_from_freepool(false);
-//
-//        pthread_mutex_unlock(&heap.mtx);
-//        return EVICT_OK;
-//    }
-//    pthread_mutex_unlock(&heap.mtx);
-
     evict_info.seg_mature_time = evict_info.seg_mature_time / 2;
 
     log_warn("cannot find enough evictable segs");
@@ -358,6 +595,31 @@ seg_merge_evict(int32_t *seg_id_ret)
     return EVICT_NO_AVAILABLE_SEG;
 }
 
+/*
+ * drop an up-to-date item that is not copied to the merged seg, it is
+ * demoted to the flash tier instead if it has been accessed often enough
+ * and has not expired
+ */
+static inline void
+_merge_drop(struct seg *seg_src, int32_t seg_id_src_ht, struct item *it,
+            int32_t it_offset, double it_raw_freq)
+{
+    struct flash_loc loc;
+    proc_time_i      expire_at = seg_src->create_at + seg_src->ttl;
+
+    if (use_flash && it_raw_freq >= evict_info.merge_opt.flash_min_freq &&
+        expire_at > time_proc_sec() &&
+        flash_append(it, seg_src->create_at, expire_at, &loc)) {
+        if (hashtable_demote(item_key(it), it->klen, seg_id_src_ht,
+                it_offset, &loc)) {
+            INCR(seg_metrics, flash_demote);
+        }
+        return;
+    }
+
+    hashtable_evict(item_key(it), it->klen, seg_id_src_ht, it_offset);
+}
+
 static void
 seg_copy(int32_t seg_id_dest, int32_t seg_id_src,
          double *cutoff_freq, double target_ratio)
@@ -384,11 +646,16 @@ seg_copy(int32_t seg_id_dest, int32_t seg_id_src,
     uint32_t offset = MIN(seg_src->write_offset, heap.seg_size) - ITEM_HDR_SIZE;
 
     int32_t it_sz, it_offset;
-    double  it_freq;
+    double  it_freq, it_raw_freq;
 
     bool it_up_to_date;
     bool dest_seg_full = false;
 
+    /* items of keys that are no longer accessed are not retained in the TTL
+     * buckets with admission */
+    bool admit = use_admit &&
+        ttl_buckets[find_ttl_bucket_idx(seg_src->ttl)].admit;
+
     /* if the merged seg has reached stop_byte, no more new seg will be merged
  * into it, so let's copy more from current seg to the merged seg */
     bool              copy_all_items = false;
@@ -475,10 +742,19 @@ seg_copy(int32_t seg_id_dest, int32_t seg_id_src,
         it_freq = (double) it->freq;
 #endif
         ASSERT(it_freq >= 0);
+        it_raw_freq = it_freq;
         it_freq = it_freq / ((double) it_sz / mean_size);
 
         if (it_freq <= cutoff && (!copy_all_items)) {
-            hashtable_evict(item_key(it), it->klen, seg_id_src_ht, it_offset);
+            _merge_drop(seg_src, seg_id_src_ht, it, it_offset, it_raw_freq);
+            curr_src += it_sz;
+            continue;
+        }
+
+        if (admit && !copy_all_items &&
+            admit_estimate(item_key(it), it->klen) < admit_threshold()) {
+            INCR(seg_metrics, admit_merge_drop);
+            _merge_drop(seg_src, seg_id_src_ht, it, it_offset, it_raw_freq);
             curr_src += it_sz;
             continue;
         }
@@ -492,7 +768,7 @@ seg_copy(int32_t seg_id_dest, int32_t seg_id_src,
                     it_offset);
             }
 
-            hashtable_evict(item_key(it), it->klen, seg_id_src_ht, it_offset);
+            _merge_drop(seg_src, seg_id_src_ht, it, it_offset, it_raw_freq);
             curr_src += it_sz;
             continue;
         }
@@ -565,11 +841,6 @@ merge_segs(struct seg *segs_to_merge[],
     uint8_t    accessible;
     int        n_merged         = 0;
 
-    /* this is the next seg_id of the last evictable segment, we keep it
-     * in case there are no active objects in all evictable segments (so no merged seg),
-     * we return this seg */
-    int32_t last_seg_next_seg_id = segs_to_merge[n_evictable - 1]->next_seg_id;
-
     /* get a reserved seg as the new seg for storing the copied objects */
     int32_t new_seg_id = seg_get_from_freepool(true);
     seg_init(new_seg_id);
@@ -577,6 +848,8 @@ merge_segs(struct seg *segs_to_merge[],
     struct seg *new_seg = &heap.segs[new_seg_id];
     ASSERT(new_seg->evictable == 0);
 
+    int32_t bkt_idx = find_ttl_bucket_idx(segs_to_merge[0]->ttl);
+
     new_seg->create_at   = segs_to_merge[0]->create_at;
     new_seg->merge_at    = time_proc_sec();
     new_seg->ttl         = segs_to_merge[0]->ttl;
@@ -595,8 +868,11 @@ merge_segs(struct seg *segs_to_merge[],
         cutoff_freq = 0;
     }
 
-    /* start from start_seg until new_seg is full or no seg can be merged */
-    while (new_seg->write_offset < mopt->stop_bytes && n_merged < n_evictable) {
+    /* start from start_seg until new_seg is full or no seg can be merged,
+     * at least two segs are merged, so that one goes back to the free pool
+     * in place of the reserved seg we have taken */
+    while ((new_seg->write_offset < mopt->stop_bytes || n_merged < 2) &&
+           n_merged < n_evictable) {
         curr_seg    = segs_to_merge[n_merged];
         curr_seg_id = curr_seg->seg_id;
 
@@ -609,20 +885,21 @@ merge_segs(struct seg *segs_to_merge[],
         ASSERT(accessible == 1);
 
         seg_wait_refcnt(curr_seg_id);
+        seg_retire(curr_seg_id);
 
-        pthread_mutex_lock(&heap.mtx);
+        ttl_bucket_lock(bkt_idx);
         if (n_merged == 0) {
             /* place the new seg at the position of the first evicted seg and
              * not return this seg to freepool, keep it for the immediate use */
             replace_seg_in_chain(new_seg_id, curr_seg_id);
+            ttl_bucket_unlock(bkt_idx);
         }
         else {
             rm_seg_from_ttl_bucket(curr_seg_id);
+            ttl_bucket_unlock(bkt_idx);
             seg_add_to_freepool(curr_seg_id, SEG_EVICTION);
         }
 
-        pthread_mutex_unlock(&heap.mtx);
-
         n_merged++;
 
         INCR_N(seg_metrics, seg_evict_age_sum,
@@ -636,10 +913,10 @@ merge_segs(struct seg *segs_to_merge[],
         /* if the evicted segs all have no live object */
         new_seg->accessible = 0;
 
-        pthread_mutex_lock(&heap.mtx);
+        ttl_bucket_lock(bkt_idx);
         rm_seg_from_ttl_bucket(new_seg_id);
+        ttl_bucket_unlock(bkt_idx);
         seg_add_to_freepool(new_seg_id, SEG_EVICTION);
-        pthread_mutex_unlock(&heap.mtx);
 
         log_warn("merged %d segments with no active objects, "
                  "return reserved seg %d", n_merged, new_seg_id);
@@ -649,16 +926,24 @@ merge_segs(struct seg *segs_to_merge[],
 
         empty_merge += 1;
 
-        return last_seg_next_seg_id;
+        return n_merged;
     }
     else {
         /* because we locked n_evictable segs,
          * and we have only evicted n_merged segs,
-         * change the status of un-merged seg */
-        for (int i = n_merged; i < n_evictable; i++) {
-            uint8_t evictable = __atomic_exchange_n(
-                &segs_to_merge[i]->evictable, 1, __ATOMIC_RELAXED);
-            ASSERT(evictable == 0);
+         * change the status of un-merged seg, and start the next merge of
+         * this bucket from them */
+        if (n_merged < n_evictable) {
+            struct ttl_bucket *tb = &ttl_buckets[bkt_idx];
+
+            ttl_bucket_lock(bkt_idx);
+            for (int i = n_merged; i < n_evictable; i++) {
+                uint8_t evictable = __atomic_exchange_n(
+                    &segs_to_merge[i]->evictable, 1, __ATOMIC_RELAXED);
+                ASSERT(evictable == 0);
+            }
+            tb->next_seg_to_merge = segs_to_merge[n_merged]->seg_id;
+            ttl_bucket_unlock(bkt_idx);
         }
 
         /* because of internal memory fragmentation, the seg is not always full
@@ -684,7 +969,7 @@ merge_segs(struct seg *segs_to_merge[],
 
         // log_verb("***************************************************");
 
-        return heap.segs[new_seg_id].next_seg_id;
+        return n_merged;
     }
 
     ASSERT(0);
@@ -3,14 +3,161 @@
 #include "item.h"
 #include "seg.h"
 
+#include <cc_mm.h>
+
 #include <pthread.h>
 #include <sys/errno.h>
 
 extern struct ttl_bucket     ttl_buckets[MAX_N_TTL_BUCKET];
 extern seg_metrics_st        *seg_metrics;
 extern seg_perttl_metrics_st perttl[MAX_N_TTL_BUCKET];
-__thread int32_t             local_last_seg[MAX_N_TTL_BUCKET] = {0};
+extern bool                  use_thread_local_seg;
+
+/* the active (not yet linked) seg of one TTL bucket owned by one thread */
+struct local_seg {
+    int32_t                 seg_id;     /* -1 if none or being written */
+    proc_time_i             last_write;
+};
+
+/* each writer thread allocates its table upon the first write and registers
+ * it on a global list, so that the background thread can reclaim segs that
+ * are no longer written to, tables are never freed, and a table from a
+ * previous setup (different gen) is reset before use */
+struct local_seg_table {
+    uint32_t                gen;
+    struct local_seg        segs[MAX_N_TTL_BUCKET];
+    struct local_seg_table  *next;
+};
+
+static __thread struct local_seg_table *local_table = NULL;
+static struct local_seg_table          *local_tables = NULL;
+static uint32_t                        local_gen = 0;
+
+/* min-heap of non-empty TTL buckets keyed on next_expiration_sec (the
+ * expiration time of the first seg), so that the background thread finds
+ * expired segs without scanning all TTL buckets, it is protected by the
+ * heap lock as it changes together with the first seg of a bucket */
+static int16_t exp_heap[MAX_N_TTL_BUCKET];
+static int16_t exp_heap_pos[MAX_N_TTL_BUCKET]; /* -1 if not in exp_heap */
+static int32_t exp_heap_n = 0;
+
+
+static inline bool
+_exp_heap_less(int32_t i, int32_t j)
+{
+    return ttl_buckets[exp_heap[i]].next_expiration_sec <
+        ttl_buckets[exp_heap[j]].next_expiration_sec;
+}
+
+static inline void
+_exp_heap_swap(int32_t i, int32_t j)
+{
+    int16_t t = exp_heap[i];
+
+    exp_heap[i] = exp_heap[j];
+    exp_heap[j] = t;
+    exp_heap_pos[exp_heap[i]] = i;
+    exp_heap_pos[exp_heap[j]] = j;
+}
+
+static void
+_exp_heap_fix(int32_t i)
+{
+    int32_t parent, child;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!_exp_heap_less(i, parent)) {
+            break;
+        }
+        _exp_heap_swap(i, parent);
+        i = parent;
+    }
+
+    while ((child = 2 * i + 1) < exp_heap_n) {
+        if (child + 1 < exp_heap_n && _exp_heap_less(child + 1, child)) {
+            child += 1;
+        }
+        if (!_exp_heap_less(child, i)) {
+            break;
+        }
+        _exp_heap_swap(i, child);
+        i = child;
+    }
+}
+
+void
+ttl_bucket_update_expiration(int32_t ttl_bucket_idx)
+{
+    struct ttl_bucket *ttl_bucket = &ttl_buckets[ttl_bucket_idx];
+    int32_t           pos         = exp_heap_pos[ttl_bucket_idx];
+    struct seg        *seg;
+
+    ASSERT(pthread_mutex_trylock(&heap.mtx) != 0);
+
+    if (ttl_bucket->first_seg_id == -1) {
+        if (pos != -1) {
+            /* move the last one to the hole */
+            exp_heap_n -= 1;
+            exp_heap_pos[ttl_bucket_idx] = -1;
+            if (pos != exp_heap_n) {
+                exp_heap[pos] = exp_heap[exp_heap_n];
+                exp_heap_pos[exp_heap[pos]] = pos;
+                _exp_heap_fix(pos);
+            }
+        }
+
+        return;
+    }
+
+    seg = &heap.segs[ttl_bucket->first_seg_id];
+    ttl_bucket->next_expiration_sec = seg->create_at + seg->ttl;
+
+    if (pos == -1) {
+        pos = exp_heap_n++;
+        exp_heap[pos] = ttl_bucket_idx;
+        exp_heap_pos[ttl_bucket_idx] = pos;
+    }
+    _exp_heap_fix(pos);
+}
+
+int32_t
+ttl_bucket_next_to_expire(void)
+{
+    ASSERT(pthread_mutex_trylock(&heap.mtx) != 0);
+
+    return exp_heap_n == 0 ? -1 : exp_heap[0];
+}
+
+void
+ttl_bucket_lock(int32_t ttl_bucket_idx)
+{
+    pthread_mutex_t *mtx = &ttl_buckets[ttl_bucket_idx].chain_mtx;
+
+    if (pthread_mutex_trylock(mtx) != 0) {
+        INCR(seg_metrics, seg_chain_contend);
+        pthread_mutex_lock(mtx);
+    }
+}
+
+void
+ttl_bucket_unlock(int32_t ttl_bucket_idx)
+{
+    pthread_mutex_unlock(&ttl_buckets[ttl_bucket_idx].chain_mtx);
+}
 
+void
+ttl_bucket_set_first_seg(int32_t ttl_bucket_idx, int32_t seg_id)
+{
+    ASSERT(pthread_mutex_trylock(&ttl_buckets[ttl_bucket_idx].chain_mtx) != 0);
+
+    /* the expiration index is shared by all TTL buckets, it only changes
+     * when the first seg of a bucket changes, which is rare */
+    pthread_mutex_lock(&heap.mtx);
+    ttl_buckets[ttl_bucket_idx].first_seg_id = seg_id;
+    ttl_bucket_update_expiration(ttl_bucket_idx);
+    pthread_mutex_unlock(&heap.mtx);
+}
 
 /* reserve the size of an incoming item in the last segment of the TTL bucket,
  * if the segment does not have enough space,
@@ -18,12 +165,9 @@ __thread int32_t             local_last_seg[MAX_N_TTL_BUCKET] = {0};
  * seg_id is used to return the id of the segment which the object will be
  * written to
  */
-#ifndef USE_THREAD_LOCAL_SEG
-/* use thread local seg requires reserving one seg per thread per active TTL
- * bucket, which is expensive when there is no need for high scalability,
- * Segcache can scale to 8 cores without turning this on */
-struct item *
-ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
+static struct item *
+_ttl_bucket_reserve_item_shared(int32_t ttl_bucket_idx, size_t sz,
+                                int32_t *seg_id)
 {
     struct item       *it;
     struct ttl_bucket *ttl_bucket = &ttl_buckets[ttl_bucket_idx];
@@ -83,11 +227,7 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
         new_seg = &heap.segs[new_seg_id];
         new_seg->ttl = ttl_bucket->ttl;
 
-        /* TODO(juncheng): update to TTL lock */
-        if (pthread_mutex_lock(&heap.mtx) != 0) {
-            log_error("unable to lock mutex");
-            return NULL;
-        }
+        ttl_bucket_lock(ttl_bucket_idx);
         /* pass the lock, need to double check whether the last_seg
          * has changed (optimistic alloc) this can change either because
          * another thread has linked a new segment or
@@ -108,7 +248,7 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
                 /* the first seg of the bucket */
                 ASSERT(ttl_bucket->last_seg_id == -1);
 
-                ttl_bucket->first_seg_id = new_seg_id;
+                ttl_bucket_set_first_seg(ttl_bucket_idx, new_seg_id);
             }
             else {
                 ASSERT(curr_seg != NULL);
@@ -125,6 +265,8 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
             ASSERT(new_seg->next_seg_id == -1);
 
             ttl_bucket->n_seg++;
+            __atomic_add_fetch(&ttl_bucket->evict_pressure, 1,
+                __ATOMIC_RELAXED);
 
             /* Q(juncheng): can we make it evictable when the seg finishes? */
             bool evictable = __atomic_exchange_n(
@@ -146,7 +288,7 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
                 ttl_bucket->first_seg_id, ttl_bucket->last_seg_id);
         }
 
-        pthread_mutex_unlock(&heap.mtx);
+        ttl_bucket_unlock(ttl_bucket_idx);
 
         curr_seg_id = new_seg_id;
         curr_seg    = &heap.segs[curr_seg_id];
@@ -166,20 +308,113 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
 
     return it;
 }
-#else
-struct item *
-ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
+
+/* link a thread-local seg to the end of the seg chain of the TTL bucket,
+ * caller should grab the chain lock before calling this function */
+static void
+_ttl_bucket_link_seg(int32_t ttl_bucket_idx, int32_t seg_id)
 {
-    struct item       *it;
     struct ttl_bucket *ttl_bucket = &ttl_buckets[ttl_bucket_idx];
-    int32_t           curr_seg_id;
-    struct seg        *curr_seg   = NULL;
+    struct seg        *seg        = &heap.segs[seg_id];
+
+    ASSERT(pthread_mutex_trylock(&ttl_bucket->chain_mtx) != 0);
+
+    /* last seg id could be -1 */
+    if (ttl_bucket->first_seg_id == -1) {
+        ASSERT(ttl_bucket->last_seg_id == -1);
+
+        ttl_bucket_set_first_seg(ttl_bucket_idx, seg_id);
+    }
+    else {
+        heap.segs[ttl_bucket->last_seg_id].next_seg_id = seg_id;
+    }
+
+    seg->prev_seg_id        = ttl_bucket->last_seg_id;
+    ttl_bucket->last_seg_id = seg_id;
+    ASSERT(seg->next_seg_id == -1);
+
+    ttl_bucket->n_seg += 1;
+    __atomic_add_fetch(&ttl_bucket->evict_pressure, 1, __ATOMIC_RELAXED);
+
+    bool evictable = __atomic_exchange_n(&seg->evictable, 1, __ATOMIC_RELAXED);
+    ASSERT(evictable == 0);
+
+    PERTTL_INCR(ttl_bucket_idx, seg_curr);
+    INCR(seg_metrics, seg_local_link);
+
+    log_debug("link seg %d (offset %d occupied_size %d) to "
+              "ttl bucket %d, total %d segments, "
+              "prev seg %d, first seg %d, last seg %d",
+        seg_id, seg->write_offset, seg->live_bytes,
+        ttl_bucket_idx, ttl_bucket->n_seg, seg->prev_seg_id,
+        ttl_bucket->first_seg_id, ttl_bucket->last_seg_id);
+}
+
+static struct local_seg_table *
+_local_seg_table(void)
+{
+    struct local_seg_table *table = local_table;
+    uint32_t               gen    = __atomic_load_n(&local_gen, __ATOMIC_ACQUIRE);
+
+    if (table == NULL) {
+        table = cc_alloc(sizeof(struct local_seg_table));
+        if (table == NULL) {
+            return NULL;
+        }
+
+        table->gen = gen - 1;
+        table->next = __atomic_load_n(&local_tables, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&local_tables, &table->next, table,
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            ;
+        }
+        local_table = table;
+    }
+
+    if (table->gen != gen) {
+        /* segs reserved before the last setup are gone with the old heap */
+        for (int i = 0; i < MAX_N_TTL_BUCKET; i++) {
+            __atomic_store_n(&table->segs[i].seg_id, -1, __ATOMIC_RELAXED);
+            table->segs[i].last_write = 0;
+        }
+        __atomic_store_n(&table->gen, gen, __ATOMIC_RELEASE);
+    }
+
+    return table;
+}
+
+/* each thread writes to its own active seg of the TTL bucket, the seg is only
+ * reserved when the thread first writes to the bucket, and it is linked into
+ * the seg chain when it is full (or reclaimed by the background thread),
+ * so writers do not share write_offset or contend on the heap lock per seg.
+ *
+ * The slot is emptied while the owner is writing, which is how the owner and
+ * ttl_bucket_reclaim_local_segs agree on who links the seg.
+ */
+static struct item *
+_ttl_bucket_reserve_item_local(int32_t ttl_bucket_idx, size_t sz,
+                               int32_t *seg_id)
+{
+    struct item            *it;
+    struct ttl_bucket      *ttl_bucket = &ttl_buckets[ttl_bucket_idx];
+    struct local_seg_table *table;
+    struct local_seg       *local;
+    int32_t                curr_seg_id;
+    struct seg             *curr_seg   = NULL;
 
     uint8_t *seg_data  = NULL;
     int32_t offset     = 0; /* offset of the reserved item in the seg */
     uint8_t accessible = false;
 
-    curr_seg_id = local_last_seg[ttl_bucket_idx] - 1;
+    table = _local_seg_table();
+    if (table == NULL) {
+        log_warn("cannot allocate thread local seg table, use shared seg");
+
+        return _ttl_bucket_reserve_item_shared(ttl_bucket_idx, sz, seg_id);
+    }
+    local = &table->segs[ttl_bucket_idx];
+
+    curr_seg_id = __atomic_exchange_n(&local->seg_id, -1, __ATOMIC_ACQUIRE);
 
     if (curr_seg_id != -1) {
         curr_seg   = &heap.segs[curr_seg_id];
@@ -190,50 +425,18 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
     }
 
     if (curr_seg_id == -1 || offset + sz > heap.seg_size || (!accessible)) {
-        if (offset + sz > heap.seg_size) {
-            ASSERT(offset <= heap.seg_size);
-            seg_data = get_seg_data_start(curr_seg_id);
-            memset(seg_data + offset, 0, heap.seg_size - offset);
-        }
-
         if (curr_seg_id != -1) {
-            /* curr seg is not linked to segment chain at this time,
-             * link it now */
-            if (pthread_mutex_lock(&heap.mtx) != 0) {
-                log_error("unable to lock mutex");
-                return NULL;
+            if (offset + sz > heap.seg_size) {
+                ASSERT(offset <= heap.seg_size);
+                seg_data = get_seg_data_start(curr_seg_id);
+                memset(seg_data + offset, 0, heap.seg_size - offset);
             }
 
-            /* last seg id could be -1 */
-            if (ttl_bucket->first_seg_id == -1) {
-                ASSERT(ttl_bucket->last_seg_id == -1);
-
-                ttl_bucket->first_seg_id = curr_seg_id;
-            }
-            else {
-                heap.segs[ttl_bucket->last_seg_id].next_seg_id = curr_seg_id;
-            }
-
-            curr_seg->prev_seg_id   = ttl_bucket->last_seg_id;
-            ttl_bucket->last_seg_id = curr_seg_id;
-            ASSERT(curr_seg->next_seg_id == -1);
-
-            ttl_bucket->n_seg += 1;
-
-            bool evictable = __atomic_exchange_n(
-                &curr_seg->evictable, 1, __ATOMIC_RELAXED);
-            ASSERT(evictable == 0);
-
-            PERTTL_INCR(ttl_bucket_idx, seg_curr);
-
-            log_debug("link seg %d (offset %d occupied_size %d) to "
-                      "ttl bucket %d, total %d segments, "
-                      "prev seg %d, first seg %d, last seg %d",
-                curr_seg_id, curr_seg->write_offset, curr_seg->live_bytes,
-                ttl_bucket_idx, ttl_bucket->n_seg, curr_seg->prev_seg_id,
-                ttl_bucket->first_seg_id, ttl_bucket->last_seg_id);
-
-            pthread_mutex_unlock(&heap.mtx);
+            /* curr seg is not linked to segment chain at this time,
+             * link it now */
+            ttl_bucket_lock(ttl_bucket_idx);
+            _ttl_bucket_link_seg(ttl_bucket_idx, curr_seg_id);
+            ttl_bucket_unlock(ttl_bucket_idx);
         }
 
         curr_seg_id = seg_get_new();
@@ -245,7 +448,6 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
             return NULL;
         }
 
-        local_last_seg[ttl_bucket_idx] = curr_seg_id + 1;
         curr_seg = &heap.segs[curr_seg_id];
         curr_seg->ttl         = ttl_bucket->ttl;
         curr_seg->next_seg_id = -1;
@@ -257,18 +459,81 @@ ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
     it       = (struct item *) (seg_data + offset);
     *seg_id = curr_seg->seg_id;
 
+    __atomic_store_n(&local->last_write, time_proc_sec(), __ATOMIC_RELAXED);
+    __atomic_store_n(&local->seg_id, curr_seg_id, __ATOMIC_RELEASE);
+
     PERTTL_INCR(ttl_bucket_idx, item_curr);
     PERTTL_INCR_N(ttl_bucket_idx, item_curr_bytes, sz);
 
     return it;
 }
-#endif
+
+/* use thread local seg requires reserving one seg per thread per active TTL
+ * bucket, which is expensive when there is no need for high scalability,
+ * Segcache can scale to 8 cores without turning this on */
+struct item *
+ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id)
+{
+    if (use_thread_local_seg) {
+        return _ttl_bucket_reserve_item_local(ttl_bucket_idx, sz, seg_id);
+    }
+
+    return _ttl_bucket_reserve_item_shared(ttl_bucket_idx, sz, seg_id);
+}
+
+void
+ttl_bucket_reclaim_local_segs(delta_time_i idle_sec)
+{
+    struct local_seg_table *table;
+    struct local_seg       *local;
+    int32_t                seg_id;
+    uint32_t               gen = __atomic_load_n(&local_gen, __ATOMIC_ACQUIRE);
+    proc_time_i            now = time_proc_sec();
+
+    table = __atomic_load_n(&local_tables, __ATOMIC_ACQUIRE);
+    for (; table != NULL; table = table->next) {
+        if (__atomic_load_n(&table->gen, __ATOMIC_ACQUIRE) != gen) {
+            continue;
+        }
+
+        for (int i = 0; i < MAX_N_TTL_BUCKET; i++) {
+            local  = &table->segs[i];
+            seg_id = __atomic_load_n(&local->seg_id, __ATOMIC_RELAXED);
+            if (seg_id == -1) {
+                continue;
+            }
+
+            if (seg_is_accessible(seg_id) && now -
+                __atomic_load_n(&local->last_write, __ATOMIC_RELAXED) <
+                idle_sec) {
+                continue;
+            }
+
+            /* fails if the owner is writing to (or has replaced) the seg */
+            if (!__atomic_compare_exchange_n(&local->seg_id, &seg_id, -1,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                continue;
+            }
+
+            ttl_bucket_lock(i);
+            _ttl_bucket_link_seg(i, seg_id);
+            ttl_bucket_unlock(i);
+
+            INCR(seg_metrics, seg_local_reclaim);
+        }
+    }
+}
 
 void
 ttl_bucket_setup(void)
 {
     struct ttl_bucket *ttl_bucket;
 
+    /* invalidate the thread local segs from last setup */
+    __atomic_add_fetch(&local_gen, 1, __ATOMIC_RELEASE);
+
+    exp_heap_n = 0;
+
     delta_time_i ttl_bucket_intvls[] = {TTL_BUCKET_INTVL1, TTL_BUCKET_INTVL2,
                                         TTL_BUCKET_INTVL3, TTL_BUCKET_INTVL4};
 
@@ -282,10 +547,32 @@ ttl_bucket_setup(void)
             ttl_bucket->next_seg_to_merge = -1;
             ttl_bucket->last_cutoff_freq  = 0;
             pthread_mutex_init(&(ttl_bucket->mtx), NULL);
+            pthread_mutex_init(&(ttl_bucket->chain_mtx), NULL);
+            exp_heap_pos[i * N_BUCKET_PER_STEP + j] = -1;
         }
     }
 }
 
+void
+ttl_bucket_admit(delta_time_i ttl_min, delta_time_i ttl_max)
+{
+    struct ttl_bucket *ttl_bucket;
+    uint32_t          n_admit = 0;
+
+    for (uint32_t i = 0; i < MAX_N_TTL_BUCKET; i++) {
+        ttl_bucket = &ttl_buckets[i];
+        if (i == MAX_TTL_BUCKET_IDX) {
+            ttl_bucket->admit = ttl_max == 0;
+        } else {
+            ttl_bucket->admit = ttl_bucket->ttl >= ttl_min &&
+                (ttl_max == 0 || ttl_bucket->ttl <= ttl_max);
+        }
+        n_admit += ttl_bucket->admit;
+    }
+
+    log_info("admission filter enabled for %" PRIu32 " TTL buckets", n_admit);
+}
+
 void
 ttl_bucket_teardown(void)
 {
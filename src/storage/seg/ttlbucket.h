@@ -11,6 +11,9 @@
 #define likely(x)      __builtin_expect(!!(x), 1)
 #define unlikely(x)    __builtin_expect(!!(x), 0)
 
+/* a thread-local seg not written for this long is linked to its TTL bucket */
+#define LOCAL_SEG_IDLE_SEC  4
+
 
 /**
  * TTL indexed segment linked list, each segment (after allocation)
@@ -106,11 +109,16 @@ struct ttl_bucket {
     int32_t             first_seg_id;
     int32_t             last_seg_id;
     delta_time_i        ttl;           /* the min ttl of this bucket */
-    proc_time_i         next_expiration_sec;
+    proc_time_i         next_expiration_sec; /* when the first seg expires */
     uint32_t            n_seg;
     int32_t             next_seg_to_merge;
     delta_time_i        last_cutoff_freq;
-    pthread_mutex_t     mtx;
+    uint32_t            evict_pressure; /* # segs linked since the bucket was
+                                         * last scheduled for merge */
+    pthread_mutex_t     mtx;           /* merge lock */
+    pthread_mutex_t     chain_mtx;     /* protects the seg chain, n_seg and
+                                        * next_seg_to_merge */
+    bool                admit;         /* writes pass the admission filter */
 };
 
 
@@ -155,6 +163,14 @@ ttl_bucket_setup(void);
 void
 ttl_bucket_teardown(void);
 
+/**
+ * Enable the admission filter for the TTL buckets whose TTL is within
+ * [ttl_min, ttl_max], ttl_max of 0 means no limit, and the bucket of items
+ * that never expire is included only then.
+ */
+void
+ttl_bucket_admit(delta_time_i ttl_min, delta_time_i ttl_max);
+
 /**
  * Reserve an item from the active segment of the ttl bucket.
  * If the active seg of current ttl bucket does not have enough space,
@@ -164,3 +180,44 @@ ttl_bucket_teardown(void);
  */
 struct item *
 ttl_bucket_reserve_item(int32_t ttl_bucket_idx, size_t sz, int32_t *seg_id);
+
+/**
+ * Link the thread-local active segs that have not been written to for
+ * idle_sec seconds (or can no longer be written to) into the seg chains of
+ * their TTL buckets, so they can be expired and evicted.
+ * Only used when seg_thread_local is enabled.
+ */
+void
+ttl_bucket_reclaim_local_segs(delta_time_i idle_sec);
+
+/**
+ * Lock/unlock the seg chain of the TTL bucket, all changes to the chain
+ * (first/last seg, prev/next of the segs in the chain) need the chain lock,
+ * writers rolling over to new segs in different TTL buckets do not contend.
+ */
+void
+ttl_bucket_lock(int32_t ttl_bucket_idx);
+
+void
+ttl_bucket_unlock(int32_t ttl_bucket_idx);
+
+/**
+ * Change the first seg of the TTL bucket and update the expiration index,
+ * caller should hold the chain lock of the TTL bucket.
+ */
+void
+ttl_bucket_set_first_seg(int32_t ttl_bucket_idx, int32_t seg_id);
+
+/**
+ * Update the expiration index after the first seg of the TTL bucket has
+ * changed, caller should grab the heap lock before calling this function.
+ */
+void
+ttl_bucket_update_expiration(int32_t ttl_bucket_idx);
+
+/**
+ * Return the index of the TTL bucket whose first seg expires the earliest,
+ * or -1 if all TTL buckets are empty, caller should hold the heap lock.
+ */
+int32_t
+ttl_bucket_next_to_expire(void);
@@ -7,6 +7,7 @@
 
 #include <check.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -24,6 +25,7 @@ struct buf *buf;
 static void
 test_setup(void)
 {
+    parse_setup(NULL, NULL);
     req = request_create();
     rsp = response_create();
     buf = buf_create();
@@ -43,6 +45,7 @@ test_teardown(void)
     buf_destroy(&buf);
     response_destroy(&rsp);
     request_destroy(&req);
+    parse_teardown();
 }
 
 /**************
@@ -725,6 +728,79 @@ START_TEST(test_partial_header)
 #undef SERIALIZED
 }
 END_TEST
+
+START_TEST(test_partial_prefix)
+{
+#define KEY0 "key:0123456789abcdef0123456789abcdef0123"
+#define KEY1 "key:with\rlone:cr:0123456789abcdef0123456789abcdef"
+#define SERIALIZED "get " KEY0 "  " KEY1 "\r\nincr " KEY0 " 12345678901234\r\n"
+
+    int ret;
+    int len = sizeof(SERIALIZED) - 1;
+    struct bstring key0 = str2bstr(KEY0);
+    struct bstring key1 = str2bstr(KEY1);
+
+    /* every cut of the headers, including between CR and LF, is incomplete */
+    for (int i = 0; i < len; i++) {
+        test_reset();
+        buf_write(buf, SERIALIZED, i);
+
+        ret = parse_req(req, buf);
+        if (ret == PARSE_OK) {
+            ck_assert(req->type == REQ_GET);
+            ck_assert(i >= sizeof("get " KEY0 "  " KEY1 "\r\n") - 1);
+            request_reset(req);
+            ret = parse_req(req, buf);
+        }
+        ck_assert_msg(ret == PARSE_EUNFIN, "cut at %d, ret: %d", i, ret);
+        ck_assert(req->rstate == REQ_PARSING);
+    }
+
+    test_reset();
+    buf_write(buf, SERIALIZED, len);
+    ret = parse_req(req, buf);
+    ck_assert_int_eq(ret, PARSE_OK);
+    ck_assert(req->type == REQ_GET);
+    ck_assert_int_eq(array_nelem(req->keys), 2);
+    ck_assert_int_eq(bstring_compare(&key0, array_get(req->keys, 0)), 0);
+    ck_assert_int_eq(bstring_compare(&key1, array_get(req->keys, 1)), 0);
+    request_reset(req);
+    ret = parse_req(req, buf);
+    ck_assert_int_eq(ret, PARSE_OK);
+    ck_assert(req->type == REQ_INCR);
+    ck_assert_int_eq(bstring_compare(&key0, array_first(req->keys)), 0);
+    ck_assert_int_eq(req->delta, 12345678901234ULL);
+    ck_assert(buf->rpos == buf->wpos);
+#undef KEY0
+#undef KEY1
+#undef SERIALIZED
+}
+END_TEST
+
+START_TEST(test_oversize_key)
+{
+    int ret;
+    char serialized[MAX_TOKEN_LEN + 16];
+
+    /* a key of MAX_TOKEN_LEN bytes is the longest accepted */
+    test_reset();
+    cc_memcpy(serialized, "get ", 4);
+    cc_memset(serialized + 4, 'k', MAX_TOKEN_LEN);
+    cc_memcpy(serialized + 4 + MAX_TOKEN_LEN, "\r\n", 2);
+    buf_write(buf, serialized, MAX_TOKEN_LEN + 6);
+    ret = parse_req(req, buf);
+    ck_assert_int_eq(ret, PARSE_OK);
+    ck_assert_int_eq(((struct bstring *)array_first(req->keys))->len,
+            MAX_TOKEN_LEN);
+
+    test_reset();
+    cc_memset(serialized + 4, 'k', MAX_TOKEN_LEN + 1);
+    cc_memcpy(serialized + 5 + MAX_TOKEN_LEN, "\r\n", 2);
+    buf_write(buf, serialized, MAX_TOKEN_LEN + 7);
+    ret = parse_req(req, buf);
+    ck_assert_int_eq(ret, PARSE_EOVERSIZE);
+}
+END_TEST
 /*
  * basic responses
  */
@@ -986,6 +1062,43 @@ START_TEST(test_value)
 }
 END_TEST
 
+START_TEST(test_value_hdr)
+{
+#define SERIALIZED "VALUE foo 123 3 42\r\nXYZ\r\n"
+#define KEY "foo"
+#define VAL "XYZ"
+#define FLAG 123
+#define VCAS 42
+
+    int ret;
+    int len = sizeof(SERIALIZED) - 1 - sizeof(VAL) + 1 - CRLF_LEN;
+    struct bstring key = str2bstr(KEY);
+    struct bstring val = str2bstr(VAL);
+
+    test_reset();
+
+    /* compose, the value and the CRLF after it are written by the caller */
+    rsp->type = RSP_VALUE;
+    rsp->key = key;
+    rsp->vstr = val;
+    rsp->flag = FLAG;
+    rsp->cas = 1;
+    rsp->vcas = VCAS;
+    ret = compose_rsp_value_hdr(&buf, rsp);
+    ck_assert_msg(ret == len, "expected: %d, returned: %d", len, ret);
+    ck_assert_int_ge(buf_wsize(buf), CRLF_LEN);
+    buf_write(buf, VAL, sizeof(VAL) - 1);
+    buf_write(buf, CRLF, CRLF_LEN);
+    ck_assert_int_eq(cc_bcmp(buf->rpos, SERIALIZED, sizeof(SERIALIZED) - 1),
+            0);
+#undef VCAS
+#undef FLAG
+#undef VAL
+#undef KEY
+#undef SERIALIZED
+}
+END_TEST
+
 START_TEST(test_numeric)
 {
 #define SERIALIZED "9223372036854775807\r\n"
@@ -1290,6 +1403,64 @@ START_TEST(test_req_pool_basic)
 }
 END_TEST
 
+static void *
+_req_pool_thread(void *arg)
+{
+    uint32_t *nborrowed = arg;
+    struct request *reqs[4];
+    uint32_t i;
+
+    for (i = 0; i < 4 && (reqs[i] = request_borrow()) != NULL; i++);
+    *nborrowed = i;
+    while (i > 0) {
+        request_return(&reqs[--i]);
+    }
+
+    return NULL; /* the pool of this thread is destroyed on exit */
+}
+
+START_TEST(test_req_pool_nthread)
+{
+#define POOL_SIZE 10
+#define NTHREAD 3
+    int i;
+    struct request *reqs[POOL_SIZE];
+    request_metrics_st metrics =
+        (request_metrics_st) { REQUEST_METRIC(METRIC_INIT) };
+    request_options_st options = {.request_poolsize =
+        {.type = OPTION_TYPE_UINT, .val.vuint = POOL_SIZE}};
+    pthread_t tid;
+    uint32_t nborrowed;
+
+    request_setup(&options, &metrics);
+    ck_assert_int_eq(metrics.request_create.counter, POOL_SIZE);
+    request_pool_nthread(NTHREAD);
+
+    /* the pool of the calling thread is not kept for the workers */
+    ck_assert_int_eq(metrics.request_destroy.counter, POOL_SIZE);
+
+    /* each thread gets ceil(POOL_SIZE / NTHREAD) requests */
+    for (i = 0; i < 4; i++) {
+        reqs[i] = request_borrow();
+        ck_assert_msg(reqs[i] != NULL, "expected to borrow a request");
+    }
+    ck_assert_msg(request_borrow() == NULL, "expected request pool to be depleted");
+
+    /* another thread borrows from a pool of its own */
+    ck_assert_int_eq(pthread_create(&tid, NULL, _req_pool_thread, &nborrowed), 0);
+    ck_assert_int_eq(pthread_join(tid, NULL), 0);
+    ck_assert_int_eq(nborrowed, 4);
+
+    for (i = 0; i < 4; i++) {
+        request_return(&reqs[i]);
+    }
+
+    request_teardown();
+#undef NTHREAD
+#undef POOL_SIZE
+}
+END_TEST
+
 /*
  * test suite
  */
@@ -1318,6 +1489,8 @@ memcache_suite(void)
     tcase_add_test(tc_basic_req, test_decr_noreply);
     tcase_add_test(tc_basic_req, test_partial_header);
     tcase_add_test(tc_basic_req, test_partial_value);
+    tcase_add_test(tc_basic_req, test_partial_prefix);
+    tcase_add_test(tc_basic_req, test_oversize_key);
 
     /* basic responses */
     TCase *tc_basic_rsp = tcase_create("basic response");
@@ -1332,6 +1505,7 @@ memcache_suite(void)
     tcase_add_test(tc_basic_rsp, test_notstored);
     tcase_add_test(tc_basic_rsp, test_stat);
     tcase_add_test(tc_basic_rsp, test_value);
+    tcase_add_test(tc_basic_rsp, test_value_hdr);
     tcase_add_test(tc_basic_rsp, test_numeric);
     tcase_add_test(tc_basic_rsp, test_servererror);
     tcase_add_test(tc_basic_rsp, test_clienterror);
@@ -1355,6 +1529,7 @@ memcache_suite(void)
     suite_add_tcase(s, tc_req_pool);
 
     tcase_add_test(tc_req_pool, test_req_pool_basic);
+    tcase_add_test(tc_req_pool, test_req_pool_nthread);
 
     return s;
 }
@@ -0,0 +1,731 @@
+#include <server/segcache/data/process.h>
+
+#include <protocol/data/memcache_include.h>
+#include <storage/seg/item.h>
+#include <storage/seg/seg.h>
+#include <time/time.h>
+
+#include <buffer/cc_buf.h>
+#include <cc_bstring.h>
+#include <cc_mm.h>
+#include <channel/cc_tcp.h>
+#include <stream/cc_sockio.h>
+
+#include <check.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* define for each suite, local scope due to macro visibility rule */
+#define SUITE_NAME "segcache"
+#define DEBUG_LOG  SUITE_NAME ".log"
+
+/* a value large enough to be sent without a copy */
+#define VLEN (64 * KiB)
+
+seg_options_st seg_opts = {SEG_OPTION(OPTION_INIT)};
+
+static channel_handler_st hdl = {
+    .recv = (channel_recv_fn)tcp_recv,
+    .send = (channel_send_fn)tcp_send,
+};
+
+/* the worker end of the connection is s, the client end is peer */
+static struct buf_sock *s;
+static int peer;
+
+static char val[VLEN];
+static char *flash_path; /* the flash tier of the next test_setup, if any */
+static char *out; /* what the client has received */
+static size_t out_len;
+
+/*
+ * utilities
+ */
+static void
+test_setup(void)
+{
+    int sv[2];
+
+    proc_sec = 0;
+    option_load_default((struct option *)&seg_opts,
+            OPTION_CARDINALITY(seg_opts));
+    if (flash_path != NULL) {
+        unlink(flash_path);
+        option_set(&seg_opts.heap_mem, "16777216");
+        option_set(&seg_opts.seg_evict_opt, "5");
+        option_set(&seg_opts.seg_mature_time, "0");
+        option_set(&seg_opts.seg_flash_path, flash_path);
+        option_set(&seg_opts.seg_flash_size, "8388608");
+    }
+    seg_setup(&seg_opts, NULL);
+    parse_setup(NULL, NULL);
+    compose_setup(NULL, NULL);
+    process_setup(NULL, NULL);
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    ck_assert_int_eq(fcntl(sv[0], F_SETFL, O_NONBLOCK), 0);
+    ck_assert_int_eq(fcntl(sv[1], F_SETFL, O_NONBLOCK), 0);
+    s = buf_sock_create();
+    ck_assert_ptr_ne(s, NULL);
+    buf_sock_reset(s);
+    s->hdl = &hdl;
+    s->ch->sd = sv[0];
+    peer = sv[1];
+
+    for (int i = 0; i < VLEN; i++) {
+        val[i] = (char)('A' + i % 26);
+    }
+    out = cc_alloc(4 * VLEN);
+    out_len = 0;
+}
+
+static void
+test_teardown(void)
+{
+    if (s->data != NULL) {
+        segcache_process_error(&s->rbuf, &s->wbuf, &s->data);
+    }
+    close(s->ch->sd);
+    if (peer >= 0) {
+        close(peer);
+    }
+    buf_sock_destroy(&s);
+    cc_free(out);
+
+    process_teardown();
+    compose_teardown();
+    parse_teardown();
+    seg_teardown();
+    if (flash_path != NULL) {
+        unlink(flash_path);
+        flash_path = NULL;
+    }
+}
+
+/* store key with the first vlen bytes of val and no flags */
+static void
+_store(const char *key, uint32_t vlen)
+{
+    struct bstring k = {.data = (char *)key, .len = strlen(key)};
+    struct bstring v = {.data = val, .len = vlen};
+    struct item *it;
+
+    ck_assert_int_eq(item_reserve(&it, &k, &v, vlen, DATAFLAG_SIZE, INT32_MAX),
+            ITEM_OK);
+    *(uint32_t *)item_optional(it) = 0;
+    item_insert(it);
+}
+
+/* overwrite the value of key in its seg, as if the seg was reused */
+static void
+_clobber(const char *key)
+{
+    struct bstring k = {.data = (char *)key, .len = strlen(key)};
+    struct item *it = item_get(&k, NULL);
+
+    ck_assert_ptr_ne(it, NULL);
+    cc_memset(item_val(it), 'x', item_nval(it));
+    item_release(it);
+}
+
+/* the client sends data */
+static void
+_client_send(const char *data, size_t len)
+{
+    ck_assert_int_eq(write(peer, data, len), len);
+}
+
+/* the client receives whatever has arrived */
+static void
+_client_recv(void)
+{
+    ssize_t n;
+
+    while ((n = read(peer, out + out_len, 4 * VLEN - out_len)) > 0) {
+        out_len += n;
+    }
+    ck_assert(n == 0 || errno == EAGAIN);
+}
+
+/* the worker handles a read event, like _worker_read */
+static int
+_worker_read(void)
+{
+    segcache_process_recv(s);
+    return segcache_process_read(&s->rbuf, &s->wbuf, &s->data);
+}
+
+/* the worker sends until wbuf is empty, while the client keeps reading */
+static void
+_worker_flush(void)
+{
+    rstatus_i status;
+
+    do {
+        status = segcache_process_send(s);
+        ck_assert(status == CC_OK || status == CC_EAGAIN ||
+                status == CC_ERETRY);
+        _client_recv();
+    } while (buf_rsize(s->wbuf) > 0);
+}
+
+/* the expected response to a get of key with the first vlen bytes of val */
+static size_t
+_value_rsp(char *p, const char *key, uint32_t vlen)
+{
+    size_t n = sprintf(p, "VALUE %s 0 %u\r\n", key, vlen);
+
+    cc_memcpy(p + n, val, vlen);
+    n += vlen;
+    cc_memcpy(p + n, "\r\n", 2);
+
+    return n + 2;
+}
+
+/* the expected response to a gets of key, with the cas it is stored with */
+static size_t
+_cas_rsp(char *p, const char *key, uint32_t vlen)
+{
+    struct bstring k = {.data = (char *)key, .len = strlen(key)};
+    struct item *it;
+    uint64_t cas;
+    size_t n;
+
+    it = item_get(&k, &cas);
+    ck_assert_ptr_ne(it, NULL);
+    item_release(it);
+
+    n = sprintf(p, "VALUE %s 0 %u %" PRIu64 "\r\n", key, vlen, cas);
+    cc_memcpy(p + n, val, vlen);
+    n += vlen;
+    cc_memcpy(p + n, "\r\n", 2);
+
+    return n + 2;
+}
+
+static void
+_assert_out(const char *expect, size_t len)
+{
+    ck_assert_int_eq(out_len, len);
+    ck_assert(cc_memcmp(out, expect, len) == 0);
+}
+
+/*
+ * zero-copy get values
+ */
+
+START_TEST(test_zcopy_send)
+{
+    char *expect = cc_alloc(2 * VLEN);
+    size_t len, hdr_len;
+    char hdr[64];
+
+    test_setup();
+
+    _store("big", VLEN);
+    hdr_len = sprintf(hdr, "VALUE big 0 %u\r\n", VLEN);
+    len = _value_rsp(expect, "big", VLEN);
+    len += sprintf(expect + len, "END\r\n");
+
+    _client_send("get big\r\n", 9);
+    ck_assert_int_eq(_worker_read(), 0);
+    /* the value is left in the seg, wbuf only has what is around it */
+    ck_assert_int_eq(buf_rsize(s->wbuf), hdr_len + CRLF_LEN + 5);
+
+    /* everything fits in the socket, and goes out in one writev */
+    ck_assert_int_eq(segcache_process_send(s), CC_OK);
+    ck_assert_int_eq(buf_rsize(s->wbuf), 0);
+    _client_recv();
+    _assert_out(expect, len);
+
+    /* nothing is referenced after the send */
+    ck_assert_int_eq(segcache_process_send(s), CC_EEMPTY);
+
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_zcopy_partial_send)
+{
+    char *expect = cc_alloc(4 * VLEN);
+    int sndbuf = 4096;
+    size_t len;
+    rstatus_i status;
+
+    test_setup();
+
+    ck_assert_int_eq(setsockopt(s->ch->sd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+            sizeof(sndbuf)), 0);
+    _store("big1", VLEN);
+    _store("big2", VLEN / 2);
+    len = _value_rsp(expect, "big1", VLEN);
+    len += _value_rsp(expect + len, "big2", VLEN / 2);
+    len += sprintf(expect + len, "END\r\n");
+
+    _client_send("get big1 big2\r\n", 15);
+    ck_assert_int_eq(_worker_read(), 0);
+
+    /* the socket takes only part of the response, the values not sent yet
+     * are copied into wbuf before the worker goes offline */
+    status = segcache_process_send(s);
+    ck_assert(status == CC_ERETRY || status == CC_EAGAIN);
+    _client_recv();
+    ck_assert_int_lt(out_len, len);
+    ck_assert_int_eq(buf_rsize(s->wbuf), len - out_len);
+
+    /* the rest no longer comes from the segs */
+    _clobber("big1");
+    _clobber("big2");
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_zcopy_settle)
+{
+    char *expect = cc_alloc(2 * VLEN);
+    const char *req = "get big\r\nset small 0 0 5\r\nhello\r\nget small\r\n";
+    size_t len;
+
+    test_setup();
+
+    _store("big", VLEN);
+    len = _value_rsp(expect, "big", VLEN);
+    len += sprintf(expect + len, "END\r\nSTORED\r\n"
+            "VALUE small 0 5\r\nhello\r\nEND\r\n");
+
+    /* the set may allocate a seg and wait for a grace period offline, so the
+     * value of the get before it is copied into wbuf first */
+    _client_send(req, strlen(req));
+    ck_assert_int_eq(_worker_read(), 0);
+    ck_assert_int_eq(buf_rsize(s->wbuf), len);
+
+    _clobber("big");
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_zcopy_settle_flash)
+{
+#define FLASH_VLEN 1000
+#define N_ITEM 30000
+
+    char *expect = cc_alloc(2 * VLEN);
+    char req[1024], key[16];
+    struct bstring k = {.data = key};
+    struct item *it;
+    size_t len, req_len;
+    uint32_t i;
+
+    flash_path = "./segcache_test.flash";
+    test_setup();
+
+    /* every item is read once, so the items evicted are demoted to flash */
+    for (i = 0; i < N_ITEM; i++) {
+        k.len = sprintf(key, "f%" PRIu32, i);
+        _store(key, FLASH_VLEN);
+        it = item_get(&k, NULL);
+        ck_assert_ptr_ne(it, NULL);
+        item_release(it);
+    }
+    for (i = N_ITEM; i-- > 0;) {
+        k.len = sprintf(key, "f%" PRIu32, i);
+        if (item_get_multi(&k, 1, &it, NULL) == 1) {
+            break;
+        }
+    }
+    ck_assert_msg(i < N_ITEM, "no item on flash");
+
+    _store("big", VLEN);
+    len = _value_rsp(expect, "big", VLEN);
+    len += sprintf(expect + len, "END\r\n");
+    len += _value_rsp(expect + len, key, FLASH_VLEN);
+    len += sprintf(expect + len, "END\r\n");
+
+    /* the flash item is looked up in the next batch of 64 keys, after
+     * the value of big is composed, promoting it may allocate a seg and wait
+     * for a grace period offline, so the value is copied first */
+    req_len = sprintf(req, "get big");
+    for (i = 1; i < 64; i++) {
+        req_len += sprintf(req + req_len, " miss%" PRIu32, i);
+    }
+    req_len += sprintf(req + req_len, "\r\nget %s\r\n", key);
+    _client_send(req, req_len);
+    ck_assert_int_eq(_worker_read(), 0);
+    ck_assert_int_eq(buf_rsize(s->wbuf), len);
+
+    _clobber("big");
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(expect);
+    test_teardown();
+
+#undef FLASH_VLEN
+#undef N_ITEM
+}
+END_TEST
+
+/*
+ * large set values received into the item
+ */
+
+/* the value being received by s, reserved by a partial set */
+static struct item *
+_reserved(void)
+{
+    struct request *req = s->data;
+
+    ck_assert_ptr_ne(req, NULL);
+    ck_assert_ptr_ne(req->reserved, NULL);
+
+    return req->reserved;
+}
+
+START_TEST(test_direct_recv)
+{
+    char hdr[64];
+    size_t hdr_len, sent;
+    struct bstring key = {.data = "big", .len = 3};
+    struct item *it;
+    uint32_t chunk[] = {7000, 20000, 12345};
+
+    test_setup();
+
+    /* the first read gets the header and the start of the value */
+    hdr_len = sprintf(hdr, "set big 0 0 %u\r\n", VLEN);
+    _client_send(hdr, hdr_len);
+    _client_send(val, 1000);
+    ck_assert_int_eq(_worker_read(), 0);
+    it = _reserved();
+    ck_assert_int_eq(it->vlen, 1000);
+    sent = 1000;
+
+    /* the rest goes straight from the socket into the item, never into rbuf,
+     * and item_backfill is given the value in place, so it copies nothing
+     * (an overlapping memcpy would show up when built with ASan) */
+    for (size_t i = 0; i < sizeof(chunk) / sizeof(chunk[0]); i++) {
+        _client_send(val + sent, chunk[i]);
+        ck_assert_int_eq(segcache_process_recv(s), CC_OK);
+        ck_assert_int_eq(buf_rsize(s->rbuf), 0);
+        ck_assert_ptr_eq(_reserved(), it);
+        sent += chunk[i];
+        ck_assert_int_eq(it->vlen, sent);
+        ck_assert(cc_memcmp(item_val(it), val, sent) == 0);
+        ck_assert_int_eq(segcache_process_read(&s->rbuf, &s->wbuf, &s->data),
+                0);
+    }
+
+    /* not visible until the value is complete */
+    ck_assert_ptr_eq(item_get(&key, NULL), NULL);
+
+    _client_send(val + sent, VLEN - sent);
+    _client_send(CRLF, CRLF_LEN);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out("STORED\r\n", 8);
+
+    it = item_get(&key, NULL);
+    ck_assert_ptr_ne(it, NULL);
+    ck_assert_int_eq(item_nval(it), VLEN);
+    ck_assert(cc_memcmp(item_val(it), val, VLEN) == 0);
+    item_release(it);
+
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_direct_recv_abort)
+{
+    char hdr[64];
+    size_t hdr_len;
+    struct bstring key = {.data = "big", .len = 3};
+
+    test_setup();
+
+    hdr_len = sprintf(hdr, "set big 0 0 %u\r\n", VLEN);
+    _client_send(hdr, hdr_len);
+    _client_send(val, 1000);
+    ck_assert_int_eq(_worker_read(), 0);
+    _client_send(val + 1000, 20000);
+    ck_assert_int_eq(segcache_process_recv(s), CC_OK);
+    ck_assert_int_eq(_reserved()->vlen, 21000);
+
+    /* the client goes away in the middle of the value */
+    close(peer);
+    peer = -1;
+    ck_assert_int_eq(segcache_process_recv(s), CC_ERDHUP);
+    ck_assert_int_eq(s->ch->state, CHANNEL_TERM);
+
+    /* the half-received item is dropped with the request */
+    segcache_process_error(&s->rbuf, &s->wbuf, &s->data);
+    ck_assert_ptr_eq(s->data, NULL);
+    ck_assert_ptr_eq(item_get(&key, NULL), NULL);
+
+    test_teardown();
+}
+END_TEST
+
+/*
+ * pipelined gets
+ */
+
+/* the value of key i is the first _vlen(i) bytes of val */
+#define PIPE_NKEY 200
+
+static uint32_t
+_vlen(uint32_t i)
+{
+    return 1 + i % 50;
+}
+
+static char *
+_key(char *p, uint32_t i)
+{
+    sprintf(p, "k%" PRIu32, i);
+
+    return p;
+}
+
+/* store the even keys below nkey, the odd ones are misses */
+static void
+_store_even(uint32_t nkey)
+{
+    char k[16];
+
+    for (uint32_t i = 0; i < nkey; i += 2) {
+        _store(_key(k, i), _vlen(i));
+    }
+}
+
+/* append a get or gets of keys first to last - 1 to req, and what it
+ * should return to expect */
+static void
+_get_keys(char *req, size_t *req_len, char *expect, size_t *expect_len,
+        bool cas, uint32_t first, uint32_t last)
+{
+    char k[16];
+
+    *req_len += sprintf(req + *req_len, cas ? "gets" : "get");
+    for (uint32_t i = first; i < last; i++) {
+        *req_len += sprintf(req + *req_len, " %s", _key(k, i));
+        if (i % 2 == 1) {
+            continue;
+        }
+        if (cas) {
+            *expect_len += _cas_rsp(expect + *expect_len, k, _vlen(i));
+        } else {
+            *expect_len += _value_rsp(expect + *expect_len, k, _vlen(i));
+        }
+    }
+    *req_len += sprintf(req + *req_len, "\r\n");
+    *expect_len += sprintf(expect + *expect_len, "END\r\n");
+}
+
+START_TEST(test_pipeline_interleave)
+{
+    char *req = cc_alloc(VLEN), *expect = cc_alloc(VLEN);
+    size_t req_len = 0, len = 0;
+
+    test_setup();
+
+    _store_even(PIPE_NKEY);
+
+    /* the set ends the pipeline of gets before it, the gets after it see
+     * what it stored */
+    _get_keys(req, &req_len, expect, &len, false, 0, 3);
+    _get_keys(req, &req_len, expect, &len, true, 3, 5);
+    req_len += sprintf(req + req_len, "set k1 0 0 5\r\nhello\r\n");
+    len += sprintf(expect + len, "STORED\r\n");
+    _get_keys(req, &req_len, expect, &len, false, 4, 5);
+    req_len += sprintf(req + req_len, "get k1 k2\r\n");
+    len += sprintf(expect + len, "VALUE k1 0 5\r\nhello\r\n");
+    len += _value_rsp(expect + len, "k2", _vlen(2));
+    len += sprintf(expect + len, "END\r\n");
+
+    _client_send(req, req_len);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(req);
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_pipeline_nreq)
+{
+    char *req = cc_alloc(VLEN), *expect = cc_alloc(VLEN);
+    size_t req_len = 0, len = 0;
+
+    test_setup();
+
+    _store_even(PIPE_NKEY);
+
+    /* more single-key gets than fit in one pipeline */
+    for (uint32_t i = 0; i < 3 * 16 + 5; i++) {
+        _get_keys(req, &req_len, expect, &len, i % 3 == 0, i, i + 1);
+    }
+
+    _client_send(req, req_len);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(req);
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_pipeline_nkey)
+{
+    char *req = cc_alloc(VLEN), *expect = cc_alloc(VLEN);
+    size_t req_len = 0, len = 0;
+
+    test_setup();
+
+    _store_even(PIPE_NKEY);
+
+    /* more keys than are looked up in one batch, with requests cut across
+     * batches, and one request with more keys than a whole batch */
+    _get_keys(req, &req_len, expect, &len, false, 0, 50);
+    _get_keys(req, &req_len, expect, &len, true, 50, 60);
+    _get_keys(req, &req_len, expect, &len, false, 60, 160);
+    _get_keys(req, &req_len, expect, &len, true, 160, 200);
+    _get_keys(req, &req_len, expect, &len, false, 7, 8);
+
+    _client_send(req, req_len);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(req);
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_pipeline_partial)
+{
+    char *req = cc_alloc(VLEN), *expect = cc_alloc(VLEN);
+    size_t req_len = 0, len = 0, cut, cut_len;
+
+    test_setup();
+
+    _store_even(PIPE_NKEY);
+
+    _get_keys(req, &req_len, expect, &len, false, 0, 2);
+    _get_keys(req, &req_len, expect, &len, true, 2, 4);
+    cut = req_len;
+    cut_len = len;
+    _get_keys(req, &req_len, expect, &len, false, 4, 7);
+
+    /* the last request is cut short, it is answered after the rest of it
+     * arrives in the next read */
+    _client_send(req, cut + 7);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, cut_len);
+
+    _client_send(req + cut + 7, req_len - cut - 7);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, len);
+
+    /* so is a request cut before its command is complete */
+    req_len = cut = 0;
+    len = cut_len = 0;
+    out_len = 0;
+    _get_keys(req, &req_len, expect, &len, true, 8, 10);
+    cut = req_len;
+    cut_len = len;
+    _get_keys(req, &req_len, expect, &len, true, 10, 12);
+
+    _client_send(req, cut + 3);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, cut_len);
+
+    _client_send(req + cut + 3, req_len - cut - 3);
+    ck_assert_int_eq(_worker_read(), 0);
+    _worker_flush();
+    _assert_out(expect, len);
+
+    cc_free(req);
+    cc_free(expect);
+    test_teardown();
+}
+END_TEST
+
+/*
+ * test suite
+ */
+static Suite *
+segcache_suite(void)
+{
+    Suite *s = suite_create(SUITE_NAME);
+
+    TCase *tc_zcopy = tcase_create("zero-copy get");
+    suite_add_tcase(s, tc_zcopy);
+
+    tcase_add_test(tc_zcopy, test_zcopy_send);
+    tcase_add_test(tc_zcopy, test_zcopy_partial_send);
+    tcase_add_test(tc_zcopy, test_zcopy_settle);
+    tcase_add_test(tc_zcopy, test_zcopy_settle_flash);
+
+    TCase *tc_direct = tcase_create("direct recv");
+    suite_add_tcase(s, tc_direct);
+
+    tcase_add_test(tc_direct, test_direct_recv);
+    tcase_add_test(tc_direct, test_direct_recv_abort);
+
+    TCase *tc_pipeline = tcase_create("pipelined gets");
+    suite_add_tcase(s, tc_pipeline);
+
+    tcase_add_test(tc_pipeline, test_pipeline_interleave);
+    tcase_add_test(tc_pipeline, test_pipeline_nreq);
+    tcase_add_test(tc_pipeline, test_pipeline_nkey);
+    tcase_add_test(tc_pipeline, test_pipeline_partial);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int nfail;
+
+    /* turn on during debug */
+    debug_options_st debug_opts = {DEBUG_OPTION(OPTION_INIT)};
+    option_load_default((struct option *)&debug_opts,
+            OPTION_CARDINALITY(debug_options_st));
+    debug_setup(&debug_opts);
+
+    Suite *suite = segcache_suite();
+    SRunner *srunner = srunner_create(suite);
+    srunner_set_log(srunner, DEBUG_LOG);
+    srunner_run_all(srunner, CK_ENV); /* set CK_VEBOSITY in ENV to customize */
+    nfail = srunner_ntests_failed(srunner);
+    srunner_free(srunner);
+
+    debug_teardown();
+
+    return (nfail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
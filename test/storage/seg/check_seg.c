@@ -1,5 +1,9 @@
+#include <storage/seg/admission.h>
+#include <storage/seg/background.h>
+#include <storage/seg/flash.h>
 #include <storage/seg/hashtable.h>
 #include <storage/seg/item.h>
+#include <storage/seg/qsbr.h>
 #include <storage/seg/seg.h>
 #include <storage/seg/ttlbucket.h>
 
@@ -11,6 +15,7 @@
 #include <check.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 /* define for each suite, local scope due to macro visibility rule */
 #define SUITE_NAME "seg"
@@ -111,12 +116,10 @@ START_TEST(test_hashtable_basic)
         hashtable_put(it, seg_id, offset);
         seg_w_deref(seg_id);
 
-        ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
         ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
         it2 = hashtable_get(key.data, key.len, &seg_id2, &cas2);
         ck_assert_ptr_eq(it2, it);
-        ck_assert_msg(seg->r_refcount == 1, "seg refcount incorrect");
         ck_assert_int_eq(cas+1, cas2);
         ck_assert_int_eq(seg_id, seg_id2);
         cas = cas2;
@@ -145,12 +148,10 @@ START_TEST(test_hashtable_basic)
         hashtable_put(it, seg_id, offset);
         seg_w_deref(seg_id);
 
-        ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
         ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
         it2 = hashtable_get(key2.data, key2.len, &seg_id2, &cas2);
         ck_assert_ptr_eq(it2, it);
-        ck_assert_msg(seg->r_refcount == 1, "seg refcount incorrect");
         item_release(it2);
     }
 
@@ -200,6 +201,278 @@ START_TEST(test_hashtable_basic)
 }
 END_TEST
 
+START_TEST(test_hashtable_resize)
+{
+#define NKEY 256
+    struct bstring key, val;
+    struct item *it;
+    item_rstatus_e status;
+    char key_char[32];
+    int n_hashtable_entries, n_hashtable_buckets = 0;
+    int n_wait = 0;
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.hash_power, "6");
+    option_set(&options.hash_resize, "yes");
+    seg_setup(&options, &metrics);
+
+    key.data = key_char;
+    for (int i = 0; i < NKEY; i++) {
+        key.len = snprintf(key_char, sizeof(key_char), "%d-resize", i);
+        val = key;
+        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+        item_insert(it);
+    }
+
+    /* the background thread grows the table from 8 to at least 64 buckets,
+     * all items can be found while the buckets are being migrated */
+    do {
+        for (int i = 0; i < NKEY; i++) {
+            key.len = snprintf(key_char, sizeof(key_char), "%d-resize", i);
+            it = item_get(&key, NULL);
+            ck_assert_msg(it != NULL, "item %d not found", i);
+            ck_assert(memcmp(item_val(it), key.data, key.len) == 0);
+            item_release(it);
+        }
+
+        hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+        if (n_hashtable_entries == NKEY && n_hashtable_buckets >= 64) {
+            break;
+        }
+
+        wake_background_thread();
+        usleep(20000);
+    } while (n_wait++ < 500);
+
+    ck_assert_int_eq(n_hashtable_entries, NKEY);
+    ck_assert_int_ge(n_hashtable_buckets, 64);
+
+    /* updates and deletes work on the new table */
+    key.len = snprintf(key_char, sizeof(key_char), "%d-resize", 0);
+    ck_assert(item_delete(&key));
+    ck_assert_msg(item_get(&key, NULL) == NULL, "deleted item found");
+
+    test_teardown();
+#undef NKEY
+}
+END_TEST
+
+/**
+ * Tests a hash table that grows while merge threads evict, merges relink
+ * items in the table being migrated from, so it must not be freed before
+ * the merge threads pass a quiescent state, and the merge threads must not
+ * hold up the grace period while they wait for work
+ */
+START_TEST(test_hashtable_resize_merge)
+{
+#define VLEN 1000
+#define MEM_SIZE "8388608"
+#define NROUND 5
+#define NKEY_PER_ROUND 20000
+    struct bstring key, val;
+    struct item *it;
+    item_rstatus_e status;
+    char key_char[32];
+    int n_hashtable_entries, n_hashtable_buckets = 0;
+    int n_wait = 0, n_retry;
+    uint32_t n = 0;
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, MEM_SIZE);
+    option_set(&options.hash_power, "6");
+    option_set(&options.hash_resize, "yes");
+    option_set(&options.seg_evict_opt, "5");
+    option_set(&options.seg_mature_time, "0");
+    option_set(&options.seg_merge_thread, "2");
+    option_set(&options.seg_free_low_wat, "2");
+    option_set(&options.seg_free_high_wat, "3");
+    seg_setup(&options, &metrics);
+
+    val.data = cc_alloc(VLEN);
+    cc_memset(val.data, 'A', VLEN);
+
+    /* the heap is full after the first round, the values get smaller round
+     * after round, so the table keeps growing while the merge threads
+     * evict; the test thread is a worker that passes a quiescent state
+     * every 100 writes */
+    seg_thread_online();
+    key.data = key_char;
+    for (int r = 0; r < NROUND; r++) {
+        val.len = VLEN >> (2 * r);
+        for (int i = 0; i < NKEY_PER_ROUND; i++, n++) {
+            proc_sec = n / 1000;
+            key.len = snprintf(key_char, sizeof(key_char), "%u-rm", n);
+            /* the inline eviction can lose every seg to the merge threads,
+             * whose segs wait for this thread to pass a quiescent state */
+            n_retry = 0;
+            while ((status = item_reserve(&it, &key, &val, val.len, 0,
+                    INT32_MAX)) == ITEM_ENOMEM && n_retry++ < 100) {
+                seg_thread_offline();
+                usleep(1000);
+                seg_thread_online();
+            }
+            ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+            item_insert(it);
+
+            if (n % 100 == 0) {
+                seg_thread_offline();
+                wake_background_thread();
+                seg_thread_online();
+            }
+        }
+
+        for (uint32_t j = n - 100; j < n; j++) {
+            key.len = snprintf(key_char, sizeof(key_char), "%u-rm", j);
+            it = item_get(&key, NULL);
+            ck_assert_msg(it != NULL, "item %u not found", j);
+            ck_assert_int_eq(item_nval(it), val.len);
+            item_release(it);
+        }
+    }
+    seg_thread_offline();
+
+    /* the table has grown from 8 buckets in more than one resize, each
+     * waiting for the table before it to be freed */
+    do {
+        hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+        if (n_hashtable_buckets >= 8192) {
+            break;
+        }
+
+        wake_background_thread();
+        usleep(20000);
+    } while (n_wait++ < 500);
+
+    ck_assert_int_ge(n_hashtable_buckets, 8192);
+
+    cc_free(val.data);
+    test_teardown();
+#undef VLEN
+#undef MEM_SIZE
+#undef NROUND
+#undef NKEY_PER_ROUND
+}
+END_TEST
+
+START_TEST(test_hashtable_two_choice)
+{
+#define NKEY 800
+    struct bstring key, val;
+    struct item *it;
+    item_rstatus_e status;
+    char key_char[32];
+    int n_hashtable_entries, n_hashtable_buckets;
+
+    /* 128 buckets with 896 item slots, which fill up to ~90% without any
+     * overflow bucket when items can be moved to their other bucket */
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.hash_power, "10");
+    option_set(&options.hash_two_choice, "yes");
+    seg_setup(&options, &metrics);
+
+    key.data = key_char;
+    for (int i = 0; i < NKEY; i++) {
+        key.len = snprintf(key_char, sizeof(key_char), "%d-two-choice", i);
+        val = key;
+        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+        item_insert(it);
+    }
+
+    hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+    ck_assert_int_eq(n_hashtable_entries, NKEY);
+    ck_assert_int_eq(n_hashtable_buckets, 128);
+
+    for (int i = 0; i < NKEY; i++) {
+        key.len = snprintf(key_char, sizeof(key_char), "%d-two-choice", i);
+        it = item_get(&key, NULL);
+        ck_assert_msg(it != NULL, "item %d not found", i);
+        ck_assert(memcmp(item_val(it), key.data, key.len) == 0);
+        item_release(it);
+    }
+
+    /* an update replaces the only version of the key, wherever it lives */
+    key.len = snprintf(key_char, sizeof(key_char), "%d-two-choice", 0);
+    val = str2bstr("updated");
+    status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+    item_insert(it);
+
+    hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+    ck_assert_int_eq(n_hashtable_entries, NKEY);
+
+    it = item_get(&key, NULL);
+    ck_assert_msg(it != NULL, "updated item not found");
+    ck_assert(memcmp(item_val(it), "updated", val.len) == 0);
+    item_release(it);
+
+    ck_assert(item_delete(&key));
+    ck_assert_msg(item_get(&key, NULL) == NULL, "deleted item found");
+
+    test_teardown();
+#undef NKEY
+}
+END_TEST
+
+START_TEST(test_hashtable_bucket_pool)
+{
+#define NKEY 64
+    struct bstring key, val;
+    struct item *it;
+    item_rstatus_e status;
+    char key_char[32];
+    int n_hashtable_entries, n_hashtable_buckets;
+
+    /* 2 head buckets, so most items are in overflown buckets */
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.hash_power, "4");
+    seg_setup(&options, &metrics);
+
+    key.data = key_char;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < NKEY; i++) {
+            key.len = snprintf(key_char, sizeof(key_char), "%d-pool", i);
+            val = key;
+            status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+            ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+            item_insert(it);
+        }
+
+        hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+        ck_assert_int_eq(n_hashtable_entries, NKEY);
+        ck_assert_int_ge(n_hashtable_buckets, NKEY / 8);
+
+        for (int i = 0; i < NKEY; i++) {
+            key.len = snprintf(key_char, sizeof(key_char), "%d-pool", i);
+            it = item_get(&key, NULL);
+            ck_assert_msg(it != NULL, "item %d not found", i);
+            ck_assert(memcmp(item_val(it), key.data, key.len) == 0);
+            item_release(it);
+        }
+
+        /* the chains shrink as items are deleted, and the released buckets
+         * are reused in the next round */
+        for (int i = 0; i < NKEY; i++) {
+            key.len = snprintf(key_char, sizeof(key_char), "%d-pool", i);
+            ck_assert(item_delete(&key));
+            if (i % 8 == 0) {
+                hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+                ck_assert_int_le(n_hashtable_buckets,
+                    2 + (NKEY - i - 1 + 6) / 7);
+            }
+        }
+
+        hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+        ck_assert_int_eq(n_hashtable_entries, 0);
+        ck_assert_int_eq(n_hashtable_buckets, 2);
+    }
+
+    test_teardown();
+#undef NKEY
+}
+END_TEST
+
 START_TEST(test_insert_basic)
 {
 #define KEY "test_insert_basic"
@@ -237,11 +510,9 @@ START_TEST(test_insert_basic)
     int32_t seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
     struct seg *seg = &heap.segs[seg_id];
 
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 1, "seg refcount incorrect");
 
     item_insert(it);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
     it2 = item_get(&key, NULL);
@@ -249,10 +520,8 @@ START_TEST(test_insert_basic)
             it2 != NULL, "item_get could not find key %.*s", key.len, key.data);
     ck_assert_msg(
             it2 == it, "item_get returns a different item %p %p", it2, it);
-    ck_assert_msg(seg->r_refcount == 1, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
     item_release(it2);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
     test_teardown();
@@ -352,7 +621,6 @@ START_TEST(test_reserve_backfill_release)
     int32_t seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
     struct seg *seg = &heap.segs[seg_id];
 
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 1, "seg refcount incorrect");
 
     /* backfill */
@@ -367,7 +635,6 @@ START_TEST(test_reserve_backfill_release)
         ;
     ck_assert_msg(len == 0, "item_data contains wrong value %.*s", val.len,
             item_val(it) + vlen - val.len);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 1, "seg refcount incorrect");
 
     test_teardown();
@@ -410,7 +677,6 @@ START_TEST(test_reserve_backfill_link)
     int32_t seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
     struct seg *seg = &heap.segs[seg_id];
     ck_assert_int_eq(it->vlen, VLEN);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
     for (p = item_val(it), len = it->vlen; len > 0 && *p == 'A'; p++, len--)
@@ -572,7 +838,6 @@ START_TEST(test_delete_basic)
     ck_assert(seg->n_live_item == 0);
     ck_assert(seg->write_offset >= cc_strlen(VAL));
     ck_assert(seg->live_bytes <= sizeof(uint64_t));
-    ck_assert(seg->r_refcount == 0);
     ck_assert(seg->w_refcount == 0);
 
     test_teardown();
@@ -612,7 +877,6 @@ START_TEST(test_delete_more)
     ck_assert_int_eq(seg->seg_id, 0);
     ck_assert_int_eq(seg->accessible, 1);
 //    ck_assert_int_eq(seg->evictable, 0);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
     ck_assert_int_eq(seg->n_live_item, 1);
     ck_assert_int_eq(seg->write_offset, seg->live_bytes);
@@ -710,11 +974,9 @@ START_TEST(test_expire_basic)
 
     it = item_get(&key, NULL);
     ck_assert_msg(it != NULL, "item_get on unexpired item not successful");
-    ck_assert_msg(seg->r_refcount == 1, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
     item_release(it);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
 
     proc_sec += 2;
@@ -731,168 +993,730 @@ START_TEST(test_expire_basic)
 END_TEST
 
 
-START_TEST(test_item_numeric)
+START_TEST(test_expire_lazy)
 {
-#define KEY "test_item_numeric"
-#define VAL "1"
+#define NKEY 32
+#define TIME 12345678
     struct bstring key, val;
     item_rstatus_e status;
     struct item *it;
+    char key_char[32];
+    int32_t seg_id;
+    uint32_t gen;
+    int n_hashtable_entries, n_hashtable_buckets;
+    int n_wait = 0;
 
-    test_setup();
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.seg_lazy_expire, "yes");
+    seg_setup(&options, &metrics);
 
-    key = str2bstr(KEY);
-    val = str2bstr(VAL);
+    proc_sec = TIME;
+    key.data = key_char;
+    for (int i = 0; i < NKEY; i++) {
+        key.len = snprintf(key_char, sizeof(key_char), "%d-lazy", i);
+        val = key;
+        status = item_reserve(&it, &key, &val, val.len, 0, TIME + 1);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+        item_insert(it);
+    }
+    seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
+    gen = heap.segs[seg_id].gen;
 
-    status = item_reserve(&it, &key, &val, val.len, 0, 0);
-    ck_assert_msg(status == ITEM_OK, "item_reserve not OK - status %d", status);
+    key = str2bstr("long-lived");
+    status = item_reserve(&it, &key, &key, key.len, 0, INT32_MAX);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
     item_insert(it);
 
-    uint64_t vint;
-    status = item_incr(&vint, it, 0);
-    ck_assert_int_eq(vint, atoi(VAL));
-    ck_assert_msg(status == ITEM_OK, "item_incr not OK - status %d", status);
-
-    item_incr(&vint, it, 28);
-    ck_assert_int_eq(vint, atoi(VAL) + 28);
-    ck_assert_msg(status == ITEM_OK, "item_incr not OK - status %d", status);
-
-    item_incr(&vint, it, 24);
-    ck_assert_int_eq(vint, atoi(VAL) + 52);
-
-    test_teardown();
-
-#undef KEY
-#undef VAL
-}
-END_TEST
-
+    /* the seg expires by bumping its gen, its items are not removed,
+     * their hash entries are dropped by the background sweep */
+    proc_sec += 5;
+    do {
+        wake_background_thread();
+        usleep(20000);
+        hashtable_stat(&n_hashtable_entries, &n_hashtable_buckets);
+    } while (n_hashtable_entries > 1 && n_wait++ < 500);
 
-START_TEST(test_seg_basic)
-{
-    test_setup();
+    ck_assert_msg(heap.segs[seg_id].gen != gen, "seg gen not bumped");
+    ck_assert_int_eq(n_hashtable_entries, 1);
 
-    int32_t seg_id;
-    struct seg *seg;
+    key.data = key_char;
+    for (int i = 0; i < NKEY; i++) {
+        key.len = snprintf(key_char, sizeof(key_char), "%d-lazy", i);
+        ck_assert_msg(item_get(&key, NULL) == NULL, "expired item %d found", i);
+    }
 
-    for (uint32_t i = 0; i < 8; i++) {
-        seg_id = seg_get_new();
-        ck_assert_int_eq(seg_id, i);
+    key = str2bstr("long-lived");
+    it = item_get(&key, NULL);
+    ck_assert_msg(it != NULL, "item_get on unexpired item not successful");
+    item_release(it);
 
-        seg = &heap.segs[seg_id];
-        ck_assert_int_eq(seg->accessible, 1);
-        ck_assert_int_eq(seg->evictable, 0);
-        ck_assert_int_eq(seg->prev_seg_id, -1);
-        ck_assert_int_eq(seg->next_seg_id, -1);
-        ck_assert_int_eq(seg->n_live_item, 0);
-    }
     test_teardown();
+#undef NKEY
+#undef TIME
 }
 END_TEST
 
-START_TEST(test_seg_more)
+START_TEST(test_seg_warm_restart)
 {
-#define KEY "test_seg_more"
-#define VLEN (1000 * KiB)
-#define MEM_SIZE "5242880"
-
-    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
-    option_set(&options.heap_mem, MEM_SIZE);
-    seg_setup(&options, &metrics);
-
-    char *keys[] = {"seg-0", "seg-1", "seg-2", "seg-3", "seg-4", "seg-5",
-            "seg-6", "seg-7", "seg-8"};
-
+#define DATAPOOL_PATH "./seg_datapool.pelikan"
+#define NKEY 1000
+#define TTL_SHORT 10
     struct bstring key, val;
     item_rstatus_e status;
     struct item *it;
-    struct seg *seg;
-    int32_t seg_id;
+    char kbuf[32], vbuf[32];
 
-    val.data = cc_alloc(VLEN);
-    cc_memset(val.data, 'A', VLEN);
-    val.len = VLEN;
+    unlink(DATAPOOL_PATH);
+    proc_sec = 0;
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.datapool_path, DATAPOOL_PATH);
+    /* spread the items over many segs recovered by several threads */
+    option_set(&options.seg_size, "4096");
+    option_set(&options.seg_recover_thread, "4");
+    seg_setup(&options, &metrics);
 
-    for (int i = 0; i < 4; i++) {
-        bstring_set_literal(&key, keys[i]);
-        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
-        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+    for (int i = 0; i < NKEY; i++) {
+        key.len = sprintf(kbuf, "%d-restart", i);
+        key.data = kbuf;
+        val.len = sprintf(vbuf, "%d-val", i);
+        val.data = vbuf;
+        status = item_reserve(&it, &key, &val, val.len, 0,
+                i % 10 == 0 ? TTL_SHORT : INT32_MAX);
+        ck_assert_int_eq(status, ITEM_OK);
         item_insert(it);
-        it = item_get(&key, NULL);
-        ck_assert_msg(it != NULL, "item_get could not find key");
-        item_release(it);
-
-        seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
-        seg = &heap.segs[seg_id];
+    }
 
-        ck_assert_int_eq(seg->seg_id, i);
-        ck_assert_int_eq(seg->accessible, 1);
-        ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
-        ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
-        ck_assert_int_eq(seg->n_live_item, 1);
-        ck_assert_int_eq(seg->write_offset, seg->live_bytes);
-        ck_assert_int_eq(seg->prev_seg_id, i - 1);
-        if (i > 0){
-            ck_assert_int_eq(heap.segs[i - 1].next_seg_id, i);
-            ck_assert_int_eq(heap.segs[i - 1].evictable, 1);
+    /* update every 3rd key and delete every 7th key */
+    for (int i = 0; i < NKEY; i++) {
+        key.len = sprintf(kbuf, "%d-restart", i);
+        key.data = kbuf;
+        if (i % 7 == 0) {
+            ck_assert(item_delete(&key));
+        } else if (i % 3 == 0) {
+            val.len = sprintf(vbuf, "%d-new", i);
+            val.data = vbuf;
+            status = item_reserve(&it, &key, &val, val.len, 0,
+                    i % 10 == 0 ? TTL_SHORT : INT32_MAX);
+            ck_assert_int_eq(status, ITEM_OK);
+            item_insert(it);
         }
     }
 
-    /* remove all item of seg 2 and return to global pool */
-    rm_all_item_on_seg(2, SEG_EVICTION);
-    pthread_mutex_lock(&heap.mtx);
-    seg_add_to_freepool(2, SEG_EVICTION);
-    pthread_mutex_unlock(&heap.mtx);
+    /* restart after the short TTL has passed */
+    seg_teardown();
+    proc_sec += TTL_SHORT + 1;
+    seg_setup(&options, &metrics);
 
-    ck_assert_int_eq(heap.free_seg_id, 2);
-    heap.segs[2].prev_seg_id = -1;
-    heap.segs[2].next_seg_id = -1;
+    for (int i = 0; i < NKEY; i++) {
+        key.len = sprintf(kbuf, "%d-restart", i);
+        key.data = kbuf;
+        it = item_get(&key, NULL);
+        if (i % 7 == 0 || i % 10 == 0) {
+            ck_assert_msg(it == NULL, "key %s should not be recovered", kbuf);
+            continue;
+        }
 
-    bstring_set_cstr(&key, keys[4]);
+        ck_assert_msg(it != NULL, "key %s is not recovered", kbuf);
+        val.len = sprintf(vbuf, i % 3 == 0 ? "%d-new" : "%d-val", i);
+        ck_assert_int_eq(it->vlen, val.len);
+        ck_assert_int_eq(memcmp(item_val(it), vbuf, val.len), 0);
+        item_release(it);
+    }
+
+    /* the recovered heap can be written to */
+    key = str2bstr("test_seg_warm_restart");
+    val = str2bstr("val");
     status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
-    ck_assert_msg(status == ITEM_OK, "item_reserve not OK status %d", status);
+    ck_assert_int_eq(status, ITEM_OK);
     item_insert(it);
     it = item_get(&key, NULL);
-    ck_assert_msg(it != NULL, "item_get could not find key");
+    ck_assert_ptr_nonnull(it);
     item_release(it);
 
-    seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
-    seg = &heap.segs[seg_id];
-
-    ck_assert_int_eq(seg->seg_id, 2);
-    ck_assert_int_eq(seg->accessible, 1);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
-    ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
-    ck_assert_int_eq(seg->n_live_item, 1);
-    ck_assert_int_eq(seg->write_offset, seg->live_bytes);
-
     test_teardown();
+    unlink(DATAPOOL_PATH);
 
-#undef KEY
-#undef VAL
-#undef MEM_SIZE
+#undef DATAPOOL_PATH
+#undef NKEY
+#undef TTL_SHORT
 }
 END_TEST
 
-START_TEST(test_segevict_FIFO)
+/**
+ * Tests that only the last version of a key is recovered, although the segs
+ * of different TTLs are recovered in no particular order, and in parallel
+ */
+START_TEST(test_seg_restart_overwrite)
 {
-#define KEY "test_segevict_FIFO"
-#define VLEN (1000 * KiB)
-#define MEM_SIZE "4194304"
-
-    char *keys[] = {"fifo-0", "fifo-1", "fifo-2", "fifo-3", "fifo-4", "fifo-5",
-            "fifo-6", "fifo-7", "fifo-8"};
+#define DATAPOOL_PATH "./seg_datapool_overwrite.pelikan"
+#define NKEY 1000
+#define NROUND 4
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+    char kbuf[32], vbuf[32];
+    char *n_thread[] = {"1", "4"};
+    int r;
 
+    unlink(DATAPOOL_PATH);
+    proc_sec = 0;
     option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
-    option_set(&options.heap_mem, MEM_SIZE);
-    option_set(&options.seg_evict_opt, "2");
-    option_set(&options.seg_mature_time, "0");
+    option_set(&options.datapool_path, DATAPOOL_PATH);
+    option_set(&options.seg_size, "4096");
+    /* long bucket chains, a new version can go to an empty slot before the
+     * one of the old version */
+    option_set(&options.hash_power, "4");
     seg_setup(&options, &metrics);
 
-    struct bstring key, val;
-    int32_t seg_id;
-    struct item *it;
-    struct seg *seg;
+    /* the versions of a key alternate between two TTLs, and some keys are
+     * deleted in each round, which empties slots early in the chains */
+    for (r = 0; r < NROUND; r++) {
+        for (int i = 0; i < NKEY; i++) {
+            key.len = sprintf(kbuf, "%d-overwrite", i);
+            key.data = kbuf;
+            if (r > 0 && (i + r) % 5 == 0) {
+                ck_assert(item_delete(&key));
+                continue;
+            }
+            val.len = sprintf(vbuf, "%d-%d", i, r);
+            val.data = vbuf;
+            status = item_reserve(&it, &key, &val, val.len, 0,
+                    r % 2 == 0 ? 100000 : 1000000);
+            ck_assert_int_eq(status, ITEM_OK);
+            item_insert(it);
+        }
+    }
+
+    /* restart twice, recovering with one thread and then several */
+    for (int t = 0; t < 2; t++) {
+        seg_teardown();
+        option_set(&options.seg_recover_thread, n_thread[t]);
+        seg_setup(&options, &metrics);
+
+        for (int i = 0; i < NKEY; i++) {
+            key.len = sprintf(kbuf, "%d-overwrite", i);
+            key.data = kbuf;
+            it = item_get(&key, NULL);
+            if ((i + NROUND - 1) % 5 == 0) {
+                ck_assert_msg(it == NULL, "deleted key %s is recovered", kbuf);
+                continue;
+            }
+
+            ck_assert_msg(it != NULL, "key %s is not recovered", kbuf);
+            val.len = sprintf(vbuf, "%d-%d", i, NROUND - 1);
+            ck_assert_int_eq(it->vlen, val.len);
+            ck_assert_int_eq(memcmp(item_val(it), vbuf, val.len), 0);
+            item_release(it);
+        }
+    }
+
+    test_teardown();
+    unlink(DATAPOOL_PATH);
+
+#undef DATAPOOL_PATH
+#undef NKEY
+#undef NROUND
+}
+END_TEST
+
+/**
+ * Tests that writers can use the heap while it is prefaulted in the
+ * background, and that the heap is torn down with the prefault in progress
+ */
+START_TEST(test_seg_prefault_lazy)
+{
+#define DATAPOOL_PATH "./seg_datapool_lazy.pelikan"
+#define NKEY 1000
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+    char kbuf[32], vbuf[32];
+
+    unlink(DATAPOOL_PATH);
+    proc_sec = 0;
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.datapool_path, DATAPOOL_PATH);
+    option_set(&options.seg_size, "4096");
+    option_set(&options.seg_prefault_thread, "2");
+    option_set(&options.seg_prefault_lazy, "yes");
+
+    for (int round = 0; round < 2; round++) {
+        seg_setup(&options, &metrics);
+
+        for (int i = 0; i < NKEY; i++) {
+            key.len = sprintf(kbuf, "%d-lazy-%d", i, round);
+            key.data = kbuf;
+            val.len = sprintf(vbuf, "%d-val", i);
+            val.data = vbuf;
+            status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+            ck_assert_int_eq(status, ITEM_OK);
+            item_insert(it);
+        }
+
+        /* the items of the last round are recovered */
+        for (int r = 0; r <= round; r++) {
+            for (int i = 0; i < NKEY; i++) {
+                key.len = sprintf(kbuf, "%d-lazy-%d", i, r);
+                key.data = kbuf;
+                it = item_get(&key, NULL);
+                ck_assert_msg(it != NULL, "key %s not found", kbuf);
+                val.len = sprintf(vbuf, "%d-val", i);
+                ck_assert_int_eq(it->vlen, val.len);
+                ck_assert_int_eq(memcmp(item_val(it), vbuf, val.len), 0);
+                item_release(it);
+            }
+        }
+
+        test_teardown();
+    }
+
+    unlink(DATAPOOL_PATH);
+
+#undef DATAPOOL_PATH
+#undef NKEY
+}
+END_TEST
+
+
+START_TEST(test_item_get_multi)
+{
+#define NKEY 40
+    struct bstring keys[NKEY], val;
+    struct item *its[NKEY], *it;
+    uint64_t cas[NKEY], cas_v;
+    char kbuf[NKEY][16];
+    item_rstatus_e status;
+
+    test_setup();
+
+    /* only the keys with even index are inserted */
+    for (uint32_t i = 0; i < NKEY; i++) {
+        keys[i].len = snprintf(kbuf[i], sizeof(kbuf[i]), "multi-%u", i);
+        keys[i].data = kbuf[i];
+        if (i % 2 == 1) {
+            continue;
+        }
+        val = keys[i];
+        status = item_reserve(&it, &keys[i], &val, val.len, 0, INT32_MAX);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK - return status %d",
+                status);
+        item_insert(it);
+    }
+
+    item_get_multi(keys, NKEY, its, cas);
+    for (uint32_t i = 0; i < NKEY; i++) {
+        if (i % 2 == 1) {
+            ck_assert_msg(its[i] == NULL, "key %u should not be found", i);
+            continue;
+        }
+        ck_assert_msg(its[i] != NULL, "key %u not found", i);
+        ck_assert_int_eq(its[i]->klen, keys[i].len);
+        ck_assert(memcmp(item_key(its[i]), keys[i].data, keys[i].len) == 0);
+        ck_assert(memcmp(item_val(its[i]), keys[i].data, keys[i].len) == 0);
+
+        it = item_get(&keys[i], &cas_v);
+        ck_assert_msg(it == its[i], "item_get returns a different item");
+        ck_assert_int_eq(cas_v, cas[i]);
+        item_release(it);
+        item_release(its[i]);
+    }
+
+    item_get_multi(keys, NKEY, its, NULL);
+    for (uint32_t i = 0; i < NKEY; i++) {
+        ck_assert_msg((its[i] != NULL) == (i % 2 == 0), "key %u wrong result", i);
+        if (its[i] != NULL) {
+            item_release(its[i]);
+        }
+    }
+
+    test_teardown();
+#undef NKEY
+}
+END_TEST
+
+START_TEST(test_item_numeric)
+{
+#define KEY "test_item_numeric"
+#define VAL "1"
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+
+    test_setup();
+
+    key = str2bstr(KEY);
+    val = str2bstr(VAL);
+
+    status = item_reserve(&it, &key, &val, val.len, 0, 0);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK - status %d", status);
+    item_insert(it);
+
+    uint64_t vint;
+    status = item_incr(&vint, it, 0);
+    ck_assert_int_eq(vint, atoi(VAL));
+    ck_assert_msg(status == ITEM_OK, "item_incr not OK - status %d", status);
+
+    item_incr(&vint, it, 28);
+    ck_assert_int_eq(vint, atoi(VAL) + 28);
+    ck_assert_msg(status == ITEM_OK, "item_incr not OK - status %d", status);
+
+    item_incr(&vint, it, 24);
+    ck_assert_int_eq(vint, atoi(VAL) + 52);
+
+    test_teardown();
+
+#undef KEY
+#undef VAL
+}
+END_TEST
+
+/**
+ * Tests that the admission filter rejects the first write of a key in the
+ * TTL buckets it is enabled for, admits the keys written or read before, and
+ * forgets old accesses.
+ */
+START_TEST(test_item_admit)
+{
+#define TIME 12345678
+#define WIDTH 4096
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.seg_admit_threshold, "2");
+    option_set(&options.seg_admit_width, "4096");
+    option_set(&options.seg_admit_ttl_min, "1000");
+    seg_setup(&options, &metrics);
+
+    proc_sec = TIME;
+
+    key = str2bstr("one-hit");
+    ck_assert_msg(!item_admit(&key, TIME + 2000), "first write admitted");
+    ck_assert_msg(item_admit(&key, TIME + 2000), "second write rejected");
+
+    /* TTL buckets below seg_admit_ttl_min are not filtered */
+    key = str2bstr("short-lived");
+    ck_assert_msg(item_admit(&key, TIME + 100), "short TTL write rejected");
+
+    /* reads count too */
+    key = str2bstr("read-first");
+    ck_assert_msg(item_get(&key, NULL) == NULL, "item_get found new key");
+    ck_assert_msg(item_admit(&key, TIME + 2000), "read key rejected");
+
+    /* a write not admitted removes the older version of the key */
+    key = str2bstr("stale");
+    val = str2bstr("old");
+    status = item_reserve(&it, &key, &val, val.len, 0, TIME + 2000);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK - status %d", status);
+    item_insert(it);
+    ck_assert_msg(!item_admit(&key, TIME + 2000), "first write admitted");
+    ck_assert_msg(item_get(&key, NULL) == NULL, "older version found");
+
+    /* the counts are halved as other keys are accessed */
+    key = str2bstr("aged");
+    for (int i = 0; i < 3; i++) {
+        admit_record(key.data, key.len);
+    }
+    ck_assert_int_ge(admit_estimate(key.data, key.len), 3);
+    for (int i = 0; i < 2 * ADMIT_AGE_FACTOR * WIDTH; i++) {
+        admit_record("other", 5);
+    }
+    ck_assert_int_lt(admit_estimate(key.data, key.len), 2);
+
+    test_teardown();
+#undef TIME
+#undef WIDTH
+}
+END_TEST
+
+
+START_TEST(test_seg_basic)
+{
+    test_setup();
+
+    int32_t seg_id;
+    struct seg *seg;
+
+    for (uint32_t i = 0; i < 8; i++) {
+        seg_id = seg_get_new();
+        ck_assert_int_eq(seg_id, i);
+
+        seg = &heap.segs[seg_id];
+        ck_assert_int_eq(seg->accessible, 1);
+        ck_assert_int_eq(seg->evictable, 0);
+        ck_assert_int_eq(seg->prev_seg_id, -1);
+        ck_assert_int_eq(seg->next_seg_id, -1);
+        ck_assert_int_eq(seg->n_live_item, 0);
+    }
+    test_teardown();
+}
+END_TEST
+
+START_TEST(test_seg_more)
+{
+#define KEY "test_seg_more"
+#define VLEN (1000 * KiB)
+#define MEM_SIZE "5242880"
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, MEM_SIZE);
+    seg_setup(&options, &metrics);
+
+    char *keys[] = {"seg-0", "seg-1", "seg-2", "seg-3", "seg-4", "seg-5",
+            "seg-6", "seg-7", "seg-8"};
+
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+    struct seg *seg;
+    int32_t seg_id;
+
+    val.data = cc_alloc(VLEN);
+    cc_memset(val.data, 'A', VLEN);
+    val.len = VLEN;
+
+    for (int i = 0; i < 4; i++) {
+        bstring_set_literal(&key, keys[i]);
+        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+        item_insert(it);
+        it = item_get(&key, NULL);
+        ck_assert_msg(it != NULL, "item_get could not find key");
+        item_release(it);
+
+        seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
+        seg = &heap.segs[seg_id];
+
+        ck_assert_int_eq(seg->seg_id, i);
+        ck_assert_int_eq(seg->accessible, 1);
+        ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
+        ck_assert_int_eq(seg->n_live_item, 1);
+        ck_assert_int_eq(seg->write_offset, seg->live_bytes);
+        ck_assert_int_eq(seg->prev_seg_id, i - 1);
+        if (i > 0){
+            ck_assert_int_eq(heap.segs[i - 1].next_seg_id, i);
+            ck_assert_int_eq(heap.segs[i - 1].evictable, 1);
+        }
+    }
+
+    /* remove all item of seg 2 and return to global pool */
+    rm_all_item_on_seg(2, SEG_EVICTION);
+    seg_add_to_freepool(2, SEG_EVICTION);
+
+    ck_assert_int_eq(FREE_SEG_ID(heap.free_seg_top[0]), 2);
+    heap.segs[2].prev_seg_id = -1;
+    heap.segs[2].next_seg_id = -1;
+
+    bstring_set_cstr(&key, keys[4]);
+    status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK status %d", status);
+    item_insert(it);
+    it = item_get(&key, NULL);
+    ck_assert_msg(it != NULL, "item_get could not find key");
+    item_release(it);
+
+    seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
+    seg = &heap.segs[seg_id];
+
+    ck_assert_int_eq(seg->seg_id, 2);
+    ck_assert_int_eq(seg->accessible, 1);
+    ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
+    ck_assert_int_eq(seg->n_live_item, 1);
+    ck_assert_int_eq(seg->write_offset, seg->live_bytes);
+
+    test_teardown();
+
+#undef KEY
+#undef VAL
+#undef MEM_SIZE
+}
+END_TEST
+
+static struct item *grace_reader_it;
+static int grace_reader_state;
+
+static void *
+_grace_reader(void *arg)
+{
+    struct bstring *key = arg;
+
+    seg_thread_online();
+    grace_reader_it = item_get(key, NULL);
+    __atomic_store_n(&grace_reader_state, 1, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&grace_reader_state, __ATOMIC_ACQUIRE) != 2) {
+        sched_yield();
+    }
+
+    item_release(grace_reader_it);
+    seg_thread_offline();
+    qsbr_unregister();
+
+    return NULL;
+}
+
+/**
+ * Tests that an evicted seg is not reused while a reader may be on it
+ */
+START_TEST(test_seg_grace_period)
+{
+#define VLEN (1000 * KiB)
+#define MEM_SIZE "5242880"
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, MEM_SIZE);
+    seg_setup(&options, &metrics);
+
+    char *keys[] = {"seg-0", "seg-1", "seg-2", "seg-3"};
+
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+    pthread_t reader;
+
+    val.data = cc_alloc(VLEN);
+    cc_memset(val.data, 'A', VLEN);
+    val.len = VLEN;
+
+    for (int i = 0; i < 4; i++) {
+        bstring_set_cstr(&key, keys[i]);
+        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+        item_insert(it);
+    }
+
+    /* a reader holds an item on seg 2 and has not passed a quiescent state */
+    bstring_set_cstr(&key, keys[2]);
+    grace_reader_state = 0;
+    pthread_create(&reader, NULL, _grace_reader, &key);
+    while (__atomic_load_n(&grace_reader_state, __ATOMIC_ACQUIRE) != 1) {
+        sched_yield();
+    }
+    ck_assert_msg(grace_reader_it != NULL, "item_get could not find key");
+    ck_assert_int_eq((((uint8_t *)grace_reader_it) - heap.base) / heap.seg_size,
+        2);
+
+    ck_assert(rm_all_item_on_seg(2, SEG_EVICTION));
+    seg_add_to_freepool(2, SEG_EVICTION);
+
+    ck_assert_int_eq(heap.n_limbo_seg, 1);
+    ck_assert_int_eq(heap.limbo_head, 2);
+    ck_assert_int_ne(FREE_SEG_ID(heap.free_seg_top[0]), 2);
+    ck_assert_int_eq(heap.n_free_seg, 2);
+    ck_assert_msg(item_get(&key, NULL) == NULL, "evicted item found");
+
+    /* other free segs are used first, the data stays intact until the
+     * reader goes offline */
+    ck_assert_int_eq(seg_get_from_freepool(true), 4);
+    ck_assert_int_eq(heap.n_limbo_seg, 1);
+    ck_assert_int_eq(item_val(grace_reader_it)[VLEN - 1], 'A');
+
+    __atomic_store_n(&grace_reader_state, 2, __ATOMIC_RELEASE);
+    pthread_join(reader, NULL);
+
+    ck_assert_int_eq(seg_get_from_freepool(true), 2);
+    ck_assert_int_eq(heap.n_limbo_seg, 0);
+
+    cc_free(val.data);
+    test_teardown();
+
+#undef VLEN
+#undef MEM_SIZE
+}
+END_TEST
+
+/**
+ * Tests the NUMA placements and huge page heap, which fall back to a single
+ * node and regular pages where they are not available
+ */
+START_TEST(test_seg_numa)
+{
+#define VLEN (1000 * KiB)
+#define MEM_SIZE "5242880"
+#define NSEG 5
+#define NKEY 4
+
+    char *numa[] = {"1", "2"};
+    char *keys[] = {"numa-0", "numa-1", "numa-2", "numa-3"};
+
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+    int32_t seg_id, node;
+    bool used[NSEG];
+
+    val.data = cc_alloc(VLEN);
+    cc_memset(val.data, 'A', VLEN);
+    val.len = VLEN;
+
+    for (int n = 0; n < 2; n++) {
+        option_load_default((struct option *)&options,
+            OPTION_CARDINALITY(options));
+        option_set(&options.heap_mem, MEM_SIZE);
+        option_set(&options.seg_numa, numa[n]);
+        option_set(&options.seg_hugepage, "2");
+        seg_setup(&options, &metrics);
+
+        ck_assert_int_ge(heap.n_node, 1);
+        ck_assert_int_le(heap.n_node, SEG_NUMA_MAX_NODE);
+
+        /* each seg of the heap is taken once, whichever pool it is in */
+        cc_memset(used, 0, sizeof(used));
+        for (int i = 0; i < NKEY; i++) {
+            bstring_set_cstr(&key, keys[i]);
+            status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+            ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+            item_insert(it);
+
+            it = item_get(&key, NULL);
+            ck_assert_msg(it != NULL, "item_get could not find key");
+            ck_assert_int_eq(item_val(it)[VLEN - 1], 'A');
+            seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
+            item_release(it);
+
+            ck_assert_msg(!used[seg_id], "seg %d is taken twice", seg_id);
+            used[seg_id] = true;
+        }
+
+        /* a freed seg goes back to the pool of its node */
+        ck_assert(rm_all_item_on_seg(2, SEG_EVICTION));
+        seg_add_to_freepool(2, SEG_EVICTION);
+        node = 2 * heap.n_node / NSEG;
+        ck_assert_int_eq(FREE_SEG_ID(heap.free_seg_top[node]), 2);
+        ck_assert_int_eq(seg_get_from_freepool(true), 2);
+
+        test_teardown();
+    }
+
+    cc_free(val.data);
+
+#undef VLEN
+#undef MEM_SIZE
+#undef NSEG
+#undef NKEY
+}
+END_TEST
+
+START_TEST(test_segevict_FIFO)
+{
+#define KEY "test_segevict_FIFO"
+#define VLEN (1000 * KiB)
+#define MEM_SIZE "4194304"
+
+    char *keys[] = {"fifo-0", "fifo-1", "fifo-2", "fifo-3", "fifo-4", "fifo-5",
+            "fifo-6", "fifo-7", "fifo-8"};
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, MEM_SIZE);
+    option_set(&options.seg_evict_opt, "2");
+    option_set(&options.seg_mature_time, "0");
+    seg_setup(&options, &metrics);
+
+    struct bstring key, val;
+    int32_t seg_id;
+    struct item *it;
+    struct seg *seg;
     item_rstatus_e status;
 
     val.data = cc_alloc(VLEN);
@@ -922,7 +1746,6 @@ START_TEST(test_segevict_FIFO)
     seg = &heap.segs[seg_id];
 
     ck_assert_int_eq(seg_id, 0);
-    ck_assert_msg(seg->r_refcount == 1, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
     ck_assert(seg->n_live_item == 1);
     item_release(it);
@@ -938,7 +1761,6 @@ START_TEST(test_segevict_FIFO)
     seg = &heap.segs[seg_id];
 
     ck_assert_int_eq(seg_id, 0);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->write_offset == item_ntotal(it) ||
                     seg->write_offset == item_ntotal(it) + 8,
@@ -960,6 +1782,236 @@ START_TEST(test_segevict_FIFO)
 END_TEST
 
 
+START_TEST(test_segevict_background)
+{
+#define VLEN (1000 * KiB)
+#define MEM_SIZE "8388608"
+
+    char *keys[] = {"bg-0", "bg-1", "bg-2", "bg-3", "bg-4", "bg-5", "bg-6",
+            "bg-7"};
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, MEM_SIZE);
+    option_set(&options.seg_evict_opt, "2");
+    option_set(&options.seg_mature_time, "0");
+    option_set(&options.seg_free_low_wat, "2");
+    option_set(&options.seg_free_high_wat, "3");
+    seg_setup(&options, &metrics);
+
+    struct bstring key, val;
+    struct item *it;
+    item_rstatus_e status;
+    int n_wait = 0;
+
+    val.data = cc_alloc(VLEN);
+    cc_memset(val.data, 'A', VLEN);
+    val.len = VLEN;
+
+    ck_assert_int_eq(heap.max_nseg, 8);
+
+    /* each item takes one seg, the free segs drop below the low watermark */
+    for (uint32_t i = 0; i < 7; i++) {
+        proc_sec++;
+        bstring_set_literal(&key, keys[i]);
+        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK - return status %d",
+                status);
+        item_insert(it);
+    }
+
+    /* the background thread evicts the oldest segs up to the high watermark */
+    while (__atomic_load_n(&heap.n_free_seg, __ATOMIC_RELAXED) < 3 &&
+            n_wait++ < 100) {
+        usleep(20000);
+    }
+    ck_assert_int_ge(heap.n_free_seg, 3);
+
+    bstring_set_literal(&key, keys[0]);
+    it = item_get(&key, NULL);
+    ck_assert_msg(it == NULL, "item should have been evicted");
+    bstring_set_literal(&key, keys[6]);
+    it = item_get(&key, NULL);
+    ck_assert(it != NULL);
+    item_release(it);
+
+    cc_free(val.data);
+    test_teardown();
+
+#undef VLEN
+#undef MEM_SIZE
+}
+END_TEST
+
+/**
+ * Tests merge eviction with two TTL buckets, writers that run out of free segs
+ * take merge jobs from the shared queue
+ */
+START_TEST(test_segevict_merge)
+{
+#define VLEN (100 * KiB)
+#define MEM_SIZE "16777216"
+#define N_ITEM 400
+
+    char keybuf[16];
+    delta_time_i ttls[] = {1000, 8000};
+
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, MEM_SIZE);
+    option_set(&options.seg_evict_opt, "5");
+    option_set(&options.seg_mature_time, "0");
+    seg_setup(&options, &metrics);
+
+    struct bstring key, val;
+    struct item *it;
+    item_rstatus_e status;
+
+    val.data = cc_alloc(VLEN);
+    cc_memset(val.data, 'A', VLEN);
+    val.len = VLEN;
+
+    /* the items take more than twice the heap, alternating between the
+     * TTL buckets every 20 items */
+    for (uint32_t i = 0; i < N_ITEM; i++) {
+        proc_sec++;
+        key.len = snprintf(keybuf, sizeof(keybuf), "merge-%u", i);
+        key.data = keybuf;
+        status = item_reserve(&it, &key, &val, val.len, 0,
+                time_proc_sec() + ttls[(i / 20) % 2]);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK - return status %d",
+                status);
+        item_insert(it);
+    }
+
+    /* both buckets have linked segs */
+    ck_assert_int_gt(ttl_buckets[find_ttl_bucket_idx(ttls[0])].evict_pressure +
+            ttl_buckets[find_ttl_bucket_idx(ttls[1])].evict_pressure, 0);
+    ck_assert_int_ge(ttl_buckets[find_ttl_bucket_idx(ttls[0])].n_seg, 1);
+    ck_assert_int_ge(ttl_buckets[find_ttl_bucket_idx(ttls[1])].n_seg, 1);
+
+    /* the latest item is never evicted */
+    key.len = snprintf(keybuf, sizeof(keybuf), "merge-%u", N_ITEM - 1);
+    key.data = keybuf;
+    it = item_get(&key, NULL);
+    ck_assert(it != NULL);
+    item_release(it);
+
+    cc_free(val.data);
+    test_teardown();
+
+#undef VLEN
+#undef MEM_SIZE
+#undef N_ITEM
+}
+END_TEST
+
+/**
+ * Tests that warm items dropped by merge eviction are demoted to the flash
+ * tier, a get promotes them back, a set or delete hides them
+ */
+START_TEST(test_segevict_flash)
+{
+#define FLASH_PATH "./seg_test.flash"
+#define VLEN 1000
+#define N_ITEM 30000
+
+    struct bstring key, val;
+    struct item *it;
+    struct flash_loc locs[4];
+    item_rstatus_e status;
+    char kbuf[32], vbuf[VLEN];
+    int32_t seg_id;
+    struct item *its[2];
+    struct bstring keys[2];
+    uint32_t flash_keys[4];
+    int n_flash_key = 0;
+
+    unlink(FLASH_PATH);
+    proc_sec = 0;
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.heap_mem, "16777216");
+    option_set(&options.seg_evict_opt, "5");
+    option_set(&options.seg_mature_time, "0");
+    option_set(&options.seg_flash_path, FLASH_PATH);
+    option_set(&options.seg_flash_size, "8388608");
+    seg_setup(&options, &metrics);
+
+    val.data = vbuf;
+    val.len = VLEN;
+
+    /* every item is read once, the items take more than the heap and the
+     * flash tier together */
+    for (uint32_t i = 0; i < N_ITEM; i++) {
+        key.len = sprintf(kbuf, "flash-%u", i);
+        key.data = kbuf;
+        cc_memset(vbuf, 'a' + i % 26, VLEN);
+        status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+        ck_assert_int_eq(status, ITEM_OK);
+        item_insert(it);
+        it = item_get(&key, NULL);
+        ck_assert(it != NULL);
+        item_release(it);
+    }
+
+    /* the latest items dropped from memory are on flash */
+    for (uint32_t i = N_ITEM; i-- > 0 && n_flash_key < 4;) {
+        key.len = sprintf(kbuf, "flash-%u", i);
+        if (hashtable_get_no_freq_incr(kbuf, key.len, &seg_id, NULL) == NULL &&
+            hashtable_get_flash(kbuf, key.len, locs, 4) > 0) {
+            flash_keys[n_flash_key++] = i;
+        }
+    }
+    ck_assert_int_eq(n_flash_key, 4);
+
+    /* promoted to memory by a get */
+    key.len = sprintf(kbuf, "flash-%u", flash_keys[0]);
+    it = item_get(&key, NULL);
+    ck_assert_msg(it != NULL, "key %s not found on flash", kbuf);
+    ck_assert_int_eq(it->vlen, VLEN);
+    ck_assert_int_eq(item_val(it)[VLEN - 1], 'a' + flash_keys[0] % 26);
+    item_release(it);
+    ck_assert(hashtable_get_no_freq_incr(kbuf, key.len, &seg_id, NULL) !=
+            NULL);
+
+    /* a new version hides the one on flash */
+    key.len = sprintf(kbuf, "flash-%u", flash_keys[1]);
+    val.len = sprintf(vbuf, "new");
+    status = item_reserve(&it, &key, &val, val.len, 0, INT32_MAX);
+    ck_assert_int_eq(status, ITEM_OK);
+    item_insert(it);
+    it = item_get(&key, NULL);
+    ck_assert(it != NULL);
+    ck_assert_int_eq(it->vlen, val.len);
+    item_release(it);
+
+    /* a deleted item is not found on flash */
+    key.len = sprintf(kbuf, "flash-%u", flash_keys[2]);
+    ck_assert(item_delete(&key));
+    ck_assert(item_get(&key, NULL) == NULL);
+
+    /* a multi-get only reports the flash item, which is found once promoted */
+    keys[0] = str2bstr("flash-missing");
+    key.len = sprintf(kbuf, "flash-%u", flash_keys[3]);
+    keys[1] = key;
+    ck_assert_int_eq(item_get_multi(keys, 2, its, NULL), 1);
+    ck_assert(its[0] == NULL && its[1] == NULL);
+    ck_assert(hashtable_get_no_freq_incr(kbuf, key.len, &seg_id, NULL) ==
+            NULL);
+    item_promote_multi(keys, 2);
+    ck_assert_int_eq(item_get_multi(keys, 2, its, NULL), 0);
+    ck_assert(its[0] == NULL);
+    ck_assert(its[1] != NULL);
+    ck_assert_int_eq(its[1]->vlen, VLEN);
+    ck_assert_int_eq(item_val(its[1])[VLEN - 1], 'a' + flash_keys[3] % 26);
+
+    test_teardown();
+    unlink(FLASH_PATH);
+
+#undef FLASH_PATH
+#undef VLEN
+#undef N_ITEM
+}
+END_TEST
+
 START_TEST(test_segevict_CTE)
 {
 #define KEY "test_segevict_CTE"
@@ -1014,7 +2066,6 @@ START_TEST(test_segevict_CTE)
     seg = &heap.segs[seg_id];
 
     ck_assert_int_eq(seg_id, 2);
-    ck_assert_msg(seg->r_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->w_refcount == 0, "seg refcount incorrect");
     ck_assert_msg(seg->write_offset == item_ntotal(it) ||
                     seg->write_offset == item_ntotal(it) + 8,
@@ -1277,6 +2328,124 @@ START_TEST(test_ttl_bucket_basic)
 }
 END_TEST
 
+START_TEST(test_ttl_bucket_thread_local)
+{
+#define KEY "test_ttl_bucket_thread_local"
+#define VAL "val"
+#define TTL 100
+
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it, *it2;
+    int32_t seg_id, seg_id2;
+    uint32_t bkt_idx = find_ttl_bucket_idx(TTL);
+
+    proc_sec = 0;
+    option_load_default((struct option *)&options, OPTION_CARDINALITY(options));
+    option_set(&options.seg_thread_local, "yes");
+    seg_setup(&options, &metrics);
+
+    key = str2bstr(KEY);
+    val = str2bstr(VAL);
+
+    status = item_reserve(&it, &key, &val, val.len, 0, time_proc_sec() + TTL);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+    item_insert(it);
+    seg_id = (((uint8_t *)it) - heap.base) / heap.seg_size;
+
+    /* the active seg belongs to this thread and is not linked yet */
+    ck_assert_int_eq(ttl_buckets[bkt_idx].first_seg_id, -1);
+    it2 = item_get(&key, NULL);
+    ck_assert_msg(it2 == it, "item_get returns a different item %p %p", it2, it);
+    item_release(it2);
+
+    /* the seg is still in use */
+    ttl_bucket_reclaim_local_segs(LOCAL_SEG_IDLE_SEC);
+    ck_assert_int_eq(ttl_buckets[bkt_idx].first_seg_id, -1);
+
+    /* the seg becomes idle and is linked to the ttl bucket */
+    proc_sec += LOCAL_SEG_IDLE_SEC;
+    ttl_bucket_reclaim_local_segs(LOCAL_SEG_IDLE_SEC);
+    ck_assert_int_eq(ttl_buckets[bkt_idx].first_seg_id, seg_id);
+    ck_assert_int_eq(ttl_buckets[bkt_idx].last_seg_id, seg_id);
+    ck_assert_int_eq(ttl_buckets[bkt_idx].n_seg, 1);
+
+    it2 = item_get(&key, NULL);
+    ck_assert_msg(it2 == it, "item_get returns a different item %p %p", it2, it);
+    item_release(it2);
+
+    /* the next write reserves a new seg for this thread */
+    status = item_reserve(&it, &key, &val, val.len, 0, time_proc_sec() + TTL);
+    ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+    item_insert(it);
+    seg_id2 = (((uint8_t *)it) - heap.base) / heap.seg_size;
+    ck_assert_int_ne(seg_id2, seg_id);
+    ck_assert_int_eq(ttl_buckets[bkt_idx].last_seg_id, seg_id);
+
+    test_teardown();
+
+#undef KEY
+#undef VAL
+#undef TTL
+}
+END_TEST
+
+START_TEST(test_ttl_bucket_expiration)
+{
+#define VAL "val"
+
+    char *keys[] = {"exp-0", "exp-1", "exp-2"};
+    delta_time_i ttls[] = {100, 20, 50};
+    struct bstring key, val;
+    item_rstatus_e status;
+    struct item *it;
+    int32_t bkt_idx;
+    int n_wait = 0;
+
+    test_setup();
+
+    val = str2bstr(VAL);
+
+    for (uint32_t i = 0; i < 3; i++) {
+        bstring_set_cstr(&key, keys[i]);
+        status = item_reserve(&it, &key, &val, val.len, 0,
+                time_proc_sec() + ttls[i]);
+        ck_assert_msg(status == ITEM_OK, "item_reserve not OK %d", status);
+        item_insert(it);
+    }
+
+    /* the bucket with the smallest TTL expires first */
+    pthread_mutex_lock(&heap.mtx);
+    bkt_idx = ttl_bucket_next_to_expire();
+    pthread_mutex_unlock(&heap.mtx);
+    ck_assert_int_eq(bkt_idx, find_ttl_bucket_idx(ttls[1]));
+    ck_assert_int_le(ttl_buckets[bkt_idx].next_expiration_sec,
+            time_proc_sec() + ttls[1]);
+
+    /* the background thread removes the expired seg */
+    proc_sec += ttls[1] + 3;
+    while (__atomic_load_n(&ttl_buckets[bkt_idx].first_seg_id,
+            __ATOMIC_RELAXED) != -1 && n_wait++ < 100) {
+        usleep(20000);
+    }
+    ck_assert_int_eq(ttl_buckets[bkt_idx].first_seg_id, -1);
+
+    pthread_mutex_lock(&heap.mtx);
+    bkt_idx = ttl_bucket_next_to_expire();
+    pthread_mutex_unlock(&heap.mtx);
+    ck_assert_int_eq(bkt_idx, find_ttl_bucket_idx(ttls[2]));
+
+    bstring_set_cstr(&key, keys[0]);
+    it = item_get(&key, NULL);
+    ck_assert_msg(it != NULL, "item_get on unexpired item not successful");
+    item_release(it);
+
+    test_teardown();
+
+#undef VAL
+}
+END_TEST
+
 
 /*
  * test suite
@@ -1299,21 +2468,38 @@ seg_suite(void)
     tcase_add_test(tc_item, test_delete_more);
     tcase_add_test(tc_item, test_flush_basic);
     tcase_add_test(tc_item, test_expire_basic);
+    tcase_add_test(tc_item, test_expire_lazy);
+    tcase_add_test(tc_item, test_item_get_multi);
     tcase_add_test(tc_item, test_item_numeric);
+    tcase_add_test(tc_item, test_item_admit);
     tcase_add_test(tc_item, test_hashtable_basic);
+    tcase_add_test(tc_item, test_hashtable_resize);
+    tcase_add_test(tc_item, test_hashtable_resize_merge);
+    tcase_add_test(tc_item, test_hashtable_two_choice);
+    tcase_add_test(tc_item, test_hashtable_bucket_pool);
 
 
     TCase *tc_ttl = tcase_create("ttl_bucket api");
     suite_add_tcase(s, tc_ttl);
     tcase_add_test(tc_ttl, test_ttl_bucket_find);
     tcase_add_test(tc_ttl, test_ttl_bucket_basic);
+    tcase_add_test(tc_ttl, test_ttl_bucket_thread_local);
+    tcase_add_test(tc_ttl, test_ttl_bucket_expiration);
 
 
     TCase *tc_seg = tcase_create("seg api");
     suite_add_tcase(s, tc_seg);
     tcase_add_test(tc_seg, test_seg_basic);
     tcase_add_test(tc_seg, test_seg_more);
+    tcase_add_test(tc_seg, test_seg_warm_restart);
+    tcase_add_test(tc_seg, test_seg_restart_overwrite);
+    tcase_add_test(tc_seg, test_seg_prefault_lazy);
+    tcase_add_test(tc_seg, test_seg_grace_period);
+    tcase_add_test(tc_seg, test_seg_numa);
     tcase_add_test(tc_seg, test_segevict_FIFO);
+    tcase_add_test(tc_seg, test_segevict_background);
+    tcase_add_test(tc_seg, test_segevict_merge);
+    tcase_add_test(tc_seg, test_segevict_flash);
     tcase_add_test(tc_seg, test_segevict_CTE);
     tcase_add_test(tc_seg, test_segevict_UTIL);
     tcase_add_test(tc_seg, test_segevict_RAND);